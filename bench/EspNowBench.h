@@ -0,0 +1,110 @@
+#ifndef ESPNOWBENCH_H
+#define ESPNOWBENCH_H
+
+// Minimal benchmark registry for the native bench build. Each bench_*.cpp
+// registers its cases with ESPNOW_BENCH and reports results through
+// EspNowBench::report or EspNowBench::measure; bench_main.cpp runs them.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class EspNowBench {
+public:
+  using BenchFn = void (*)();
+
+  // Calls per measure for a micro benchmark; cheap ones scale it up
+  static constexpr size_t Iterations = 1000000;
+
+  struct Case {
+    const char *name;
+    BenchFn fn;
+  };
+
+  struct Result {
+    std::string bench;
+    std::string metric;
+    double value;
+    std::string unit;
+  };
+
+  static std::vector<Case> &cases() {
+    static std::vector<Case> registered;
+    return registered;
+  }
+
+  static bool add(const char *name, BenchFn fn) {
+    Case benchCase = {name, fn};
+    cases().push_back(benchCase);
+    return true;
+  }
+
+  // Every result reported so far, in order
+  static std::vector<Result> &results() {
+    static std::vector<Result> reported;
+    return reported;
+  }
+
+  // Prints JSON lines instead of the aligned table when set
+  static bool &json() {
+    static bool enabled = false;
+    return enabled;
+  }
+
+  // Measured code stores its result here so the compiler keeps it
+  static volatile uint32_t &sink() {
+    static volatile uint32_t value = 0;
+    return value;
+  }
+
+  // Heap allocations made by the process so far; bench_main.cpp counts
+  // them in its replacement operator new
+  static std::atomic<uint64_t> &allocations() {
+    static std::atomic<uint64_t> count(0);
+    return count;
+  }
+
+  static void report(const char *bench, const char *metric, double value,
+                     const char *unit) {
+    Result result = {bench, metric, value, unit};
+    results().push_back(result);
+    if (json())
+      printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"value\":%.4f,"
+             "\"unit\":\"%s\"}\n",
+             bench, metric, value, unit);
+    else
+      printf("%-36s %-28s %14.2f %s\n", bench, metric, value, unit);
+  }
+
+  // Runs fn(i) for i in [0, iterations) after a warm-up pass of a tenth as
+  // many, then reports the wall-clock time and heap allocations per call
+  template <typename Fn>
+  static void measure(const char *bench, const char *metric,
+                      size_t iterations, Fn fn) {
+    for (size_t i = 0; i < iterations / 10; ++i)
+      fn(i);
+    const uint64_t allocsBefore = allocations().load();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      fn(i);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const uint64_t allocs = allocations().load() - allocsBefore;
+    report(bench, metric,
+           std::chrono::duration<double, std::nano>(elapsed).count() /
+               iterations,
+           "ns/op");
+    report(bench, metric, static_cast<double>(allocs) / iterations,
+           "allocs/op");
+  }
+};
+
+#define ESPNOW_BENCH(name)                                                     \
+  static void name();                                                          \
+  static const bool name##Registered = EspNowBench::add(#name, name);         \
+  static void name()
+
+#endif
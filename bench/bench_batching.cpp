@@ -0,0 +1,72 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// One sensor sampling an 8-byte reading every 50 us and sending it to a
+// coordinator, with and without batching. Like a non-blocking loop(), the
+// sensor skips a reading while the transmit queue is full.
+
+namespace {
+
+enum class BenchNode : uint8_t { Sensor, Coordinator, Count };
+enum class BenchPacket : uint8_t { Reading, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+struct Reading {
+  uint32_t sentAtUs;
+  uint32_t value;
+};
+
+void runReadings(const char *name, bool batching) {
+  const uint64_t durationUs = 1000000;
+  const uint32_t intervalUs = 50;
+  Network net;
+  net.addNode(BenchNode::Sensor);
+  net.addNode(BenchNode::Coordinator);
+  net.link(0, 1);
+  if (batching)
+    net.node(0).enableBatching(BenchNode::Coordinator, 2000);
+
+  EspNowSimSamples latency;
+  net.node(1).registerCallback<Reading>(
+      BenchPacket::Reading, [&latency](const Reading &reading, BenchNode) {
+        latency.add(micros() - reading.sentAtUs);
+      });
+
+  uint64_t skipped = 0;
+  uint64_t refused = 0;
+  std::function<void()> tick = [&]() {
+    Reading reading = {static_cast<uint32_t>(micros()), 0};
+    const Network::Handler::TxQueueStats queue =
+        net.node(0).getTxQueueStats();
+    if (queue.queued + queue.inFlight >= 12) // Of 16 slots
+      skipped++;
+    else if (!net.node(0).sendPacket(BenchNode::Coordinator,
+                                     BenchPacket::Reading, reading))
+      refused++;
+    if (net.sim().now() < durationUs)
+      net.at(intervalUs, 0, tick);
+  };
+  net.pollEvery(500);
+  net.sim().resetStats();
+  net.at(0, 0, tick);
+  net.runFor(durationUs + 100000);
+
+  const double seconds = durationUs / 1e6;
+  const EspNowSimStats &stats = net.sim().getStats();
+  EspNowBench::report(name, "delivered", latency.count() / seconds, "msg/s");
+  EspNowBench::report(name, "frames", stats.framesSent / seconds, "frame/s");
+  EspNowBench::report(name, "skipped", skipped, "msg");
+  EspNowBench::report(name, "send failures", refused, "msg");
+  EspNowBench::report(name, "airtime per msg",
+                      latency.count() ? stats.busyUs / latency.count() : 0.0,
+                      "us");
+  EspNowBench::report(name, "latency p50", latency.percentile(50), "us");
+  EspNowBench::report(name, "latency p99", latency.percentile(99), "us");
+}
+
+} // namespace
+
+ESPNOW_BENCH(readings_unbatched) { runReadings("readings_unbatched", false); }
+
+ESPNOW_BENCH(readings_batched) { runReadings("readings_batched", true); }
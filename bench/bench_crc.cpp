@@ -0,0 +1,67 @@
+#include "EspNowBench.h"
+#include <EspNowCrc.h>
+#include <chrono>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Throughput of the frame integrity checks over full 250 byte frames: the
+// byte-wise XOR used for discovery packets against the table-driven
+// CRC-16/CCITT of setCrc. Reported in bytes per TSC cycle on x86 hosts and
+// bytes per nanosecond elsewhere.
+
+namespace {
+
+const size_t FrameLen = 250;
+const size_t Iterations = 2000000;
+volatile uint32_t sink;
+
+uint8_t xorChecksum(const uint8_t *dataPtr, size_t len) {
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < len; ++i)
+    checksum ^= dataPtr[i];
+  return checksum;
+}
+
+template <typename Fn> void runThroughput(const char *name, Fn fn) {
+  static uint8_t frame[FrameLen];
+  for (size_t i = 0; i < FrameLen; ++i)
+    frame[i] = static_cast<uint8_t>(i * 131 + 7);
+
+  const auto start = std::chrono::steady_clock::now();
+#if defined(__x86_64__) || defined(__i386__)
+  const uint64_t startCycles = __rdtsc();
+#endif
+  for (size_t i = 0; i < Iterations; ++i) {
+    frame[0] = static_cast<uint8_t>(i); // Defeat hoisting out of the loop
+    sink = fn(frame, FrameLen);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  const uint64_t cycles = __rdtsc() - startCycles;
+#endif
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  const double bytes = static_cast<double>(FrameLen) * Iterations;
+
+#if defined(__x86_64__) || defined(__i386__)
+  EspNowBench::report(name, "throughput", bytes / cycles, "bytes/cycle");
+#else
+  EspNowBench::report(name, "throughput", bytes / ns, "bytes/ns");
+#endif
+  EspNowBench::report(name, "per 250 byte frame", ns / Iterations, "ns");
+}
+
+} // namespace
+
+ESPNOW_BENCH(integrity_xor) {
+  runThroughput("integrity_xor", [](const uint8_t *dataPtr, size_t len) {
+    return static_cast<uint32_t>(xorChecksum(dataPtr, len));
+  });
+}
+
+ESPNOW_BENCH(integrity_crc16) {
+  runThroughput("integrity_crc16", [](const uint8_t *dataPtr, size_t len) {
+    return static_cast<uint32_t>(espNowCrc16(dataPtr, len));
+  });
+}
@@ -0,0 +1,152 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+#include <chrono>
+
+// Delta encoding of a 64-byte telemetry struct sent every 50 ms, where a
+// counter, the uptime and a few readings change per packet. The codec
+// cases time espNowDeltaEncode and espNowDeltaApply against a keyframe
+// refreshed every 20 packets, as enableDelta does, and report the encoded
+// size including the tag byte. The network cases run 10 sensors reporting
+// to a gateway on the simulator with and without enableDelta.
+
+namespace {
+
+struct Telemetry {
+  uint32_t sequence;
+  uint32_t uptimeMs;
+  int16_t temperature[4];
+  uint16_t humidity;
+  uint16_t battery;
+  uint8_t status;
+  uint8_t firmware[3];
+  uint32_t errors;
+  uint32_t config[9];
+};
+
+volatile size_t sink;
+
+void sample(Telemetry &t, uint32_t sequence) {
+  t.sequence = sequence;
+  t.uptimeMs = sequence * 50;
+  for (size_t i = 0; i < 4; ++i) // Slow drift
+    t.temperature[i] = static_cast<int16_t>(2150 + i * 10 + sequence / 8);
+  t.humidity = static_cast<uint16_t>(400 + (sequence / 20) % 3);
+  t.battery = static_cast<uint16_t>(3700 - sequence / 1000);
+  t.status = 1;
+}
+
+Telemetry initialTelemetry() {
+  Telemetry t = {};
+  t.firmware[0] = 2;
+  for (size_t i = 0; i < 9; ++i)
+    t.config[i] = 1000 + static_cast<uint32_t>(i);
+  return t;
+}
+
+enum class BenchNode : uint8_t { Gateway, Count = 11 };
+enum class BenchPacket : uint8_t { Telemetry, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+void runNetwork(const char *name, bool delta) {
+  const size_t sensors = 10;
+  const uint32_t periodUs = 50000;
+  const uint32_t packets = 200;
+  Network net;
+  for (size_t i = 0; i <= sensors; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t i = 1; i <= sensors; ++i)
+    net.link(0, i);
+  if (delta) {
+    for (size_t i = 0; i <= sensors; ++i)
+      net.node(i).enableDelta<Telemetry>(BenchPacket::Telemetry);
+  }
+  uint64_t received = 0;
+  uint64_t wrong = 0;
+  net.node(0).registerCallback<Telemetry>(
+      BenchPacket::Telemetry, [&](const Telemetry &t, BenchNode) {
+        received++;
+        wrong += t.uptimeMs != t.sequence * 50 || t.config[8] != 1008;
+      });
+
+  std::vector<Telemetry> state(sensors + 1, initialTelemetry());
+  net.pollEvery(1000);
+  net.sim().resetStats();
+  for (uint32_t seq = 0; seq < packets; ++seq) {
+    for (size_t i = 1; i <= sensors; ++i) // Staggered sensors
+      net.at(static_cast<uint64_t>(seq) * periodUs + i * 997, i,
+             [&net, &state, i, seq]() {
+               sample(state[i], seq);
+               net.node(i).sendPacket(BenchNode::Gateway,
+                                      BenchPacket::Telemetry, state[i]);
+             });
+  }
+  net.runFor(static_cast<uint64_t>(packets) * periodUs + 100000);
+
+  const EspNowSimStats &stats = net.sim().getStats();
+  const double sent = static_cast<double>(sensors) * packets;
+  EspNowBench::report(name, "frame bytes", stats.bytesDelivered / sent,
+                      "bytes/packet");
+  EspNowBench::report(name, "airtime", stats.busyUs / sent, "us/packet");
+  EspNowBench::report(name, "channel busy",
+                      100.0 * stats.busyUs / (packets * periodUs), "%");
+  EspNowBench::report(name, "delivered", received, "packets");
+  EspNowBench::report(name, "wrong structs", wrong, "");
+}
+
+} // namespace
+
+ESPNOW_BENCH(delta_codec_64_byte_telemetry) {
+  const char *name = "delta_codec_64_byte_telemetry";
+  const uint32_t packets = 200000;
+  const size_t keyframeInterval = 20;
+  Telemetry current = initialTelemetry();
+  Telemetry keyframe = current;
+  uint8_t delta[sizeof(Telemetry)];
+  uint64_t encodedBytes = 0;
+  double encodeNs = 0;
+  double applyNs = 0;
+  size_t keyframes = 0;
+  for (uint32_t seq = 0; seq < packets; ++seq) {
+    sample(current, seq);
+    if (seq % keyframeInterval == 0) {
+      keyframe = current;
+      encodedBytes += 1 + sizeof(Telemetry);
+      keyframes++;
+      continue;
+    }
+    size_t len = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const bool fits = espNowDeltaEncode(
+        reinterpret_cast<const uint8_t *>(&keyframe),
+        reinterpret_cast<const uint8_t *>(&current), sizeof(Telemetry), delta,
+        sizeof(Telemetry) - 1, len);
+    const auto encoded = std::chrono::steady_clock::now();
+    Telemetry rebuilt = keyframe;
+    espNowDeltaApply(reinterpret_cast<uint8_t *>(&rebuilt), sizeof(rebuilt),
+                     delta, len);
+    const auto applied = std::chrono::steady_clock::now();
+    sink = rebuilt.sequence;
+    encodeNs += std::chrono::duration<double, std::nano>(encoded - start)
+                    .count();
+    applyNs += std::chrono::duration<double, std::nano>(applied - encoded)
+                   .count();
+    encodedBytes += fits ? 1 + len : 1 + sizeof(Telemetry);
+  }
+  const double deltas = static_cast<double>(packets - keyframes);
+  const double averageBytes = 1.0 * encodedBytes / packets;
+  EspNowBench::report(name, "struct size", sizeof(Telemetry), "bytes");
+  EspNowBench::report(name, "average payload", averageBytes, "bytes/packet");
+  EspNowBench::report(name, "compression ratio",
+                      sizeof(Telemetry) / averageBytes, "x");
+  EspNowBench::report(name, "encode", encodeNs / deltas, "ns/packet");
+  EspNowBench::report(name, "decode", applyNs / deltas, "ns/packet");
+}
+
+ESPNOW_BENCH(delta_10_sensors_full_structs) {
+  runNetwork("delta_10_sensors_full_structs", false);
+}
+
+ESPNOW_BENCH(delta_10_sensors_delta) {
+  runNetwork("delta_10_sensors_delta", true);
+}
@@ -0,0 +1,90 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Per-packet cost of dispatching a received struct packet to its callback:
+// the former std::function table (a std::function wrapping the user's
+// std::function), the EspNowDelegate table the handler uses now, and the
+// handler's whole receive path. Wall-clock time on the host.
+
+namespace {
+
+enum class BenchNode : uint8_t { Self, Peer, Count };
+enum class BenchPacket : uint8_t { Reading, Count };
+
+struct Reading {
+  uint32_t sequence;
+  uint16_t value;
+  uint8_t flags;
+};
+
+const size_t Iterations = EspNowBench::Iterations * 10;
+volatile uint32_t &sink = EspNowBench::sink();
+
+// Same wrapper as registerCallback<DataStruct> builds, stored in Table
+template <typename Table, typename Callback>
+void bindStruct(Table &table, Callback callback) {
+  table[0] = [callback](const uint8_t *dataPtr, size_t len, BenchNode sender) {
+    if (len != sizeof(Reading))
+      return;
+    Reading reading;
+    memcpy(&reading, dataPtr, sizeof(Reading));
+    callback(reading, sender);
+  };
+}
+
+void onReading(const Reading &reading, BenchNode) {
+  sink = reading.sequence + reading.value;
+}
+
+} // namespace
+
+ESPNOW_BENCH(dispatch_std_function) {
+  using Raw = std::function<void(const uint8_t *, size_t, BenchNode)>;
+  std::array<Raw, 1> table;
+  bindStruct(table,
+             std::function<void(const Reading &, BenchNode)>(onReading));
+  Reading reading = {1, 2, 3};
+  const uint8_t *dataPtr = reinterpret_cast<const uint8_t *>(&reading);
+  EspNowBench::measure("dispatch_std_function", "dispatch", Iterations,
+                       [&](size_t) {
+                         table[0](dataPtr, sizeof(reading), BenchNode::Peer);
+                       });
+}
+
+ESPNOW_BENCH(dispatch_delegate) {
+  using Raw = EspNowDelegate<void(const uint8_t *, size_t, BenchNode)>;
+  std::array<Raw, 1> table;
+  bindStruct(table, [](const Reading &reading, BenchNode sender) {
+    onReading(reading, sender);
+  });
+  Reading reading = {1, 2, 3};
+  const uint8_t *dataPtr = reinterpret_cast<const uint8_t *>(&reading);
+  EspNowBench::measure("dispatch_delegate", "dispatch", Iterations,
+                       [&](size_t) {
+                         table[0](dataPtr, sizeof(reading), BenchNode::Peer);
+                       });
+}
+
+ESPNOW_BENCH(dispatch_receive_path) {
+  using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+  Network net;
+  Network::Handler &handler = net.addNode(BenchNode::Self);
+  handler.registerCallback<Reading>(
+      BenchPacket::Reading,
+      [](const Reading &reading, BenchNode sender) {
+        onReading(reading, sender);
+      });
+
+  // Version 1 header: [version|flags][type][sender][len], then the struct
+  uint8_t frame[4 + sizeof(Reading)] = {
+      0x40, static_cast<uint8_t>(BenchPacket::Reading),
+      static_cast<uint8_t>(BenchNode::Peer), sizeof(Reading)};
+  uint8_t mac[6];
+  Network::macFor(BenchNode::Peer, mac);
+  handler.registry->addDevice(BenchNode::Peer, mac); // Passes authentication
+  EspNowBench::measure("dispatch_receive_path", "onDataRecv to callback",
+                       Iterations, [&](size_t) {
+                         EspNowSimAccess::receive(handler, mac, frame,
+                                                  sizeof(frame));
+                       });
+}
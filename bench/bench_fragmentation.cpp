@@ -0,0 +1,63 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Throughput and latency of fragmented messages between two nodes on the
+// simulated medium. Each message is sent once the previous one arrived.
+
+namespace {
+
+enum class BenchNode : uint8_t { Sender, Receiver, Count };
+enum class BenchPacket : uint8_t { Blob, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+void runTransfer(const char *name, size_t messageSize) {
+  const size_t messages = 50;
+  Network net;
+  net.addNode(BenchNode::Sender);
+  net.addNode(BenchNode::Receiver);
+  net.link(0, 1);
+  net.node(1).enableReassembly(2, messageSize);
+
+  std::unique_ptr<uint8_t[]> payload(new uint8_t[messageSize]());
+  EspNowSimSamples latency;
+  uint64_t sentAtUs = 0;
+  size_t sent = 0;
+  size_t refused = 0;
+
+  std::function<void()> sendNext = [&]() {
+    sentAtUs = net.sim().now();
+    sent++;
+    if (!net.node(0).sendPacket(BenchNode::Receiver, BenchPacket::Blob,
+                                payload.get(), messageSize))
+      refused++;
+  };
+  net.node(1).registerCallback(
+      BenchPacket::Blob, [&](const uint8_t *, size_t, BenchNode) {
+        latency.add(net.sim().now() - sentAtUs);
+        if (sent < messages)
+          net.at(0, 0, sendNext);
+      });
+
+  net.sim().resetStats();
+  net.at(0, 0, sendNext);
+  net.runFor(messages * messageSize * 100 + 1000000);
+
+  // Messages go back to back, so the median latency is the time per message
+  const double perMessageUs = latency.percentile(50);
+  EspNowBench::report(name, "delivered", latency.count(), "msg");
+  EspNowBench::report(name, "send failures", refused, "msg");
+  EspNowBench::report(name, "latency p50", perMessageUs, "us");
+  EspNowBench::report(name, "latency p99", latency.percentile(99), "us");
+  EspNowBench::report(name, "throughput", 1e6 / perMessageUs, "msg/s");
+  EspNowBench::report(name, "throughput",
+                      messageSize * 1e6 / perMessageUs / 1024.0, "KB/s");
+}
+
+} // namespace
+
+ESPNOW_BENCH(fragment_1kb) { runTransfer("fragment_1kb", 1024); }
+
+ESPNOW_BENCH(fragment_4kb) { runTransfer("fragment_4kb", 4096); }
+
+ESPNOW_BENCH(fragment_16kb) { runTransfer("fragment_16kb", 16384); }
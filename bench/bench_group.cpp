@@ -0,0 +1,126 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+#include <chrono>
+
+// A coordinator pushing the same 16-byte command to 20 actuators every
+// 20 ms: sendPacket in a loop against sendToGroup, by broadcast and by
+// unicast copies. Fan-out is the virtual time from the send call until the
+// last actuator ran its callback; host time is wall-clock time spent in the
+// send call, simulated driver included. ESP-NOW allows 20 peers, so the
+// broadcast coordinator keeps its actuators in the registry only: the
+// broadcast peer takes the slot a 20th unicast peer would need.
+
+namespace {
+
+enum class BenchNode : uint8_t { Coordinator, Count = 21 };
+enum class BenchPacket : uint8_t { Command, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+enum class FanOut { Loop, Broadcast, Unicast };
+
+struct Command {
+  uint32_t sequence;
+  uint8_t setpoints[12];
+};
+
+void runFanOut(const char *name, FanOut mode) {
+  const size_t actuators = 20;
+  const uint32_t commands = 200;
+  const uint32_t intervalUs = 20000;
+  Network net;
+  for (size_t i = 0; i <= actuators; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t i = 1; i <= actuators; ++i) {
+    if (mode != FanOut::Broadcast) {
+      net.link(0, i);
+      continue;
+    }
+    uint8_t mac[6];
+    Network::macFor(static_cast<BenchNode>(i), mac);
+    net.node(0).registry->addDevice(static_cast<BenchNode>(i), mac);
+    Network::macFor(BenchNode::Coordinator, mac);
+    net.node(i).registry->addDevice(BenchNode::Coordinator, mac);
+    net.node(i).registerComms(BenchNode::Coordinator);
+  }
+  net.node(0).defineGroup(0, {});
+  for (size_t i = 1; i <= actuators; ++i)
+    net.node(0).addToGroup(0, static_cast<BenchNode>(i));
+
+  std::vector<uint32_t> arrived(commands, 0);
+  std::vector<uint64_t> lastArrivalUs(commands, 0);
+  for (size_t i = 1; i <= actuators; ++i)
+    net.node(i).registerCallback<Command>(
+        BenchPacket::Command, [&](const Command &command, BenchNode) {
+          arrived[command.sequence]++;
+          lastArrivalUs[command.sequence] = net.sim().now();
+        });
+  uint64_t reports = 0;
+  net.node(0).registerSendCallback(
+      [&reports](BenchNode, BenchPacket, bool) { reports++; });
+
+  std::vector<uint64_t> sentAtUs(commands, 0);
+  double hostNs = 0;
+  uint64_t refused = 0;
+  std::function<void(uint32_t)> send = [&](uint32_t sequence) {
+    Command command = {};
+    command.sequence = sequence;
+    sentAtUs[sequence] = net.sim().now();
+    const auto start = std::chrono::steady_clock::now();
+    if (mode == FanOut::Loop) {
+      for (size_t i = 1; i <= actuators; ++i)
+        refused += net.node(0).sendPacket(static_cast<BenchNode>(i),
+                                          BenchPacket::Command, command)
+                       ? 0
+                       : 1;
+    } else {
+      refused += net.node(0).sendToGroup(0, BenchPacket::Command, command,
+                                         mode == FanOut::Unicast)
+                     ? 0
+                     : 1;
+    }
+    hostNs += std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  };
+  net.pollEvery(1000);
+  net.sim().resetStats();
+  for (uint32_t i = 0; i < commands; ++i)
+    net.at(static_cast<uint64_t>(i) * intervalUs, 0,
+           [&send, i]() { send(i); });
+  net.runFor(static_cast<uint64_t>(commands) * intervalUs + 100000);
+
+  EspNowSimSamples fanOut;
+  uint64_t complete = 0;
+  for (uint32_t i = 0; i < commands; ++i) {
+    if (arrived[i] != actuators)
+      continue;
+    complete++;
+    fanOut.add(static_cast<uint32_t>(lastArrivalUs[i] - sentAtUs[i]));
+  }
+  const EspNowSimStats &stats = net.sim().getStats();
+  EspNowBench::report(name, "host time", hostNs / commands, "ns/fan-out");
+  EspNowBench::report(name, "fan-out p50", fanOut.percentile(50), "us");
+  EspNowBench::report(name, "fan-out max", fanOut.max(), "us");
+  EspNowBench::report(name, "frames", 1.0 * stats.framesSent / commands,
+                      "frame/fan-out");
+  EspNowBench::report(name, "airtime", 1.0 * stats.busyUs / commands,
+                      "us/fan-out");
+  EspNowBench::report(name, "complete fan-outs", complete, "of 200");
+  EspNowBench::report(name, "send reports", reports, "");
+  EspNowBench::report(name, "send failures", refused, "");
+}
+
+} // namespace
+
+ESPNOW_BENCH(group_20_peers_loop) {
+  runFanOut("group_20_peers_loop", FanOut::Loop);
+}
+
+ESPNOW_BENCH(group_20_peers_broadcast) {
+  runFanOut("group_20_peers_broadcast", FanOut::Broadcast);
+}
+
+ESPNOW_BENCH(group_20_peers_unicast) {
+  runFanOut("group_20_peers_unicast", FanOut::Unicast);
+}
@@ -0,0 +1,134 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Micro benchmarks of the handler's hot paths on the host, each reporting
+// wall-clock ns/op and heap allocs/op: header encode and hand-off in
+// sendPacket, header parse and dispatch in onDataRecv, the
+// registerCallback<DataStruct> wrapper, calcChecksum and discovery
+// handling. The simulator runs in capture mode, so sends complete without
+// the medium's scheduler and only the handler's own costs are counted.
+// Run with --json and --baseline to catch regressions.
+
+namespace {
+
+enum class BenchNode : uint8_t { Self, Peer, Count };
+enum class BenchPacket : uint8_t { Raw, Reading, Count };
+
+struct Reading {
+  uint32_t sequence;
+  uint16_t value;
+  uint8_t flags;
+};
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+using Handler = Network::Handler;
+
+const size_t Iterations = EspNowBench::Iterations;
+volatile uint32_t &sink = EspNowBench::sink();
+
+// Self linked to Peer, with sends captured instead of transmitted
+struct Bench {
+  Network net;
+  uint8_t peerMac[6];
+
+  Bench() {
+    net.addNode(BenchNode::Self);
+    net.addNode(BenchNode::Peer);
+    net.link(0, 1);
+    net.listenForPairing(0); // Discovery replies go to broadcast
+    Network::macFor(BenchNode::Peer, peerMac);
+    net.sim().setCapture(true);
+  }
+
+  Handler &handler() { return net.node(0); }
+
+  void receive(const uint8_t *frame, size_t len) {
+    EspNowSimAccess::receive(handler(), peerMac, frame,
+                             static_cast<int>(len));
+  }
+};
+
+} // namespace
+
+ESPNOW_BENCH(handler_send_packet) {
+  Bench bench;
+  uint8_t payload[32] = {};
+  EspNowBench::measure("handler_send_packet", "32 bytes raw", Iterations,
+                       [&](size_t i) {
+                         payload[0] = static_cast<uint8_t>(i);
+                         bench.handler().sendPacket(BenchNode::Peer,
+                                                    BenchPacket::Raw, payload,
+                                                    sizeof(payload));
+                         bench.net.sim().flushCaptured();
+                       });
+  Reading reading = {0, 2, 3};
+  EspNowBench::measure("handler_send_packet", "struct", Iterations,
+                       [&](size_t i) {
+                         reading.sequence = static_cast<uint32_t>(i);
+                         bench.handler().sendPacket(
+                             BenchNode::Peer, BenchPacket::Reading, reading);
+                         bench.net.sim().flushCaptured();
+                       });
+}
+
+ESPNOW_BENCH(handler_receive_packet) {
+  Bench bench;
+  bench.handler().registerCallback(
+      BenchPacket::Raw,
+      [](const uint8_t *dataPtr, size_t len, BenchNode) {
+        sink = dataPtr[0] + static_cast<uint32_t>(len);
+      });
+  bench.handler().registerCallback<Reading>(
+      BenchPacket::Reading, [](const Reading &reading, BenchNode) {
+        sink = reading.sequence + reading.value;
+      });
+
+  // Version 1 header: [version|flags][type][sender][len], then the payload
+  uint8_t raw[4 + 32] = {0x40, static_cast<uint8_t>(BenchPacket::Raw),
+                         static_cast<uint8_t>(BenchNode::Peer), 32};
+  EspNowBench::measure("handler_receive_packet", "32 bytes raw", Iterations,
+                       [&](size_t) { bench.receive(raw, sizeof(raw)); });
+
+  uint8_t structFrame[4 + sizeof(Reading)] = {
+      0x40, static_cast<uint8_t>(BenchPacket::Reading),
+      static_cast<uint8_t>(BenchNode::Peer), sizeof(Reading)};
+  EspNowBench::measure(
+      "handler_receive_packet", "struct callback", Iterations,
+      [&](size_t) { bench.receive(structFrame, sizeof(structFrame)); });
+}
+
+ESPNOW_BENCH(handler_checksum) {
+  uint8_t data[250];
+  for (size_t i = 0; i < sizeof(data); ++i)
+    data[i] = static_cast<uint8_t>(i * 7);
+  EspNowBench::measure("handler_checksum", "3 bytes", Iterations * 10,
+                       [&](size_t i) {
+                         data[0] = static_cast<uint8_t>(i);
+                         sink = EspNowSimAccess::checksum<Handler>(data, 3);
+                       });
+  EspNowBench::measure("handler_checksum", "250 bytes", Iterations,
+                       [&](size_t i) {
+                         data[0] = static_cast<uint8_t>(i);
+                         sink = EspNowSimAccess::checksum<Handler>(
+                             data, sizeof(data));
+                       });
+}
+
+ESPNOW_BENCH(handler_discovery) {
+  Bench bench;
+  uint8_t frame[16];
+  const size_t responseLen = EspNowSimAccess::discoveryFrame<Handler>(
+      BenchNode::Peer, BenchNode::Self, false, frame);
+  EspNowBench::measure("handler_discovery", "response from known peer",
+                       Iterations,
+                       [&](size_t) { bench.receive(frame, responseLen); });
+
+  uint8_t request[16];
+  const size_t requestLen = EspNowSimAccess::discoveryFrame<Handler>(
+      BenchNode::Peer, BenchNode::Self, true, request);
+  EspNowBench::measure("handler_discovery", "request and reply", Iterations,
+                       [&](size_t) {
+                         bench.receive(request, requestLen);
+                         bench.net.sim().flushCaptured();
+                       });
+}
@@ -0,0 +1,51 @@
+#include "EspNowBench.h"
+#include <DeviceRegistry.h>
+
+// Cost of authenticating a received frame's sender: resolving its MAC to a
+// device ID with a linear scan over the registry, against what the receive
+// path does, looking up the MAC of the ID the header claims and comparing.
+// Every lookup hits; MACs share a vendor prefix like a real fleet.
+// Wall-clock time on the host.
+
+namespace {
+
+const size_t Iterations = EspNowBench::Iterations * 10;
+volatile uint32_t &sink = EspNowBench::sink();
+
+template <size_t Peers> void runLookup(const char *name) {
+  enum class Id : uint8_t { Count = Peers - 1 };
+  static uint8_t macs[Peers][6];
+  const uint8_t selfMac[6] = {0x24, 0x6F, 0x28, 0x4A, 0xFF, 0xFF};
+  static DeviceRegistry<Id> registry(Id::Count, selfMac);
+  for (size_t i = 0; i < Peers - 1; ++i) {
+    const uint8_t mac[6] = {0x24, 0x6F, 0x28, 0x4A,
+                            static_cast<uint8_t>(i * 37 >> 8),
+                            static_cast<uint8_t>(i * 37)};
+    memcpy(macs[i], mac, 6);
+    registry.addDevice(static_cast<Id>(i), macs[i]);
+  }
+
+  EspNowBench::measure(name, "linear scan", Iterations, [&](size_t i) {
+    const uint8_t *mac = macs[(i * 7) % (Peers - 1)];
+    for (size_t id = 0; id < Peers - 1; ++id) {
+      const uint8_t *known = registry.getDeviceMac(static_cast<Id>(id));
+      if (known != nullptr && memcmp(known, mac, 6) == 0) {
+        sink = static_cast<uint32_t>(id);
+        break;
+      }
+    }
+  });
+  EspNowBench::measure(name, "claimed ID", Iterations, [&](size_t i) {
+    const size_t id = (i * 7) % (Peers - 1);
+    const uint8_t *known = registry.getDeviceMac(static_cast<Id>(id));
+    sink = known != nullptr && memcmp(known, macs[id], 6) == 0;
+  });
+}
+
+} // namespace
+
+ESPNOW_BENCH(mac_lookup_8_peers) { runLookup<8>("mac_lookup_8_peers"); }
+
+ESPNOW_BENCH(mac_lookup_64_peers) { runLookup<64>("mac_lookup_64_peers"); }
+
+ESPNOW_BENCH(mac_lookup_256_peers) { runLookup<256>("mac_lookup_256_peers"); }
@@ -0,0 +1,123 @@
+#include "EspNowBench.h"
+#include <cstdlib>
+#include <new>
+
+// Counts every heap allocation for EspNowBench::measure
+void *operator new(size_t size) {
+  EspNowBench::allocations().fetch_add(1, std::memory_order_relaxed);
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+namespace {
+
+// Copies the string value of "key" in one JSON line written by report()
+bool jsonField(const char *line, const char *key, std::string &out) {
+  std::string pattern = std::string("\"") + key + "\":\"";
+  const char *start = strstr(line, pattern.c_str());
+  if (start == nullptr)
+    return false;
+  start += pattern.size();
+  const char *end = strchr(start, '"');
+  if (end == nullptr)
+    return false;
+  out.assign(start, end);
+  return true;
+}
+
+bool loadBaseline(const char *path, std::vector<EspNowBench::Result> &out) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr)
+    return false;
+  char line[512];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    EspNowBench::Result result;
+    const char *value = strstr(line, "\"value\":");
+    if (value == nullptr || !jsonField(line, "bench", result.bench) ||
+        !jsonField(line, "metric", result.metric) ||
+        !jsonField(line, "unit", result.unit))
+      continue;
+    result.value = strtod(value + strlen("\"value\":"), nullptr);
+    out.push_back(result);
+  }
+  fclose(file);
+  return true;
+}
+
+// Compares the per-operation results against a baseline run. Time may grow
+// by thresholdPct before it counts, allocations may not grow at all. Other
+// units come from the simulator and are not compared.
+size_t countRegressions(const std::vector<EspNowBench::Result> &baseline,
+                        double thresholdPct) {
+  size_t regressions = 0;
+  for (size_t i = 0; i < EspNowBench::results().size(); ++i) {
+    const EspNowBench::Result &now = EspNowBench::results()[i];
+    const bool time = now.unit == "ns/op";
+    const bool allocs = now.unit == "allocs/op";
+    if (!time && !allocs)
+      continue;
+    for (size_t j = 0; j < baseline.size(); ++j) {
+      const EspNowBench::Result &base = baseline[j];
+      if (base.bench != now.bench || base.metric != now.metric ||
+          base.unit != now.unit)
+        continue;
+      const double limit = time ? base.value * (1.0 + thresholdPct / 100.0)
+                                : base.value + 0.001;
+      if (now.value > limit) {
+        fprintf(stderr, "REGRESSION %s %s: %.2f -> %.2f %s\n",
+                now.bench.c_str(), now.metric.c_str(), base.value, now.value,
+                now.unit.c_str());
+        regressions++;
+      }
+      break;
+    }
+  }
+  return regressions;
+}
+
+} // namespace
+
+// Usage: program [--json] [--baseline file] [--threshold pct] [filter]
+// Runs every registered benchmark, or only those whose name contains
+// filter. With --baseline, exits with 1 if any ns/op or allocs/op result
+// regressed against a file written by an earlier --json run.
+int main(int argc, char **argv) {
+  const char *filter = nullptr;
+  const char *baselinePath = nullptr;
+  double thresholdPct = 10.0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0)
+      EspNowBench::json() = true;
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      baselinePath = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      thresholdPct = strtod(argv[++i], nullptr);
+    else
+      filter = argv[i];
+  }
+
+  std::vector<EspNowBench::Result> baseline;
+  if (baselinePath != nullptr && !loadBaseline(baselinePath, baseline)) {
+    fprintf(stderr, "Cannot read baseline %s\n", baselinePath);
+    return 2;
+  }
+
+  for (size_t i = 0; i < EspNowBench::cases().size(); ++i) {
+    const EspNowBench::Case &benchCase = EspNowBench::cases()[i];
+    if (filter != nullptr && strstr(benchCase.name, filter) == nullptr)
+      continue;
+    benchCase.fn();
+  }
+
+  if (baselinePath != nullptr && countRegressions(baseline, thresholdPct) > 0)
+    return 1;
+  return 0;
+}
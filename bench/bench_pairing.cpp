@@ -0,0 +1,51 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Time for a coordinator to pair with every node of a freshly booted site.
+// The coordinator starts all pairings at once and services them from a
+// 1 ms loop; all nodes listen for discovery broadcasts.
+
+namespace {
+
+enum class BenchNode : uint8_t { Coordinator, Count = 64 };
+enum class BenchPacket : uint8_t { Telemetry, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+void runPairing(const char *name, size_t nodeCount) {
+  Network net;
+  net.addNode(BenchNode::Coordinator);
+  for (size_t i = 1; i <= nodeCount; ++i) {
+    net.addNode(static_cast<BenchNode>(i));
+    net.listenForPairing(i);
+  }
+
+  size_t paired = 0;
+  size_t failed = 0;
+  uint64_t lastUs = 0;
+  net.node(0).registerPairingCallback([&](BenchNode, bool ok) {
+    ok ? paired++ : failed++;
+    lastUs = net.sim().now();
+  });
+
+  const uint64_t start = net.sim().now();
+  for (size_t i = 1; i <= nodeCount; ++i)
+    net.node(0).registerComms(static_cast<BenchNode>(i), true);
+  net.pollEvery(1000);
+  while (net.node(0).pendingPairings() > 0 &&
+         net.sim().now() - start < 60000000)
+    net.runFor(1000);
+
+  EspNowBench::report(name, "paired", paired, "nodes");
+  EspNowBench::report(name, "failed", failed, "nodes");
+  EspNowBench::report(name, "time to pair all", (lastUs - start) / 1000.0,
+                      "ms");
+}
+
+} // namespace
+
+ESPNOW_BENCH(pair_1_node) { runPairing("pair_1_node", 1); }
+
+ESPNOW_BENCH(pair_10_nodes) { runPairing("pair_10_nodes", 10); }
+
+ESPNOW_BENCH(pair_50_nodes) { runPairing("pair_50_nodes", 50); }
@@ -0,0 +1,83 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// A controller streaming 200-byte telemetry frames to an actuator faster
+// than the link carries them, while sending a stop command every 10 ms.
+// Reports the command latency (sendPacket to callback, virtual time) with
+// every type in the default class, and with the command in Control and
+// telemetry in Bulk with a 50 ms deadline.
+
+namespace {
+
+enum class BenchNode : uint8_t { Controller, Actuator, Count };
+enum class BenchPacket : uint8_t { Telemetry, Stop, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+void runUnderLoad(const char *name, bool prioritized) {
+  const uint64_t durationUs = 2000000;
+  const uint32_t telemetryIntervalUs = 1500; // Link carries one per ~2 ms
+  const uint32_t stopIntervalUs = 10000;
+  Network net;
+  net.addNode(BenchNode::Controller);
+  net.addNode(BenchNode::Actuator);
+  net.link(0, 1);
+  if (prioritized) {
+    net.node(0).setPriority(BenchPacket::Stop, EspNowPriority::Control);
+    net.node(0).setPriority(BenchPacket::Telemetry, EspNowPriority::Bulk);
+    net.node(0).setPriorityPolicy(EspNowPriority::Bulk, 1, 50);
+  }
+
+  EspNowSimSamples stopLatency;
+  uint64_t telemetryDelivered = 0;
+  net.node(1).registerCallback(
+      BenchPacket::Stop, [&](const uint8_t *dataPtr, size_t, BenchNode) {
+        uint32_t sentAtUs;
+        memcpy(&sentAtUs, dataPtr, sizeof(sentAtUs));
+        stopLatency.add(static_cast<uint32_t>(micros()) - sentAtUs);
+      });
+  net.node(1).registerCallback(
+      BenchPacket::Telemetry,
+      [&](const uint8_t *, size_t, BenchNode) { telemetryDelivered++; });
+
+  uint64_t stopsSent = 0;
+  uint64_t stopsRefused = 0;
+  for (uint64_t t = 0; t < durationUs; t += telemetryIntervalUs)
+    net.at(t, 0, [&net]() {
+      uint8_t telemetry[200] = {};
+      net.node(0).sendPacket(BenchNode::Actuator, BenchPacket::Telemetry,
+                             telemetry, sizeof(telemetry));
+    });
+  for (uint64_t t = 5000; t < durationUs; t += stopIntervalUs)
+    net.at(t, 0, [&]() {
+      const uint32_t sentAtUs = static_cast<uint32_t>(micros());
+      stopsSent++;
+      if (!net.node(0).sendPacket(BenchNode::Actuator, BenchPacket::Stop,
+                                  reinterpret_cast<const uint8_t *>(&sentAtUs),
+                                  sizeof(sentAtUs)))
+        stopsRefused++;
+    });
+  net.runFor(durationUs + 200000);
+
+  const Network::Handler::TxQueueStats stats = net.node(0).getTxQueueStats();
+  EspNowBench::report(name, "stop latency p50", stopLatency.percentile(50),
+                      "us");
+  EspNowBench::report(name, "stop latency p99", stopLatency.percentile(99),
+                      "us");
+  EspNowBench::report(name, "stop latency max", stopLatency.max(), "us");
+  EspNowBench::report(name, "stops delivered", stopLatency.count(), "pkt");
+  EspNowBench::report(name, "stops refused", stopsRefused, "pkt");
+  EspNowBench::report(name, "telemetry delivered",
+                      telemetryDelivered / (durationUs / 1e6), "pkt/s");
+  EspNowBench::report(name, "telemetry expired", stats.expired, "pkt");
+}
+
+} // namespace
+
+ESPNOW_BENCH(priority_stop_under_load_fifo) {
+  runUnderLoad("priority_stop_under_load_fifo", false);
+}
+
+ESPNOW_BENCH(priority_stop_under_load_control) {
+  runUnderLoad("priority_stop_under_load_control", true);
+}
@@ -0,0 +1,82 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Thirty nodes bursting 200-byte readings at one coordinator, offering far
+// more than the channel carries. The medium models contention: every node
+// with frames in its driver adds a 3% chance that a frame collides and is
+// lost, after taking its airtime. Uncontrolled senders keep their drivers
+// full and most frames collide; with rate control each node's token bucket
+// backs off on the failed sends, fewer nodes contend at once and more of the
+// airtime carries frames that arrive. Reports goodput at the coordinator,
+// the share of frames lost to collisions and channel load, all in virtual
+// time.
+
+namespace {
+
+enum class BenchNode : uint8_t { Coordinator, Count = 31 };
+enum class BenchPacket : uint8_t { Reading, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+const size_t Senders = 30;
+const uint64_t WarmupUs = 1000000;
+const uint64_t DurationUs = 4000000;
+const uint32_t IntervalUs = 1000; // Offered: 1000 readings/s per node
+
+void runBurst(const char *name, bool rateControl) {
+  EspNowSimConfig config;
+  config.collisionRate = 0.03f;
+  Network net(config);
+  for (size_t i = 0; i <= Senders; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t i = 1; i <= Senders; ++i) {
+    net.link(0, i);
+    net.node(i).setTxTimeout(0); // Refuse readings while the queue is full
+    if (rateControl)
+      net.node(i).enableRateControl();
+  }
+  net.pollEvery(1000);
+
+  uint64_t received = 0;
+  net.node(0).registerCallback(
+      BenchPacket::Reading,
+      [&received](const uint8_t *, size_t len, BenchNode) {
+        received += len;
+      });
+  const uint64_t endUs = WarmupUs + DurationUs;
+  std::function<void(size_t)> tick = [&](size_t index) {
+    uint8_t reading[200] = {};
+    net.node(index).sendPacket(BenchNode::Coordinator, BenchPacket::Reading,
+                               reading, sizeof(reading));
+    if (net.sim().now() + IntervalUs < endUs)
+      net.at(IntervalUs, index, [&tick, index]() { tick(index); });
+  };
+  for (size_t i = 1; i <= Senders; ++i)
+    net.at(IntervalUs * i / Senders, i, [&tick, i]() { tick(i); });
+
+  net.runFor(WarmupUs); // Rates settle
+  received = 0;
+  net.sim().resetStats();
+  net.runFor(DurationUs);
+
+  const EspNowSimStats &stats = net.sim().getStats();
+  EspNowBench::report(name, "goodput", received / 1024.0 / (DurationUs / 1e6),
+                      "KB/s");
+  EspNowBench::report(name, "collided",
+                      stats.framesSent > 0
+                          ? 100.0 * stats.framesCollided / stats.framesSent
+                          : 0.0,
+                      "%");
+  EspNowBench::report(name, "channel load",
+                      100.0 * stats.busyUs / net.sim().statsElapsedUs(), "%");
+}
+
+} // namespace
+
+ESPNOW_BENCH(rate_30_nodes_uncontrolled) {
+  runBurst("rate_30_nodes_uncontrolled", false);
+}
+
+ESPNOW_BENCH(rate_30_nodes_controlled) {
+  runBurst("rate_30_nodes_controlled", true);
+}
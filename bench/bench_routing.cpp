@@ -0,0 +1,79 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Multi-hop delivery on a line of nodes where each node only hears its
+// neighbors: the first node sends a reading every 20 ms to the last one,
+// three to five hops away, once the route beacons have converged. Reports
+// the delivery rate and the end-to-end latency (sendPacket to callback,
+// virtual time) on a clean medium and with 5% loss per hop.
+
+namespace {
+
+enum class BenchNode : uint8_t { N0, N1, N2, N3, N4, N5, Count };
+enum class BenchPacket : uint8_t { Reading, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+void runLine(const char *name, size_t hops, float lossRate) {
+  const size_t packets = 200;
+  const uint32_t intervalUs = 20000;
+  EspNowSimConfig config;
+  config.lossRate = lossRate;
+  Network net(config);
+  for (size_t i = 0; i <= hops; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t a = 0; a <= hops; ++a) {
+    for (size_t b = a + 2; b <= hops; ++b)
+      net.sim().setInRange(a, b, false);
+    if (a < hops)
+      net.link(a, a + 1);
+  }
+  for (size_t i = 0; i <= hops; ++i)
+    net.node(i).enableRouting(100);
+  net.pollEvery(1000);
+  net.runFor(1000000); // Routes spread one hop per beacon
+
+  EspNowSimSamples latency;
+  net.node(hops).registerCallback(
+      BenchPacket::Reading, [&](const uint8_t *dataPtr, size_t, BenchNode) {
+        uint32_t sentAtUs;
+        memcpy(&sentAtUs, dataPtr, sizeof(sentAtUs));
+        latency.add(static_cast<uint32_t>(micros()) - sentAtUs);
+      });
+  const BenchNode target = static_cast<BenchNode>(hops);
+  for (size_t i = 0; i < packets; ++i)
+    net.at(i * intervalUs, 0, [&net, target]() {
+      const uint32_t sentAtUs = static_cast<uint32_t>(micros());
+      net.node(0).sendPacket(target, BenchPacket::Reading,
+                             reinterpret_cast<const uint8_t *>(&sentAtUs),
+                             sizeof(sentAtUs));
+    });
+  net.runFor(packets * intervalUs + 200000);
+
+  uint64_t forwarded = 0;
+  for (size_t i = 1; i < hops; ++i)
+    forwarded += net.node(i).getRouteStats().forwarded;
+  EspNowBench::report(name, "delivered",
+                      100.0 * latency.count() / packets, "%");
+  EspNowBench::report(name, "latency p50", latency.percentile(50), "us");
+  EspNowBench::report(name, "latency p99", latency.percentile(99), "us");
+  EspNowBench::report(name, "forwards per delivery",
+                      latency.count() > 0
+                          ? static_cast<double>(forwarded) / latency.count()
+                          : 0.0,
+                      "frames");
+}
+
+} // namespace
+
+ESPNOW_BENCH(routing_line_3_hops) { runLine("routing_line_3_hops", 3, 0.0f); }
+
+ESPNOW_BENCH(routing_line_5_hops) { runLine("routing_line_5_hops", 5, 0.0f); }
+
+ESPNOW_BENCH(routing_line_3_hops_lossy) {
+  runLine("routing_line_3_hops_lossy", 3, 0.05f);
+}
+
+ESPNOW_BENCH(routing_line_5_hops_lossy) {
+  runLine("routing_line_5_hops_lossy", 5, 0.05f);
+}
@@ -0,0 +1,97 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Request/reply round trips on the simulator: eight clients keep calls in
+// flight to one server, which answers each 16-byte request with 32 bytes.
+// Each client reissues a call from its completion callback, so the server
+// sees up to clients * depth requests at once. Reports the round trip
+// (callRpc to completion, virtual time), completed calls per second and
+// timeouts, with one and with four calls in flight per client. With four,
+// the server's transmit queue overflows and the replies it can't queue from
+// the receive callback time out.
+
+namespace {
+
+enum class BenchNode : uint8_t { Server, Count = 9 }; // Clients 1 to 8
+enum class BenchPacket : uint8_t { Query, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+const size_t Clients = 8;
+const uint64_t DurationUs = 2000000;
+const uint32_t TimeoutMs = 100;
+
+struct Client {
+  Network *net;
+  size_t index;
+  EspNowSimSamples *roundTrip;
+  uint64_t *timeouts;
+  bool running;
+
+  void call() {
+    uint8_t request[16] = {};
+    const uint32_t sentAtUs = static_cast<uint32_t>(micros());
+    memcpy(request, &sentAtUs, sizeof(sentAtUs));
+    Client *self = this;
+    net->node(index).callRpc(
+        BenchNode::Server, BenchPacket::Query, request, sizeof(request),
+        TimeoutMs,
+        [self](EspNowRpcStatus status, const uint8_t *reply, size_t,
+               BenchNode) {
+          if (status == EspNowRpcStatus::Ok) {
+            uint32_t sentAtUs;
+            memcpy(&sentAtUs, reply, sizeof(sentAtUs));
+            self->roundTrip->add(static_cast<uint32_t>(micros()) - sentAtUs);
+          } else {
+            (*self->timeouts)++;
+          }
+          if (self->running)
+            self->call();
+        });
+  }
+};
+
+void runClients(const char *name, size_t depth) {
+  Network net;
+  for (size_t i = 0; i <= Clients; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t i = 1; i <= Clients; ++i) {
+    net.link(0, i);
+    net.node(i).enableRpc(BenchPacket::Query);
+  }
+  net.pollEvery(1000);
+  net.node(0).registerRpcHandler(
+      BenchPacket::Query,
+      [](const uint8_t *request, size_t len, BenchNode, uint8_t *reply,
+         size_t &replyLen) {
+        memset(reply, 0, 32);
+        memcpy(reply, request, len < 32 ? len : 32);
+        replyLen = 32;
+        return true;
+      });
+
+  EspNowSimSamples roundTrip;
+  uint64_t timeouts = 0;
+  Client clients[Clients];
+  for (size_t i = 0; i < Clients; ++i) {
+    clients[i] = {&net, i + 1, &roundTrip, &timeouts, true};
+    for (size_t j = 0; j < depth; ++j)
+      net.at(j * 100, i + 1, [&clients, i]() { clients[i].call(); });
+  }
+  net.runFor(DurationUs);
+  for (size_t i = 0; i < Clients; ++i)
+    clients[i].running = false;
+  net.runFor(200000);
+
+  EspNowBench::report(name, "round trip p50", roundTrip.percentile(50), "us");
+  EspNowBench::report(name, "round trip p99", roundTrip.percentile(99), "us");
+  EspNowBench::report(name, "completed", roundTrip.count() / (DurationUs / 1e6),
+                      "calls/s");
+  EspNowBench::report(name, "timeouts", timeouts, "calls");
+}
+
+} // namespace
+
+ESPNOW_BENCH(rpc_8_clients_depth_1) { runClients("rpc_8_clients_depth_1", 1); }
+
+ESPNOW_BENCH(rpc_8_clients_depth_4) { runClients("rpc_8_clients_depth_4", 4); }
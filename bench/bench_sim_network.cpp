@@ -0,0 +1,87 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Macro benchmarks on the simulated medium: many sensor nodes reporting to one
+// coordinator. All times are virtual (simulated) time.
+
+namespace {
+
+enum class BenchNode : uint8_t { Coordinator, Count = 64 };
+enum class BenchPacket : uint8_t { Telemetry, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+
+struct Telemetry {
+  uint32_t sentAtUs;
+  uint8_t sample[28];
+};
+
+void runStar(const char *name, size_t nodeCount, uint32_t intervalUs,
+             const EspNowSimConfig &config) {
+  const uint64_t durationUs = 2000000;
+  Network net(config);
+  for (size_t i = 0; i < nodeCount; ++i)
+    net.addNode(static_cast<BenchNode>(i));
+  for (size_t i = 1; i < nodeCount; ++i)
+    net.link(0, i);
+
+  EspNowSimSamples latency;
+  uint64_t offered = 0;
+  uint64_t refused = 0;
+  net.node(0).registerCallback(
+      BenchPacket::Telemetry,
+      [&latency](const uint8_t *dataPtr, size_t len, BenchNode sender) {
+        Telemetry telemetry;
+        memcpy(&telemetry, dataPtr, sizeof(telemetry));
+        latency.add(micros() - telemetry.sentAtUs);
+      });
+
+  std::function<void(size_t)> tick = [&](size_t index) {
+    Telemetry telemetry = {};
+    telemetry.sentAtUs = micros();
+    offered++;
+    if (!net.node(index).sendPacket(BenchNode::Coordinator,
+                                    BenchPacket::Telemetry, telemetry))
+      refused++;
+    if (net.sim().now() + intervalUs < durationUs)
+      net.at(intervalUs, index, [&tick, index]() { tick(index); });
+  };
+  for (size_t i = 1; i < nodeCount; ++i)
+    net.at(intervalUs * i / nodeCount, i, [&tick, i]() { tick(i); });
+
+  net.sim().resetStats();
+  net.runFor(durationUs + 100000);
+
+  const double seconds = durationUs / 1e6;
+  EspNowBench::report(name, "offered", offered / seconds, "pkt/s");
+  EspNowBench::report(name, "delivered", latency.count() / seconds, "pkt/s");
+  EspNowBench::report(name, "send failures", refused, "pkt");
+  EspNowBench::report(name, "latency p50", latency.percentile(50), "us");
+  EspNowBench::report(name, "latency p90", latency.percentile(90), "us");
+  EspNowBench::report(name, "latency p99", latency.percentile(99), "us");
+  EspNowBench::report(name, "latency max", latency.max(), "us");
+  EspNowBench::report(name, "channel load",
+                      100.0 * net.sim().getStats().busyUs /
+                          net.sim().statsElapsedUs(),
+                      "%");
+}
+
+} // namespace
+
+ESPNOW_BENCH(sim_star_2_nodes) {
+  runStar("sim_star_2_nodes", 2, 20000, EspNowSimConfig());
+}
+
+ESPNOW_BENCH(sim_star_10_nodes) {
+  runStar("sim_star_10_nodes", 10, 20000, EspNowSimConfig());
+}
+
+ESPNOW_BENCH(sim_star_40_nodes) {
+  runStar("sim_star_40_nodes", 40, 20000, EspNowSimConfig());
+}
+
+ESPNOW_BENCH(sim_star_40_nodes_lossy) {
+  EspNowSimConfig config;
+  config.lossRate = 0.1f;
+  runStar("sim_star_40_nodes_lossy", 40, 20000, config);
+}
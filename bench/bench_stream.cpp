@@ -0,0 +1,113 @@
+#include "EspNowBench.h"
+#include <EspNowSimNetwork.h>
+
+// Bulk transfer of 200 KB between two nodes on the simulator, on a clean
+// medium and with 5% and 10% loss per frame. Reports goodput (bytes at the
+// sink over virtual time until the sender sees completion) and how many
+// chunks were sent again. The baseline moves the same data as reliable
+// packets, sending each chunk once the previous one was acknowledged.
+
+namespace {
+
+enum class BenchNode : uint8_t { Sender, Receiver, Count };
+enum class BenchPacket : uint8_t { Chunk, Count };
+
+using Network = EspNowSimNetwork<BenchNode, BenchPacket>;
+using Handler = Network::Handler;
+
+const uint32_t Total = 200000;
+const uint64_t LimitUs = 60000000;
+const size_t ChunkSize = 232; // About a stream chunk, as one reliable frame
+
+void runStream(const char *name, float lossRate) {
+  EspNowSimConfig config;
+  config.lossRate = lossRate;
+  Network net(config);
+  net.addNode(BenchNode::Sender);
+  net.addNode(BenchNode::Receiver);
+  net.link(0, 1);
+  net.pollEvery(1000);
+
+  uint32_t received = 0;
+  net.node(1).registerStreamSink([&](BenchNode, uint8_t, uint32_t,
+                                     const uint8_t *, size_t len,
+                                     uint32_t) { received += len; });
+  bool complete = false;
+  net.node(0).registerStreamCallback(
+      [&](BenchNode, uint8_t, bool done, uint32_t) { complete = done; });
+  net.node(0).openStream(
+      BenchNode::Receiver, 1, Total,
+      [](uint32_t offset, uint8_t *out, size_t len) {
+        memset(out, static_cast<uint8_t>(offset), len);
+        return true;
+      });
+  uint64_t elapsedUs = 0;
+  while (!complete && elapsedUs < LimitUs) {
+    net.runFor(1000);
+    elapsedUs += 1000;
+  }
+
+  const Handler::StreamStats stats = net.node(0).getStreamStats();
+  EspNowBench::report(name, "goodput", received / 1024.0 / (elapsedUs / 1e6),
+                      "KB/s");
+  EspNowBench::report(name, "chunks sent", stats.chunksSent, "chunks");
+  EspNowBench::report(name, "chunks resent", stats.chunksResent, "chunks");
+}
+
+void runReliable(const char *name, float lossRate) {
+  EspNowSimConfig config;
+  config.lossRate = lossRate;
+  Network net(config);
+  net.addNode(BenchNode::Sender);
+  net.addNode(BenchNode::Receiver);
+  net.link(0, 1);
+  net.pollEvery(1000);
+  net.node(0).setReliable(BenchPacket::Chunk);
+  net.node(1).setReliable(BenchPacket::Chunk);
+
+  uint32_t received = 0;
+  net.node(1).registerCallback(
+      BenchPacket::Chunk,
+      [&](const uint8_t *, size_t len, BenchNode) { received += len; });
+  uint8_t chunk[ChunkSize] = {};
+  uint32_t acked = 0;
+  bool waiting = false;
+  net.node(0).registerSendCallback(
+      [&](BenchNode, BenchPacket, bool delivered) {
+        if (delivered)
+          acked += sizeof(chunk);
+        waiting = false; // Sent again if it failed
+      });
+  uint64_t elapsedUs = 0;
+  while (acked < Total && elapsedUs < LimitUs) {
+    if (!waiting)
+      waiting = net.node(0).sendPacket(BenchNode::Receiver,
+                                       BenchPacket::Chunk, chunk,
+                                       sizeof(chunk));
+    net.runFor(100);
+    elapsedUs += 100;
+  }
+
+  EspNowBench::report(name, "goodput", received / 1024.0 / (elapsedUs / 1e6),
+                      "KB/s");
+  EspNowBench::report(name, "packets resent",
+                      net.node(0).getReliableStats().retransmits, "packets");
+}
+
+} // namespace
+
+ESPNOW_BENCH(stream_200k) { runStream("stream_200k", 0.0f); }
+
+ESPNOW_BENCH(stream_200k_loss_5) { runStream("stream_200k_loss_5", 0.05f); }
+
+ESPNOW_BENCH(stream_200k_loss_10) {
+  runStream("stream_200k_loss_10", 0.1f);
+}
+
+ESPNOW_BENCH(stream_200k_reliable_packets) {
+  runReliable("stream_200k_reliable_packets", 0.0f);
+}
+
+ESPNOW_BENCH(stream_200k_reliable_packets_loss_10) {
+  runReliable("stream_200k_reliable_packets_loss_10", 0.1f);
+}
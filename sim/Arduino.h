@@ -0,0 +1,12 @@
+#ifndef ARDUINO_SIM_SHIM_H
+#define ARDUINO_SIM_SHIM_H
+
+// Native build replacement for the parts of Arduino.h the library uses.
+// delay(), millis() and micros() run on the EspNowSim virtual clock.
+#include "EspNowSim.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef DEVICEREGISTRY_SIM_H
+#define DEVICEREGISTRY_SIM_H
+
+// Native build replacement for the DeviceRegistry library. Keeps the same
+// interface but stores devices in RAM and only counts flash writes.
+
+#include <Arduino.h>
+#include <array>
+#include <cstring>
+#include <functional>
+
+static const uint8_t BroadCastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+template <typename UniqueID> class DeviceRegistry {
+public:
+  static constexpr size_t DeviceCount = static_cast<size_t>(UniqueID::Count);
+
+  DeviceRegistry(UniqueID selfUniqueID, const uint8_t *selfMacPtr)
+      : selfID(selfUniqueID) {
+    addDevice(selfUniqueID, selfMacPtr);
+  }
+
+  bool addDevice(UniqueID id, const uint8_t *macPtr) {
+    const size_t index = static_cast<size_t>(id);
+    if (index >= DeviceCount || macPtr == nullptr)
+      return false;
+    memcpy(entries[index].mac, macPtr, 6);
+    entries[index].valid = true;
+    return true;
+  }
+
+  bool removeDevice(UniqueID id) {
+    const size_t index = static_cast<size_t>(id);
+    if (index >= DeviceCount || !entries[index].valid)
+      return false;
+    entries[index].valid = false;
+    return true;
+  }
+
+  const uint8_t *getDeviceMac(UniqueID id) const {
+    const size_t index = static_cast<size_t>(id);
+    if (index >= DeviceCount || !entries[index].valid)
+      return nullptr;
+    return entries[index].mac;
+  }
+
+  bool saveToFlash() {
+    flashWrites++;
+    return true;
+  }
+
+  bool loadFromFlash() { return true; }
+
+  size_t flashWriteCount() const { return flashWrites; }
+
+private:
+  struct Entry {
+    uint8_t mac[6];
+    bool valid;
+  };
+
+  UniqueID selfID;
+  std::array<Entry, DeviceCount> entries = {};
+  size_t flashWrites = 0;
+};
+
+#endif
@@ -0,0 +1,631 @@
+#ifndef ESPNOWSIM_H
+#define ESPNOWSIM_H
+
+// In-process ESP-NOW radio simulator for the native (host) build.
+// Stands in for the esp_now driver and the Arduino timing functions, and runs
+// every simulated node on one shared virtual medium driven by a virtual clock.
+// Everything is single threaded: radio callbacks run from inside delay(),
+// runFor() or esp_now_send() exactly like they would interleave on a board.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+// esp_now.h subset
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define ESP_ERR_ESPNOW_BASE 0x3000
+#define ESP_ERR_ESPNOW_NOT_INIT (ESP_ERR_ESPNOW_BASE + 1)
+#define ESP_ERR_ESPNOW_ARG (ESP_ERR_ESPNOW_BASE + 2)
+#define ESP_ERR_ESPNOW_NO_MEM (ESP_ERR_ESPNOW_BASE + 3)
+#define ESP_ERR_ESPNOW_FULL (ESP_ERR_ESPNOW_BASE + 4)
+#define ESP_ERR_ESPNOW_NOT_FOUND (ESP_ERR_ESPNOW_BASE + 5)
+#define ESP_ERR_ESPNOW_INTERNAL (ESP_ERR_ESPNOW_BASE + 6)
+#define ESP_ERR_ESPNOW_EXIST (ESP_ERR_ESPNOW_BASE + 7)
+#define ESP_ERR_ESPNOW_IF (ESP_ERR_ESPNOW_BASE + 8)
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+#define ESP_NOW_MAX_TOTAL_PEER_NUM 20
+#define ESP_NOW_MAX_ENCRYPT_PEER_NUM 6
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef enum {
+  ESP_NOW_SEND_SUCCESS = 0,
+  ESP_NOW_SEND_FAIL,
+} esp_now_send_status_t;
+
+typedef enum {
+  WIFI_IF_STA = 0,
+  WIFI_IF_AP,
+} wifi_interface_t;
+
+typedef struct {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[ESP_NOW_KEY_LEN];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void *priv;
+} esp_now_peer_info_t;
+
+typedef struct {
+  int total_num;
+  int encrypt_num;
+} esp_now_peer_num_t;
+
+typedef void (*esp_now_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data,
+                                  int data_len);
+typedef void (*esp_now_send_cb_t)(const uint8_t *mac_addr,
+                                  esp_now_send_status_t status);
+
+// Medium parameters. Defaults approximate the 1 Mbps ESP-NOW default rate.
+struct EspNowSimConfig {
+  uint32_t latencyUs = 150;       // Fixed driver + propagation latency
+  uint32_t jitterUs = 100;        // Uniform extra latency in [0, jitterUs]
+  float lossRate = 0.0f;          // Per receiver frame loss probability
+  float corruptRate = 0.0f;       // Per receiver chance of a flipped bit
+                                  // that slips past the MAC layer FCS
+  float collisionRate = 0.0f;     // Chance a frame collides, per other node
+                                  // with frames waiting in its driver
+  float airtimeUsPerByte = 8.0f;  // 1 Mbps PHY
+  uint32_t frameOverheadUs = 400; // Preamble, MAC header, IFS and MAC ACK
+  uint8_t driverQueueDepth = 8;   // Frames queued per node before NO_MEM
+  uint32_t seed = 1;
+};
+
+// Collects latency samples and reports percentiles
+class EspNowSimSamples {
+public:
+  void add(uint32_t sample) { samples.push_back(sample); }
+  void clear() { samples.clear(); }
+  size_t count() const { return samples.size(); }
+
+  uint32_t percentile(double p) const {
+    if (samples.empty())
+      return 0;
+    std::vector<uint32_t> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+  }
+
+  uint32_t max() const {
+    return samples.empty() ? 0
+                           : *std::max_element(samples.begin(), samples.end());
+  }
+
+private:
+  std::vector<uint32_t> samples;
+};
+
+struct EspNowSimStats {
+  uint64_t framesSent = 0;      // Frames put on the air
+  uint64_t framesDelivered = 0; // Frame copies handed to a receive callback
+  uint64_t framesLost = 0;      // Frame copies dropped by the medium
+  uint64_t framesCollided = 0;  // Frames lost to contention, see collide()
+  uint64_t framesCorrupted = 0; // Frame copies delivered with a bit error
+  uint64_t framesRejected = 0;  // esp_now_send calls refused by the driver
+  uint64_t bytesDelivered = 0;
+  uint64_t busyUs = 0;          // Total airtime used on the channel
+  EspNowSimSamples latencyUs;   // esp_now_send -> receive callback
+};
+
+class EspNowSim {
+public:
+  static EspNowSim &instance() {
+    static EspNowSim sim;
+    return sim;
+  }
+
+  void reset(const EspNowSimConfig &newConfig = EspNowSimConfig()) {
+    config = newConfig;
+    nodes.clear();
+    events = EventQueue();
+    stats = EspNowSimStats();
+    rng.seed(config.seed);
+    idRng.seed(config.seed + 1);
+    nowUs = 0;
+    statsSinceUs = 0;
+    channelFreeAt = 0;
+    eventSeq = 0;
+    currentNode = 0;
+    capture = false;
+  }
+
+  // Adds a radio with the given MAC. The activate hook is run whenever the
+  // simulator switches execution to this node (before its callbacks run).
+  size_t addNode(const uint8_t *mac, std::function<void()> activateHook) {
+    Node node;
+    memcpy(node.mac, mac, ESP_NOW_ETH_ALEN);
+    node.activate = activateHook;
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+
+  void activate(size_t node) {
+    currentNode = node;
+    if (nodes[node].activate)
+      nodes[node].activate();
+  }
+
+  size_t current() const { return currentNode; }
+  size_t nodeCount() const { return nodes.size(); }
+  uint64_t now() const { return nowUs; }
+
+  // Skews a node's local clock: micros() and millis() read offsetUs ahead of
+  // virtual time, plus driftPpm of it, while that node runs. The medium and
+  // the event queue stay on virtual time.
+  void setClock(size_t node, uint64_t offsetUs, double driftPpm) {
+    nodes[node].clockOffsetUs = offsetUs;
+    nodes[node].clockDriftPpm = driftPpm;
+  }
+
+  // Puts two nodes in or out of each other's radio range (default in).
+  // Frames between nodes out of range are neither received nor acked.
+  void setInRange(size_t a, size_t b, bool inRange) {
+    for (size_t i = 0; i < 2; ++i) {
+      Node &node = nodes[i == 0 ? a : b];
+      const size_t other = i == 0 ? b : a;
+      if (node.outOfRange.size() <= other)
+        node.outOfRange.resize(other + 1, false);
+      node.outOfRange[other] = !inRange;
+    }
+  }
+
+  bool inRange(size_t a, size_t b) const {
+    const std::vector<bool> &outOfRange = nodes[a].outOfRange;
+    return b >= outOfRange.size() || !outOfRange[b];
+  }
+
+  // Virtual time on the current node's clock
+  uint64_t localNow() const {
+    if (nodes.empty())
+      return nowUs;
+    const Node &node = nodes[currentNode];
+    return nowUs + node.clockOffsetUs +
+           static_cast<int64_t>(nowUs * node.clockDriftPpm / 1e6);
+  }
+  const EspNowSimConfig &getConfig() const { return config; }
+  EspNowSimStats &getStats() { return stats; }
+  uint32_t random() { return idRng(); }
+
+  void resetStats() {
+    stats = EspNowSimStats();
+    statsSinceUs = nowUs;
+  }
+
+  uint64_t statsElapsedUs() const { return nowUs - statsSinceUs; }
+
+  // Runs fn on the virtual clock delayUs from now, on behalf of node
+  void schedule(uint64_t delayUs, size_t node, std::function<void()> fn) {
+    Event event;
+    event.time = nowUs + delayUs;
+    event.seq = eventSeq++;
+    event.node = node;
+    event.fn = fn;
+    events.push(event);
+  }
+
+  // Advances virtual time, running every event that falls due
+  void runFor(uint64_t us) {
+    const uint64_t until = nowUs + us;
+    while (!events.empty() && events.top().time <= until) {
+      Event event = events.top();
+      events.pop();
+      nowUs = std::max(nowUs, event.time);
+      const size_t previous = currentNode;
+      activate(event.node);
+      event.fn();
+      activate(previous);
+    }
+    nowUs = std::max(nowUs, until);
+  }
+
+  size_t pendingEvents() const { return events.size(); }
+
+  // Capture mode: esp_now_send accepts frames but puts nothing on the air
+  // and schedules nothing. flushCaptured() then runs the current node's
+  // send callback for each of them as if the peer had acknowledged it.
+  // Keeps the medium's bookkeeping out of micro benchmarks.
+  void setCapture(bool enabled) { capture = enabled; }
+
+  // Completes the current node's captured frames, including any it sends
+  // from its send callback. Returns the number completed.
+  size_t flushCaptured() {
+    size_t completed = 0;
+    Node &node = self();
+    while (node.capturedCount > 0) {
+      uint8_t mac[ESP_NOW_ETH_ALEN];
+      memcpy(mac, node.captured[node.capturedHead], ESP_NOW_ETH_ALEN);
+      node.capturedHead = static_cast<uint8_t>(node.capturedHead + 1);
+      node.capturedCount--;
+      if (node.inDriver > 0)
+        node.inDriver--;
+      completed++;
+      if (node.sendCb != nullptr)
+        node.sendCb(mac, ESP_NOW_SEND_SUCCESS);
+    }
+    return completed;
+  }
+
+  // Driver API, executed on behalf of the current node
+
+  esp_err_t init() {
+    self().initialized = true;
+    return ESP_OK;
+  }
+
+  esp_err_t deinit() {
+    Node &node = self();
+    node.initialized = false;
+    node.recvCb = nullptr;
+    node.sendCb = nullptr;
+    node.peers.clear();
+    return ESP_OK;
+  }
+
+  esp_err_t registerRecv(esp_now_recv_cb_t cb) {
+    if (!self().initialized)
+      return ESP_ERR_ESPNOW_NOT_INIT;
+    self().recvCb = cb;
+    return ESP_OK;
+  }
+
+  esp_err_t registerSend(esp_now_send_cb_t cb) {
+    if (!self().initialized)
+      return ESP_ERR_ESPNOW_NOT_INIT;
+    self().sendCb = cb;
+    return ESP_OK;
+  }
+
+  esp_err_t addPeer(const esp_now_peer_info_t *peer) {
+    Node &node = self();
+    if (!node.initialized)
+      return ESP_ERR_ESPNOW_NOT_INIT;
+    if (peer == nullptr)
+      return ESP_ERR_ESPNOW_ARG;
+    if (findPeer(node, peer->peer_addr) != nullptr)
+      return ESP_ERR_ESPNOW_EXIST;
+    if (node.peers.size() >= ESP_NOW_MAX_TOTAL_PEER_NUM)
+      return ESP_ERR_ESPNOW_FULL;
+    if (peer->encrypt && encryptedPeers(node) >= ESP_NOW_MAX_ENCRYPT_PEER_NUM)
+      return ESP_ERR_ESPNOW_FULL;
+    node.peers.push_back(*peer);
+    return ESP_OK;
+  }
+
+  esp_err_t modPeer(const esp_now_peer_info_t *peer) {
+    if (peer == nullptr)
+      return ESP_ERR_ESPNOW_ARG;
+    esp_now_peer_info_t *existing = findPeer(self(), peer->peer_addr);
+    if (existing == nullptr)
+      return ESP_ERR_ESPNOW_NOT_FOUND;
+    *existing = *peer;
+    return ESP_OK;
+  }
+
+  esp_err_t delPeer(const uint8_t *mac) {
+    Node &node = self();
+    for (size_t i = 0; i < node.peers.size(); ++i) {
+      if (memcmp(node.peers[i].peer_addr, mac, ESP_NOW_ETH_ALEN) == 0) {
+        node.peers.erase(node.peers.begin() + i);
+        return ESP_OK;
+      }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+  }
+
+  bool isPeer(const uint8_t *mac) { return findPeer(self(), mac) != nullptr; }
+
+  esp_err_t peerNum(esp_now_peer_num_t *num) {
+    if (num == nullptr)
+      return ESP_ERR_ESPNOW_ARG;
+    num->total_num = static_cast<int>(self().peers.size());
+    num->encrypt_num = static_cast<int>(encryptedPeers(self()));
+    return ESP_OK;
+  }
+
+  esp_err_t send(const uint8_t *mac, const uint8_t *data, size_t len) {
+    Node &node = self();
+    if (!node.initialized)
+      return ESP_ERR_ESPNOW_NOT_INIT;
+    if (data == nullptr || len == 0 || len > ESP_NOW_MAX_DATA_LEN)
+      return ESP_ERR_ESPNOW_ARG;
+
+    if (mac == nullptr) { // Send to every peer in the peer list
+      if (node.peers.empty())
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+      if (node.inDriver + node.peers.size() > config.driverQueueDepth) {
+        stats.framesRejected++;
+        return ESP_ERR_ESPNOW_NO_MEM;
+      }
+      for (size_t i = 0; i < node.peers.size(); ++i)
+        emit(node.peers[i].peer_addr, data, len);
+      return ESP_OK;
+    }
+
+    if (findPeer(node, mac) == nullptr)
+      return ESP_ERR_ESPNOW_NOT_FOUND;
+    if (node.inDriver >= config.driverQueueDepth) {
+      stats.framesRejected++;
+      return ESP_ERR_ESPNOW_NO_MEM;
+    }
+    emit(mac, data, len);
+    return ESP_OK;
+  }
+
+private:
+  struct Node {
+    uint8_t mac[ESP_NOW_ETH_ALEN] = {};
+    bool initialized = false;
+    esp_now_recv_cb_t recvCb = nullptr;
+    esp_now_send_cb_t sendCb = nullptr;
+    std::vector<esp_now_peer_info_t> peers;
+    size_t inDriver = 0;
+    std::function<void()> activate;
+    uint8_t captured[256][ESP_NOW_ETH_ALEN]; // Ring, see setCapture()
+    uint8_t capturedHead = 0;
+    size_t capturedCount = 0;
+    uint64_t clockOffsetUs = 0;
+    double clockDriftPpm = 0;
+    std::vector<bool> outOfRange; // By node index, see setInRange()
+  };
+
+  struct Event {
+    uint64_t time;
+    uint64_t seq;
+    size_t node;
+    std::function<void()> fn;
+  };
+
+  struct EventLater {
+    bool operator()(const Event &a, const Event &b) const {
+      return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+    }
+  };
+
+  using EventQueue =
+      std::priority_queue<Event, std::vector<Event>, EventLater>;
+
+  EspNowSim() { reset(); }
+
+  // Handlers created outside a network act on an implicit standalone radio
+  Node &self() {
+    if (nodes.empty())
+      nodes.push_back(Node());
+    return nodes[currentNode];
+  }
+
+  static bool isBroadcast(const uint8_t *mac) {
+    static const uint8_t broadcast[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF,
+                                                        0xFF, 0xFF, 0xFF};
+    return memcmp(mac, broadcast, ESP_NOW_ETH_ALEN) == 0;
+  }
+
+  static esp_now_peer_info_t *findPeer(Node &node, const uint8_t *mac) {
+    for (size_t i = 0; i < node.peers.size(); ++i) {
+      if (memcmp(node.peers[i].peer_addr, mac, ESP_NOW_ETH_ALEN) == 0)
+        return &node.peers[i];
+    }
+    return nullptr;
+  }
+
+  static size_t encryptedPeers(const Node &node) {
+    size_t count = 0;
+    for (size_t i = 0; i < node.peers.size(); ++i)
+      count += node.peers[i].encrypt ? 1 : 0;
+    return count;
+  }
+
+  bool lose() {
+    if (config.lossRate <= 0.0f)
+      return false;
+    return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) <
+           config.lossRate;
+  }
+
+  // Backlogged nodes contend for the channel, so every node with frames
+  // in its driver adds a collisionRate chance that the frame is lost to
+  // all receivers. It still takes its airtime.
+  bool collide(size_t sender) {
+    if (config.collisionRate <= 0.0f)
+      return false;
+    size_t contenders = 0;
+    for (size_t i = 0; i < nodes.size(); ++i)
+      contenders += i != sender && nodes[i].inDriver > 0 ? 1 : 0;
+    const float clear = std::pow(1.0f - config.collisionRate,
+                                 static_cast<float>(contenders));
+    return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) >= clear;
+  }
+
+  bool corrupt(std::vector<uint8_t> &frame) {
+    if (config.corruptRate <= 0.0f || frame.empty() ||
+        std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) >=
+            config.corruptRate)
+      return false;
+    const size_t bit =
+        std::uniform_int_distribution<size_t>(0, frame.size() * 8 - 1)(rng);
+    frame[bit / 8] ^= static_cast<uint8_t>(1 << (bit % 8));
+    return true;
+  }
+
+  uint32_t jitter() {
+    if (config.jitterUs == 0)
+      return 0;
+    return std::uniform_int_distribution<uint32_t>(0, config.jitterUs)(rng);
+  }
+
+  void emit(const uint8_t *mac, const uint8_t *data, size_t len) {
+    if (!capture) {
+      transmit(mac, data, len);
+      return;
+    }
+    Node &node = nodes[currentNode];
+    const uint8_t slot =
+        static_cast<uint8_t>(node.capturedHead + node.capturedCount);
+    memcpy(node.captured[slot], mac, ESP_NOW_ETH_ALEN);
+    node.capturedCount++;
+    node.inDriver++;
+    stats.framesSent++;
+  }
+
+  // Puts one frame on the shared channel and schedules its deliveries and the
+  // sender's send callback
+  void transmit(const uint8_t *mac, const uint8_t *data, size_t len) {
+    const size_t sender = currentNode;
+    const uint64_t sentAt = nowUs;
+    const uint64_t airtime =
+        config.frameOverheadUs +
+        static_cast<uint64_t>(config.airtimeUsPerByte * len + 0.5f);
+    const uint64_t start = std::max(nowUs, channelFreeAt);
+    const uint64_t end = start + airtime;
+    channelFreeAt = end;
+    stats.framesSent++;
+    stats.busyUs += airtime;
+    nodes[sender].inDriver++;
+
+    std::vector<uint8_t> frame(data, data + len);
+    uint8_t senderMac[ESP_NOW_ETH_ALEN];
+    memcpy(senderMac, nodes[sender].mac, ESP_NOW_ETH_ALEN);
+    const bool broadcast = isBroadcast(mac);
+    const bool collided = collide(sender);
+    if (collided)
+      stats.framesCollided++;
+    bool acked = broadcast;
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      if (i == sender)
+        continue;
+      if (!broadcast && memcmp(nodes[i].mac, mac, ESP_NOW_ETH_ALEN) != 0)
+        continue;
+      if (!inRange(sender, i) || collided)
+        continue;
+      if (lose()) {
+        stats.framesLost++;
+        continue;
+      }
+      if (!broadcast)
+        acked = true;
+      const uint64_t deliverAt = end + config.latencyUs + jitter();
+      std::vector<uint8_t> copy(frame);
+      if (corrupt(copy))
+        stats.framesCorrupted++;
+      std::vector<uint8_t> senderAddr(senderMac, senderMac + ESP_NOW_ETH_ALEN);
+      schedule(deliverAt - nowUs, i, [this, i, copy, senderAddr, sentAt]() {
+        Node &receiver = nodes[i];
+        if (!receiver.initialized || receiver.recvCb == nullptr)
+          return;
+        stats.framesDelivered++;
+        stats.bytesDelivered += copy.size();
+        stats.latencyUs.add(static_cast<uint32_t>(nowUs - sentAt));
+        receiver.recvCb(senderAddr.data(), copy.data(),
+                        static_cast<int>(copy.size()));
+      });
+    }
+
+    std::vector<uint8_t> target(mac, mac + ESP_NOW_ETH_ALEN);
+    schedule(end - nowUs, sender, [this, sender, target, acked]() {
+      Node &node = nodes[sender];
+      if (node.inDriver > 0)
+        node.inDriver--;
+      if (node.sendCb != nullptr)
+        node.sendCb(target.data(),
+                    acked ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+    });
+  }
+
+  EspNowSimConfig config;
+  std::vector<Node> nodes;
+  EventQueue events;
+  EspNowSimStats stats;
+  std::mt19937 rng;
+  std::mt19937 idRng; // esp_random(), kept apart from the medium's draws
+  uint64_t nowUs = 0;
+  uint64_t statsSinceUs = 0;
+  uint64_t channelFreeAt = 0;
+  uint64_t eventSeq = 0;
+  size_t currentNode = 0;
+  bool capture = false;
+};
+
+// Driver entry points
+
+inline esp_err_t esp_now_init() { return EspNowSim::instance().init(); }
+inline esp_err_t esp_now_deinit() { return EspNowSim::instance().deinit(); }
+
+inline esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  return EspNowSim::instance().registerRecv(cb);
+}
+
+inline esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+  return EspNowSim::instance().registerSend(cb);
+}
+
+inline esp_err_t esp_now_unregister_recv_cb() {
+  return EspNowSim::instance().registerRecv(nullptr);
+}
+
+inline esp_err_t esp_now_unregister_send_cb() {
+  return EspNowSim::instance().registerSend(nullptr);
+}
+
+inline esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+  return EspNowSim::instance().addPeer(peer);
+}
+
+inline esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer) {
+  return EspNowSim::instance().modPeer(peer);
+}
+
+inline esp_err_t esp_now_del_peer(const uint8_t *peer_addr) {
+  return EspNowSim::instance().delPeer(peer_addr);
+}
+
+inline bool esp_now_is_peer_exist(const uint8_t *peer_addr) {
+  return EspNowSim::instance().isPeer(peer_addr);
+}
+
+inline esp_err_t esp_now_get_peer_num(esp_now_peer_num_t *num) {
+  return EspNowSim::instance().peerNum(num);
+}
+
+inline esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data,
+                              size_t len) {
+  return EspNowSim::instance().send(peer_addr, data, len);
+}
+
+// Arduino timing on the virtual clock. delay() lets the medium run, so
+// blocking code like pairDevice() sees responses arrive while it waits.
+
+inline unsigned long micros() {
+  return static_cast<unsigned long>(EspNowSim::instance().localNow());
+}
+
+inline unsigned long millis() {
+  return static_cast<unsigned long>(EspNowSim::instance().localNow() / 1000);
+}
+
+inline void delay(unsigned long ms) {
+  EspNowSim::instance().runFor(static_cast<uint64_t>(ms) * 1000);
+}
+
+inline void delayMicroseconds(unsigned int us) {
+  EspNowSim::instance().runFor(us);
+}
+
+inline void yield() {}
+
+inline uint32_t esp_random() { return EspNowSim::instance().random(); }
+
+#endif
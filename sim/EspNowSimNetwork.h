@@ -0,0 +1,152 @@
+#ifndef ESPNOWSIMNETWORK_H
+#define ESPNOWSIMNETWORK_H
+
+// Runs several EspNowHandler nodes on one EspNowSim medium. Each node is a
+// separate handler instance with its own MAC, peer list and registry; the
+// network switches the handler's static instance pointer whenever the
+// simulator executes on behalf of another node.
+
+#include "EspNowSim.h"
+#include <EspNowHandler.h>
+#include <memory>
+#include <vector>
+
+class EspNowSimAccess {
+public:
+  template <typename Handler> static void activate(Handler &handler) {
+    Handler::instance = &handler;
+  }
+
+  // Runs the handler's receive callback directly, bypassing the medium
+  template <typename Handler>
+  static void receive(Handler &handler, const uint8_t *mac,
+                      const uint8_t *data, int len) {
+    activate(handler);
+    Handler::onDataRecv(mac, data, len);
+  }
+
+  template <typename Handler>
+  static uint8_t checksum(const uint8_t *data, size_t len) {
+    return Handler::calcChecksum(data, len);
+  }
+
+  // Writes the frame a discovery packet from sender to target arrives as,
+  // a request when waiting is set and a response otherwise. Returns its
+  // length.
+  template <typename Handler, typename UniqueID>
+  static size_t discoveryFrame(UniqueID sender, UniqueID target, bool waiting,
+                               uint8_t *out) {
+    using State = typename Handler::PairingState;
+    const State state = waiting ? State::Waiting : State::Paired;
+    uint8_t fields[3] = {static_cast<uint8_t>(sender),
+                         static_cast<uint8_t>(target),
+                         static_cast<uint8_t>(state)};
+    const typename Handler::DiscoveryPacket packet = {
+        sender, target, state, Handler::calcChecksum(fields, sizeof(fields))};
+    typename Handler::PacketHeader header;
+    header.flags = 0;
+    header.type =
+        typename Handler::PacketType(Handler::InternalPacket::Discovery)
+            .encoded;
+    header.sender = sender;
+    header.len = sizeof(packet);
+    header.encode(out);
+    memcpy(out + Handler::PacketHeader::Size, &packet, sizeof(packet));
+    return Handler::PacketHeader::Size + sizeof(packet);
+  }
+};
+
+template <typename UniqueID, typename UserPacket> class EspNowSimNetwork {
+public:
+  using Handler = EspNowHandler<UniqueID, UserPacket>;
+
+  explicit EspNowSimNetwork(const EspNowSimConfig &config = EspNowSimConfig()) {
+    EspNowSim::instance().reset(config);
+  }
+
+  static void macFor(UniqueID id, uint8_t *mac) {
+    const uint8_t simMac[6] = {0x02, 0x51, 0x4D, 0x00, 0x00,
+                               static_cast<uint8_t>(id)};
+    memcpy(mac, simMac, 6);
+  }
+
+  // Creates a node for the given ID and brings up its radio
+  Handler &addNode(UniqueID id) {
+    uint8_t mac[6];
+    macFor(id, mac);
+    Handler *handler = new Handler(id, mac);
+    handlers.push_back(std::unique_ptr<Handler>(handler));
+    ids.push_back(id);
+    const size_t index = sim().addNode(mac, [handler]() {
+      EspNowSimAccess::activate(*handler);
+    });
+    sim().activate(index);
+    handler->begin();
+    return *handler;
+  }
+
+  // Switches execution to the node and returns its handler. Calls on the
+  // handler act on this node's radio until another node is selected.
+  Handler &node(size_t index) {
+    sim().activate(index);
+    return *handlers[index];
+  }
+
+  size_t size() const { return handlers.size(); }
+
+  // Makes a and b known to each other without running discovery
+  void link(size_t a, size_t b) {
+    uint8_t mac[6];
+    macFor(idOf(b), mac);
+    node(a).registry->addDevice(idOf(b), mac);
+    node(a).registerComms(idOf(b));
+    macFor(idOf(a), mac);
+    node(b).registry->addDevice(idOf(a), mac);
+    node(b).registerComms(idOf(a));
+  }
+
+  void linkAll() {
+    for (size_t a = 0; a < handlers.size(); ++a) {
+      for (size_t b = a + 1; b < handlers.size(); ++b)
+        link(a, b);
+    }
+  }
+
+  // Adds the broadcast peer so the node can answer discovery broadcasts
+  bool listenForPairing(size_t index) {
+    node(index);
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, BroadCastMac, 6);
+    return esp_now_add_peer(&peerInfo) == ESP_OK;
+  }
+
+  // Schedules fn on the node's context delayUs from now
+  void at(uint64_t delayUs, size_t index, std::function<void()> fn) {
+    sim().schedule(delayUs, index, fn);
+  }
+
+  // Calls poll() on every node each intervalUs, like an Arduino loop()
+  void pollEvery(uint64_t intervalUs) {
+    for (size_t i = 0; i < handlers.size(); ++i)
+      schedulePoll(i, intervalUs);
+  }
+
+  void runFor(uint64_t us) { sim().runFor(us); }
+
+  EspNowSim &sim() { return EspNowSim::instance(); }
+
+private:
+  UniqueID idOf(size_t index) const { return ids[index]; }
+
+  void schedulePoll(size_t index, uint64_t intervalUs) {
+    at(intervalUs, index, [this, index, intervalUs]() {
+      handlers[index]->poll();
+      schedulePoll(index, intervalUs);
+    });
+  }
+
+  std::vector<std::unique_ptr<Handler>> handlers;
+  std::vector<UniqueID> ids;
+};
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef ESP_NOW_SIM_SHIM_H
+#define ESP_NOW_SIM_SHIM_H
+
+// Native build replacement for the ESP-IDF esp_now.h, backed by EspNowSim
+#include "EspNowSim.h"
+
+#endif
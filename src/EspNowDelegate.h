@@ -0,0 +1,116 @@
+#ifndef ESPNOWDELEGATE_H
+#define ESPNOWDELEGATE_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#ifndef ESPNOW_DELEGATE_STORAGE
+#define ESPNOW_DELEGATE_STORAGE (6 * sizeof(void *))
+#endif
+// Bytes of inline storage per delegate, enough for a lambda capturing six
+// references or a std::function. Callables that don't fit are rejected at
+// compile time; capture a pointer to larger state instead.
+
+// Callable wrapper like std::function, but without heap allocation: the
+// callable is stored inline and invoked through one function pointer that
+// is resolved when the delegate is bound.
+template <typename Signature> class EspNowDelegate;
+
+template <typename R, typename... Args> class EspNowDelegate<R(Args...)> {
+public:
+  static constexpr size_t StorageSize = ESPNOW_DELEGATE_STORAGE;
+
+  EspNowDelegate() = default;
+
+  EspNowDelegate(std::nullptr_t) {}
+
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<F>::type, EspNowDelegate>::value>::type>
+  EspNowDelegate(F &&callable) {
+    bind(static_cast<F &&>(callable));
+  }
+
+  EspNowDelegate(const EspNowDelegate &other) { copyFrom(other); }
+
+  EspNowDelegate &operator=(const EspNowDelegate &other) {
+    if (this != &other) {
+      reset();
+      copyFrom(other);
+    }
+    return *this;
+  }
+
+  EspNowDelegate &operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+
+  ~EspNowDelegate() { reset(); }
+
+  R operator()(Args... args) const {
+    return invoker(&storage, static_cast<Args>(args)...);
+  }
+
+  explicit operator bool() const { return invoker != nullptr; }
+
+  friend bool operator==(const EspNowDelegate &delegate, std::nullptr_t) {
+    return !delegate;
+  }
+  friend bool operator!=(const EspNowDelegate &delegate, std::nullptr_t) {
+    return static_cast<bool>(delegate);
+  }
+
+private:
+  using Storage =
+      typename std::aligned_storage<StorageSize, alignof(void *)>::type;
+  using Invoker = R (*)(void *, Args...);
+  using Manager = void (*)(void *dst, const void *src);
+  // Copy-constructs src into dst, or destroys dst if src is null
+
+  template <typename F> void bind(F &&callable) {
+    using Callable = typename std::decay<F>::type;
+    static_assert(sizeof(Callable) <= StorageSize,
+                  "Callable too large for EspNowDelegate; capture less or "
+                  "raise ESPNOW_DELEGATE_STORAGE");
+    static_assert(alignof(Callable) <= alignof(Storage),
+                  "Callable alignment not supported by EspNowDelegate");
+    new (&storage) Callable(static_cast<F &&>(callable));
+    invoker = &invoke<Callable>;
+    manager = &manage<Callable>;
+  }
+
+  template <typename Callable>
+  static R invoke(void *storage, Args... args) {
+    return (*static_cast<Callable *>(storage))(static_cast<Args>(args)...);
+  }
+
+  template <typename Callable>
+  static void manage(void *dst, const void *src) {
+    if (src != nullptr)
+      new (dst) Callable(*static_cast<const Callable *>(src));
+    else
+      static_cast<Callable *>(dst)->~Callable();
+  }
+
+  void copyFrom(const EspNowDelegate &other) {
+    if (other.manager != nullptr)
+      other.manager(&storage, &other.storage);
+    invoker = other.invoker;
+    manager = other.manager;
+  }
+
+  void reset() {
+    if (manager != nullptr)
+      manager(&storage, nullptr);
+    invoker = nullptr;
+    manager = nullptr;
+  }
+
+  mutable Storage storage;
+  Invoker invoker = nullptr;
+  Manager manager = nullptr;
+};
+
+#endif
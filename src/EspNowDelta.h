@@ -0,0 +1,76 @@
+#ifndef ESPNOWDELTA_H
+#define ESPNOWDELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Delta encoding of a fixed-size struct against an earlier copy of it. A
+// delta is a sequence of runs [skip][count][count bytes]: keep skip bytes
+// of the baseline, then overwrite the next count bytes. A run costs two
+// bytes, so changes up to two unchanged bytes apart share one. Structs are
+// limited to 255 bytes.
+
+inline bool espNowDeltaEncode(const uint8_t *basePtr, const uint8_t *dataPtr,
+                              size_t size, uint8_t *out, size_t room,
+                              size_t &outLen) {
+  size_t len = 0;
+  size_t runEnd = 0; // End of the previous run
+  size_t pos = 0;
+  while (pos < size) {
+    if (dataPtr[pos] == basePtr[pos]) {
+      pos++;
+      continue;
+    }
+    const size_t start = pos;
+    size_t end = pos + 1;
+    while (end < size) {
+      if (dataPtr[end] != basePtr[end]) {
+        end++;
+        continue;
+      }
+      size_t same = 1;
+      while (same < 3 && end + same < size &&
+             dataPtr[end + same] == basePtr[end + same])
+        same++;
+      if (same == 3 || end + same == size)
+        break; // Cheaper to start a new run, or nothing left to change
+      end += same;
+    }
+    if (len + 2 + (end - start) > room)
+      return false;
+    out[len++] = static_cast<uint8_t>(start - runEnd);
+    out[len++] = static_cast<uint8_t>(end - start);
+    memcpy(out + len, dataPtr + start, end - start);
+    len += end - start;
+    runEnd = end;
+    pos = end;
+  }
+  outLen = len;
+  return true;
+}
+// Writes the runs turning basePtr into dataPtr to out. Returns false
+// if they need more than room bytes.
+
+inline bool espNowDeltaApply(uint8_t *dataPtr, size_t size,
+                             const uint8_t *deltaPtr, size_t len) {
+  size_t pos = 0;
+  size_t offset = 0;
+  while (offset < len) {
+    if (offset + 2 > len)
+      return false;
+    pos += deltaPtr[offset];
+    const size_t count = deltaPtr[offset + 1];
+    offset += 2;
+    if (pos + count > size || offset + count > len)
+      return false;
+    memcpy(dataPtr + pos, deltaPtr + offset, count);
+    pos += count;
+    offset += count;
+  }
+  return true;
+}
+// Applies a delta to dataPtr, which holds the baseline. Returns false
+// for truncated runs or runs past size.
+
+#endif
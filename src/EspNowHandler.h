@@ -1,75 +1,736 @@
 #ifndef ESPNOWHANDLER_H
 #define ESPNOWHANDLER_H
 
+#include <Arduino.h>
+#include "EspNowCrc.h"
+#include "EspNowDelegate.h"
+#include "EspNowDelta.h"
+#include "EspNowLog.h"
+#include "EspNowPayload.h"
+#include "EspNowRingBuffer.h"
+#include "EspNowStats.h"
 #include <DeviceRegistry.h>
+#include <array>
 #include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <esp_now.h>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <type_traits>
 
 #define HANDLER_TEMPLATE template <typename UniqueID, typename UserPacket>
 
 #define HANDLER_PARAMS EspNowHandler<UniqueID, UserPacket>
 
+// Transmit priority classes, highest first (see setPriority)
+enum class EspNowPriority : uint8_t {
+  Control, // Always sent first, may use the reserved transmit slots
+  High,
+  Normal, // Default for every packet type
+  Bulk,
+  Count
+};
+
+// Outcome of a call started with callRpc
+enum class EspNowRpcStatus : uint8_t {
+  Pending, // Waiting for the reply
+  Ok,      // Replied; the reply is available
+  Error,   // The peer has no handler for the type or it failed the request
+  Timeout, // No reply before the deadline
+  Invalid  // Never sent, cancelled or already collected
+};
+
 HANDLER_TEMPLATE
 class EspNowHandler {
 private:
-  using PacketCallback =
-      std::function<void(const uint8_t *dataPtr, size_t len, UniqueID sender)>;
+  using PacketCallback = EspNowDelegate<void(const uint8_t *dataPtr,
+                                              size_t len, UniqueID sender)>;
 
   template <typename DataStruct>
   using StructPacketCallback =
       std::function<void(const DataStruct &, UniqueID sender)>;
 
+  using SendCallback =
+      EspNowDelegate<void(UniqueID target, UserPacket type, bool delivered)>;
+
+  using PairingCallback = EspNowDelegate<void(UniqueID target, bool paired)>;
+
+  using RpcHandler =
+      EspNowDelegate<bool(const uint8_t *request, size_t len, UniqueID sender,
+                          uint8_t *reply, size_t &replyLen)>;
+
+  using RpcCallback = EspNowDelegate<void(
+      EspNowRpcStatus status, const uint8_t *reply, size_t len, UniqueID peer)>;
+
+  using StreamSource =
+      EspNowDelegate<bool(uint32_t offset, uint8_t *out, size_t len)>;
+
+  using StreamSink =
+      EspNowDelegate<void(UniqueID sender, uint8_t streamId, uint32_t offset,
+                          const uint8_t *dataPtr, size_t len, uint32_t total)>;
+
+  using StreamCallback = EspNowDelegate<void(UniqueID target, uint8_t streamId,
+                                             bool complete, uint32_t offset)>;
+
   static_assert(std::is_enum<UserPacket>::value,
                 "UserPacket must be an enum type");
   static_assert(std::is_same<typename std::underlying_type<UserPacket>::type,
                              uint8_t>::value,
                 "UserPacket underlying type must be uint8_t");
+  static_assert(static_cast<size_t>(UniqueID::Count) <= 256,
+                "UniqueID must fit in one byte on the wire");
 
   struct PacketType;
   struct PacketHeader;
+  struct FragmentHeader;
+  struct ReassemblySlot;
+  struct BatchBuffer;
+  struct ReliableSlot;
+  struct ReliablePeer;
+  struct AckPacket;
+  struct PairingSlot;
   struct DiscoveryPacket;
+  struct RxFrame;
+  struct TxFrame;
+  struct TxCompletion;
+  struct CachedPeer;
+  struct PriorityPolicy;
+  struct TokenBucket;
+  struct PeerRate;
+  struct DeltaPeer;
+  struct DeltaChannel;
+  struct TimeProbe;
+  struct TimePeer;
+  struct RouteEntry;
+  struct ClockSample;
+  struct RpcSlot;
+  struct StreamTx;
+  struct StreamRx;
+  struct StreamLoss;
+  template <UserPacket Type> struct TypedPayload;
+  enum class TxState : uint8_t;
   enum class PairingState : uint8_t;
   enum class InternalPacket : uint8_t;
-  std::atomic<PairingState> pairingState{PairingState::Waiting};
+  enum class RpcKind : uint8_t;
+  enum class StreamKind : uint8_t;
 
   static constexpr uint8_t maxRetries = 30;
+  static constexpr uint32_t PairingBackoffMs = 100; // Doubles per attempt
+  static constexpr uint32_t PairingMaxBackoffMs = 2000;
+  static constexpr size_t TxQueueDepth = 16;
+  static constexpr size_t TxReservedSlots = 2; // Kept free for Control
+  static constexpr size_t PriorityCount =
+      static_cast<size_t>(EspNowPriority::Count);
+  static constexpr uint32_t RateTokens = 1000; // Per frame: frames/s * ms
+  static constexpr uint32_t RateBurst = 4;     // Frames a bucket saves up
+  static constexpr uint16_t RateStep = 5;      // Frames/s per increase
+  static constexpr size_t HeaderSize = 4;
+  static constexpr size_t FragmentHeaderSize = 5;
+  static constexpr size_t MaxFragments = 255;
+  static constexpr size_t BatchRecordHeaderSize = 2; // Type, length
+  static constexpr size_t ReliableHeaderSize = 4; // Epoch, sequence, backlog
+  static constexpr size_t CrcSize = 2;
+  static constexpr size_t GroupSlots = 8;
+  static constexpr size_t RouteHeaderSize = 3; // Origin, target, relays|TTL
+  static constexpr size_t RouteEntrySize = 3;  // Destination, hops, next hop
+  static constexpr uint8_t MaxRouteHops = 8;
+  static constexpr size_t RpcHeaderSize = 2; // Kind, correlation ID
+  static constexpr size_t RpcSlots = 8;      // Calls pending at once
+  static constexpr size_t StreamHeaderSize = 6; // Kind, stream ID, offset
+  static constexpr size_t StreamOpenSize = 11;
+  static constexpr uint8_t StreamResume = 0x01;
+  static constexpr size_t StreamSlots = 2;      // Outgoing streams at once
+  static constexpr size_t StreamRxSlots = 2;    // Incoming streams tracked
+  static constexpr size_t StreamWindow = 8;     // Unacknowledged chunks
+  static constexpr uint8_t StreamAckEvery = 4;  // Chunks per cumulative ACK
+  static constexpr uint32_t StreamRtoMs = 50;
+  static constexpr uint8_t StreamMaxStalls = 20; // Timeouts without progress
+  static constexpr size_t DeltaTagSize = 1; // Keyframe bit, epoch
+  static constexpr uint8_t DeltaKeyframe = 0x80;
+  static constexpr uint8_t DeltaEpochMask = 0x7F;
+  static constexpr size_t ReliableSlots = 16;
+  static constexpr uint16_t ReliableWindow = 16; // Unacked frames per peer
+  static constexpr uint8_t ReliableMaxRetries = 8;
+  static constexpr uint32_t InitialRtoUs = 50000;
+  static constexpr uint32_t MinRtoUs = 5000;
+  static constexpr uint32_t MaxRtoUs = 1000000;
+  static constexpr size_t ClockFilterSize = 8;        // Offset samples kept
+  static constexpr uint32_t DriftIntervalUs = 8000000; // Drift baseline
   static constexpr size_t DeviceCount = static_cast<size_t>(UniqueID::Count);
   static constexpr size_t PacketCount = static_cast<size_t>(UserPacket::Count);
+  static constexpr size_t GroupMaskSize = (DeviceCount + 7) / 8; // Bit per ID
 
   static HANDLER_PARAMS *instance;
   // Static instance pointer for callbacks
 
   bool pairDevice(UniqueID targetUniqueID, bool encrypt);
-  // Pairs a specific device by sending
-  // broadcasts with the target device ID
-  // and the sender device ID
+  // Starts pairing a specific device by sending broadcasts
+  // with the target device ID and the sender device ID.
+  // Returns immediately; servicePairing() retries and completes.
+
+  bool authenticateSender(const uint8_t *macAddrPtr, UniqueID sender);
+  // True if the frame's MAC belongs to the ID it claims to be from
 
-  bool handleDiscoveryPacket(const uint8_t *macAddrPtr, const uint8_t *dataPtr);
+  void serviceRegistry();
+  // Saves the registry once it has been unchanged for
+  // registryFlushDelayMs
+  void saveRegistry();
 
-  void sendDiscoveryPacket(UniqueID targetID);
+  void servicePairing();
+  // Resends discovery to targets whose backoff expired, and
+  // finishes pairings that were answered or ran out of attempts
+
+  bool handleDiscoveryPacket(const uint8_t *macAddrPtr, const uint8_t *dataPtr,
+                             size_t len);
+
+  void sendDiscoveryPacket(UniqueID targetID, PairingState state);
 
   static void onDataSent(const uint8_t *macAddrPtr,
                          esp_now_send_status_t status);
   static void onDataRecv(const uint8_t *macAddrPtr, const uint8_t *dataPtr,
                          int data_len);
+  void processFrame(const uint8_t *macAddrPtr, const uint8_t *dataPtr,
+                    int data_len, uint32_t rxUs);
+  // Parses a received frame and dispatches it to its callback.
+  // rxUs is the local time onDataRecv saw it.
+  void deliver(uint8_t type, const uint8_t *dataPtr, size_t len,
+               UniqueID sender);
+  // Runs the type's callback and counts it, with its run time
+  void enqueueFrame(const uint8_t *macAddrPtr, const uint8_t *dataPtr,
+                    int data_len, uint32_t rxUs);
+  // Copies a received frame into the deferred dispatch queue
+  void handleSendStatus(const uint8_t *macAddrPtr,
+                        esp_now_send_status_t status);
+  // Completes the oldest in-flight frame to that MAC and
+  // refills the window
+
+  bool queueFrame(UniqueID targetID, const uint8_t *targetMac,
+                  const PacketHeader &header, const uint8_t *extPtr,
+                  size_t extLen, const uint8_t *payloadPtr);
+  // Builds a frame (header, extension fields, header.len payload
+  // bytes) in a transmit slot and sends it if the window allows
+  bool fillTxFrame(TxFrame &frame, UniqueID targetID, UniqueID hopID,
+                   const uint8_t *hopMac, const PacketHeader &header,
+                   const uint8_t *extPtr, size_t extLen,
+                   const uint8_t *payloadPtr);
+  // Builds the frame in a slot returned by freeTxFrame or
+  // acquireTxFrame and submits it. Must hold txLock since then.
+  bool queueEncoded(UniqueID targetID, const uint8_t *targetMac,
+                    const uint8_t *frameData, size_t frameLen);
+  // Queues a frame built by encodeFrame as is
+  size_t encodeFrame(uint8_t *out, PacketHeader header, const uint8_t *extPtr,
+                     size_t extLen, const uint8_t *payloadPtr) const;
+  // Writes the frame to out and returns its length. extPtr holds
+  // the extensions announced in header.flags; the CRC is inserted
+  // at its place among them if enabled and it fits.
+  uint8_t *beginFrame(uint8_t *out, PacketHeader &header,
+                      const uint8_t *extPtr, size_t extLen) const;
+  // encodeFrame up to the payload: adds the CRC flag to header if
+  // the CRC is enabled and returns where the payload goes
+  static size_t finishFrame(uint8_t *out, const PacketHeader &header);
+  // Fills in the CRC once the payload is written and returns the
+  // frame length
+  bool submitTxFrame(TxFrame &frame);
+  // Sends a freshly queued frame unless its peer's window is full
+  // or older frames to the peer are waiting. Must hold txLock.
+
+  bool routePacket(UniqueID targetID, PacketType packetType,
+                   const uint8_t *dataPtr, size_t len);
+  // sendPacket without the per type accounting: batches,
+  // fragments or sends the packet as a single frame
+
+  bool sendDelta(UniqueID targetID, uint8_t type, const uint8_t *dataPtr,
+                 size_t len);
+  // routePacket for delta types: sends a keyframe or the runs
+  // against the last keyframe the peer was sent
+  bool decodeDelta(UniqueID sender, uint8_t type, const uint8_t *dataPtr,
+                   size_t len, uint8_t *out);
+  // Rebuilds the full struct into out. Returns false without the
+  // keyframe the delta refers to.
+  bool enableDeltaChannel(PacketType packetType, size_t size,
+                          uint8_t keyframeInterval);
+
+  bool sendFragmented(UniqueID targetID, const uint8_t *targetMac,
+                      PacketType packetType, const uint8_t *dataPtr,
+                      size_t len);
+  // Splits a message into evenly sized fragments sharing one
+  // message ID; the receiver reassembles them by sender and ID.
+  // If a fragment can't be queued after others were, the message
+  // is reported failed at once and the rest is abandoned.
+  void abandonMessage(UniqueID targetID, uint8_t type, uint8_t messageId);
+  bool messagePending(uint8_t messageId) const;
+  // True while fragments of an own, unreliable message are queued
+  // or in flight. Must hold txLock.
+
+  void handleFragment(const PacketHeader &header, const uint8_t *extPtr,
+                      const uint8_t *payloadPtr);
+  ReassemblySlot *findReassemblySlot(UniqueID sender,
+                                     const FragmentHeader &fragment);
+  void expireReassembly();
+
+  bool appendToBatch(UniqueID targetID, const uint8_t *targetMac,
+                     PacketType packetType, const uint8_t *dataPtr,
+                     size_t len);
+  bool flushBatch(BatchBuffer &batch, std::unique_lock<std::mutex> &lock);
+  // Sends the batch as one frame. Queues it under batchLock, so
+  // batches to a target leave in order, but releases the lock
+  // while waiting for a transmit slot, so a full queue doesn't
+  // block other senders.
+  void flushExpiredBatches();
+  // Sends batches past their deadline; runs from poll() only
+  void handleBatch(UniqueID sender, const uint8_t *dataPtr, size_t len);
+  // Dispatches every record of a received batch frame
+
+  bool sendFrame(UniqueID targetID, const uint8_t *targetMac,
+                 const PacketHeader &header, const uint8_t *extPtr,
+                 size_t extLen, const uint8_t *payloadPtr);
+  // Sends reliably if the packet type is marked reliable,
+  // otherwise queues the frame as is
+
+  bool sendReliable(UniqueID targetID, PacketHeader header,
+                    const uint8_t *extPtr, size_t extLen,
+                    const uint8_t *payloadPtr);
+  // Appends the epoch, sequence number and backlog, keeps a copy of
+  // the frame until the peer acknowledges it and queues it
+  ReliableSlot *acquireReliableSlot(UniqueID targetID,
+                                    std::unique_lock<std::mutex> &lock);
+  bool queueStoredFrame(UniqueID targetID, const uint8_t *frameData,
+                        size_t frameLen);
+  void serviceReliable();
+  // Retransmits frames whose timeout expired and reports those
+  // out of retries as failed. A frame whose last copy still waits
+  // in the transmit queue is left alone.
+  void releaseReliableCopy(const TxFrame &frame, bool sent);
+  // Called as a queued copy of one of our reliable frames leaves the
+  // transmit queue; if it went to the driver, its timeout and RTT
+  // sample start now. Must hold txLock, takes reliableLock.
+  uint16_t oldestUnacked(UniqueID targetID) const;
+  // Sequence number of the oldest frame to the peer still waiting
+  // for its ACK, or the next one if none is; must hold reliableLock
+  bool acceptReliable(UniqueID sender, const uint8_t *reliablePtr,
+                      bool &duplicate);
+  // Records a received sequence number. Returns false if the frame
+  // is not to be delivered; duplicate then says it was delivered
+  // before and is to be acknowledged again.
+  void sendAck(UniqueID sender);
+  void handleAck(UniqueID sender, const uint8_t *dataPtr, size_t len);
+
+  void handleTimeProbe(UniqueID sender, const uint8_t *dataPtr, size_t len,
+                       uint32_t rxUs);
+  // Answers probe requests and turns responses into round trip
+  // and, from the time reference, clock offset samples
+  void stampTimeProbe(TxFrame &frame);
+  // Writes the send time into a probe frame as it is handed to the
+  // driver and refreshes its CRC. Must hold txLock.
+  void addClockSample(uint32_t localUs, int32_t offsetUs, uint32_t delayUs);
+  // Keeps the last ClockFilterSize samples and steers the clock to
+  // the one with the shortest round trip, the least skewed by
+  // queueing. Must hold timeLock.
+  uint32_t networkTimeAt(uint32_t localUs) const;
+  // Must hold timeLock
+  void serviceTimeSync();
+
+  bool nextHop(UniqueID targetID, UniqueID &hopID, const uint8_t *&hopMac);
+  // Looks up the neighbor that frames to a device without a
+  // registry entry go through. False without a live route.
+  bool acceptOrigin(UniqueID origin, UniqueID relay);
+  // True if a routed frame's origin may have reached us through
+  // relay: the route to it goes that way and it is not in range.
+  // The origin ID is not authenticated, the relay's MAC is.
+  void forwardFrame(const uint8_t *dataPtr, size_t len,
+                    const PacketHeader &header, const uint8_t *routePtr);
+  // Copies a frame for another device into a transmit slot once and
+  // rewrites its sender, TTL and CRC there for the next hop
+  void handleRouteBeacon(UniqueID sender, const uint8_t *dataPtr,
+                         size_t len);
+  void serviceRouting();
+  // Expires stale routes and broadcasts the table every
+  // routeBeaconMs
+
+  bool callbackAllowed(uint8_t type) const;
+  // False, with a warning, for types reserved by enableRpc
+  void handleRpc(uint8_t type, const uint8_t *dataPtr, size_t len,
+                 UniqueID sender);
+  // Runs the handler for requests and answers them; matches replies
+  // to their pending call by sender, type and correlation ID
+  bool startRpc(UniqueID targetID, PacketType packetType,
+                const uint8_t *request, size_t len, uint32_t timeoutMs,
+                const RpcCallback &callback, uint8_t &slotOut);
+  void serviceRpc();
+  // Times out calls past their deadline
+
+  void handleStream(UniqueID sender, const uint8_t *dataPtr, size_t len);
+  // Delivers in-order chunks to the sink and acknowledges them
+  // cumulatively; on the sending side, advances the window on ACKs
+  // and goes back to the first unacknowledged chunk on a gap. New
+  // chunks are only pulled from the source from poll().
+  void sendStreamAck(const StreamRx &stream, StreamKind kind);
+  bool fillStream(StreamTx &stream);
+  // Sends chunks while the window and the transmit queue have room.
+  // Returns false if the source failed. Must hold streamLock; runs
+  // from poll() only.
+  bool sendStreamOpen(StreamTx &stream);
+  void noteStreamLoss(const TxFrame &frame, const PacketHeader &header);
+  // Records a chunk the peer didn't acknowledge at the MAC level, so
+  // the stream goes back to it without waiting for the receiver.
+  // Called under txLock, so it only touches streamLosses.
+  void rewindStream(StreamTx &stream, uint32_t offset);
+  // Goes back to the first unacknowledged chunk and frees the
+  // stream's chunks still waiting in the transmit queue, which the
+  // receiver would drop as out of order
+  void serviceStreams();
+  // Resends unanswered opens, goes back on a timeout and fails
+  // streams without progress for StreamMaxStalls timeouts
+  size_t freeTxSlots() const;
+  // Must hold txLock
+
+  bool completeTxFrame(TxFrame &frame, bool delivered, TxCompletion &out);
+  // Frees a finished slot. Returns true if the result should be
+  // reported (not for fragments before a message's last one).
+
+  TxFrame *acquireTxFrame(std::unique_lock<std::mutex> &lock, uint8_t type);
+  // Returns a free transmit slot, waiting for one up to
+  // txTimeoutMs unless called from a radio callback. Only Control
+  // frames may take the last TxReservedSlots.
+  TxFrame *freeTxFrame(uint8_t type);
+  // A free slot a frame of type may take, without waiting. Must
+  // hold txLock.
+  uint8_t priorityOf(uint8_t type) const;
+  uint8_t batchPriority(const TxFrame &frame) const;
+  // Most urgent class among a batch frame's records, but never
+  // Control: batches share the queue with user traffic
+  TxFrame *nextTxFrame(TxCompletion *failed, size_t &failedCount);
+  // Picks the queued frame to send next: Control first, then the
+  // other classes by their remaining credit. Frames past their
+  // class deadline are freed and written to failed.
+  size_t inFlightTo(const uint8_t *macAddrPtr) const;
+  bool rateAllows(const TxFrame &frame, uint32_t nowMs);
+  // True if the frame's packet type and peer have a token left.
+  // Control frames and broadcasts of uncapped types always pass.
+  // Must hold txLock, like the other rate functions.
+  void takeRateTokens(const TxFrame &frame);
+  void adjustRate(const TxFrame &frame, bool delivered);
+  // AIMD on the MAC-level result of a frame to a paced peer
+  PeerRate *peerRateFor(const TxFrame &frame);
+  static void refillBucket(TokenBucket &bucket, uint32_t nowMs);
+  size_t pumpTxQueue(TxCompletion *failed);
+  // Sends queued frames while their peer's window has room.
+  // Must hold txLock. Frames the driver rejects are freed and
+  // written to failed; returns how many.
+  void serviceTxQueue();
+  void notifySent(const TxCompletion *completions, size_t count);
+  void reportSent(UniqueID target, uint8_t type, bool delivered);
+  static bool &inRadioCallback();
+
+  bool ensurePeer(UniqueID targetID, const uint8_t *targetMac);
+  // Adds the target to the driver's peer list if the peer cache
+  // manages it and it isn't there yet, evicting the least
+  // recently used peer when full. Must hold txLock.
+  bool evictPeer(bool encryptedOnly);
+  bool cachePeer(size_t id, const uint8_t *mac);
+  bool peerBusy(const uint8_t *macAddrPtr) const;
+  // True while frames to the MAC are queued or in flight
+
+  size_t payloadRoom(uint8_t flags) const;
+  // Payload bytes left in one frame carrying the extensions in
+  // flags, plus the CRC if enabled
+  static bool checkCrc(const uint8_t *dataPtr, size_t len, uint8_t flags);
+
   static constexpr size_t toIndex(PacketType packetType);
   static uint8_t calcChecksum(const uint8_t *dataPtr, size_t len);
 
   std::array<PacketCallback, PacketCount> packetCallbacks = {};
+  EspNowStats<PacketCount, DeviceCount> counters;
+  std::atomic<unsigned long> countersResetMs{0};
   UniqueID selfID;
   uint8_t selfMac[6] = {};
 
+  std::unique_ptr<EspNowRingBuffer<RxFrame>> rxQueue;
+  // Only allocated in deferred dispatch mode
+  std::atomic<size_t> rxHighWater{0};
+  uint32_t rxDispatched = 0;
+  bool dispatchTaskRunning = false;
+#ifdef ESP_PLATFORM
+  TaskHandle_t dispatchTask = nullptr;
+  size_t dispatchBatch = 0;
+  static void dispatchTaskLoop(void *arg);
+#endif
+
+  std::unique_ptr<TxFrame[]> txFrames;
+  std::mutex txLock;
+  uint32_t txTicket = 0;
+  uint8_t txWindow = 2;
+  uint32_t txTimeoutMs = 100;
+  uint32_t txDelivered = 0;
+  uint32_t txFailed = 0;
+  uint32_t txTimeouts = 0;
+  uint32_t txDriverFull = 0;
+  uint8_t txMessageId = 0;
+  uint8_t txFailedMessages[32] = {};    // Bit per message ID
+  uint8_t txAbandonedMessages[32] = {}; // Results no longer reported
+  uint32_t txExpired = 0;
+  std::array<uint8_t, PacketCount> packetPriority; // EspNowPriority
+  PriorityPolicy priorities[PriorityCount];        // Guarded by txLock
+  TokenBucket typeRates[PacketCount] = {};         // Rate 0: not capped
+  std::unique_ptr<PeerRate[]> peerRates; // Allocated by enableRateControl
+  uint16_t rateMin = 0;
+  uint16_t rateMax = 0;
+  uint32_t rateBackoffs = 0;
+  uint32_t rateIncreases = 0;
+  SendCallback sendCallback;
+
+  std::unique_ptr<ReassemblySlot[]> reassemblySlots;
+  std::unique_ptr<uint8_t[]> reassemblyMemory;
+  size_t reassemblySlotCount = 0;
+  size_t reassemblyMaxSize = 0;
+  uint32_t reassemblyTimeoutMs = 1000;
+  uint32_t reassemblyCompleted = 0;
+  uint32_t reassemblyTimeouts = 0;
+  uint32_t reassemblyDrops = 0;
+
+  std::array<std::unique_ptr<BatchBuffer>, DeviceCount> batches;
+  // Allocated per target the first time batching is enabled
+  std::mutex batchLock;
+
+  std::array<bool, PacketCount> reliableTypes = {};
+  std::unique_ptr<ReliableSlot[]> reliableSlots;
+  std::unique_ptr<ReliablePeer[]> reliablePeers;
+  // Both allocated by the first setReliable call
+  std::mutex reliableLock;
+  uint8_t reliableEpoch = 0; // Tells receivers this boot from earlier ones
+  uint32_t reliableRetransmits = 0;
+  uint32_t reliableDuplicates = 0;
+
+  std::atomic<bool> crcEnabled{false};
+
+  std::array<std::unique_ptr<DeltaChannel>, PacketCount> deltaChannels;
+  // Allocated per packet type by enableDelta
+  std::mutex deltaLock; // Sender state
+  uint32_t deltaKeyframes = 0;
+  uint32_t deltaPackets = 0;
+  uint32_t deltaResyncs = 0;
+
+  std::unique_ptr<TimePeer[]> timePeers; // Allocated by the first probe
+  mutable std::mutex timeLock;           // Probes and the clock estimate
+  uint8_t timeProbeSeq = 0;
+  bool timeSyncEnabled = false;
+  UniqueID timeReference;
+  uint32_t timeSyncIntervalMs = 1000;
+  uint32_t timeSyncLastMs = 0;
+  ClockSample clockSamples[ClockFilterSize];
+  size_t clockSampleCount = 0;
+  size_t clockSampleNext = 0;
+  uint32_t clockSamplesTotal = 0;
+  bool clockSynced = false;
+  int32_t clockOffsetUs = 0; // Reference minus local time at the anchor
+  uint32_t clockAnchorUs = 0;
+  float clockDriftPpm = 0;
+  bool clockDriftKnown = false;
+  uint32_t driftBaseUs = 0;
+  int32_t driftBaseOffsetUs = 0;
+
+  std::unique_ptr<RouteEntry[]> routes; // Allocated by enableRouting
+  std::mutex routeLock;
+  uint32_t routeBeaconMs = 1000;
+  uint32_t routeLastBeaconMs = 0;
+  uint8_t routeTtl = MaxRouteHops;
+  uint32_t routeOriginated = 0;
+  uint32_t routeForwarded = 0;
+  uint32_t routeDelivered = 0;
+  uint32_t routeDeliveredByHops[MaxRouteHops] = {};
+
+  std::array<RpcHandler, PacketCount> rpcHandlers = {};
+  std::array<bool, PacketCount> rpcTypes = {}; // Dispatched by handleRpc
+  std::unique_ptr<RpcSlot[]> rpcSlots;         // Allocated by the first call
+  std::mutex rpcLock;
+  uint8_t rpcNextId = 0;
+  uint32_t rpcCompleted = 0;
+  uint32_t rpcErrors = 0;
+  uint32_t rpcTimeouts = 0;
+  uint32_t rpcLate = 0;
+  uint32_t rpcServed = 0;
+
+  std::unique_ptr<StreamTx[]> streamsTx; // Allocated by the first stream
+  std::unique_ptr<StreamRx[]> streamsRx; // Allocated by registerStreamSink
+  std::mutex streamLock;
+  StreamLoss streamLosses[StreamSlots] = {}; // Per streamsTx slot; txLock
+  StreamSink streamSink;
+  StreamCallback streamCallback;
+  uint32_t streamChunksSent = 0;
+  uint32_t streamChunksResent = 0;
+  uint32_t streamTimeouts = 0;
+  uint32_t streamFastResends = 0;
+  uint32_t streamBytesReceived = 0;
+  uint32_t streamCompleted = 0;
+  uint32_t streamFailed = 0;
+
+  uint8_t groups[GroupSlots][GroupMaskSize] = {};
+  uint8_t encryptedPeers[GroupMaskSize] = {}; // Set by registerComms
+  std::mutex groupLock;
+  std::atomic<bool> broadcastPeerAdded{false};
+
+  std::unique_ptr<CachedPeer[]> peerCache; // Per device, guarded by txLock
+  size_t peerCacheCapacity = 0;
+  size_t peerCacheSize = 0;
+  uint32_t peerCacheClock = 0; // Ticks once per frame queued
+  uint32_t peerCacheHits = 0;
+  uint32_t peerCacheMisses = 0;
+  uint32_t peerCacheEvictions = 0;
+
+  std::atomic<bool> registryDirty{false};
+  std::atomic<unsigned long> registryChangedMs{0};
+  uint32_t registryFlushDelayMs = 1000;
+
+  std::unique_ptr<PairingSlot[]> pairingSlots;
+  // One per device ID, allocated by the first pairing
+  PairingCallback pairingCallback;
+
   friend class EspNowHandlerTest;
+  friend class EspNowSimAccess; // Host simulator switches instance per node
 
 public:
   DeviceRegistry<UniqueID> *registry;
 
+  static constexpr size_t MaxPayloadSize = ESP_NOW_MAX_DATA_LEN - HeaderSize;
+  // Largest payload that fits one frame behind the header. Reliable
+  // types and setCrc take a few bytes of it for their extensions.
+
+  static constexpr size_t MaxMessageSize =
+      MaxFragments * (MaxPayloadSize - FragmentHeaderSize -
+                      ReliableHeaderSize - CrcSize - RouteHeaderSize);
+  // Largest payload sendPacket can fragment, with every optional
+  // extension enabled
+
+  static constexpr size_t MaxGroups = GroupSlots;
+
+  static constexpr size_t MaxGroupPayloadSize =
+      MaxPayloadSize - GroupMaskSize - CrcSize;
+  // Largest payload sendToGroup sends as one shared frame
+
+  static constexpr size_t MaxTypedPayloadSize =
+      MaxPayloadSize - ReliableHeaderSize - CrcSize - RouteHeaderSize;
+  // Largest ESPNOW_PAYLOAD struct; fits one frame with any extension
+  // sendPacket adds
+
+  static constexpr size_t MaxRpcPayloadSize =
+      MaxTypedPayloadSize - RpcHeaderSize;
+  // Largest request or reply of a call
+
+  struct RxQueueStats {
+    size_t depth;
+    size_t capacity;
+    size_t highWater;
+    uint32_t overflowDrops;
+    uint32_t dispatched;
+  };
+
+  struct TxQueueStats {
+    size_t queued;
+    size_t inFlight;
+    uint32_t delivered;
+    uint32_t failed;
+    uint32_t timeouts;
+    uint32_t driverFull;
+    uint32_t expired; // Dropped at their priority class deadline
+  };
+
+  struct RateStats {
+    uint32_t backoffs;  // Peer rates halved after a failed send
+    uint32_t increases; // Peer rates raised by RateStep
+  };
+
+  struct ReliableStats {
+    size_t unacked;
+    uint32_t retransmits;
+    uint32_t duplicates;
+  };
+
+  struct DeltaStats {
+    uint32_t keyframes;
+    uint32_t deltas;
+    uint32_t resyncs; // Keyframes sent early after a failed send
+    uint32_t missed;  // Received deltas dropped for a missing keyframe
+  };
+
+  struct PeerLatency {
+    uint32_t srttUs; // Smoothed round trip, radio to radio
+    uint32_t rttVarUs;
+    uint32_t minRttUs;
+    uint32_t lastRttUs;
+    uint32_t samples;
+    uint32_t lost; // Probes never answered
+  };
+
+  struct TimeSyncStats {
+    bool synced;
+    int32_t offsetUs; // Reference clock minus the local clock, now
+    float driftPpm;   // Rate of the offset, once measured
+    uint32_t samples;
+  };
+
+  struct RouteStats {
+    size_t routes;        // Devices reachable through a neighbor
+    uint32_t originated;  // Frames this node sent over a route
+    uint32_t forwarded;   // Frames relayed for other devices
+    uint32_t delivered;   // Routed frames addressed to this node
+    uint32_t ttlExpired;  // Dropped after MaxRouteHops or the set TTL
+    uint32_t noRoute;     // Dropped without a route to the destination
+    uint32_t badOrigin;   // Dropped: origin not routed via the relay
+    uint32_t deliveredByHops[MaxRouteHops]; // [n]: took n + 1 hops
+  };
+
+  struct RpcCall {
+    uint8_t slot; // RpcSlots if the call wasn't sent
+    uint8_t id;
+  };
+
+  struct StreamStats {
+    size_t active;           // Outgoing streams in progress
+    uint32_t chunksSent;     // Including resends
+    uint32_t chunksResent;   // Sent again after a gap or timeout
+    uint32_t timeouts;       // Windows resent for lack of ACKs
+    uint32_t fastResends;    // Windows resent on a gap the receiver reported
+    uint32_t bytesReceived;  // Delivered to the sink, in order
+    uint32_t completed;      // Outgoing streams acknowledged in full
+    uint32_t failed;         // Outgoing streams given up, resumable
+  };
+
+  struct RpcStats {
+    size_t pending;     // Calls waiting for a reply or to be collected
+    uint32_t completed; // Calls answered with a reply
+    uint32_t errors;    // Calls the peer answered with an error
+    uint32_t timeouts;
+    uint32_t late;   // Replies that arrived after their call ended
+    uint32_t served; // Requests this node answered
+  };
+
+  struct PeerCacheStats {
+    size_t cached;
+    size_t capacity;
+    uint32_t hits;      // Frames whose peer was in the driver already
+    uint32_t misses;    // Frames that had to add their peer
+    uint32_t evictions; // Peers removed to make room
+  };
+
+  struct ReassemblyStats {
+    size_t active;
+    uint32_t completed;
+    uint32_t timeouts;
+    uint32_t dropped;
+  };
+
   EspNowHandler(UniqueID selfUniqueID, const uint8_t *selfMacPtr);
   // Initializes the class and registers
   // the given name as the own device name
   // (mainly used for pairing).
 
+  ~EspNowHandler();
+
   bool begin();
 
   bool registerComms(UniqueID targetID, bool pairingMode = false,
@@ -77,20 +738,62 @@ public:
   // Returns a 1-Byte integer ID for the target device to use as
   // the commID for sending packets and for identifying where
   // packets were sent from. If no device of the given name
-  // exists, and pairingMode is true, enters pairing mode to try
-  // and find the device
+  // exists, and pairingMode is true, starts pairing with it in
+  // the background and returns at once. Pairing continues from
+  // poll() and ends with a call to the pairing callback; any
+  // number of devices can pair at the same time.
+
+  void registerPairingCallback(PairingCallback callback);
+  // Called from poll() when a pairing started by registerComms
+  // succeeds (paired = true), runs out of attempts or the device
+  // answered but could not be added as an ESP-NOW peer
+
+  size_t pendingPairings() const;
+  // Number of pairings still in progress
+
+  uint32_t getAuthDrops() const;
+  // Frames dropped because their MAC didn't match the sender ID
+
+  void setRegistryFlushDelay(uint32_t delayMs);
+  // Devices learned through discovery are saved to flash from
+  // poll() once no further device was added for delayMs
+  // (default 1000), so a burst of discoveries costs one write
+
+  bool flush();
+  // Writes out everything held back now: pending batches and
+  // unsaved registry changes. Returns false if a batch couldn't
+  // be queued.
 
   bool registerCallback(PacketType packetTypeID, PacketCallback);
   // Registers a callback function for a specific packet
   // type. Multiple callbacks per type not possible.
   // PacketCallback must be format "void function(const
-  // uint8_t dataPtr, size_t len, uint8_t sender)"
+  // uint8_t dataPtr, size_t len, uint8_t sender)". Returns false
+  // for a type enabled for RPC; this applies to every overload.
 
   bool sendPacket(UniqueID targetID, PacketType packetType,
                   const uint8_t *dataPtr, size_t len);
   // Sends a packet of the type "packetType" to a
   // device with the corresponding commID (as
-  // returned when calling registerComms)
+  // returned when calling registerComms).
+  // Payloads that don't fit one frame (MaxPayloadSize, less the
+  // reliable and CRC extensions if enabled) are split into
+  // fragments that the receiver reassembles before calling its
+  // callback.
+  // The frame goes through the transmit queue: it is handed
+  // to the driver once fewer than txWindow frames to that peer
+  // are in flight. If the queue is full this waits for a slot
+  // (backpressure) for up to the transmit timeout. Returns
+  // false only if the frame could not be queued or the driver
+  // rejected it outright; the delivery result is reported
+  // through the send callback.
+
+  template <typename DataStruct, typename Callback>
+  bool registerCallback(PacketType type, Callback callback);
+  // Callback is any callable taking (const DataStruct &, UniqueID).
+  // It is stored inline in the dispatch table together with the
+  // size check, so dispatch costs one indirect call and no heap.
+  // Captures must fit ESPNOW_DELEGATE_STORAGE.
 
   template <typename DataStruct>
   bool registerCallback(PacketType type,
@@ -99,6 +802,360 @@ public:
   template <typename DataStruct>
   bool sendPacket(UniqueID targetID, PacketType packetType,
                   const DataStruct &payload);
+
+  template <UserPacket Type, typename Callback>
+  bool registerCallback(Callback callback);
+  // Typed callback for a packet type bound with ESPNOW_PAYLOAD,
+  // taking (const Payload &, UniqueID). The reference points into
+  // the receive buffer, without a copy, when the payload is aligned
+  // for the struct there (frames without extensions, in a buffer
+  // aligned to 4 like the deferred dispatch queue). Otherwise it
+  // refers to an aligned copy. Frames of another size are dropped.
+
+  template <UserPacket Type>
+  bool sendPacket(UniqueID targetID,
+                  const typename TypedPayload<Type>::type &payload);
+
+  template <UserPacket Type, typename Builder>
+  bool buildPacket(UniqueID targetID, Builder build);
+  // Calls build(Payload &) on a value-initialized payload placed
+  // directly in the outgoing frame, then queues the frame like
+  // sendPacket. Saves the staging copy for plain packets; reliable,
+  // delta and batched types are built on the stack and sent as
+  // usual. build runs while the transmit queue is locked, so it
+  // must not send or block.
+
+  bool defineGroup(uint8_t groupId, std::initializer_list<UniqueID> members);
+  // Sets the members of group groupId (below MaxGroups), replacing
+  // its previous members. Returns false, leaving the group as it
+  // was, for an invalid group ID or member, or this device.
+
+  bool addToGroup(uint8_t groupId, UniqueID member);
+  bool removeFromGroup(uint8_t groupId, UniqueID member);
+
+  bool sendToGroup(uint8_t groupId, PacketType packetType,
+                   const uint8_t *dataPtr, size_t len, bool unicast = false);
+  // Sends one packet to every member of the group. The frame is
+  // built once, carrying a bitmap of the members it addresses, and
+  // nodes outside the bitmap drop it. Members registered without
+  // encryption share a single broadcast frame; encrypted members,
+  // or all of them with unicast set, get a unicast copy each.
+  // A broadcast isn't acknowledged at the MAC level, so its
+  // members are reported delivered once it went out; unicast
+  // copies report the peer's acknowledgement. Either way the send
+  // callback runs once per member, also for members whose frame
+  // couldn't be queued. Reliable types and payloads above
+  // MaxGroupPayloadSize are sent to each member with sendPacket.
+  // Returns false if any member's frame couldn't be queued.
+  // A broadcast is sent in the clear, so don't mix encrypted and
+  // unencrypted members for confidential payloads.
+
+  template <typename DataStruct>
+  bool sendToGroup(uint8_t groupId, PacketType packetType,
+                   const DataStruct &payload, bool unicast = false);
+
+  bool enableDeferredDispatch(size_t queueDepth = 16);
+  // Opt-in: the ESP-NOW receive callback (Wi-Fi task) then only
+  // copies frames into a preallocated queue of queueDepth slots
+  // and returns. Callbacks run later from poll() or the dispatch
+  // task. Frames arriving while the queue is full are dropped
+  // and counted.
+
+  size_t poll(size_t maxFrames = SIZE_MAX);
+  // Dispatches up to maxFrames queued frames to their callbacks
+  // and returns how many were handled. Call from one task only,
+  // and not while the dispatch task is running.
+
+  RxQueueStats getRxQueueStats() const;
+
+  void registerSendCallback(SendCallback callback);
+  // Called once per user packet with the MAC-level delivery
+  // result reported by onDataSent
+
+  void setTxWindow(uint8_t framesPerPeer);
+  // Frames allowed in flight per peer before further frames
+  // wait in the transmit queue (default 2)
+
+  void setTxTimeout(uint32_t timeoutMs);
+  // How long sendPacket waits for a free transmit slot
+
+  TxQueueStats getTxQueueStats();
+
+  void setPriority(PacketType packetType, EspNowPriority priority);
+  // Puts a packet type in a transmit priority class (default
+  // Normal). Frames waiting in the transmit queue are sent by
+  // class: Control always first, and High, Normal and Bulk in
+  // proportion to their weights, highest first, so lower classes
+  // still make progress under load. Control frames overtake other
+  // frames to the same peer and can use TxReservedSlots that other
+  // classes leave free, so they wait at most for the frames
+  // already handed to the driver.
+
+  void setPriorityPolicy(EspNowPriority priority, uint8_t weight,
+                         uint32_t deadlineMs = 0);
+  // weight: frames sent per scheduling round while the class
+  // competes with others (defaults 8, 4 and 1; ignored for
+  // Control). deadlineMs: frames of the class still queued after
+  // this long are dropped and reported as failed instead of
+  // sent late; 0 for none. Reliable frames are retransmitted as
+  // usual.
+
+  bool enableRateControl(uint16_t maxFramesPerSecond = 1000,
+                         uint16_t minFramesPerSecond = 5);
+  // Opt-in: paces frames to each peer with a token bucket whose
+  // rate follows the MAC-level results from onDataSent. A failed
+  // send halves the peer's rate, once per loss episode (frames
+  // already in flight at the last back-off don't count), and every
+  // rate / RateStep delivered frames add RateStep frames per
+  // second, about one step per 200 ms on a busy link. Rates
+  // start at maxFramesPerSecond and stay within the bounds. Frames
+  // without a token wait in the transmit queue like frames beyond
+  // the window, so senders see backpressure instead of a channel
+  // full of collisions. Control frames aren't paced.
+
+  void setRateLimit(PacketType packetType, uint16_t framesPerSecond);
+  // Caps the frames per second of a packet type, to all peers
+  // together, on top of the peer rates; 0 removes the cap. Works
+  // without enableRateControl.
+
+  uint16_t getPeerRate(UniqueID peerID);
+  // The peer's current rate in frames per second, 0 while rate
+  // control is off
+
+  RateStats getRateStats();
+
+  bool enablePeerCache(size_t capacity = ESP_NOW_MAX_TOTAL_PEER_NUM - 1);
+  // Opt-in: the handler manages the driver's peer list, so more
+  // devices than ESP-NOW's peer limit can be reached. Peers are
+  // added when a frame to them is queued, and the least recently
+  // used one is removed once capacity peers are cached or the
+  // driver is full (unless frames to it are still pending).
+  // registerComms then only records the encryption setting. The
+  // default capacity leaves one slot for the broadcast peer used
+  // by pairing and groups. Peers already added are adopted.
+
+  bool pinPeer(UniqueID targetID, bool pinned = true);
+  // Adds the peer now and never evicts it while pinned. Pin
+  // encrypted peers that send to this node unprompted: the driver
+  // can only decrypt frames from peers in its list.
+
+  PeerCacheStats getPeerCacheStats();
+
+  static constexpr size_t MaxDeltaSize = MaxTypedPayloadSize - DeltaTagSize;
+  // Largest struct enableDelta takes
+
+  template <typename DataStruct>
+  bool enableDelta(PacketType packetType, uint8_t keyframeInterval = 20);
+  // Opt-in per packet type, on senders and receivers alike, before
+  // the type is sent: packets of the type must be DataStruct sized
+  // and are sent as the bytes that changed since the last keyframe
+  // sent to that peer. Every keyframeInterval-th packet, and the
+  // next one after a failed send, is a full keyframe. Receivers
+  // rebuild the struct before calling the callback and drop deltas
+  // whose keyframe they missed, until the next keyframe. Keeps a
+  // sent and a received copy of DataStruct per device.
+
+  DeltaStats getDeltaStats();
+
+  bool enableReassembly(size_t slots = 2, size_t maxMessageSize = 4096,
+                        uint32_t timeoutMs = 1000);
+  // Preallocates slots buffers of maxMessageSize bytes for
+  // incoming fragmented messages. A message must complete within
+  // timeoutMs of its last fragment. Fragments are dropped when
+  // reassembly isn't enabled or all slots are busy.
+
+  ReassemblyStats getReassemblyStats() const;
+
+  bool enableBatching(UniqueID targetID, uint32_t flushDeadlineUs = 2000);
+  // Opt-in per target: small user packets to targetID are packed
+  // into one frame, which is sent when the next packet doesn't
+  // fit or flushDeadlineUs after its first packet. The deadline
+  // is checked from poll(), so call it regularly. Packets in a
+  // batch aren't reported to the send callback individually.
+
+  void disableBatching(UniqueID targetID);
+  // Sends any pending batch and returns to one frame per packet
+
+  bool flushBatch(UniqueID targetID);
+  // Sends the pending batch for targetID now
+
+  void setReliable(PacketType packetType, bool reliable = true);
+  // Marks a packet type reliable, on senders and receivers alike.
+  // Reliable packets carry a per-peer sequence number; the
+  // receiver acknowledges them once its callback ran, drops
+  // duplicates and the sender retransmits until acknowledged,
+  // with a timeout adapted to the measured round trip. The send
+  // callback reports the acknowledgement (or failure after
+  // ReliableMaxRetries) instead of the MAC-level result.
+  // Retransmits run from poll(), so call it regularly. Other
+  // types stay unchanged.
+
+  ReliableStats getReliableStats();
+
+  bool probePeer(UniqueID targetID);
+  // Sends a timestamped probe the peer's handler answers on its
+  // own. The round trip is measured between the driver hand-off
+  // and onDataRecv on both ends, minus the time the peer held the
+  // probe, so dispatch delays and the transmit queue don't count.
+  // A probe still unanswered when the next one is sent is counted
+  // as lost. Returns false if the probe couldn't be queued.
+
+  bool getPeerLatency(UniqueID targetID, PeerLatency &out) const;
+  // Round trip statistics from probes to targetID (smoothed like
+  // the reliable timeout: 1/8 gain, 1/4 for the variance). False
+  // until the first answer.
+
+  void enableTimeSync(UniqueID reference, uint32_t intervalMs = 1000);
+  // Probes reference every intervalMs from poll() and runs an NTP
+  // style estimate of its clock: the offset from the sample with
+  // the shortest round trip among the last ClockFilterSize, and
+  // the drift between offsets measured DriftIntervalUs apart, so
+  // networkTime() stays on track between probes. The reference
+  // needs nothing enabled; if it syncs to another node itself,
+  // it answers with its own network time.
+
+  void disableTimeSync();
+  // Stops probing; networkTime() keeps the last estimate
+
+  uint32_t networkTime() const;
+  // Microseconds on the reference's clock, or the local micros()
+  // on the reference itself and before the first sample. Wraps
+  // like micros(); clocks must be within 35 minutes of each other.
+
+  TimeSyncStats getTimeSyncStats() const;
+
+  bool enableRouting(uint32_t beaconIntervalMs = 1000,
+                     uint8_t ttl = MaxRouteHops);
+  // Opt-in on every node of a mesh: devices without a registry
+  // entry (out of radio range) are reached through neighbors.
+  // Each node broadcasts its routes every beaconIntervalMs from
+  // poll(); nodes heard directly are one hop away, and routes
+  // keep the shortest path heard of for up to three intervals.
+  // Routed frames carry origin, destination and a TTL of ttl
+  // hops; nodes relay frames for
+  // other devices without calling callbacks, and the destination
+  // sees the origin as sender. The send callback reports the first
+  // hop's acknowledgement; reliable types are acknowledged end to
+  // end. Batching and groups stay single hop.
+
+  bool getRoute(UniqueID targetID, UniqueID &nextHop, uint8_t &hops);
+  // The neighbor frames to targetID go through and the hop count
+
+  RouteStats getRouteStats();
+
+  bool enableRpc(PacketType type);
+  // Reserves type for RPC frames: its packets go to the RPC
+  // dispatch instead of a packet callback. Needed before callRpc
+  // on the calling side; registerRpcHandler does it on the
+  // serving side. Fails if type already has a packet callback,
+  // and registerCallback fails for the type afterwards.
+
+  bool registerRpcHandler(PacketType requestType, RpcHandler handler);
+  // Serves calls of requestType: handler gets the request and
+  // writes up to MaxRpcPayloadSize reply bytes to reply, setting
+  // replyLen. Returning false answers with an error instead. It
+  // runs where packet callbacks run and the reply is sent as a
+  // packet of the same type, so setReliable and setPriority apply
+  // to both directions. Enables RPC for the type, so fails if it
+  // has a packet callback.
+
+  RpcCall callRpc(UniqueID targetID, PacketType requestType,
+                  const uint8_t *request, size_t len, uint32_t timeoutMs);
+  // Sends a request carrying a one byte correlation ID and returns
+  // at once with a handle to poll with rpcStatus and collect with
+  // takeRpcReply. requestType must be enabled with enableRpc. Up
+  // to RpcSlots calls, to any peers, can be pending at once; the
+  // table is allocated by the first call and a call allocates
+  // nothing. A call that couldn't be sent (type not enabled, no
+  // free slot, request above MaxRpcPayloadSize, queue full)
+  // returns a handle whose status is Invalid. Timeouts are checked
+  // from poll(), so call it regularly.
+
+  bool callRpc(UniqueID targetID, PacketType requestType,
+               const uint8_t *request, size_t len, uint32_t timeoutMs,
+               RpcCallback callback);
+  // Same, but callback gets the result once: with the reply when
+  // it arrives (where packet callbacks run), or Timeout from poll().
+  // The slot is freed before the callback runs. Returns false, and
+  // the callback isn't called, if the call couldn't be sent.
+
+  EspNowRpcStatus rpcStatus(RpcCall call);
+
+  EspNowRpcStatus takeRpcReply(RpcCall call, uint8_t *reply, size_t &len);
+  // Once a call is no longer Pending, copies the reply (if Ok) to
+  // reply, which must hold MaxRpcPayloadSize bytes, sets len, and
+  // frees the slot. Handles must be collected or cancelled, or
+  // their slot stays taken.
+
+  void cancelRpc(RpcCall call);
+  // Frees the call's slot; a reply arriving later counts as late
+
+  RpcStats getRpcStats();
+
+  bool openStream(UniqueID targetID, uint8_t streamId, uint32_t total,
+                  StreamSource source, uint32_t offset = 0);
+  // Sends total bytes to targetID as a stream, pulling each chunk
+  // from source(offset, out, len) as it is sent, so no buffer
+  // holds the whole transfer. Chunks fill one frame each and go
+  // out with up to StreamWindow unacknowledged, in the Bulk
+  // priority class; the receiver acknowledges them cumulatively
+  // and the sender goes back to the first missing chunk when the
+  // receiver reports a gap or no ACK comes for StreamRtoMs. source
+  // may be asked for a range again, runs from poll(), must not
+  // start or stop streams, and can fail the stream by returning
+  // false. Resume after a drop by opening the same streamId and
+  // total again with the offset the stream callback reported; the
+  // receiver answers with its own position if it still has the
+  // stream, and that one wins. An offset of 0 starts over, also on
+  // the receiver. Up to StreamSlots streams can be open at once.
+
+  void closeStream(UniqueID targetID, uint8_t streamId);
+  // Stops sending without calling the stream callback
+
+  void registerStreamCallback(StreamCallback callback);
+  // Called once per stream when the receiver acknowledged all of
+  // it (complete), or when it was given up after StreamMaxStalls
+  // timeouts without progress. offset is the position the receiver
+  // acknowledged, where a resumed stream continues.
+
+  bool registerStreamSink(StreamSink sink);
+  // Receives incoming streams: sink gets each chunk once, in
+  // order, straight from the received frame, together with the
+  // stream's total length. The last StreamRxSlots streams are
+  // tracked for resuming; an unknown stream evicts the oldest.
+
+  StreamStats getStreamStats();
+
+  void setCrc(bool enable = true);
+  // Adds a CRC-16/CCITT over header, extensions and payload to
+  // every frame sent from now on, costing two payload bytes per
+  // frame. Receivers verify the CRC whenever a frame carries one
+  // and drop the frame if it doesn't match; the short checksum of
+  // discovery packets stays as it is.
+
+  uint32_t getCrcDrops() const;
+  // Frames dropped because their CRC didn't match
+
+  using Stats = typename EspNowStats<PacketCount, DeviceCount>::Snapshot;
+
+  void getStats(Stats &out, bool reset = false);
+  // Copies the runtime counters: per packet type (packets and
+  // bytes sent and received, send failures, callback run time
+  // histogram), per peer (frames and bytes, MAC-level failures),
+  // drops by EspNowDrop reason and the longest receive callback.
+  // With reset, the counters restart from zero as they are read,
+  // so periodic calls give per-period values without losing
+  // updates in between. Stats is large with many devices, so keep
+  // it off small task stacks.
+
+  void resetStats();
+
+#ifdef ESP_PLATFORM
+  bool startDispatchTask(UBaseType_t priority = 1, uint32_t stackSize = 4096,
+                         size_t batchSize = 8);
+  // Starts a FreeRTOS task that drains the queue in batches of
+  // batchSize whenever frames arrive. Requires deferred dispatch.
+#endif
 };
 
 // Full definitions
@@ -121,233 +1178,4028 @@ struct HANDLER_PARAMS::DiscoveryPacket {
   uint8_t checksum;
 };
 
+// Waiting and Paired also go on the wire in discovery packets
 HANDLER_TEMPLATE
-enum class HANDLER_PARAMS::PairingState : uint8_t { Waiting, Paired, Timeout };
+enum class HANDLER_PARAMS::PairingState : uint8_t {
+  Waiting,
+  Paired,
+  Timeout,
+  Idle
+};
 
 HANDLER_TEMPLATE
-enum class HANDLER_PARAMS::InternalPacket : uint8_t { Discovery, Count };
+struct HANDLER_PARAMS::PairingSlot {
+  std::atomic<PairingState> state{PairingState::Idle};
+  bool reported = true; // Completion passed to the callback
+  bool encrypt = false;
+  uint8_t attempts = 0;
+  unsigned long nextAttemptMs = 0;
+};
 
 HANDLER_TEMPLATE
-struct HANDLER_PARAMS::PacketHeader {
-  uint8_t type;
-  UniqueID sender;
-  size_t len;
+enum class HANDLER_PARAMS::InternalPacket : uint8_t {
+  Discovery,
+  Batch,
+  Ack,
+  Time,
+  Route,
+  Stream,
+  Count
 };
 
-// Template implementation
+// Batch frame payload: records of [type][len][len bytes], back to back
 HANDLER_TEMPLATE
-HANDLER_PARAMS *HANDLER_PARAMS::instance = nullptr;
+struct HANDLER_PARAMS::BatchBuffer {
+  std::atomic<bool> enabled;
+  uint32_t deadlineUs;
+  uint32_t startedUs; // micros() when the first record was added
+  UniqueID target;
+  uint8_t mac[6];
+  uint8_t count;
+  uint8_t len;
+  uint8_t data[MaxPayloadSize];
+};
 
 HANDLER_TEMPLATE
-HANDLER_PARAMS::EspNowHandler(UniqueID selfUniqueID,
-                              const uint8_t *selfMacPtr) {
-  registry = new DeviceRegistry<UniqueID>(selfUniqueID, selfMacPtr);
-  selfID = selfUniqueID;
-  memcpy(selfMac, selfMacPtr, 6);
-  instance = this; // Set static instance pointer
-}
+struct HANDLER_PARAMS::RxFrame {
+  alignas(4) uint8_t data[ESP_NOW_MAX_DATA_LEN]; // Aligns plain payloads
+  uint32_t rxUs;
+  uint8_t mac[6];
+  uint8_t len;
+};
 
 HANDLER_TEMPLATE
-bool HANDLER_PARAMS::begin() {
-  if (esp_now_init() != ESP_OK) {
-    return false;
-  }
-  esp_err_t registerSentSuccess = esp_now_register_send_cb(onDataSent);
-  esp_err_t regiserRecvSuccess = esp_now_register_recv_cb(onDataRecv);
-  return (regiserRecvSuccess == ESP_OK) && (registerSentSuccess == ESP_OK);
-}
+enum class HANDLER_PARAMS::TxState : uint8_t { Free, Queued, InFlight };
 
 HANDLER_TEMPLATE
-constexpr size_t HANDLER_PARAMS::toIndex(PacketType packetType) {
-  return static_cast<size_t>(packetType.encoded);
-}
+struct HANDLER_PARAMS::TxFrame {
+  TxState state;
+  UniqueID target;
+  uint8_t type;
+  uint8_t len;
+  uint32_t ticket; // Queue order, also the send order per peer and class
+  uint32_t queuedMs;
+  uint8_t priority;
+  UniqueID hop; // The neighbor it goes to: target unless routed
+  uint8_t mac[6];
+  alignas(4) uint8_t data[ESP_NOW_MAX_DATA_LEN]; // For buildPacket
+};
 
 HANDLER_TEMPLATE
-uint8_t HANDLER_PARAMS::calcChecksum(const uint8_t *dataPtr, size_t len) {
-  uint8_t checksum = 0;
-  for (size_t i = 0; i < len; ++i) {
-    checksum ^= dataPtr[i];
-  }
-  return checksum;
-}
+struct HANDLER_PARAMS::PriorityPolicy {
+  uint8_t weight;
+  uint8_t credit; // Frames left in the current round
+  uint32_t deadlineMs;
+};
 
 HANDLER_TEMPLATE
-bool HANDLER_PARAMS::registerComms(UniqueID targetID, bool pairingMode,
-                                   bool encrypt) {
-  const uint8_t *macPtr = registry->getDeviceMac(targetID);
-  bool pair = false;
-  if (macPtr == nullptr) {
-    if (!pairingMode) {
-      return false;
-    }
-    macPtr = BroadCastMac; // use broadcast when pairing
-    pair = true;
-  }
-  esp_now_peer_info_t peerInfo = {};
-  memcpy(peerInfo.peer_addr, macPtr, 6);
-  peerInfo.channel = 0;
-  peerInfo.encrypt = (encrypt && !pairingMode);
-  esp_err_t addPeerReturn = esp_now_add_peer(&peerInfo);
-  if (addPeerReturn != ESP_OK) {
-    return false;
-  }
-  if (pair == true)
-    pairDevice(targetID, encrypt);
-  return true;
-}
+struct HANDLER_PARAMS::TokenBucket {
+  uint16_t rate;     // Frames per second
+  uint32_t tokens;   // RateTokens per frame, up to RateBurst frames
+  uint32_t refillMs; // When tokens were last added
+};
 
 HANDLER_TEMPLATE
-bool HANDLER_PARAMS::registerCallback(PacketType packetType,
-                                      PacketCallback callback) {
-  packetCallbacks[toIndex(packetType)] = callback;
-  return true;
-}
+struct HANDLER_PARAMS::PeerRate {
+  TokenBucket bucket;
+  uint16_t delivered; // Since the last increase
+  uint8_t sentBefore; // Frames in flight at the last back-off
+};
 
-// No idea how this part works, AI magic. To reevaluate later
 HANDLER_TEMPLATE
-template <typename DataStruct>
-bool HANDLER_PARAMS::registerCallback(
-    PacketType type, StructPacketCallback<DataStruct> callback) {
+struct HANDLER_PARAMS::TxCompletion {
+  UniqueID target;
+  uint8_t type;
+  bool delivered;
+  bool group;                     // Reported for members, not target
+  uint8_t members[GroupMaskSize]; // Bit per ID
+};
 
-  static_assert(std::is_trivially_copyable<DataStruct>::value,
-                "Struct must be trivially copyable");
+HANDLER_TEMPLATE
+template <UserPacket Type>
+struct HANDLER_PARAMS::TypedPayload {
+  static_assert(EspNowPayload<UserPacket, Type>::bound,
+                "Packet type has no ESPNOW_PAYLOAD binding");
+  using type = typename EspNowPayload<UserPacket, Type>::type;
+  static_assert(sizeof(type) <= MaxTypedPayloadSize,
+                "Payload struct doesn't fit one frame");
+  static_assert(static_cast<size_t>(Type) < PacketCount,
+                "Packet type out of range");
+};
 
-  packetCallbacks[toIndex(type)] = [callback](const uint8_t *dataPtr,
-                                              size_t len, UniqueID sender) {
-    if (len != sizeof(DataStruct)) {
-      printf("Invalid struct size for packet type\n");
-      return;
-    }
-    DataStruct obj;
-    memcpy(&obj, dataPtr, sizeof(DataStruct));
-    callback(obj, sender);
-  };
-  return true;
-}
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::DeltaPeer {
+  uint8_t sinceKeyframe; // Packets sent since the keyframe, 0 for none
+  uint8_t txEpoch;       // Of the keyframe sent last
+  uint8_t rxEpoch;       // Of the keyframe received last
+  bool rxValid;
+  std::atomic<bool> resync; // A send failed, the keyframe may be lost
+};
 
+// Delta payload, for types passed to enableDelta:
+//   [0] bit 7 keyframe, bits 0..6 keyframe epoch
+//   [1..] keyframe: the whole struct; delta: runs as in EspNowDelta.h
 HANDLER_TEMPLATE
-bool HANDLER_PARAMS::sendPacket(UniqueID targetID, PacketType packetType,
-                                const uint8_t *dataPtr, size_t len) {
-  if (targetID == selfID) {
-    printf("[ESPNowHandler] Cannot send packet to self\n");
-    return false; // Cannot send to self
-  }
-  const uint8_t *targetMac;
-  if (PacketType(packetType).encoded ==
-      PacketType(InternalPacket::Discovery).encoded) { // Send to broadcast
-    targetMac = BroadCastMac;
-  } else { // Normal send
-    targetMac = this->registry->getDeviceMac(targetID);
-  }
-  if (targetMac == nullptr) {
-    printf("[ESPNowHandler] Target MAC not found for device ID %u\n",
-           static_cast<uint8_t>(targetID));
-    return false;
+struct HANDLER_PARAMS::DeltaChannel {
+  size_t size;
+  uint8_t keyframeInterval;
+  std::unique_ptr<DeltaPeer[]> peers;
+  std::unique_ptr<uint8_t[]> baselines; // Sent, then received, per device
+
+  uint8_t *sent(size_t id) { return baselines.get() + id * size; }
+  uint8_t *received(size_t id) {
+    return baselines.get() + (DeviceCount + id) * size;
   }
+};
 
-  PacketHeader packetHeader = {packetType.encoded, selfID, len};
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::CachedPeer {
+  bool cached; // In the driver's peer list
+  bool pinned;
+  bool encrypt;
+  uint32_t lastUsed; // peerCacheClock when last sent to
+  uint8_t mac[6];    // As added, so a changed MAC still evicts
+};
 
-  size_t packetSize = sizeof(packetHeader) + len;
+// Fragment extension, present when FragmentFlag is set:
+//   [0] message ID  [1] fragment index  [2] fragment count
+//   [3..4] total message length, little endian
+// Every fragment but the last carries chunkSize() bytes.
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::FragmentHeader {
+  static constexpr size_t Size = FragmentHeaderSize;
 
-  uint8_t data[packetSize] = {};
+  uint8_t messageId;
+  uint8_t index;
+  uint8_t count;
+  uint16_t total;
 
-  memcpy(data, &packetHeader, sizeof(PacketHeader));
-  memcpy(data + sizeof(PacketHeader), dataPtr, len);
+  size_t chunkSize() const { return (total + count - 1) / count; }
 
-  esp_err_t sendSuccess = esp_now_send(targetMac, data, packetSize);
-  if (sendSuccess != ESP_OK) {
-    printf("[ESPNowHandler] Failed to send packet, esp_err_t: %d\n",
-           sendSuccess);
-    return false;
+  void encode(uint8_t *out) const {
+    out[0] = messageId;
+    out[1] = index;
+    out[2] = count;
+    out[3] = static_cast<uint8_t>(total & 0xFF);
+    out[4] = static_cast<uint8_t>(total >> 8);
   }
-  return true;
+
+  static FragmentHeader decode(const uint8_t *in) {
+    FragmentHeader fragment;
+    fragment.messageId = in[0];
+    fragment.index = in[1];
+    fragment.count = in[2];
+    fragment.total = static_cast<uint16_t>(in[3] | (in[4] << 8));
+    return fragment;
+  }
+};
+
+// A reliable frame kept for retransmission until acknowledged
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::ReliableSlot {
+  bool inUse;
+  bool report; // False for fragments before a message's last one
+  UniqueID target;
+  uint8_t type;
+  uint16_t seq;
+  uint8_t retries;
+  uint8_t len;
+  uint8_t reliableAt; // Offset of the reliable extension in data
+  bool queued;        // A copy waits in the transmit queue
+  uint32_t sentUs;    // When the last copy went to the driver
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::ReliablePeer {
+  // Sending side
+  uint16_t nextSeq;
+  uint32_t srttUs; // 0 until the first sample
+  uint32_t rttVarUs;
+  uint32_t rtoUs;
+  // Receiving side
+  bool rxKnown;
+  uint8_t rxEpoch;
+  uint16_t rxNextSeq; // Everything before this was delivered
+  uint32_t rxSeen;    // Bit i: rxNextSeq + i was delivered
+};
+
+// Acknowledges everything before nextSeq plus the sequence numbers
+// nextSeq + i whose bit i is set in selective
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::AckPacket {
+  uint8_t epoch;
+  uint8_t nextSeq[2];   // Little endian
+  uint8_t selective[4]; // Little endian
+};
+
+// NTP style probe: the requester sends originUs on its local clock, the
+// responder echoes it with its network time at reception and at sending.
+// The send times are written as the frame goes to the driver.
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::TimeProbe {
+  static constexpr size_t Size = 14;
+  static constexpr size_t OriginOffset = 2;
+  static constexpr size_t TransmitOffset = 10;
+  static constexpr uint8_t Request = 0;
+  static constexpr uint8_t Response = 1;
+
+  uint8_t kind;
+  uint8_t seq;
+  uint32_t originUs;
+  uint32_t receiveUs;
+  uint32_t transmitUs;
+
+  static void putUs(uint8_t *out, uint32_t value) { // Little endian
+    for (size_t i = 0; i < 4; ++i)
+      out[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  static uint32_t getUs(const uint8_t *in) {
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) |
+           (static_cast<uint32_t>(in[3]) << 24);
+  }
+
+  void encode(uint8_t *out) const {
+    out[0] = kind;
+    out[1] = seq;
+    putUs(out + OriginOffset, originUs);
+    putUs(out + 6, receiveUs);
+    putUs(out + TransmitOffset, transmitUs);
+  }
+
+  static TimeProbe decode(const uint8_t *in) {
+    TimeProbe probe;
+    probe.kind = in[0];
+    probe.seq = in[1];
+    probe.originUs = getUs(in + OriginOffset);
+    probe.receiveUs = getUs(in + 6);
+    probe.transmitUs = getUs(in + TransmitOffset);
+    return probe;
+  }
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::TimePeer {
+  bool pending; // Waiting for the answer to seq
+  uint8_t seq;
+  uint32_t srttUs; // 0 until the first sample
+  uint32_t rttVarUs;
+  uint32_t minRttUs;
+  uint32_t lastRttUs;
+  uint32_t samples;
+  uint32_t lost;
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::RouteEntry {
+  UniqueID nextHop;
+  uint8_t hops; // 0 for no route
+  uint32_t heardMs;
+};
+
+// RPC frames are packets of the call's type whose payload starts with
+//   [0] RpcKind  [1] correlation ID, chosen by the caller
+// followed by the request or reply.
+HANDLER_TEMPLATE
+enum class HANDLER_PARAMS::RpcKind : uint8_t { Request, Reply, Error };
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::RpcSlot {
+  bool inUse;
+  bool done; // Result waiting for takeRpcReply
+  EspNowRpcStatus status;
+  UniqueID target;
+  uint8_t type;
+  uint8_t id;
+  uint32_t startMs;
+  uint32_t timeoutMs;
+  RpcCallback callback; // Empty for calls collected through a handle
+  uint8_t len;
+  uint8_t reply[MaxRpcPayloadSize];
+};
+
+// Stream payloads, integers little endian:
+//   Open [0] kind [1] stream ID [2..5] total length [6..9] start offset
+//        [10] StreamResume if the receiver's position is to be kept
+//   Data [0] kind [1] stream ID [2..5] offset, then the chunk
+//   Ack  [0] kind [1] stream ID [2..5] next offset expected
+// A Gap is an Ack sent on a chunk past the next offset expected.
+HANDLER_TEMPLATE
+enum class HANDLER_PARAMS::StreamKind : uint8_t { Open, Data, Ack, Gap };
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::StreamTx {
+  bool inUse;
+  bool open; // The receiver answered the open
+  UniqueID target;
+  uint8_t id;
+  uint8_t stalls;
+  uint32_t total;
+  uint32_t base;      // Acknowledged by the receiver
+  uint32_t next;      // Next offset to send
+  uint32_t sent;      // Highest offset sent so far
+  uint32_t resentAt;  // Where the window last went back to
+  uint32_t progressMs; // Last time base moved, or the window went back
+  StreamSource source;
+};
+
+// Copy of a StreamTx slot's target and ID, made when it opens, so the
+// transmit path can match failed chunks under txLock alone
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::StreamLoss {
+  UniqueID target;
+  uint8_t id;
+  uint32_t lostAt; // Lowest chunk the driver failed to send
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::StreamRx {
+  bool inUse;
+  bool gapAcked; // Reported the current gap already
+  UniqueID sender;
+  uint8_t id;
+  uint8_t unacked; // Chunks delivered since the last ACK
+  uint32_t total;
+  uint32_t next;
+  uint32_t lastMs;
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::ClockSample {
+  uint32_t localUs; // When the response arrived
+  int32_t offsetUs;
+  uint32_t delayUs; // Round trip
+};
+
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::ReassemblySlot {
+  bool inUse;
+  UniqueID sender;
+  uint8_t type;
+  FragmentHeader fragment;
+  uint8_t received;
+  uint8_t seen[32]; // Bit per fragment index
+  unsigned long lastMs;
+  uint8_t *buffer;
+};
+
+// Wire header, serialized byte by byte so the format doesn't depend on
+// the platform's alignment or size_t width:
+//   [0] version (bits 7-6) | flags (bits 5-0)
+//   [1] packet type   [2] sender ID   [3] payload length
+// Flags announce optional extension fields between header and payload,
+// laid out in flag bit order. header.len counts the payload only.
+// The CRC extension covers the whole frame except its own two bytes.
+// The group extension is a bitmap of the IDs the frame addresses,
+// bit i of byte i / 8 for ID i.
+HANDLER_TEMPLATE
+struct HANDLER_PARAMS::PacketHeader {
+  static constexpr uint8_t Version = 1;
+  static constexpr size_t Size = HeaderSize;
+  static constexpr uint8_t FlagMask = 0x3F;
+  static constexpr uint8_t FragmentFlag = 0x01;
+  static constexpr uint8_t ReliableFlag = 0x02;
+  static constexpr uint8_t CrcFlag = 0x04;
+  static constexpr uint8_t GroupFlag = 0x08;
+  static constexpr uint8_t RouteFlag = 0x10;
+  static constexpr uint8_t KnownFlags =
+      FragmentFlag | ReliableFlag | CrcFlag | GroupFlag | RouteFlag;
+
+  uint8_t flags;
+  uint8_t type;
+  UniqueID sender;
+  uint8_t len;
+
+  void encode(uint8_t *out) const {
+    out[0] = static_cast<uint8_t>((Version << 6) | (flags & FlagMask));
+    out[1] = type;
+    out[2] = static_cast<uint8_t>(sender);
+    out[3] = len;
+  }
+
+  static bool decode(const uint8_t *in, size_t available,
+                     PacketHeader &header) {
+    if (available < Size || (in[0] >> 6) != Version)
+      return false;
+    header.flags = in[0] & FlagMask;
+    header.type = in[1];
+    header.sender = static_cast<UniqueID>(in[2]);
+    header.len = in[3];
+    return true;
+  }
+
+  static size_t extensionSize(uint8_t flags) {
+    return ((flags & FragmentFlag) ? FragmentHeader::Size : 0) +
+           ((flags & ReliableFlag) ? ReliableHeaderSize : 0) +
+           ((flags & CrcFlag) ? CrcSize : 0) +
+           ((flags & GroupFlag) ? GroupMaskSize : 0) +
+           ((flags & RouteFlag) ? RouteHeaderSize : 0);
+  }
+
+  static size_t extensionOffset(uint8_t flags, uint8_t flag) {
+    // Extensions of lower flag bits come first
+    return extensionSize(flags & (flag - 1));
+  }
+};
+
+// Template implementation
+HANDLER_TEMPLATE
+HANDLER_PARAMS *HANDLER_PARAMS::instance = nullptr;
+
+HANDLER_TEMPLATE
+HANDLER_PARAMS::EspNowHandler(UniqueID selfUniqueID,
+                              const uint8_t *selfMacPtr) {
+  registry = new DeviceRegistry<UniqueID>(selfUniqueID, selfMacPtr);
+  txFrames.reset(new TxFrame[TxQueueDepth]());
+  packetPriority.fill(static_cast<uint8_t>(EspNowPriority::Normal));
+  const uint8_t weights[PriorityCount] = {1, 8, 4, 1};
+  for (size_t i = 0; i < PriorityCount; ++i)
+    priorities[i] = {weights[i], weights[i], 0};
+  selfID = selfUniqueID;
+  memcpy(selfMac, selfMacPtr, 6);
+  countersResetMs = millis();
+  reliableEpoch = static_cast<uint8_t>(esp_random());
+  instance = this; // Set static instance pointer
+}
+
+HANDLER_TEMPLATE
+HANDLER_PARAMS::~EspNowHandler() {
+#ifdef ESP_PLATFORM
+  if (dispatchTask != nullptr)
+    vTaskDelete(dispatchTask);
+#endif
+  if (registryDirty)
+    saveRegistry(); // Don't lose devices learned since the last save
+  if (instance == this)
+    instance = nullptr;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::begin() {
+  if (esp_now_init() != ESP_OK) {
+    return false;
+  }
+  esp_err_t registerSentSuccess = esp_now_register_send_cb(onDataSent);
+  esp_err_t regiserRecvSuccess = esp_now_register_recv_cb(onDataRecv);
+  return (regiserRecvSuccess == ESP_OK) && (registerSentSuccess == ESP_OK);
+}
+
+HANDLER_TEMPLATE
+constexpr size_t HANDLER_PARAMS::toIndex(PacketType packetType) {
+  return static_cast<size_t>(packetType.encoded);
+}
+
+HANDLER_TEMPLATE
+uint8_t HANDLER_PARAMS::calcChecksum(const uint8_t *dataPtr, size_t len) {
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < len; ++i) {
+    checksum ^= dataPtr[i];
+  }
+  return checksum;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::registerComms(UniqueID targetID, bool pairingMode,
+                                   bool encrypt) {
+  const uint8_t *macPtr = registry->getDeviceMac(targetID);
+  bool pair = false;
+  if (macPtr == nullptr) {
+    if (!pairingMode) {
+      return false;
+    }
+    macPtr = BroadCastMac; // use broadcast when pairing
+    pair = true;
+  }
+  esp_now_peer_info_t peerInfo = {};
+  memcpy(peerInfo.peer_addr, macPtr, 6);
+  peerInfo.channel = 0;
+  peerInfo.encrypt = (encrypt && !pairingMode);
+  esp_err_t addPeerReturn;
+  if (!pair && peerCache) { // Added by the cache when first used
+    std::lock_guard<std::mutex> lock(txLock);
+    CachedPeer &peer = peerCache[static_cast<size_t>(targetID)];
+    peer.encrypt = peerInfo.encrypt;
+    addPeerReturn = ESP_OK;
+    if (peer.cached && memcmp(peer.mac, macPtr, 6) == 0)
+      addPeerReturn = esp_now_mod_peer(&peerInfo);
+  } else {
+    addPeerReturn = esp_now_add_peer(&peerInfo);
+  }
+  if (addPeerReturn == ESP_ERR_ESPNOW_EXIST && pair)
+    addPeerReturn = ESP_OK; // Broadcast peer shared by parallel pairings
+  if (addPeerReturn != ESP_OK) {
+    return false;
+  }
+  if (pair == true) {
+    pairDevice(targetID, encrypt);
+    return true;
+  }
+  const size_t id = static_cast<size_t>(targetID);
+  const uint8_t bit = static_cast<uint8_t>(1 << (id & 7));
+  std::lock_guard<std::mutex> lock(groupLock);
+  if (peerInfo.encrypt)
+    encryptedPeers[id >> 3] |= bit;
+  else
+    encryptedPeers[id >> 3] &= static_cast<uint8_t>(~bit);
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::authenticateSender(const uint8_t *macAddrPtr,
+                                        UniqueID sender) {
+  if (macAddrPtr == nullptr)
+    return false;
+  // The header names the sender, so one registry lookup by ID
+  // answers it; no reverse MAC lookup needed
+  const uint8_t *knownMac = registry->getDeviceMac(sender);
+  return knownMac != nullptr && memcmp(knownMac, macAddrPtr, 6) == 0;
+}
+
+HANDLER_TEMPLATE
+uint32_t HANDLER_PARAMS::getAuthDrops() const {
+  return counters.dropCount(EspNowDrop::AuthFailed);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::registerCallback(PacketType packetType,
+                                      PacketCallback callback) {
+  if (!callbackAllowed(packetType.encoded))
+    return false;
+  packetCallbacks[toIndex(packetType)] = callback;
+  return true;
+}
+
+HANDLER_TEMPLATE
+template <typename DataStruct>
+bool HANDLER_PARAMS::registerCallback(
+    PacketType type, StructPacketCallback<DataStruct> callback) {
+  return registerCallback<DataStruct, StructPacketCallback<DataStruct>>(
+      type, callback);
+}
+
+// Wraps the typed callback in a raw one that checks the size and
+// copies the payload into an aligned DataStruct
+HANDLER_TEMPLATE
+template <typename DataStruct, typename Callback>
+bool HANDLER_PARAMS::registerCallback(PacketType type, Callback callback) {
+
+  static_assert(std::is_trivially_copyable<DataStruct>::value,
+                "Struct must be trivially copyable");
+  if (!callbackAllowed(type.encoded))
+    return false;
+
+  packetCallbacks[toIndex(type)] = [callback](const uint8_t *dataPtr,
+                                              size_t len, UniqueID sender) {
+    if (len != sizeof(DataStruct)) {
+      ESPNOW_LOGW("Invalid struct size for packet type\n");
+      return;
+    }
+    DataStruct obj;
+    memcpy(&obj, dataPtr, sizeof(DataStruct));
+    callback(obj, sender);
+  };
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendPacket(UniqueID targetID, PacketType packetType,
+                                const uint8_t *dataPtr, size_t len) {
+  const bool user = packetType.encoded < PacketCount;
+  if (user)
+    counters.countTx(packetType.encoded, len);
+  const bool queued = (user && deltaChannels[packetType.encoded])
+                          ? sendDelta(targetID, packetType.encoded, dataPtr,
+                                      len)
+                          : routePacket(targetID, packetType, dataPtr, len);
+  if (!queued && user)
+    counters.countTxFailure(packetType.encoded);
+  return queued;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::routePacket(UniqueID targetID, PacketType packetType,
+                                 const uint8_t *dataPtr, size_t len) {
+  if (targetID == selfID) {
+    ESPNOW_LOGW("Cannot send packet to self\n");
+    return false; // Cannot send to self
+  }
+  const uint8_t *targetMac;
+  if (PacketType(packetType).encoded ==
+      PacketType(InternalPacket::Discovery).encoded) { // Send to broadcast
+    targetMac = BroadCastMac;
+  } else { // Normal send
+    targetMac = this->registry->getDeviceMac(targetID);
+  }
+  UniqueID hopID;
+  const uint8_t *hopMac;
+  if (targetMac == nullptr && !nextHop(targetID, hopID, hopMac)) {
+    ESPNOW_LOGW("Target MAC not found for device ID %u\n",
+                static_cast<uint8_t>(targetID));
+    return false;
+  }
+  // A null targetMac from here on means the frame is routed
+
+  const BatchBuffer *batch = batches[static_cast<size_t>(targetID)].get();
+  if (targetMac != nullptr && batch != nullptr &&
+      batch->enabled.load(std::memory_order_relaxed))
+    return appendToBatch(targetID, targetMac, packetType, dataPtr, len);
+
+  const bool reliable =
+      packetType.encoded < PacketCount && reliableTypes[packetType.encoded];
+  const uint8_t flags =
+      (reliable ? PacketHeader::ReliableFlag : 0) |
+      (targetMac == nullptr ? PacketHeader::RouteFlag : 0);
+  if (len > payloadRoom(flags))
+    return sendFragmented(targetID, targetMac, packetType, dataPtr, len);
+
+  PacketHeader packetHeader = {0, packetType.encoded, selfID,
+                               static_cast<uint8_t>(len)};
+  return sendFrame(targetID, targetMac, packetHeader, nullptr, 0, dataPtr);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::appendToBatch(UniqueID targetID, const uint8_t *targetMac,
+                                   PacketType packetType,
+                                   const uint8_t *dataPtr, size_t len) {
+  std::unique_lock<std::mutex> lock(batchLock);
+  BatchBuffer &batch = *batches[static_cast<size_t>(targetID)];
+  const size_t recordLen = BatchRecordHeaderSize + len;
+
+  const size_t room = payloadRoom(0);
+  if (packetType.encoded >= PacketCount || recordLen > room ||
+      reliableTypes[packetType.encoded]) {
+    // Internal, oversized and reliable packets bypass the batch
+    flushBatch(batch, lock);
+    lock.unlock();
+    const bool reliable =
+        packetType.encoded < PacketCount && reliableTypes[packetType.encoded];
+    if (len > payloadRoom(reliable ? PacketHeader::ReliableFlag : 0))
+      return sendFragmented(targetID, targetMac, packetType, dataPtr, len);
+    PacketHeader packetHeader = {0, packetType.encoded, selfID,
+                                 static_cast<uint8_t>(len)};
+    return sendFrame(targetID, targetMac, packetHeader, nullptr, 0, dataPtr);
+  }
+
+  while (batch.count > 0 && batch.len + recordLen > room)
+    flushBatch(batch, lock); // Make room, keeping packets in order
+
+  if (batch.count == 0) {
+    batch.startedUs = micros();
+    memcpy(batch.mac, targetMac, 6);
+  }
+  batch.data[batch.len] = packetType.encoded;
+  batch.data[batch.len + 1] = static_cast<uint8_t>(len);
+  memcpy(batch.data + batch.len + BatchRecordHeaderSize, dataPtr, len);
+  batch.len = static_cast<uint8_t>(batch.len + recordLen);
+  batch.count++;
+
+  if (room - batch.len <= BatchRecordHeaderSize)
+    return flushBatch(batch, lock); // No room for another record
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::flushBatch(BatchBuffer &batch,
+                                std::unique_lock<std::mutex> &lock) {
+  for (;;) {
+    if (batch.count == 0)
+      return true; // Flushed by another sender while we waited
+    const uint8_t type = batch.count == 1
+                             ? batch.data[0]
+                             : PacketType(InternalPacket::Batch).encoded;
+    std::unique_lock<std::mutex> txGuard(txLock);
+    TxFrame *frame = freeTxFrame(type);
+    if (frame != nullptr) { // Filled under the same txLock hold
+      const uint8_t count = batch.count;
+      const uint8_t len = batch.len;
+      batch.count = 0;
+      batch.len = 0;
+      if (count == 1) { // A lone record goes out as a plain packet
+        PacketHeader header = {0, batch.data[0], selfID, batch.data[1]};
+        return fillTxFrame(*frame, batch.target, batch.target, batch.mac,
+                           header, nullptr, 0,
+                           batch.data + BatchRecordHeaderSize);
+      }
+      PacketHeader header = {0, type, selfID, len};
+      return fillTxFrame(*frame, batch.target, batch.target, batch.mac,
+                         header, nullptr, 0, batch.data);
+    }
+    lock.unlock();
+    const bool ready = acquireTxFrame(txGuard, type) != nullptr;
+    txGuard.unlock(); // The slot stays free for whoever gets there first
+    lock.lock();
+    if (!ready) {
+      ESPNOW_LOGW("Transmit queue full, batch dropped\n");
+      counters.countDrop(EspNowDrop::TxQueueFull);
+      batch.count = 0;
+      batch.len = 0;
+      return false;
+    }
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::flushExpiredBatches() {
+  std::unique_lock<std::mutex> lock(batchLock);
+  for (size_t i = 0; i < DeviceCount; ++i) {
+    BatchBuffer *batch = batches[i].get();
+    if (batch != nullptr && batch->count > 0 &&
+        micros() - batch->startedUs >= batch->deadlineUs)
+      flushBatch(*batch, lock);
+  }
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableBatching(UniqueID targetID,
+                                    uint32_t flushDeadlineUs) {
+  if (static_cast<size_t>(targetID) >= DeviceCount || targetID == selfID)
+    return false;
+  std::lock_guard<std::mutex> lock(batchLock);
+  std::unique_ptr<BatchBuffer> &batch = batches[static_cast<size_t>(targetID)];
+  if (!batch) {
+    batch.reset(new BatchBuffer());
+    batch->target = targetID;
+  }
+  batch->deadlineUs = flushDeadlineUs;
+  batch->enabled = true;
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::disableBatching(UniqueID targetID) {
+  if (static_cast<size_t>(targetID) >= DeviceCount)
+    return;
+  std::unique_lock<std::mutex> lock(batchLock);
+  BatchBuffer *batch = batches[static_cast<size_t>(targetID)].get();
+  if (batch == nullptr)
+    return;
+  batch->enabled = false; // The buffer stays allocated for racing senders
+  while (batch->count > 0)
+    flushBatch(*batch, lock);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::flushBatch(UniqueID targetID) {
+  if (static_cast<size_t>(targetID) >= DeviceCount)
+    return false;
+  std::unique_lock<std::mutex> lock(batchLock);
+  BatchBuffer *batch = batches[static_cast<size_t>(targetID)].get();
+  return batch == nullptr || flushBatch(*batch, lock);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendFrame(UniqueID targetID, const uint8_t *targetMac,
+                               const PacketHeader &header,
+                               const uint8_t *extPtr, size_t extLen,
+                               const uint8_t *payloadPtr) {
+  if (header.type < PacketCount && reliableTypes[header.type])
+    return sendReliable(targetID, header, extPtr, extLen, payloadPtr);
+  return queueFrame(targetID, targetMac, header, extPtr, extLen, payloadPtr);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendReliable(UniqueID targetID, PacketHeader header,
+                                  const uint8_t *extPtr, size_t extLen,
+                                  const uint8_t *payloadPtr) {
+  uint8_t frameData[ESP_NOW_MAX_DATA_LEN];
+  size_t frameLen;
+  ReliableSlot *slot;
+  {
+    std::unique_lock<std::mutex> lock(reliableLock);
+    slot = acquireReliableSlot(targetID, lock);
+    if (slot == nullptr) {
+      ESPNOW_LOGW("Reliable window full, packet dropped\n");
+      counters.countDrop(EspNowDrop::ReliableWindow);
+      return false;
+    }
+    ReliablePeer &peer = reliablePeers[static_cast<size_t>(targetID)];
+    header.flags |= PacketHeader::ReliableFlag;
+    uint8_t *out = slot->data;
+    header.encode(out);
+    out += PacketHeader::Size;
+    if (extLen > 0)
+      memcpy(out, extPtr, extLen);
+    out += extLen;
+    slot->reliableAt = static_cast<uint8_t>(out - slot->data);
+    out[0] = reliableEpoch;
+    out[1] = static_cast<uint8_t>(peer.nextSeq & 0xFF);
+    out[2] = static_cast<uint8_t>(peer.nextSeq >> 8);
+    out[3] = static_cast<uint8_t>(peer.nextSeq - oldestUnacked(targetID));
+    out += ReliableHeaderSize;
+    memcpy(out, payloadPtr, header.len);
+
+    slot->inUse = true;
+    slot->report = true;
+    if (header.flags & PacketHeader::FragmentFlag) {
+      const FragmentHeader fragment = FragmentHeader::decode(extPtr);
+      slot->report = (fragment.index + 1 == fragment.count);
+    }
+    slot->target = targetID;
+    slot->type = header.type;
+    slot->seq = peer.nextSeq++;
+    slot->retries = 0;
+    slot->len = static_cast<uint8_t>(out + header.len - slot->data);
+    slot->queued = true;
+    slot->sentUs = micros();
+    frameLen = slot->len;
+    memcpy(frameData, slot->data, frameLen);
+  }
+  if (!queueStoredFrame(targetID, frameData, frameLen)) {
+    std::lock_guard<std::mutex> lock(reliableLock);
+    slot->inUse = false;
+    ReliablePeer &peer = reliablePeers[static_cast<size_t>(targetID)];
+    if (peer.nextSeq == static_cast<uint16_t>(slot->seq + 1))
+      peer.nextSeq = slot->seq; // Else the backlog lets the peer skip it
+    return false;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::ReliableSlot *
+HANDLER_PARAMS::acquireReliableSlot(UniqueID targetID,
+                                    std::unique_lock<std::mutex> &lock) {
+  const unsigned long start = millis();
+  for (;;) {
+    ReliableSlot *freeSlot = nullptr;
+    for (size_t i = 0; i < ReliableSlots && freeSlot == nullptr; ++i)
+      if (!reliableSlots[i].inUse)
+        freeSlot = &reliableSlots[i];
+    const uint16_t nextSeq =
+        reliablePeers[static_cast<size_t>(targetID)].nextSeq;
+    const uint16_t backlog =
+        static_cast<uint16_t>(nextSeq - oldestUnacked(targetID));
+    if (freeSlot != nullptr && backlog < ReliableWindow)
+      return freeSlot;
+    if (inRadioCallback() || millis() - start >= txTimeoutMs)
+      return nullptr;
+    lock.unlock();
+    delay(1);
+    serviceReliable();
+    lock.lock();
+  }
+}
+
+HANDLER_TEMPLATE
+uint16_t HANDLER_PARAMS::oldestUnacked(UniqueID targetID) const {
+  const uint16_t nextSeq =
+      reliablePeers[static_cast<size_t>(targetID)].nextSeq;
+  uint16_t oldest = nextSeq;
+  for (size_t i = 0; i < ReliableSlots; ++i) {
+    const ReliableSlot &slot = reliableSlots[i];
+    if (slot.inUse && slot.target == targetID &&
+        static_cast<uint16_t>(nextSeq - slot.seq) >
+            static_cast<uint16_t>(nextSeq - oldest))
+      oldest = slot.seq;
+  }
+  return oldest;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::queueStoredFrame(UniqueID targetID,
+                                      const uint8_t *frameData,
+                                      size_t frameLen) {
+  const uint8_t *targetMac = registry->getDeviceMac(targetID); // Or routed
+  PacketHeader header = {};
+  if (!PacketHeader::decode(frameData, frameLen, header))
+    return false;
+  const size_t extLen = PacketHeader::extensionSize(header.flags);
+  return queueFrame(targetID, targetMac, header,
+                    frameData + PacketHeader::Size, extLen,
+                    frameData + PacketHeader::Size + extLen);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceReliable() {
+  if (!reliableSlots)
+    return;
+  for (size_t i = 0; i < ReliableSlots; ++i) {
+    uint8_t frameData[ESP_NOW_MAX_DATA_LEN];
+    size_t frameLen = 0;
+    TxCompletion failed;
+    uint16_t seq;
+    bool report = false;
+    {
+      std::lock_guard<std::mutex> lock(reliableLock);
+      ReliableSlot &slot = reliableSlots[i];
+      if (!slot.inUse || slot.queued)
+        continue;
+      const ReliablePeer &peer =
+          reliablePeers[static_cast<size_t>(slot.target)];
+      uint32_t timeoutUs = peer.rtoUs << slot.retries; // Exponential backoff
+      if (timeoutUs > MaxRtoUs)
+        timeoutUs = MaxRtoUs;
+      if (micros() - slot.sentUs < timeoutUs)
+        continue;
+      if (slot.retries >= ReliableMaxRetries) {
+        slot.inUse = false;
+        report = true; // Even for a fragment: the message is lost
+      } else {
+        slot.retries++;
+        slot.queued = true;
+        slot.sentUs = micros();
+        slot.data[slot.reliableAt + 3] =
+            static_cast<uint8_t>(slot.seq - oldestUnacked(slot.target));
+        reliableRetransmits++;
+        frameLen = slot.len;
+        memcpy(frameData, slot.data, frameLen);
+      }
+      failed = {slot.target, slot.type, false, false, {}};
+      seq = slot.seq;
+    }
+    if (report) {
+      notifySent(&failed, 1);
+    } else if (!queueStoredFrame(failed.target, frameData, frameLen)) {
+      std::lock_guard<std::mutex> lock(reliableLock);
+      ReliableSlot &slot = reliableSlots[i];
+      if (slot.inUse && slot.target == failed.target && slot.seq == seq)
+        slot.queued = false; // Retried on the next timeout
+    }
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::releaseReliableCopy(const TxFrame &frame, bool sent) {
+  PacketHeader header;
+  if (!PacketHeader::decode(frame.data, frame.len, header) ||
+      !(header.flags & PacketHeader::ReliableFlag) || header.sender != selfID)
+    return; // Not reliable, or relayed for another node
+  const uint8_t *reliablePtr =
+      frame.data + PacketHeader::Size +
+      PacketHeader::extensionOffset(header.flags, PacketHeader::ReliableFlag);
+  const uint16_t seq =
+      static_cast<uint16_t>(reliablePtr[1] | (reliablePtr[2] << 8));
+  std::lock_guard<std::mutex> lock(reliableLock);
+  for (size_t i = 0; reliableSlots && i < ReliableSlots; ++i) {
+    ReliableSlot &slot = reliableSlots[i];
+    if (!slot.inUse || slot.target != frame.target || slot.seq != seq)
+      continue;
+    slot.queued = false;
+    if (sent)
+      slot.sentUs = micros();
+  }
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::acceptReliable(UniqueID sender,
+                                    const uint8_t *reliablePtr,
+                                    bool &duplicate) {
+  const uint8_t epoch = reliablePtr[0];
+  const uint16_t seq =
+      static_cast<uint16_t>(reliablePtr[1] | (reliablePtr[2] << 8));
+  // Everything before base was acknowledged or given up by the sender
+  const uint16_t base = static_cast<uint16_t>(seq - reliablePtr[3]);
+  duplicate = false;
+  if (reliablePtr[3] >= ReliableWindow)
+    return false;
+  std::lock_guard<std::mutex> lock(reliableLock);
+  ReliablePeer &peer = reliablePeers[static_cast<size_t>(sender)];
+  const uint16_t lead = static_cast<uint16_t>(peer.rxNextSeq - base);
+  if (!peer.rxKnown || peer.rxEpoch != epoch ||
+      (lead > ReliableWindow && lead < 0x8000)) {
+    // First contact or a reboot; also one that drew the same epoch,
+    // since the sender cannot be that far behind what it sent
+    peer.rxKnown = true;
+    peer.rxEpoch = epoch;
+    peer.rxNextSeq = base;
+    peer.rxSeen = 0;
+  } else if (lead >= 0x8000) { // Skip what the sender gave up on
+    const uint16_t skip = static_cast<uint16_t>(base - peer.rxNextSeq);
+    peer.rxSeen = (skip < 32) ? peer.rxSeen >> skip : 0;
+    peer.rxNextSeq = base;
+    while (peer.rxSeen & 1) {
+      peer.rxSeen >>= 1;
+      peer.rxNextSeq++;
+    }
+  }
+
+  const uint16_t ahead = static_cast<uint16_t>(seq - peer.rxNextSeq);
+  if (ahead >= 0x8000 || (peer.rxSeen & (1UL << ahead))) {
+    reliableDuplicates++;
+    duplicate = true;
+    return false;
+  }
+  peer.rxSeen |= 1UL << ahead; // Below ReliableWindow, like seq - base
+  while (peer.rxSeen & 1) {
+    peer.rxSeen >>= 1;
+    peer.rxNextSeq++;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::sendAck(UniqueID sender) {
+  AckPacket ack;
+  {
+    std::lock_guard<std::mutex> lock(reliableLock);
+    const ReliablePeer &peer = reliablePeers[static_cast<size_t>(sender)];
+    ack.epoch = peer.rxEpoch;
+    ack.nextSeq[0] = static_cast<uint8_t>(peer.rxNextSeq & 0xFF);
+    ack.nextSeq[1] = static_cast<uint8_t>(peer.rxNextSeq >> 8);
+    for (size_t i = 0; i < 4; ++i)
+      ack.selective[i] = static_cast<uint8_t>(peer.rxSeen >> (8 * i));
+  }
+  sendPacket(sender, InternalPacket::Ack,
+             reinterpret_cast<const uint8_t *>(&ack), sizeof(ack));
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleAck(UniqueID sender, const uint8_t *dataPtr,
+                               size_t len) {
+  if (len != sizeof(AckPacket) || !reliableSlots) {
+    ESPNOW_LOGW("Invalid ACK packet\n");
+    return;
+  }
+  AckPacket ack;
+  memcpy(&ack, dataPtr, sizeof(ack));
+  if (ack.epoch != reliableEpoch)
+    return; // Acknowledges a previous boot
+  const uint16_t nextSeq =
+      static_cast<uint16_t>(ack.nextSeq[0] | (ack.nextSeq[1] << 8));
+  uint32_t selective = 0;
+  for (size_t i = 0; i < 4; ++i)
+    selective |= static_cast<uint32_t>(ack.selective[i]) << (8 * i);
+
+  TxCompletion completions[ReliableSlots];
+  size_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(reliableLock);
+    ReliablePeer &peer = reliablePeers[static_cast<size_t>(sender)];
+    const uint32_t now = micros();
+    for (size_t i = 0; i < ReliableSlots; ++i) {
+      ReliableSlot &slot = reliableSlots[i];
+      if (!slot.inUse || slot.target != sender)
+        continue;
+      const uint16_t ahead = static_cast<uint16_t>(slot.seq - nextSeq);
+      const bool acked =
+          ahead >= 0x8000 || (ahead < 32 && (selective & (1UL << ahead)));
+      if (!acked)
+        continue;
+      if (slot.retries == 0) { // Karn: only unambiguous samples
+        const uint32_t sampleUs = now - slot.sentUs;
+        if (peer.srttUs == 0) {
+          peer.srttUs = sampleUs;
+          peer.rttVarUs = sampleUs / 2;
+        } else {
+          const uint32_t error = (sampleUs > peer.srttUs)
+                                     ? sampleUs - peer.srttUs
+                                     : peer.srttUs - sampleUs;
+          peer.rttVarUs = (3 * peer.rttVarUs + error) / 4;
+          peer.srttUs = (7 * peer.srttUs + sampleUs) / 8;
+        }
+        uint32_t rtoUs = peer.srttUs + 4 * peer.rttVarUs;
+        rtoUs = (rtoUs < MinRtoUs) ? MinRtoUs : rtoUs;
+        peer.rtoUs = (rtoUs > MaxRtoUs) ? MaxRtoUs : rtoUs;
+      }
+      slot.inUse = false;
+      if (slot.report)
+        completions[count++] = {slot.target, slot.type, true, false, {}};
+    }
+  }
+  notifySent(completions, count);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setReliable(PacketType packetType, bool reliable) {
+  if (packetType.encoded >= PacketCount)
+    return;
+  std::lock_guard<std::mutex> lock(reliableLock);
+  if (reliable && !reliableSlots) {
+    reliableSlots.reset(new ReliableSlot[ReliableSlots]());
+    reliablePeers.reset(new ReliablePeer[DeviceCount]());
+    for (size_t i = 0; i < DeviceCount; ++i)
+      reliablePeers[i].rtoUs = InitialRtoUs;
+  }
+  reliableTypes[packetType.encoded] = reliable;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setCrc(bool enable) {
+  crcEnabled = enable;
+}
+
+HANDLER_TEMPLATE
+uint32_t HANDLER_PARAMS::getCrcDrops() const {
+  return counters.dropCount(EspNowDrop::CrcMismatch);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::getStats(Stats &out, bool reset) {
+  counters.snapshot(out, reset);
+  const unsigned long now = millis();
+  out.periodMs = static_cast<uint32_t>(now - countersResetMs);
+  if (reset)
+    countersResetMs = now;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::resetStats() {
+  counters.reset();
+  countersResetMs = millis();
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::payloadRoom(uint8_t flags) const {
+  if (crcEnabled.load(std::memory_order_relaxed))
+    flags |= PacketHeader::CrcFlag;
+  return ESP_NOW_MAX_DATA_LEN - PacketHeader::Size -
+         PacketHeader::extensionSize(flags);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::checkCrc(const uint8_t *dataPtr, size_t len,
+                              uint8_t flags) {
+  const size_t offset =
+      PacketHeader::Size +
+      PacketHeader::extensionOffset(flags, PacketHeader::CrcFlag);
+  const uint8_t *crcPtr = dataPtr + offset;
+  uint16_t value = espNowCrc16(dataPtr, offset);
+  value = espNowCrc16(crcPtr + CrcSize, len - offset - CrcSize, value);
+  return crcPtr[0] == (value & 0xFF) && crcPtr[1] == (value >> 8);
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::ReliableStats HANDLER_PARAMS::getReliableStats() {
+  std::lock_guard<std::mutex> lock(reliableLock);
+  ReliableStats stats = {};
+  for (size_t i = 0; reliableSlots && i < ReliableSlots; ++i)
+    stats.unacked += reliableSlots[i].inUse ? 1 : 0;
+  stats.retransmits = reliableRetransmits;
+  stats.duplicates = reliableDuplicates;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::queueFrame(UniqueID targetID, const uint8_t *targetMac,
+                                const PacketHeader &header,
+                                const uint8_t *extPtr, size_t extLen,
+                                const uint8_t *payloadPtr) {
+  UniqueID hopID = targetID;
+  PacketHeader hopHeader = header;
+  uint8_t routedExt[FragmentHeaderSize + ReliableHeaderSize + RouteHeaderSize];
+  if (targetMac == nullptr) { // Out of range: append the route extension
+    if (!nextHop(targetID, hopID, targetMac) ||
+        extLen + RouteHeaderSize > sizeof(routedExt)) {
+      counters.countDrop(EspNowDrop::NoRoute);
+      return false;
+    }
+    if (extLen > 0)
+      memcpy(routedExt, extPtr, extLen);
+    routedExt[extLen] = static_cast<uint8_t>(selfID);
+    routedExt[extLen + 1] = static_cast<uint8_t>(targetID);
+    routedExt[extLen + 2] = routeTtl;
+    hopHeader.flags |= PacketHeader::RouteFlag;
+    extPtr = routedExt;
+    extLen += RouteHeaderSize;
+  }
+
+  std::unique_lock<std::mutex> lock(txLock);
+  TxFrame *frame = acquireTxFrame(lock, header.type);
+  if (frame == nullptr) {
+    ESPNOW_LOGW("Transmit queue full, packet dropped\n");
+    counters.countDrop(EspNowDrop::TxQueueFull);
+    return false;
+  }
+  return fillTxFrame(*frame, targetID, hopID, targetMac, hopHeader, extPtr,
+                     extLen, payloadPtr);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::fillTxFrame(TxFrame &frame, UniqueID targetID,
+                                 UniqueID hopID, const uint8_t *hopMac,
+                                 const PacketHeader &header,
+                                 const uint8_t *extPtr, size_t extLen,
+                                 const uint8_t *payloadPtr) {
+  if (!ensurePeer(hopID, hopMac))
+    return false;
+  if (header.flags & PacketHeader::RouteFlag)
+    routeOriginated++; // Under txLock, like routeForwarded
+  memcpy(frame.mac, hopMac, 6);
+  frame.target = targetID;
+  frame.hop = hopID;
+  frame.type = header.type;
+  frame.len = static_cast<uint8_t>(
+      encodeFrame(frame.data, header, extPtr, extLen, payloadPtr));
+  return submitTxFrame(frame);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::queueEncoded(UniqueID targetID, const uint8_t *targetMac,
+                                  const uint8_t *frameData, size_t frameLen) {
+  std::unique_lock<std::mutex> lock(txLock);
+  TxFrame *frame = acquireTxFrame(lock, frameData[1]);
+  if (frame == nullptr) {
+    ESPNOW_LOGW("Transmit queue full, packet dropped\n");
+    counters.countDrop(EspNowDrop::TxQueueFull);
+    return false;
+  }
+  if (!ensurePeer(targetID, targetMac))
+    return false;
+  memcpy(frame->mac, targetMac, 6);
+  frame->target = targetID;
+  frame->hop = targetID;
+  frame->type = frameData[1];
+  frame->len = static_cast<uint8_t>(frameLen);
+  memcpy(frame->data, frameData, frameLen);
+  return submitTxFrame(*frame);
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::encodeFrame(uint8_t *out, PacketHeader header,
+                                   const uint8_t *extPtr, size_t extLen,
+                                   const uint8_t *payloadPtr) const {
+  uint8_t *payloadOut = beginFrame(out, header, extPtr, extLen);
+  memcpy(payloadOut, payloadPtr, header.len);
+  return finishFrame(out, header);
+}
+
+HANDLER_TEMPLATE
+uint8_t *HANDLER_PARAMS::beginFrame(uint8_t *out, PacketHeader &header,
+                                    const uint8_t *extPtr,
+                                    size_t extLen) const {
+  const bool crc = crcEnabled.load(std::memory_order_relaxed) &&
+                   PacketHeader::Size + extLen + CrcSize + header.len <=
+                       ESP_NOW_MAX_DATA_LEN;
+  if (crc)
+    header.flags |= PacketHeader::CrcFlag;
+  const size_t crcLen = crc ? CrcSize : 0;
+  // Extensions of lower flag bits go in front of the CRC, the rest after
+  const size_t before =
+      crc ? PacketHeader::extensionOffset(header.flags, PacketHeader::CrcFlag)
+          : extLen;
+
+  header.encode(out);
+  uint8_t *crcPtr = out + PacketHeader::Size + before;
+  if (before > 0)
+    memcpy(out + PacketHeader::Size, extPtr, before);
+  if (extLen > before)
+    memcpy(crcPtr + crcLen, extPtr + before, extLen - before);
+  return crcPtr + crcLen + (extLen - before);
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::finishFrame(uint8_t *out, const PacketHeader &header) {
+  const size_t len = PacketHeader::Size +
+                     PacketHeader::extensionSize(header.flags) + header.len;
+  if (header.flags & PacketHeader::CrcFlag) {
+    const size_t offset =
+        PacketHeader::Size +
+        PacketHeader::extensionOffset(header.flags, PacketHeader::CrcFlag);
+    uint8_t *crcPtr = out + offset;
+    uint16_t value = espNowCrc16(out, offset);
+    value = espNowCrc16(crcPtr + CrcSize, len - offset - CrcSize, value);
+    crcPtr[0] = static_cast<uint8_t>(value & 0xFF);
+    crcPtr[1] = static_cast<uint8_t>(value >> 8);
+  }
+  return len;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::submitTxFrame(TxFrame &frame) {
+  frame.ticket = ++txTicket;
+  frame.state = TxState::Queued;
+  frame.queuedMs = static_cast<uint32_t>(millis());
+  frame.priority = (frame.type == PacketType(InternalPacket::Batch).encoded)
+                       ? batchPriority(frame)
+                       : priorityOf(frame.type);
+
+  if (inFlightTo(frame.mac) >= txWindow)
+    return true; // Sent by handleSendStatus once the window opens
+
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    const TxFrame &other = txFrames[i];
+    if (&other == &frame || other.state != TxState::Queued ||
+        memcmp(other.mac, frame.mac, 6) != 0)
+      continue;
+    if (other.priority < frame.priority ||
+        (other.priority == frame.priority && other.ticket < frame.ticket))
+      return true; // Higher classes and older frames to this peer go first
+  }
+  if (!rateAllows(frame, frame.queuedMs))
+    return true; // Sent from the queue once a token is left
+
+  stampTimeProbe(frame);
+  esp_err_t sendSuccess = esp_now_send(frame.mac, frame.data, frame.len);
+  if (sendSuccess == ESP_OK) {
+    frame.state = TxState::InFlight;
+    releaseReliableCopy(frame, true);
+    takeRateTokens(frame);
+    PriorityPolicy &policy = priorities[frame.priority];
+    if (policy.credit > 0)
+      policy.credit--;
+  } else if (sendSuccess == ESP_ERR_ESPNOW_NO_MEM) {
+    txDriverFull++; // Driver buffer full, stays queued
+  } else {
+    frame.state = TxState::Free;
+    releaseReliableCopy(frame, false);
+    txFailed++;
+    if (frame.target != selfID) // Group broadcasts have no single peer
+      counters.countPeerTx(static_cast<size_t>(frame.target), frame.len,
+                           false);
+    ESPNOW_LOGE("Failed to send packet, esp_err_t: %d\n", sendSuccess);
+    return false;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendFragmented(UniqueID targetID,
+                                    const uint8_t *targetMac,
+                                    PacketType packetType,
+                                    const uint8_t *dataPtr, size_t len) {
+  if (len > MaxMessageSize) {
+    ESPNOW_LOGW("Packet too large: %u bytes\n", static_cast<unsigned>(len));
+    return false;
+  }
+  uint8_t flags = PacketHeader::FragmentFlag;
+  if (packetType.encoded < PacketCount && reliableTypes[packetType.encoded])
+    flags |= PacketHeader::ReliableFlag;
+  if (targetMac == nullptr)
+    flags |= PacketHeader::RouteFlag;
+  const size_t maxChunk = payloadRoom(flags);
+  FragmentHeader fragment;
+  fragment.messageId = ++txMessageId;
+  fragment.count = static_cast<uint8_t>((len + maxChunk - 1) / maxChunk);
+  fragment.total = static_cast<uint16_t>(len);
+  const size_t chunk = fragment.chunkSize();
+
+  for (size_t i = 0; i < fragment.count; ++i) {
+    const size_t offset = i * chunk;
+    const size_t fragmentLen = (len - offset < chunk) ? len - offset : chunk;
+    fragment.index = static_cast<uint8_t>(i);
+    uint8_t ext[FragmentHeader::Size];
+    fragment.encode(ext);
+    PacketHeader header = {PacketHeader::FragmentFlag, packetType.encoded,
+                           selfID, static_cast<uint8_t>(fragmentLen)};
+    if (!sendFrame(targetID, targetMac, header, ext, sizeof(ext),
+                   dataPtr + offset)) {
+      if (i > 0)
+        abandonMessage(targetID, packetType.encoded, fragment.messageId);
+      return false; // The receiver drops the partial message on timeout
+    }
+  }
+  return true;
+}
+
+// The last fragment, which reports the message, will never be sent
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::abandonMessage(UniqueID targetID, uint8_t type,
+                                    uint8_t messageId) {
+  const uint8_t bit = static_cast<uint8_t>(1 << (messageId & 7));
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    txFailedMessages[messageId >> 3] &= static_cast<uint8_t>(~bit);
+    if (messagePending(messageId))
+      txAbandonedMessages[messageId >> 3] |= bit;
+  }
+  if (type < PacketCount)
+    reportSent(targetID, type, false);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::messagePending(uint8_t messageId) const {
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    const TxFrame &frame = txFrames[i];
+    PacketHeader header;
+    if (frame.state == TxState::Free ||
+        !PacketHeader::decode(frame.data, frame.len, header) ||
+        (header.flags & (PacketHeader::ReliableFlag |
+                         PacketHeader::FragmentFlag)) !=
+            PacketHeader::FragmentFlag)
+      continue; // Reliable fragments never touch the bits
+    if ((header.flags & PacketHeader::RouteFlag) &&
+        frame.data[PacketHeader::Size +
+                   PacketHeader::extensionOffset(
+                       header.flags, PacketHeader::RouteFlag)] !=
+            static_cast<uint8_t>(selfID))
+      continue; // Relayed for another device
+    if (FragmentHeader::decode(frame.data + PacketHeader::Size).messageId ==
+        messageId)
+      return true;
+  }
+  return false;
+}
+
+HANDLER_TEMPLATE
+template <typename DataStruct>
+bool HANDLER_PARAMS::sendPacket(UniqueID targetID, PacketType packetType,
+                                const DataStruct &payload) {
+  static_assert(std::is_trivially_copyable<DataStruct>::value,
+                "Struct must be trivially copyable");
+  return sendPacket(targetID, packetType,
+                    reinterpret_cast<const uint8_t *>(&payload),
+                    sizeof(DataStruct));
+}
+
+// Hands the callback a reference into the receive buffer when the
+// payload is aligned for the struct there, an aligned copy otherwise
+HANDLER_TEMPLATE
+template <UserPacket Type, typename Callback>
+bool HANDLER_PARAMS::registerCallback(Callback callback) {
+  using Payload = typename TypedPayload<Type>::type;
+  if (!callbackAllowed(static_cast<uint8_t>(toIndex(Type))))
+    return false;
+  packetCallbacks[toIndex(Type)] =
+      [callback](const uint8_t *dataPtr, size_t len, UniqueID sender) {
+        if (len != sizeof(Payload)) {
+          ESPNOW_LOGW("Invalid struct size for packet type\n");
+          return;
+        }
+        if (reinterpret_cast<uintptr_t>(dataPtr) % alignof(Payload) == 0) {
+          callback(*reinterpret_cast<const Payload *>(dataPtr), sender);
+          return;
+        }
+        Payload payload;
+        memcpy(&payload, dataPtr, sizeof(Payload));
+        callback(payload, sender);
+      };
+  return true;
+}
+
+HANDLER_TEMPLATE
+template <UserPacket Type>
+bool HANDLER_PARAMS::sendPacket(
+    UniqueID targetID, const typename TypedPayload<Type>::type &payload) {
+  return sendPacket(targetID, Type,
+                    reinterpret_cast<const uint8_t *>(&payload),
+                    sizeof(payload));
+}
+
+HANDLER_TEMPLATE
+template <UserPacket Type, typename Builder>
+bool HANDLER_PARAMS::buildPacket(UniqueID targetID, Builder build) {
+  using Payload = typename TypedPayload<Type>::type;
+  const uint8_t type = static_cast<uint8_t>(Type);
+  const uint8_t *targetMac = registry->getDeviceMac(targetID);
+  const BatchBuffer *batch =
+      (static_cast<size_t>(targetID) < DeviceCount)
+          ? batches[static_cast<size_t>(targetID)].get()
+          : nullptr;
+  if (targetID == selfID || targetMac == nullptr || reliableTypes[type] ||
+      deltaChannels[type] ||
+      (batch != nullptr && batch->enabled.load(std::memory_order_relaxed))) {
+    // Stored, encoded or batched on the way anyway; sendPacket also
+    // reports errors
+    Payload payload = Payload();
+    build(payload);
+    return sendPacket(targetID, Type,
+                      reinterpret_cast<const uint8_t *>(&payload),
+                      sizeof(Payload));
+  }
+
+  counters.countTx(type, sizeof(Payload));
+  std::unique_lock<std::mutex> lock(txLock);
+  TxFrame *frame = acquireTxFrame(lock, type);
+  if (frame == nullptr) {
+    ESPNOW_LOGW("Transmit queue full, packet dropped\n");
+    counters.countDrop(EspNowDrop::TxQueueFull);
+    counters.countTxFailure(type);
+    return false;
+  }
+  if (!ensurePeer(targetID, targetMac)) {
+    counters.countTxFailure(type);
+    return false;
+  }
+  memcpy(frame->mac, targetMac, 6);
+  frame->target = targetID;
+  frame->hop = targetID;
+  frame->type = type;
+  PacketHeader header = {0, type, selfID, sizeof(Payload)};
+  uint8_t *payloadPtr = beginFrame(frame->data, header, nullptr, 0);
+  if (reinterpret_cast<uintptr_t>(payloadPtr) % alignof(Payload) == 0) {
+    build(*new (payloadPtr) Payload());
+  } else { // Behind the CRC: build aside
+    Payload payload = Payload();
+    build(payload);
+    memcpy(payloadPtr, &payload, sizeof(Payload));
+  }
+  frame->len = static_cast<uint8_t>(finishFrame(frame->data, header));
+  const bool queued = submitTxFrame(*frame);
+  if (!queued)
+    counters.countTxFailure(type);
+  return queued;
+}
+
+HANDLER_TEMPLATE
+template <typename DataStruct>
+bool HANDLER_PARAMS::enableDelta(PacketType packetType,
+                                 uint8_t keyframeInterval) {
+  static_assert(std::is_trivially_copyable<DataStruct>::value,
+                "Struct must be trivially copyable");
+  static_assert(sizeof(DataStruct) <= MaxDeltaSize,
+                "Struct too large for delta encoding");
+  return enableDeltaChannel(packetType, sizeof(DataStruct), keyframeInterval);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableDeltaChannel(PacketType packetType, size_t size,
+                                        uint8_t keyframeInterval) {
+  if (packetType.encoded >= PacketCount || keyframeInterval == 0 ||
+      deltaChannels[packetType.encoded])
+    return false;
+  std::unique_ptr<DeltaChannel> channel(new DeltaChannel());
+  channel->size = size;
+  channel->keyframeInterval = keyframeInterval;
+  channel->peers.reset(new DeltaPeer[DeviceCount]());
+  channel->baselines.reset(new uint8_t[2 * DeviceCount * size]());
+  deltaChannels[packetType.encoded] = std::move(channel);
+  return true;
+}
+
+// Deltas always refer to the last keyframe, never to the previous
+// packet, so a lost delta costs nothing and a lost keyframe at most
+// keyframeInterval packets
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendDelta(UniqueID targetID, uint8_t type,
+                               const uint8_t *dataPtr, size_t len) {
+  DeltaChannel &channel = *deltaChannels[type];
+  const size_t id = static_cast<size_t>(targetID);
+  if (len != channel.size || id >= DeviceCount) {
+    ESPNOW_LOGW("Delta packet type %u takes %u byte packets\n", type,
+                static_cast<unsigned>(channel.size));
+    return false;
+  }
+  DeltaPeer &peer = channel.peers[id];
+  uint8_t *base = channel.sent(id);
+  uint8_t payload[DeltaTagSize + MaxDeltaSize];
+
+  std::lock_guard<std::mutex> lock(deltaLock);
+  const bool resync = peer.resync.exchange(false);
+  size_t payloadLen = 0;
+  const bool keyframe =
+      resync || peer.sinceKeyframe == 0 ||
+      peer.sinceKeyframe >= channel.keyframeInterval ||
+      !espNowDeltaEncode(base, dataPtr, len, payload + DeltaTagSize, len - 1,
+                         payloadLen); // Too many changes to save anything
+  const uint8_t epoch =
+      keyframe ? static_cast<uint8_t>((peer.txEpoch + 1) & DeltaEpochMask)
+               : peer.txEpoch;
+  payload[0] = static_cast<uint8_t>(epoch | (keyframe ? DeltaKeyframe : 0));
+  if (keyframe) {
+    memcpy(payload + DeltaTagSize, dataPtr, len);
+    payloadLen = len;
+  }
+  if (!routePacket(targetID, static_cast<UserPacket>(type), payload,
+                   DeltaTagSize + payloadLen)) {
+    if (resync)
+      peer.resync = true;
+    return false;
+  }
+  if (keyframe) {
+    memcpy(base, dataPtr, len);
+    peer.txEpoch = epoch;
+    peer.sinceKeyframe = 0;
+    deltaKeyframes++;
+    deltaResyncs += resync ? 1 : 0;
+  } else {
+    deltaPackets++;
+  }
+  peer.sinceKeyframe++;
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::decodeDelta(UniqueID sender, uint8_t type,
+                                 const uint8_t *dataPtr, size_t len,
+                                 uint8_t *out) {
+  DeltaChannel &channel = *deltaChannels[type];
+  DeltaPeer &peer = channel.peers[static_cast<size_t>(sender)];
+  uint8_t *base = channel.received(static_cast<size_t>(sender));
+  if (len < DeltaTagSize)
+    return false;
+  const uint8_t epoch = dataPtr[0] & DeltaEpochMask;
+  if (dataPtr[0] & DeltaKeyframe) {
+    if (len != DeltaTagSize + channel.size)
+      return false;
+    memcpy(base, dataPtr + DeltaTagSize, channel.size);
+    memcpy(out, base, channel.size);
+    peer.rxEpoch = epoch;
+    peer.rxValid = true;
+    return true;
+  }
+  if (!peer.rxValid || peer.rxEpoch != epoch) {
+    ESPNOW_LOGD("Delta from %u without its keyframe\n",
+                static_cast<uint8_t>(sender));
+    return false;
+  }
+  memcpy(out, base, channel.size);
+  return espNowDeltaApply(out, channel.size, dataPtr + DeltaTagSize,
+                          len - DeltaTagSize);
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::DeltaStats HANDLER_PARAMS::getDeltaStats() {
+  std::lock_guard<std::mutex> lock(deltaLock);
+  DeltaStats stats = {};
+  stats.keyframes = deltaKeyframes;
+  stats.deltas = deltaPackets;
+  stats.resyncs = deltaResyncs;
+  stats.missed = counters.dropCount(EspNowDrop::BadDelta);
+  return stats;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::defineGroup(uint8_t groupId,
+                                 std::initializer_list<UniqueID> members) {
+  if (groupId >= MaxGroups)
+    return false;
+  uint8_t mask[GroupMaskSize] = {};
+  for (UniqueID member : members) {
+    const size_t id = static_cast<size_t>(member);
+    if (id >= DeviceCount || member == selfID)
+      return false;
+    mask[id >> 3] |= static_cast<uint8_t>(1 << (id & 7));
+  }
+  std::lock_guard<std::mutex> lock(groupLock);
+  memcpy(groups[groupId], mask, GroupMaskSize);
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::addToGroup(uint8_t groupId, UniqueID member) {
+  const size_t id = static_cast<size_t>(member);
+  if (groupId >= MaxGroups || id >= DeviceCount || member == selfID)
+    return false;
+  std::lock_guard<std::mutex> lock(groupLock);
+  groups[groupId][id >> 3] |= static_cast<uint8_t>(1 << (id & 7));
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::removeFromGroup(uint8_t groupId, UniqueID member) {
+  const size_t id = static_cast<size_t>(member);
+  if (groupId >= MaxGroups || id >= DeviceCount)
+    return false;
+  std::lock_guard<std::mutex> lock(groupLock);
+  groups[groupId][id >> 3] &= static_cast<uint8_t>(~(1 << (id & 7)));
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendToGroup(uint8_t groupId, PacketType packetType,
+                                 const uint8_t *dataPtr, size_t len,
+                                 bool unicast) {
+  if (groupId >= MaxGroups || packetType.encoded >= PacketCount)
+    return false;
+  uint8_t members[GroupMaskSize];
+  uint8_t broadcast[GroupMaskSize] = {}; // Share the broadcast frame
+  uint8_t direct[GroupMaskSize] = {};    // Get a unicast copy each
+  uint8_t refused[GroupMaskSize] = {};
+  size_t broadcastCount = 0;
+  size_t directCount = 0;
+  {
+    std::lock_guard<std::mutex> lock(groupLock);
+    memcpy(members, groups[groupId], GroupMaskSize);
+    for (size_t i = 0; i < GroupMaskSize; ++i) {
+      broadcast[i] = unicast ? 0 : members[i] & ~encryptedPeers[i];
+      direct[i] = members[i] & ~broadcast[i];
+    }
+  }
+  for (size_t id = 0; id < DeviceCount; ++id) {
+    if (members[id >> 3] & (1 << (id & 7))) {
+      counters.countTx(packetType.encoded, len);
+      if (batches[id])
+        flushBatch(static_cast<UniqueID>(id)); // Keep packets in order
+    }
+    if (broadcast[id >> 3] & (1 << (id & 7)))
+      broadcastCount++;
+    if (direct[id >> 3] & (1 << (id & 7)))
+      directCount++;
+  }
+  // Reliable types are acknowledged, delta types encoded and oversized
+  // payloads fragmented per member, like sendPacket does
+  const bool delta = deltaChannels[packetType.encoded] != nullptr;
+  const bool perMember = reliableTypes[packetType.encoded] || delta ||
+                         len > MaxGroupPayloadSize;
+  if (!perMember && broadcastCount > 0 && !broadcastPeerAdded) {
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, BroadCastMac, 6);
+    const esp_err_t added = esp_now_add_peer(&peerInfo);
+    broadcastPeerAdded = (added == ESP_OK || added == ESP_ERR_ESPNOW_EXIST);
+    if (!broadcastPeerAdded)
+      ESPNOW_LOGD("No peer slot for broadcast, sending group as unicast\n");
+  }
+  if (broadcastCount == 1 || !broadcastPeerAdded) {
+    // A lone member is better off acknowledged, and without a
+    // broadcast peer every member needs its own copy
+    for (size_t i = 0; i < GroupMaskSize; ++i) {
+      direct[i] |= broadcast[i];
+      broadcast[i] = 0;
+    }
+    directCount += broadcastCount;
+    broadcastCount = 0;
+  }
+
+  if (perMember) {
+    for (size_t id = 0; id < DeviceCount; ++id) {
+      if (!(members[id >> 3] & (1 << (id & 7))))
+        continue;
+      const UniqueID member = static_cast<UniqueID>(id);
+      if (delta ? !sendDelta(member, packetType.encoded, dataPtr, len)
+                : !routePacket(member, packetType, dataPtr, len))
+        refused[id >> 3] |= static_cast<uint8_t>(1 << (id & 7));
+    }
+  } else {
+    // Built once per mode; the bitmap keeps non-members from
+    // delivering it
+    uint8_t frameData[ESP_NOW_MAX_DATA_LEN];
+    PacketHeader header = {PacketHeader::GroupFlag, packetType.encoded,
+                           selfID, static_cast<uint8_t>(len)};
+    if (broadcastCount > 0) {
+      const size_t frameLen =
+          encodeFrame(frameData, header, broadcast, GroupMaskSize, dataPtr);
+      // Addressed to no single peer: selfID marks it for completeTxFrame
+      const bool queued =
+          queueEncoded(selfID, BroadCastMac, frameData, frameLen);
+      for (size_t i = 0; !queued && i < GroupMaskSize; ++i)
+        refused[i] |= broadcast[i];
+    }
+    const size_t frameLen =
+        directCount > 0
+            ? encodeFrame(frameData, header, direct, GroupMaskSize, dataPtr)
+            : 0;
+    for (size_t id = 0; directCount > 0 && id < DeviceCount; ++id) {
+      if (!(direct[id >> 3] & (1 << (id & 7))))
+        continue;
+      const uint8_t *mac = registry->getDeviceMac(static_cast<UniqueID>(id));
+      if (mac == nullptr ||
+          !queueEncoded(static_cast<UniqueID>(id), mac, frameData, frameLen))
+        refused[id >> 3] |= static_cast<uint8_t>(1 << (id & 7));
+    }
+  }
+
+  bool anyRefused = false;
+  for (size_t i = 0; i < GroupMaskSize; ++i)
+    anyRefused |= refused[i] != 0;
+  if (anyRefused) { // Reported like any other failed frame
+    TxCompletion completion = {selfID, packetType.encoded, false, true, {}};
+    memcpy(completion.members, refused, GroupMaskSize);
+    notifySent(&completion, 1);
+  }
+  return !anyRefused;
+}
+
+HANDLER_TEMPLATE
+template <typename DataStruct>
+bool HANDLER_PARAMS::sendToGroup(uint8_t groupId, PacketType packetType,
+                                 const DataStruct &payload, bool unicast) {
+  static_assert(std::is_trivially_copyable<DataStruct>::value,
+                "Struct must be trivially copyable");
+  return sendToGroup(groupId, packetType,
+                     reinterpret_cast<const uint8_t *>(&payload),
+                     sizeof(DataStruct), unicast);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::pairDevice(UniqueID targetUniqueID, bool encrypt) {
+  ESPNOW_LOGI("Starting pairing with device ID %u\n",
+              static_cast<uint8_t>(targetUniqueID));
+  if (!pairingSlots)
+    pairingSlots.reset(new PairingSlot[DeviceCount]);
+  PairingSlot &slot = pairingSlots[static_cast<size_t>(targetUniqueID)];
+  slot.encrypt = encrypt;
+  slot.attempts = 0;
+  slot.nextAttemptMs = millis();
+  slot.reported = false;
+  slot.state = PairingState::Waiting;
+  servicePairing(); // First discovery goes out right away
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::servicePairing() {
+  if (!pairingSlots)
+    return;
+  for (size_t i = 0; i < DeviceCount; ++i) {
+    PairingSlot &slot = pairingSlots[i];
+    const UniqueID target = static_cast<UniqueID>(i);
+    PairingState state = slot.state.load();
+    if (state == PairingState::Waiting &&
+        static_cast<long>(millis() - slot.nextAttemptMs) >= 0) {
+      if (slot.attempts >= maxRetries) {
+        slot.state.compare_exchange_strong(state, PairingState::Timeout);
+      } else {
+        sendDiscoveryPacket(target, PairingState::Waiting);
+        // Exponential backoff with equal jitter, so nodes that
+        // booted together don't keep colliding
+        uint32_t backoffMs = PairingBackoffMs << slot.attempts;
+        if (backoffMs > PairingMaxBackoffMs || slot.attempts >= 16)
+          backoffMs = PairingMaxBackoffMs;
+        slot.attempts++;
+        slot.nextAttemptMs =
+            millis() + backoffMs / 2 + esp_random() % (backoffMs / 2 + 1);
+      }
+      state = slot.state.load();
+    }
+    if (slot.reported ||
+        (state != PairingState::Paired && state != PairingState::Timeout))
+      continue;
+    slot.reported = true;
+    bool paired = (state == PairingState::Paired);
+    if (paired) {
+      paired = registerComms(target, false, slot.encrypt); // Actual MAC
+      if (!paired)
+        ESPNOW_LOGE("Could not add device ID %u as a peer\n",
+                    static_cast<uint8_t>(target));
+    } else {
+      ESPNOW_LOGW("Pairing with device ID %u timed out\n",
+                  static_cast<uint8_t>(target));
+    }
+    if (pairingCallback)
+      pairingCallback(target, paired);
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceRegistry() {
+  if (registryDirty.load(std::memory_order_relaxed) &&
+      millis() - registryChangedMs.load() >= registryFlushDelayMs)
+    saveRegistry();
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::saveRegistry() {
+  if (registryDirty.exchange(false)) // Changes from now on mark it again
+    registry->saveToFlash();
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setRegistryFlushDelay(uint32_t delayMs) {
+  registryFlushDelayMs = delayMs;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::flush() {
+  bool flushed = true;
+  for (size_t i = 0; i < DeviceCount; ++i) {
+    if (batches[i])
+      flushed &= flushBatch(static_cast<UniqueID>(i));
+  }
+  saveRegistry();
+  return flushed;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::registerPairingCallback(PairingCallback callback) {
+  pairingCallback = callback;
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::pendingPairings() const {
+  size_t pending = 0;
+  for (size_t i = 0; pairingSlots && i < DeviceCount; ++i)
+    pending += pairingSlots[i].reported ? 0 : 1;
+  return pending;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::onDataRecv(const uint8_t *macAddrPtr,
+                                const uint8_t *dataPtr, int data_len) {
+  if (!instance) {
+    ESPNOW_LOGE("Instance is null\n");
+    return; // Safety check
+  }
+
+  const unsigned long start = micros();
+  const uint32_t rxUs = static_cast<uint32_t>(start);
+  if (instance->rxQueue) {
+    instance->enqueueFrame(macAddrPtr, dataPtr, data_len, rxUs);
+  } else {
+    inRadioCallback() = true;
+    instance->processFrame(macAddrPtr, dataPtr, data_len, rxUs);
+    inRadioCallback() = false;
+  }
+  instance->counters.countReceiveTime(
+      static_cast<uint32_t>(micros() - start));
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::processFrame(const uint8_t *macAddrPtr,
+                                  const uint8_t *dataPtr, int data_len,
+                                  uint32_t rxUs) {
+  if (data_len < static_cast<int>(PacketHeader::Size)) {
+    ESPNOW_LOGW("Data length too small: %d\n", data_len);
+    counters.countDrop(EspNowDrop::TooShort);
+    return; // Not enough data for header
+  }
+
+  PacketHeader header;
+  if (!PacketHeader::decode(dataPtr, data_len, header)) {
+    ESPNOW_LOGW("Unsupported header version: %d\n", dataPtr[0] >> 6);
+    counters.countDrop(EspNowDrop::BadVersion);
+    return;
+  }
+
+  if (header.flags & ~PacketHeader::KnownFlags) {
+    ESPNOW_LOGW("Unknown header flags: 0x%02X\n", header.flags);
+    counters.countDrop(EspNowDrop::UnknownFlags);
+    return; // Can't locate the payload behind unknown extensions
+  }
+
+  const size_t extLen = PacketHeader::extensionSize(header.flags);
+  if (PacketHeader::Size + extLen + header.len !=
+      static_cast<size_t>(data_len)) {
+    ESPNOW_LOGW("Length mismatch: header %u, frame %d\n", header.len, data_len);
+    counters.countDrop(EspNowDrop::LengthMismatch);
+    return;
+  }
+
+  if ((header.flags & PacketHeader::CrcFlag) &&
+      !checkCrc(dataPtr, data_len, header.flags)) {
+    counters.countDrop(EspNowDrop::CrcMismatch);
+    ESPNOW_LOGW("CRC mismatch, frame dropped\n");
+    return;
+  }
+
+  if (static_cast<size_t>(header.sender) >= DeviceCount) {
+    ESPNOW_LOGW("Sender ID out of bounds: %u\n",
+                static_cast<uint8_t>(header.sender));
+    counters.countDrop(EspNowDrop::BadSender);
+    return;
+  }
+
+  // Extension fields follow the header, then the payload
+  const uint8_t *extPtr = dataPtr + PacketHeader::Size;
+  const uint8_t *payloadPtr = extPtr + extLen;
+
+  if (header.flags & PacketHeader::GroupFlag) {
+    const uint8_t *members =
+        extPtr + PacketHeader::extensionOffset(header.flags,
+                                               PacketHeader::GroupFlag);
+    const size_t self = static_cast<size_t>(selfID);
+    if (!(members[self >> 3] & (1 << (self & 7)))) {
+      ESPNOW_LOGD("Group frame not addressed to us, dropped\n");
+      counters.countDrop(EspNowDrop::NotAddressed);
+      return; // Broadcast to a group we aren't in
+    }
+  }
+
+  if (header.type == PacketType(InternalPacket::Discovery).encoded) {
+    handleDiscoveryPacket(macAddrPtr, payloadPtr, header.len);
+    return;
+  }
+
+  if (!authenticateSender(macAddrPtr, header.sender)) {
+    counters.countDrop(EspNowDrop::AuthFailed);
+    ESPNOW_LOGW("Sender ID %u doesn't match frame MAC, dropped\n",
+                static_cast<uint8_t>(header.sender));
+    return;
+  }
+  counters.countPeerRx(static_cast<size_t>(header.sender), data_len);
+
+  if (header.flags & PacketHeader::RouteFlag) {
+    const uint8_t *routePtr =
+        extPtr + PacketHeader::extensionOffset(header.flags,
+                                               PacketHeader::RouteFlag);
+    if (!routes || routePtr[0] >= DeviceCount || routePtr[1] >= DeviceCount) {
+      counters.countDrop(EspNowDrop::NoRoute);
+      return;
+    }
+    if (static_cast<UniqueID>(routePtr[1]) != selfID) {
+      forwardFrame(dataPtr, data_len, header, routePtr);
+      return; // Relayed without calling callbacks
+    }
+    const UniqueID origin = static_cast<UniqueID>(routePtr[0]);
+    if (!acceptOrigin(origin, header.sender)) {
+      counters.countDrop(EspNowDrop::BadOrigin);
+      ESPNOW_LOGW("Routed frame from ID %u via %u not on its route\n",
+                  routePtr[0], static_cast<uint8_t>(header.sender));
+      return;
+    }
+    const size_t relays = routePtr[2] >> 4;
+    routeDelivered++;
+    routeDeliveredByHops[relays < MaxRouteHops ? relays : MaxRouteHops - 1]++;
+    header.sender = origin;
+  }
+
+  if (header.type == PacketType(InternalPacket::Route).encoded) {
+    handleRouteBeacon(header.sender, payloadPtr, header.len);
+    return;
+  }
+
+  if (header.type == PacketType(InternalPacket::Batch).encoded) {
+    handleBatch(header.sender, payloadPtr, header.len);
+    return;
+  }
+
+  if (header.type == PacketType(InternalPacket::Ack).encoded) {
+    handleAck(header.sender, payloadPtr, header.len);
+    return;
+  }
+
+  if (header.type == PacketType(InternalPacket::Time).encoded) {
+    handleTimeProbe(header.sender, payloadPtr, header.len, rxUs);
+    return;
+  }
+
+  if (header.type == PacketType(InternalPacket::Stream).encoded) {
+    handleStream(header.sender, payloadPtr, header.len);
+    return;
+  }
+
+  // Bounds check for callback array
+  if (header.type >= PacketCount) {
+    ESPNOW_LOGW("Header type out of bounds: %d\n", header.type);
+    counters.countDrop(EspNowDrop::BadType);
+    return;
+  }
+
+  // Check if callback is registered
+  if (!packetCallbacks[header.type]) {
+    ESPNOW_LOGW("No callback registered for header type: %d\n", header.type);
+    counters.countDrop(EspNowDrop::NoCallback);
+    return;
+  }
+
+  const bool reliable = (header.flags & PacketHeader::ReliableFlag) != 0;
+  if (reliable) {
+    if (!reliablePeers) {
+      ESPNOW_LOGW("Reliable packet type %d not enabled\n", header.type);
+      counters.countDrop(EspNowDrop::ReliableDisabled);
+      return;
+    }
+    const uint8_t *reliablePtr =
+        extPtr + PacketHeader::extensionOffset(header.flags,
+                                               PacketHeader::ReliableFlag);
+    bool duplicate = false;
+    if (!acceptReliable(header.sender, reliablePtr, duplicate)) {
+      if (duplicate)
+        sendAck(header.sender); // Our earlier ACK may have been lost
+      return;
+    }
+  }
+
+  if (header.flags & PacketHeader::FragmentFlag)
+    handleFragment(header, extPtr, payloadPtr);
+  else
+    deliver(header.type, payloadPtr, header.len, header.sender);
+
+  if (reliable)
+    sendAck(header.sender); // Only once the callback has run
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::deliver(uint8_t type, const uint8_t *dataPtr, size_t len,
+                             UniqueID sender) {
+  const unsigned long start = micros();
+  if (deltaChannels[type]) {
+    alignas(8) uint8_t state[MaxDeltaSize];
+    if (!decodeDelta(sender, type, dataPtr, len, state)) {
+      counters.countDrop(EspNowDrop::BadDelta);
+      return;
+    }
+    packetCallbacks[type](state, deltaChannels[type]->size, sender);
+  } else {
+    packetCallbacks[type](dataPtr, len, sender);
+  }
+  counters.countRx(type, len, static_cast<uint32_t>(micros() - start));
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleBatch(UniqueID sender, const uint8_t *dataPtr,
+                                 size_t len) {
+  size_t offset = 0;
+  while (offset + BatchRecordHeaderSize <= len) {
+    const uint8_t type = dataPtr[offset];
+    const size_t recordLen = dataPtr[offset + 1];
+    const uint8_t *recordPtr = dataPtr + offset + BatchRecordHeaderSize;
+    if (offset + BatchRecordHeaderSize + recordLen > len)
+      break; // Truncated record
+    offset += BatchRecordHeaderSize + recordLen;
+    if (type >= PacketCount || !packetCallbacks[type]) {
+      ESPNOW_LOGW("No callback registered for header type: %d\n", type);
+      counters.countDrop(type >= PacketCount ? EspNowDrop::BadType
+                                             : EspNowDrop::NoCallback);
+      continue;
+    }
+    deliver(type, recordPtr, recordLen, sender);
+  }
+  if (offset != len) {
+    ESPNOW_LOGW("Malformed batch frame, %u bytes left\n",
+                static_cast<unsigned>(len - offset));
+    counters.countDrop(EspNowDrop::MalformedBatch);
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleFragment(const PacketHeader &header,
+                                    const uint8_t *extPtr,
+                                    const uint8_t *payloadPtr) {
+  const FragmentHeader fragment = FragmentHeader::decode(extPtr);
+  if (fragment.count == 0 || fragment.index >= fragment.count ||
+      fragment.total == 0) {
+    ESPNOW_LOGW("Invalid fragment header\n");
+    counters.countDrop(EspNowDrop::BadFragment);
+    return;
+  }
+  const size_t chunk = fragment.chunkSize();
+  const size_t offset = fragment.index * chunk;
+  if (offset >= fragment.total ||
+      header.len != ((fragment.total - offset < chunk)
+                         ? fragment.total - offset
+                         : chunk)) {
+    ESPNOW_LOGW("Invalid fragment length: %u\n", header.len);
+    counters.countDrop(EspNowDrop::BadFragment);
+    return;
+  }
+  if (!reassemblySlots || fragment.total > reassemblyMaxSize) {
+    ESPNOW_LOGW("Can't reassemble %u byte message\n", fragment.total);
+    reassemblyDrops++;
+    counters.countDrop(EspNowDrop::NoReassembly);
+    return;
+  }
+
+  ReassemblySlot *slot = findReassemblySlot(header.sender, fragment);
+  if (slot == nullptr) {
+    ESPNOW_LOGW("No free reassembly slot\n");
+    reassemblyDrops++;
+    counters.countDrop(EspNowDrop::NoReassembly);
+    return;
+  }
+  if (!slot->inUse) {
+    slot->inUse = true;
+    slot->sender = header.sender;
+    slot->type = header.type;
+    slot->fragment = fragment;
+    slot->received = 0;
+    memset(slot->seen, 0, sizeof(slot->seen));
+  }
+
+  const uint8_t bit = static_cast<uint8_t>(1 << (fragment.index & 7));
+  if (slot->seen[fragment.index >> 3] & bit)
+    return; // Duplicate
+  slot->seen[fragment.index >> 3] |= bit;
+  memcpy(slot->buffer + offset, payloadPtr, header.len);
+  slot->received++;
+  slot->lastMs = millis();
+
+  if (slot->received == fragment.count) {
+    slot->inUse = false;
+    reassemblyCompleted++;
+    deliver(header.type, slot->buffer, fragment.total, header.sender);
+  }
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::ReassemblySlot *
+HANDLER_PARAMS::findReassemblySlot(UniqueID sender,
+                                   const FragmentHeader &fragment) {
+  expireReassembly();
+  ReassemblySlot *freeSlot = nullptr;
+  for (size_t i = 0; i < reassemblySlotCount; ++i) {
+    ReassemblySlot &slot = reassemblySlots[i];
+    if (!slot.inUse) {
+      if (freeSlot == nullptr)
+        freeSlot = &slot;
+      continue;
+    }
+    if (slot.sender != sender ||
+        slot.fragment.messageId != fragment.messageId)
+      continue;
+    if (slot.fragment.count != fragment.count ||
+        slot.fragment.total != fragment.total)
+      slot.inUse = false; // Message ID reused for a new message, restart
+    return &slot;
+  }
+  return freeSlot;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::expireReassembly() {
+  const unsigned long now = millis();
+  for (size_t i = 0; i < reassemblySlotCount; ++i) {
+    ReassemblySlot &slot = reassemblySlots[i];
+    if (slot.inUse && now - slot.lastMs >= reassemblyTimeoutMs) {
+      slot.inUse = false;
+      reassemblyTimeouts++;
+    }
+  }
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableReassembly(size_t slots, size_t maxMessageSize,
+                                      uint32_t timeoutMs) {
+  if (reassemblySlots || slots == 0 || maxMessageSize > MaxMessageSize)
+    return false;
+  const size_t stride = (maxMessageSize + 7) & ~static_cast<size_t>(7);
+  reassemblySlots.reset(new ReassemblySlot[slots]());
+  reassemblyMemory.reset(new uint8_t[slots * stride]); // Aligned buffers
+  for (size_t i = 0; i < slots; ++i)
+    reassemblySlots[i].buffer = reassemblyMemory.get() + i * stride;
+  reassemblySlotCount = slots;
+  reassemblyMaxSize = maxMessageSize;
+  reassemblyTimeoutMs = timeoutMs;
+  return true;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::ReassemblyStats
+HANDLER_PARAMS::getReassemblyStats() const {
+  ReassemblyStats stats = {};
+  for (size_t i = 0; i < reassemblySlotCount; ++i)
+    stats.active += reassemblySlots[i].inUse ? 1 : 0;
+  stats.completed = reassemblyCompleted;
+  stats.timeouts = reassemblyTimeouts;
+  stats.dropped = reassemblyDrops;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::enqueueFrame(const uint8_t *macAddrPtr,
+                                  const uint8_t *dataPtr, int data_len,
+                                  uint32_t rxUs) {
+  if (data_len <= 0 || data_len > ESP_NOW_MAX_DATA_LEN) {
+    ESPNOW_LOGW("Invalid frame length: %d\n", data_len);
+    counters.countDrop(EspNowDrop::LengthMismatch);
+    return;
+  }
+  RxFrame *frame = rxQueue->reserve();
+  if (frame == nullptr) {
+    counters.countDrop(EspNowDrop::RxQueueFull);
+    return; // Queue full, consumer is not keeping up
+  }
+  memcpy(frame->mac, macAddrPtr, 6);
+  frame->rxUs = rxUs;
+  frame->len = static_cast<uint8_t>(data_len);
+  memcpy(frame->data, dataPtr, data_len);
+  rxQueue->commit();
+
+  const size_t depth = rxQueue->size();
+  if (depth > rxHighWater.load(std::memory_order_relaxed))
+    rxHighWater.store(depth, std::memory_order_relaxed);
+#ifdef ESP_PLATFORM
+  if (dispatchTask != nullptr)
+    xTaskNotifyGive(dispatchTask);
+#endif
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableDeferredDispatch(size_t queueDepth) {
+  if (rxQueue || queueDepth == 0)
+    return false; // Already enabled, the queue can't be resized safely
+  rxQueue.reset(new EspNowRingBuffer<RxFrame>(queueDepth));
+  return true;
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::poll(size_t maxFrames) {
+  flushExpiredBatches();
+  servicePairing();
+  serviceRegistry();
+  serviceReliable();
+  serviceTxQueue(); // Frames the driver had no room for or out of tokens
+  expireReassembly();
+  serviceTimeSync();
+  serviceRouting();
+  serviceRpc();
+  serviceStreams();
+  if (!rxQueue)
+    return 0;
+  size_t handled = 0;
+  while (handled < maxFrames) {
+    RxFrame *frame = rxQueue->front();
+    if (frame == nullptr)
+      break;
+    processFrame(frame->mac, frame->data, frame->len, frame->rxUs);
+    rxQueue->pop();
+    handled++;
+  }
+  rxDispatched += handled;
+  return handled;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::RxQueueStats HANDLER_PARAMS::getRxQueueStats() const {
+  RxQueueStats stats = {};
+  if (rxQueue) {
+    stats.depth = rxQueue->size();
+    stats.capacity = rxQueue->capacity();
+  }
+  stats.highWater = rxHighWater.load(std::memory_order_relaxed);
+  stats.overflowDrops = counters.dropCount(EspNowDrop::RxQueueFull);
+  stats.dispatched = rxDispatched;
+  return stats;
+}
+
+#ifdef ESP_PLATFORM
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::startDispatchTask(UBaseType_t priority,
+                                       uint32_t stackSize, size_t batchSize) {
+  if (!rxQueue || dispatchTask != nullptr)
+    return false;
+  dispatchBatch = batchSize;
+  BaseType_t created = xTaskCreate(dispatchTaskLoop, "EspNowDispatch",
+                                   stackSize, this, priority, &dispatchTask);
+  dispatchTaskRunning = (created == pdPASS);
+  return dispatchTaskRunning;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::dispatchTaskLoop(void *arg) {
+  HANDLER_PARAMS *handler = static_cast<HANDLER_PARAMS *>(arg);
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (handler->poll(handler->dispatchBatch) > 0) {
+      // Keep draining until the queue is empty
+    }
+  }
+}
+#endif
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::onDataSent(const uint8_t *macAddrPtr,
+                                esp_now_send_status_t status) {
+  if (!instance)
+    return;
+  inRadioCallback() = true;
+  instance->handleSendStatus(macAddrPtr, status);
+  inRadioCallback() = false;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleSendStatus(const uint8_t *macAddrPtr,
+                                      esp_now_send_status_t status) {
+  TxCompletion completions[TxQueueDepth + 1];
+  size_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    TxFrame *oldest = nullptr;
+    for (size_t i = 0; i < TxQueueDepth; ++i) {
+      TxFrame &frame = txFrames[i];
+      if (frame.state != TxState::InFlight ||
+          memcmp(frame.mac, macAddrPtr, 6) != 0)
+        continue;
+      if (oldest == nullptr || frame.ticket < oldest->ticket)
+        oldest = &frame;
+    }
+    if (oldest != nullptr) {
+      adjustRate(*oldest, status == ESP_NOW_SEND_SUCCESS);
+      if (completeTxFrame(*oldest, status == ESP_NOW_SEND_SUCCESS,
+                          completions[count]))
+        count++;
+    }
+    count += pumpTxQueue(completions + count);
+  }
+  notifySent(completions, count);
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::TxFrame *
+HANDLER_PARAMS::acquireTxFrame(std::unique_lock<std::mutex> &lock,
+                               uint8_t type) {
+  const unsigned long start = millis();
+  for (;;) {
+    TxFrame *slot = freeTxFrame(type);
+    if (slot != nullptr)
+      return slot;
+    // Waiting inside a radio callback would stall the completions we
+    // are waiting for
+    if (inRadioCallback() || millis() - start >= txTimeoutMs) {
+      txTimeouts++;
+      return nullptr;
+    }
+    lock.unlock();
+    delay(1);
+    serviceTxQueue();
+    lock.lock();
+  }
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::TxFrame *HANDLER_PARAMS::freeTxFrame(uint8_t type) {
+  const size_t reserved =
+      priorityOf(type) == static_cast<uint8_t>(EspNowPriority::Control)
+          ? 0
+          : TxReservedSlots;
+  TxFrame *slot = nullptr;
+  size_t freeSlots = 0;
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    if (txFrames[i].state != TxState::Free)
+      continue;
+    freeSlots++;
+    if (slot == nullptr)
+      slot = &txFrames[i];
+  }
+  return freeSlots > reserved ? slot : nullptr;
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::inFlightTo(const uint8_t *macAddrPtr) const {
+  size_t count = 0;
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    if (txFrames[i].state == TxState::InFlight &&
+        memcmp(txFrames[i].mac, macAddrPtr, 6) == 0)
+      count++;
+  }
+  return count;
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::pumpTxQueue(TxCompletion *failed) {
+  size_t failedCount = 0;
+  for (;;) {
+    TxFrame *next = nextTxFrame(failed, failedCount);
+    if (next == nullptr)
+      return failedCount;
+
+    stampTimeProbe(*next);
+    esp_err_t sendSuccess = esp_now_send(next->mac, next->data, next->len);
+    if (sendSuccess == ESP_OK) {
+      next->state = TxState::InFlight;
+      releaseReliableCopy(*next, true);
+      takeRateTokens(*next);
+      PriorityPolicy &policy = priorities[next->priority];
+      if (policy.credit > 0)
+        policy.credit--;
+    } else if (sendSuccess == ESP_ERR_ESPNOW_NO_MEM) {
+      txDriverFull++;
+      return failedCount; // Retried on the next completion or poll()
+    } else {
+      ESPNOW_LOGE("Failed to send packet, esp_err_t: %d\n", sendSuccess);
+      if (completeTxFrame(*next, false, failed[failedCount]))
+        failedCount++;
+    }
+  }
+}
+
+// Weighted round robin over the classes below Control: each round
+// a class may send its weight in frames, higher classes first, and
+// the round restarts once no class with waiting frames has credit
+// left. Per peer and class order holds because a frame is only
+// picked when it is the oldest of its class with window room; a
+// packet type out of tokens lets other types to the peer pass.
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::TxFrame *
+HANDLER_PARAMS::nextTxFrame(TxCompletion *failed, size_t &failedCount) {
+  const uint32_t now = static_cast<uint32_t>(millis());
+  TxFrame *oldest[PriorityCount] = {};
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    TxFrame &frame = txFrames[i];
+    if (frame.state != TxState::Queued)
+      continue;
+    const uint32_t deadlineMs = priorities[frame.priority].deadlineMs;
+    if (deadlineMs > 0 && now - frame.queuedMs > deadlineMs) {
+      ESPNOW_LOGD("Frame of type %u expired in the transmit queue\n",
+                  frame.type);
+      counters.countDrop(EspNowDrop::Expired);
+      txExpired++;
+      if (completeTxFrame(frame, false, failed[failedCount]))
+        failedCount++;
+      continue;
+    }
+    TxFrame *&best = oldest[frame.priority];
+    if ((best == nullptr || frame.ticket < best->ticket) &&
+        inFlightTo(frame.mac) < txWindow && rateAllows(frame, now))
+      best = &frame;
+  }
+  if (oldest[0] != nullptr)
+    return oldest[0];
+  bool waiting = false;
+  for (size_t i = 1; i < PriorityCount; ++i) {
+    if (oldest[i] != nullptr && priorities[i].credit > 0)
+      return oldest[i];
+    waiting = waiting || oldest[i] != nullptr;
+  }
+  if (!waiting)
+    return nullptr;
+  for (size_t i = 1; i < PriorityCount; ++i) // Next round
+    priorities[i].credit = priorities[i].weight;
+  for (size_t i = 1; i < PriorityCount; ++i) {
+    if (oldest[i] != nullptr)
+      return oldest[i];
+  }
+  return nullptr;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::completeTxFrame(TxFrame &frame, bool delivered,
+                                     TxCompletion &out) {
+  if (frame.state == TxState::Queued)
+    releaseReliableCopy(frame, false); // Expired or refused by the driver
+  frame.state = TxState::Free;
+  if (delivered)
+    txDelivered++;
+  else
+    txFailed++;
+  out = {frame.target, frame.type, delivered, false, {}};
+
+  PacketHeader header = {};
+  PacketHeader::decode(frame.data, frame.len, header);
+  if (frame.target == selfID && (header.flags & PacketHeader::GroupFlag)) {
+    // Group broadcast: reported for every member it addressed
+    out.group = true;
+    memcpy(out.members,
+           frame.data + PacketHeader::Size +
+               PacketHeader::extensionOffset(header.flags,
+                                             PacketHeader::GroupFlag),
+           GroupMaskSize);
+    return true;
+  }
+  counters.countPeerTx(static_cast<size_t>(frame.target), frame.len,
+                       delivered);
+  if (!delivered && frame.type == PacketType(InternalPacket::Stream).encoded)
+    noteStreamLoss(frame, header);
+  if ((header.flags & PacketHeader::RouteFlag) &&
+      frame.data[PacketHeader::Size +
+                 PacketHeader::extensionOffset(
+                     header.flags, PacketHeader::RouteFlag)] !=
+          static_cast<uint8_t>(selfID))
+    return false; // Relayed for another device
+  if (header.flags & PacketHeader::ReliableFlag)
+    return false; // Reported when acknowledged
+  if (!(header.flags & PacketHeader::FragmentFlag))
+    return true;
+
+  // One report per fragmented message, failed if any fragment failed
+  FragmentHeader fragment =
+      FragmentHeader::decode(frame.data + PacketHeader::Size);
+  uint8_t &failedByte = txFailedMessages[fragment.messageId >> 3];
+  const uint8_t failedBit = static_cast<uint8_t>(1 << (fragment.messageId & 7));
+  uint8_t &abandonedByte = txAbandonedMessages[fragment.messageId >> 3];
+  if (abandonedByte & failedBit) { // Already reported by abandonMessage
+    if (!messagePending(fragment.messageId))
+      abandonedByte &= static_cast<uint8_t>(~failedBit);
+    return false;
+  }
+  if (!delivered)
+    failedByte |= failedBit;
+  if (fragment.index + 1 != fragment.count)
+    return false;
+  out.delivered = !(failedByte & failedBit);
+  failedByte &= static_cast<uint8_t>(~failedBit);
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceTxQueue() {
+  TxCompletion failed[TxQueueDepth];
+  size_t count;
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    count = pumpTxQueue(failed);
+  }
+  notifySent(failed, count);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::notifySent(const TxCompletion *completions,
+                                size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    const TxCompletion &completion = completions[i];
+    if (completion.type >= PacketCount)
+      continue; // Internal packets aren't reported
+    if (!completion.group) {
+      reportSent(completion.target, completion.type, completion.delivered);
+      continue;
+    }
+    for (size_t id = 0; id < DeviceCount; ++id) {
+      if (completion.members[id >> 3] & (1 << (id & 7)))
+        reportSent(static_cast<UniqueID>(id), completion.type,
+                   completion.delivered);
+    }
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::reportSent(UniqueID target, uint8_t type,
+                                bool delivered) {
+  if (!delivered) {
+    counters.countTxFailure(type);
+    if (deltaChannels[type] && static_cast<size_t>(target) < DeviceCount)
+      deltaChannels[type]->peers[static_cast<size_t>(target)].resync = true;
+  }
+  if (sendCallback)
+    sendCallback(target, static_cast<UserPacket>(type), delivered);
+}
+
+HANDLER_TEMPLATE
+bool &HANDLER_PARAMS::inRadioCallback() {
+  static thread_local bool inCallback = false;
+  return inCallback;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::registerSendCallback(SendCallback callback) {
+  sendCallback = callback;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setTxWindow(uint8_t framesPerPeer) {
+  std::lock_guard<std::mutex> lock(txLock);
+  txWindow = framesPerPeer > 0 ? framesPerPeer : 1;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setTxTimeout(uint32_t timeoutMs) {
+  txTimeoutMs = timeoutMs;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::TxQueueStats HANDLER_PARAMS::getTxQueueStats() {
+  std::lock_guard<std::mutex> lock(txLock);
+  TxQueueStats stats = {};
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    if (txFrames[i].state == TxState::Queued)
+      stats.queued++;
+    else if (txFrames[i].state == TxState::InFlight)
+      stats.inFlight++;
+  }
+  stats.delivered = txDelivered;
+  stats.failed = txFailed;
+  stats.timeouts = txTimeouts;
+  stats.driverFull = txDriverFull;
+  stats.expired = txExpired;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setPriority(PacketType packetType,
+                                 EspNowPriority priority) {
+  if (packetType.encoded >= PacketCount || priority >= EspNowPriority::Count)
+    return;
+  std::lock_guard<std::mutex> lock(txLock);
+  packetPriority[packetType.encoded] = static_cast<uint8_t>(priority);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setPriorityPolicy(EspNowPriority priority,
+                                       uint8_t weight, uint32_t deadlineMs) {
+  if (priority >= EspNowPriority::Count)
+    return;
+  std::lock_guard<std::mutex> lock(txLock);
+  PriorityPolicy &policy = priorities[static_cast<size_t>(priority)];
+  policy.weight = weight > 0 ? weight : 1;
+  policy.credit = policy.weight;
+  policy.deadlineMs = deadlineMs;
+}
+
+HANDLER_TEMPLATE
+uint8_t HANDLER_PARAMS::priorityOf(uint8_t type) const {
+  if (type < PacketCount)
+    return packetPriority[type];
+  if (type == PacketType(InternalPacket::Stream).encoded)
+    return static_cast<uint8_t>(EspNowPriority::Bulk);
+  if (type == PacketType(InternalPacket::Batch).encoded)
+    return static_cast<uint8_t>(EspNowPriority::Normal); // See batchPriority
+  // Other internal packets (acknowledgements, discovery, time sync,
+  // routes) are small and rare
+  return static_cast<uint8_t>(EspNowPriority::Control);
+}
+
+HANDLER_TEMPLATE
+uint8_t HANDLER_PARAMS::batchPriority(const TxFrame &frame) const {
+  PacketHeader header = {};
+  if (!PacketHeader::decode(frame.data, frame.len, header))
+    return static_cast<uint8_t>(EspNowPriority::Normal);
+  const uint8_t *records = frame.data + PacketHeader::Size +
+                           PacketHeader::extensionSize(header.flags);
+  uint8_t priority = static_cast<uint8_t>(EspNowPriority::Bulk);
+  for (size_t offset = 0; offset + BatchRecordHeaderSize <= header.len;
+       offset += BatchRecordHeaderSize + records[offset + 1]) {
+    const uint8_t record = priorityOf(records[offset]);
+    priority = (record < priority) ? record : priority;
+  }
+  const uint8_t high = static_cast<uint8_t>(EspNowPriority::High);
+  return (priority < high) ? high : priority;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableRateControl(uint16_t maxFramesPerSecond,
+                                       uint16_t minFramesPerSecond) {
+  if (minFramesPerSecond == 0 || maxFramesPerSecond < minFramesPerSecond)
+    return false;
+  std::lock_guard<std::mutex> lock(txLock);
+  if (!peerRates)
+    peerRates.reset(new PeerRate[DeviceCount]());
+  rateMin = minFramesPerSecond;
+  rateMax = maxFramesPerSecond;
+  const uint32_t now = static_cast<uint32_t>(millis());
+  for (size_t i = 0; i < DeviceCount; ++i)
+    peerRates[i] = {{maxFramesPerSecond, RateBurst * RateTokens, now}, 0, 0};
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::setRateLimit(PacketType packetType,
+                                  uint16_t framesPerSecond) {
+  if (packetType.encoded >= PacketCount)
+    return;
+  std::lock_guard<std::mutex> lock(txLock);
+  typeRates[packetType.encoded] = {framesPerSecond, RateBurst * RateTokens,
+                                   static_cast<uint32_t>(millis())};
+}
+
+HANDLER_TEMPLATE
+uint16_t HANDLER_PARAMS::getPeerRate(UniqueID peerID) {
+  std::lock_guard<std::mutex> lock(txLock);
+  const size_t id = static_cast<size_t>(peerID);
+  return peerRates && id < DeviceCount ? peerRates[id].bucket.rate : 0;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::RateStats HANDLER_PARAMS::getRateStats() {
+  std::lock_guard<std::mutex> lock(txLock);
+  return {rateBackoffs, rateIncreases};
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::PeerRate *
+HANDLER_PARAMS::peerRateFor(const TxFrame &frame) {
+  const size_t id = static_cast<size_t>(frame.hop);
+  if (!peerRates || id >= DeviceCount ||
+      memcmp(frame.mac, BroadCastMac, 6) == 0)
+    return nullptr; // Broadcasts get no MAC-level feedback
+  return &peerRates[id];
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::refillBucket(TokenBucket &bucket, uint32_t nowMs) {
+  const uint32_t full = RateBurst * RateTokens;
+  const uint32_t elapsedMs = nowMs - bucket.refillMs;
+  bucket.refillMs = nowMs;
+  bucket.tokens = elapsedMs >= full
+                      ? full
+                      : std::min(full, bucket.tokens + elapsedMs * bucket.rate);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::rateAllows(const TxFrame &frame, uint32_t nowMs) {
+  if (frame.priority == static_cast<uint8_t>(EspNowPriority::Control))
+    return true;
+  if (frame.type < PacketCount && typeRates[frame.type].rate > 0) {
+    refillBucket(typeRates[frame.type], nowMs);
+    if (typeRates[frame.type].tokens < RateTokens)
+      return false;
+  }
+  PeerRate *peer = peerRateFor(frame);
+  if (peer == nullptr)
+    return true;
+  refillBucket(peer->bucket, nowMs);
+  return peer->bucket.tokens >= RateTokens;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::takeRateTokens(const TxFrame &frame) {
+  if (frame.priority == static_cast<uint8_t>(EspNowPriority::Control))
+    return;
+  if (frame.type < PacketCount && typeRates[frame.type].rate > 0 &&
+      typeRates[frame.type].tokens >= RateTokens)
+    typeRates[frame.type].tokens -= RateTokens;
+  PeerRate *peer = peerRateFor(frame);
+  if (peer != nullptr && peer->bucket.tokens >= RateTokens)
+    peer->bucket.tokens -= RateTokens;
+}
+
+// Additive increase, multiplicative decrease: the rates of peers
+// sharing a congested channel converge on a fair share of it
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::adjustRate(const TxFrame &frame, bool delivered) {
+  PeerRate *peer = peerRateFor(frame);
+  if (peer == nullptr)
+    return;
+  uint16_t &rate = peer->bucket.rate;
+  if (peer->sentBefore > 0) {
+    // Sent before the last back-off, into the same congestion
+    peer->sentBefore--;
+    return;
+  }
+  if (!delivered) {
+    // Results come back in send order, and this frame is still one of
+    // those in flight
+    peer->sentBefore = static_cast<uint8_t>(inFlightTo(frame.mac) - 1);
+    peer->delivered = 0;
+    rate = std::max<uint16_t>(rate / 2, rateMin);
+    rateBackoffs++;
+    return;
+  }
+  if (rate >= rateMax || ++peer->delivered < rate / RateStep)
+    return;
+  peer->delivered = 0;
+  rate = static_cast<uint16_t>(rateMax - rate > RateStep ? rate + RateStep
+                                                          : rateMax);
+  rateIncreases++;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enablePeerCache(size_t capacity) {
+  if (capacity == 0)
+    return false;
+  uint8_t encrypted[GroupMaskSize];
+  {
+    std::lock_guard<std::mutex> lock(groupLock);
+    memcpy(encrypted, encryptedPeers, GroupMaskSize);
+  }
+  std::lock_guard<std::mutex> lock(txLock);
+  if (peerCache)
+    return false;
+  peerCache.reset(new CachedPeer[DeviceCount]());
+  peerCacheCapacity = capacity;
+  for (size_t id = 0; id < DeviceCount; ++id) {
+    CachedPeer &peer = peerCache[id];
+    peer.encrypt = (encrypted[id >> 3] >> (id & 7)) & 1;
+    const uint8_t *mac = registry->getDeviceMac(static_cast<UniqueID>(id));
+    if (mac == nullptr || !esp_now_is_peer_exist(mac))
+      continue;
+    peer.cached = true; // Added by registerComms earlier
+    memcpy(peer.mac, mac, 6);
+    peerCacheSize++;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::pinPeer(UniqueID targetID, bool pinned) {
+  const size_t id = static_cast<size_t>(targetID);
+  if (id >= DeviceCount || targetID == selfID)
+    return false;
+  std::lock_guard<std::mutex> lock(txLock);
+  if (!peerCache)
+    return false;
+  CachedPeer &peer = peerCache[id];
+  peer.pinned = false;
+  if (pinned) {
+    const uint8_t *mac = registry->getDeviceMac(targetID);
+    if (mac == nullptr || (!peer.cached && !cachePeer(id, mac)))
+      return false;
+  }
+  peer.pinned = pinned;
+  return true;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::PeerCacheStats HANDLER_PARAMS::getPeerCacheStats() {
+  std::lock_guard<std::mutex> lock(txLock);
+  PeerCacheStats stats = {};
+  stats.cached = peerCacheSize;
+  stats.capacity = peerCacheCapacity;
+  stats.hits = peerCacheHits;
+  stats.misses = peerCacheMisses;
+  stats.evictions = peerCacheEvictions;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::ensurePeer(UniqueID targetID, const uint8_t *targetMac) {
+  const size_t id = static_cast<size_t>(targetID);
+  if (!peerCache || id >= DeviceCount || targetID == selfID ||
+      memcmp(targetMac, BroadCastMac, 6) == 0)
+    return true; // Not managed: discovery and group broadcasts
+  CachedPeer &peer = peerCache[id];
+  peer.lastUsed = ++peerCacheClock;
+  if (peer.cached && memcmp(peer.mac, targetMac, 6) == 0) {
+    peerCacheHits++;
+    return true;
+  }
+  peerCacheMisses++;
+  if (peer.cached && !peerBusy(peer.mac)) { // The device's MAC changed
+    esp_now_del_peer(peer.mac);
+    peer.cached = false;
+    peerCacheSize--;
+  }
+  if (peer.cached || !cachePeer(id, targetMac)) {
+    ESPNOW_LOGW("No peer slot for device ID %u, packet dropped\n",
+                static_cast<uint8_t>(id));
+    counters.countDrop(EspNowDrop::NoPeerSlot);
+    return false;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::cachePeer(size_t id, const uint8_t *mac) {
+  CachedPeer &peer = peerCache[id];
+  esp_now_peer_info_t peerInfo = {};
+  memcpy(peerInfo.peer_addr, mac, 6);
+  peerInfo.encrypt = peer.encrypt;
+  for (;;) {
+    if (peerCacheSize < peerCacheCapacity) {
+      const esp_err_t added = esp_now_add_peer(&peerInfo);
+      if (added == ESP_OK || added == ESP_ERR_ESPNOW_EXIST) {
+        peer.cached = true;
+        memcpy(peer.mac, mac, 6);
+        peerCacheSize++;
+        return true;
+      }
+      if (added != ESP_ERR_ESPNOW_FULL)
+        return false;
+    }
+    // Below capacity, a full driver means the encrypted peer limit
+    // (or peers the cache doesn't manage)
+    if (!evictPeer(peer.encrypt && peerCacheSize < peerCacheCapacity))
+      return false;
+  }
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::evictPeer(bool encryptedOnly) {
+  // A linear scan per miss; cheap next to the radio time of a frame
+  size_t victim = DeviceCount;
+  uint32_t oldest = 0;
+  for (size_t id = 0; id < DeviceCount; ++id) {
+    const CachedPeer &peer = peerCache[id];
+    if (!peer.cached || peer.pinned || (encryptedOnly && !peer.encrypt))
+      continue;
+    const uint32_t age = peerCacheClock - peer.lastUsed;
+    if ((victim == DeviceCount || age > oldest) && !peerBusy(peer.mac)) {
+      victim = id;
+      oldest = age;
+    }
+  }
+  if (victim == DeviceCount)
+    return false;
+  CachedPeer &peer = peerCache[victim];
+  esp_now_del_peer(peer.mac);
+  peer.cached = false;
+  peerCacheSize--;
+  peerCacheEvictions++;
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::peerBusy(const uint8_t *macAddrPtr) const {
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    if (txFrames[i].state != TxState::Free &&
+        memcmp(txFrames[i].mac, macAddrPtr, 6) == 0)
+      return true;
+  }
+  return false;
 }
 
 HANDLER_TEMPLATE
-template <typename DataStruct>
-bool HANDLER_PARAMS::sendPacket(UniqueID targetID, PacketType packetType,
-                                const DataStruct &payload) {
-  static_assert(std::is_trivially_copyable<DataStruct>::value,
-                "Struct must be trivially copyable");
-  return sendPacket(targetID, packetType,
-                    reinterpret_cast<const uint8_t *>(&payload),
-                    sizeof(DataStruct));
+bool HANDLER_PARAMS::probePeer(UniqueID targetID) {
+  const size_t id = static_cast<size_t>(targetID);
+  if (id >= DeviceCount || targetID == selfID)
+    return false;
+  TimeProbe probe = {};
+  probe.kind = TimeProbe::Request;
+  {
+    std::lock_guard<std::mutex> lock(timeLock);
+    if (!timePeers)
+      timePeers.reset(new TimePeer[DeviceCount]());
+    TimePeer &peer = timePeers[id];
+    if (peer.pending)
+      peer.lost++; // Superseded without an answer
+    peer.pending = true;
+    peer.seq = ++timeProbeSeq;
+    probe.seq = peer.seq;
+  }
+  uint8_t data[TimeProbe::Size];
+  probe.encode(data); // originUs is written by stampTimeProbe
+  if (!sendPacket(targetID, InternalPacket::Time, data, sizeof(data))) {
+    std::lock_guard<std::mutex> lock(timeLock);
+    timePeers[id].pending = false;
+    return false;
+  }
+  return true;
 }
 
 HANDLER_TEMPLATE
-bool HANDLER_PARAMS::pairDevice(UniqueID targetUniqueID, bool encrypt) {
-  printf("[ESPNowHandler] Starting pairing with device ID %u\n",
-         static_cast<uint8_t>(targetUniqueID));
-  pairingState = PairingState::Waiting;
-  uint8_t retries = 0;
-  const uint8_t *targetMac = BroadCastMac;
-  while (pairingState != PairingState::Paired && retries < maxRetries) {
-    sendDiscoveryPacket(targetUniqueID);
-    retries++;
-    if (retries == maxRetries) {
-      pairingState = PairingState::Timeout;
+bool HANDLER_PARAMS::getPeerLatency(UniqueID targetID,
+                                    PeerLatency &out) const {
+  const size_t id = static_cast<size_t>(targetID);
+  std::lock_guard<std::mutex> lock(timeLock);
+  if (!timePeers || id >= DeviceCount || timePeers[id].samples == 0)
+    return false;
+  const TimePeer &peer = timePeers[id];
+  out.srttUs = peer.srttUs;
+  out.rttVarUs = peer.rttVarUs;
+  out.minRttUs = peer.minRttUs;
+  out.lastRttUs = peer.lastRttUs;
+  out.samples = peer.samples;
+  out.lost = peer.lost;
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::enableTimeSync(UniqueID reference, uint32_t intervalMs) {
+  std::lock_guard<std::mutex> lock(timeLock);
+  if (timeSyncEnabled && reference != timeReference) {
+    clockSampleCount = 0; // Samples of another clock
+    clockSynced = false;
+    clockDriftKnown = false;
+  }
+  timeReference = reference;
+  timeSyncIntervalMs = intervalMs;
+  timeSyncLastMs = static_cast<uint32_t>(millis()) - intervalMs; // Probe now
+  timeSyncEnabled = true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::disableTimeSync() {
+  std::lock_guard<std::mutex> lock(timeLock);
+  timeSyncEnabled = false;
+}
+
+HANDLER_TEMPLATE
+uint32_t HANDLER_PARAMS::networkTime() const {
+  const uint32_t localUs = static_cast<uint32_t>(micros());
+  std::lock_guard<std::mutex> lock(timeLock);
+  return networkTimeAt(localUs);
+}
+
+HANDLER_TEMPLATE
+uint32_t HANDLER_PARAMS::networkTimeAt(uint32_t localUs) const {
+  if (!clockSynced)
+    return localUs;
+  const int32_t sinceAnchorUs = static_cast<int32_t>(localUs - clockAnchorUs);
+  const int32_t driftUs = static_cast<int32_t>(
+      clockDriftPpm * static_cast<float>(sinceAnchorUs) / 1e6f);
+  return localUs + static_cast<uint32_t>(clockOffsetUs + driftUs);
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::TimeSyncStats
+HANDLER_PARAMS::getTimeSyncStats() const {
+  const uint32_t localUs = static_cast<uint32_t>(micros());
+  std::lock_guard<std::mutex> lock(timeLock);
+  TimeSyncStats stats = {};
+  stats.synced = clockSynced;
+  stats.offsetUs = static_cast<int32_t>(networkTimeAt(localUs) - localUs);
+  stats.driftPpm = clockDriftPpm;
+  stats.samples = clockSamplesTotal;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceTimeSync() {
+  UniqueID reference;
+  {
+    std::lock_guard<std::mutex> lock(timeLock);
+    const uint32_t now = static_cast<uint32_t>(millis());
+    if (!timeSyncEnabled || now - timeSyncLastMs < timeSyncIntervalMs)
+      return;
+    timeSyncLastMs = now;
+    reference = timeReference;
+  }
+  probePeer(reference);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::stampTimeProbe(TxFrame &frame) {
+  if (frame.type != PacketType(InternalPacket::Time).encoded)
+    return;
+  PacketHeader header;
+  if (!PacketHeader::decode(frame.data, frame.len, header))
+    return;
+  uint8_t *probePtr = frame.data + PacketHeader::Size +
+                      PacketHeader::extensionSize(header.flags);
+  if (probePtr[0] == TimeProbe::Request)
+    TimeProbe::putUs(probePtr + TimeProbe::OriginOffset,
+                     static_cast<uint32_t>(micros()));
+  else
+    TimeProbe::putUs(probePtr + TimeProbe::TransmitOffset, networkTime());
+  finishFrame(frame.data, header);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleTimeProbe(UniqueID sender, const uint8_t *dataPtr,
+                                     size_t len, uint32_t rxUs) {
+  if (len != TimeProbe::Size) {
+    ESPNOW_LOGW("Invalid time probe\n");
+    return;
+  }
+  TimeProbe probe = TimeProbe::decode(dataPtr);
+  if (probe.kind == TimeProbe::Request) {
+    {
+      std::lock_guard<std::mutex> lock(timeLock);
+      probe.receiveUs = networkTimeAt(rxUs);
     }
-    delay(1000);
+    probe.kind = TimeProbe::Response;
+    uint8_t data[TimeProbe::Size];
+    probe.encode(data); // transmitUs is written by stampTimeProbe
+    sendPacket(sender, InternalPacket::Time, data, sizeof(data));
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(timeLock);
+  const size_t id = static_cast<size_t>(sender);
+  if (!timePeers || !timePeers[id].pending || timePeers[id].seq != probe.seq)
+    return; // Unsolicited or superseded
+  TimePeer &peer = timePeers[id];
+  peer.pending = false;
+
+  // t1..t4: request sent, received, response sent, received
+  const int32_t roundTripUs = static_cast<int32_t>(rxUs - probe.originUs);
+  const int32_t heldUs =
+      static_cast<int32_t>(probe.transmitUs - probe.receiveUs);
+  const uint32_t sampleUs =
+      roundTripUs > heldUs ? static_cast<uint32_t>(roundTripUs - heldUs) : 0;
+  if (peer.samples == 0) {
+    peer.srttUs = sampleUs;
+    peer.rttVarUs = sampleUs / 2;
+    peer.minRttUs = sampleUs;
+  } else {
+    const uint32_t error = (sampleUs > peer.srttUs) ? sampleUs - peer.srttUs
+                                                    : peer.srttUs - sampleUs;
+    peer.rttVarUs = (3 * peer.rttVarUs + error) / 4;
+    peer.srttUs = (7 * peer.srttUs + sampleUs) / 8;
+    if (sampleUs < peer.minRttUs)
+      peer.minRttUs = sampleUs;
+  }
+  peer.lastRttUs = sampleUs;
+  peer.samples++;
+
+  if (timeSyncEnabled && sender == timeReference) {
+    const int64_t offsetUs =
+        (static_cast<int64_t>(static_cast<int32_t>(probe.receiveUs -
+                                                   probe.originUs)) +
+         static_cast<int32_t>(probe.transmitUs - rxUs)) /
+        2;
+    addClockSample(rxUs, static_cast<int32_t>(offsetUs), sampleUs);
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::addClockSample(uint32_t localUs, int32_t offsetUs,
+                                    uint32_t delayUs) {
+  ClockSample &sample = clockSamples[clockSampleNext];
+  sample.localUs = localUs;
+  sample.offsetUs = offsetUs;
+  sample.delayUs = delayUs;
+  clockSampleNext = (clockSampleNext + 1) % ClockFilterSize;
+  if (clockSampleCount < ClockFilterSize)
+    clockSampleCount++;
+  clockSamplesTotal++;
+
+  const ClockSample *best = &clockSamples[0];
+  for (size_t i = 1; i < clockSampleCount; ++i) {
+    if (clockSamples[i].delayUs < best->delayUs)
+      best = &clockSamples[i];
+  }
+  if (clockSynced && static_cast<int32_t>(best->localUs - clockAnchorUs) <= 0)
+    return; // Still steering by this sample
+
+  if (!clockSynced) {
+    driftBaseUs = best->localUs;
+    driftBaseOffsetUs = best->offsetUs;
+  } else if (best->localUs - driftBaseUs >= DriftIntervalUs) {
+    const float measuredPpm =
+        static_cast<float>(best->offsetUs - driftBaseOffsetUs) * 1e6f /
+        static_cast<float>(best->localUs - driftBaseUs);
+    clockDriftPpm = clockDriftKnown
+                        ? clockDriftPpm + (measuredPpm - clockDriftPpm) / 4
+                        : measuredPpm;
+    clockDriftKnown = true;
+    driftBaseUs = best->localUs;
+    driftBaseOffsetUs = best->offsetUs;
   }
+  clockOffsetUs = best->offsetUs;
+  clockAnchorUs = best->localUs;
+  clockSynced = true;
+}
 
-  if (pairingState == PairingState::Timeout) {
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableRouting(uint32_t beaconIntervalMs, uint8_t ttl) {
+  if (beaconIntervalMs == 0 || ttl == 0 || ttl > MaxRouteHops)
     return false;
+  std::lock_guard<std::mutex> lock(routeLock);
+  if (!routes)
+    routes.reset(new RouteEntry[DeviceCount]());
+  routeBeaconMs = beaconIntervalMs;
+  routeTtl = ttl;
+  routeLastBeaconMs = static_cast<uint32_t>(millis()) - beaconIntervalMs;
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::nextHop(UniqueID targetID, UniqueID &hopID,
+                             const uint8_t *&hopMac) {
+  const size_t id = static_cast<size_t>(targetID);
+  {
+    std::lock_guard<std::mutex> lock(routeLock);
+    if (!routes || id >= DeviceCount || routes[id].hops == 0)
+      return false;
+    hopID = routes[id].nextHop;
   }
-  registerComms(targetUniqueID, false, encrypt); // Re-register with actual MAC
+  hopMac = registry->getDeviceMac(hopID);
+  return hopMac != nullptr;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::getRoute(UniqueID targetID, UniqueID &nextHopID,
+                              uint8_t &hops) {
+  const size_t id = static_cast<size_t>(targetID);
+  std::lock_guard<std::mutex> lock(routeLock);
+  if (!routes || id >= DeviceCount || routes[id].hops == 0)
+    return false;
+  nextHopID = routes[id].nextHop;
+  hops = routes[id].hops;
   return true;
 }
 
 HANDLER_TEMPLATE
-void HANDLER_PARAMS::onDataRecv(const uint8_t *macAddrPtr,
-                                const uint8_t *dataPtr, int data_len) {
-  // printf("Data received\n");
-  if (!instance) {
-    printf("[ESPNowHandler] Instance is null\n");
-    return; // Safety check
+typename HANDLER_PARAMS::RouteStats HANDLER_PARAMS::getRouteStats() {
+  RouteStats stats = {};
+  {
+    std::lock_guard<std::mutex> lock(routeLock);
+    for (size_t i = 0; routes && i < DeviceCount; ++i)
+      stats.routes += routes[i].hops > 0 ? 1 : 0;
+  }
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    stats.originated = routeOriginated;
+    stats.forwarded = routeForwarded;
   }
+  stats.delivered = routeDelivered;
+  stats.ttlExpired = counters.dropCount(EspNowDrop::TtlExpired);
+  stats.noRoute = counters.dropCount(EspNowDrop::NoRoute);
+  stats.badOrigin = counters.dropCount(EspNowDrop::BadOrigin);
+  memcpy(stats.deliveredByHops, routeDeliveredByHops,
+         sizeof(routeDeliveredByHops));
+  return stats;
+}
 
-  if (data_len < sizeof(PacketHeader)) {
-    printf("[ESPNowHandler] Data length too small: %d\n", data_len);
-    return; // Not enough data for header
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::acceptOrigin(UniqueID origin, UniqueID relay) {
+  if (origin == relay)
+    return true; // Sent to us directly, authenticated by its MAC
+  if (registry->getDeviceMac(origin) != nullptr)
+    return false; // In range: it would have sent to us directly
+  std::lock_guard<std::mutex> lock(routeLock);
+  const RouteEntry &route = routes[static_cast<size_t>(origin)];
+  return route.hops > 0 && route.nextHop == relay;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::forwardFrame(const uint8_t *dataPtr, size_t len,
+                                  const PacketHeader &header,
+                                  const uint8_t *routePtr) {
+  const UniqueID targetID = static_cast<UniqueID>(routePtr[1]);
+  if ((routePtr[2] & 0x0F) <= 1) {
+    counters.countDrop(EspNowDrop::TtlExpired);
+    return;
+  }
+  UniqueID hopID = targetID;
+  const uint8_t *hopMac = registry->getDeviceMac(targetID);
+  if (hopMac == nullptr && !nextHop(targetID, hopID, hopMac)) {
+    counters.countDrop(EspNowDrop::NoRoute);
+    return;
   }
 
-  PacketHeader header;
-  memcpy(&header, dataPtr, sizeof(PacketHeader));
+  std::unique_lock<std::mutex> lock(txLock);
+  TxFrame *frame = acquireTxFrame(lock, header.type);
+  if (frame == nullptr) {
+    counters.countDrop(EspNowDrop::TxQueueFull);
+    return;
+  }
+  if (!ensurePeer(hopID, hopMac))
+    return;
+  memcpy(frame->mac, hopMac, 6);
+  frame->target = hopID;
+  frame->hop = hopID;
+  frame->type = header.type;
+  frame->len = static_cast<uint8_t>(len);
+  memcpy(frame->data, dataPtr, len);
+  const size_t ttlOffset = (routePtr - dataPtr) + 2;
+  frame->data[2] = static_cast<uint8_t>(selfID); // Header sender
+  frame->data[ttlOffset] += 0x10 - 1; // One more relay, one less hop to go
+  finishFrame(frame->data, header);
+  routeForwarded++;
+  submitTxFrame(*frame);
+}
 
-  if (header.type == PacketType(InternalPacket::Discovery).encoded) {
-    instance->handleDiscoveryPacket(macAddrPtr, dataPtr);
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleRouteBeacon(UniqueID sender, const uint8_t *dataPtr,
+                                       size_t len) {
+  std::lock_guard<std::mutex> lock(routeLock);
+  if (!routes || len % RouteEntrySize != 0)
     return;
+  const uint32_t now = static_cast<uint32_t>(millis());
+  RouteEntry &neighbor = routes[static_cast<size_t>(sender)];
+  neighbor.nextHop = sender; // Heard directly, so one hop away
+  neighbor.hops = 1;
+  neighbor.heardMs = now;
+  for (size_t offset = 0; offset < len; offset += RouteEntrySize) {
+    const size_t id = dataPtr[offset];
+    const uint8_t hops = static_cast<uint8_t>(dataPtr[offset + 1] + 1);
+    const UniqueID via = static_cast<UniqueID>(dataPtr[offset + 2]);
+    if (id >= DeviceCount || static_cast<UniqueID>(id) == selfID ||
+        via == selfID || hops > MaxRouteHops)
+      continue; // Ours, through us (split horizon) or too far
+    RouteEntry &route = routes[id];
+    if (route.hops == 0 || hops <= route.hops || route.nextHop == sender) {
+      route.nextHop = sender;
+      route.hops = hops;
+      route.heardMs = now;
+    }
   }
+}
 
-  // Bounds check for callback array
-  if (header.type >= PacketCount) {
-    printf("[ESPNowHandler] Header type out of bounds: %d\n", header.type);
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceRouting() {
+  uint8_t beacon[ESP_NOW_MAX_DATA_LEN];
+  size_t len = 0;
+  {
+    std::lock_guard<std::mutex> lock(routeLock);
+    const uint32_t now = static_cast<uint32_t>(millis());
+    if (!routes || now - routeLastBeaconMs < routeBeaconMs)
+      return;
+    routeLastBeaconMs = now;
+    const size_t room = payloadRoom(0) / RouteEntrySize * RouteEntrySize;
+    for (size_t id = 0; id < DeviceCount && len + RouteEntrySize <= room;
+         ++id) {
+      RouteEntry &route = routes[id];
+      if (route.hops > 0 && now - route.heardMs > 3 * routeBeaconMs)
+        route.hops = 0; // Not heard of for three beacons
+      if (route.hops > 0) {
+        beacon[len++] = static_cast<uint8_t>(id);
+        beacon[len++] = route.hops;
+        beacon[len++] = static_cast<uint8_t>(route.nextHop);
+      }
+    }
+  }
+  if (!broadcastPeerAdded) { // Sent even when empty, so neighbors hear us
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, BroadCastMac, 6);
+    const esp_err_t added = esp_now_add_peer(&peerInfo);
+    broadcastPeerAdded = (added == ESP_OK || added == ESP_ERR_ESPNOW_EXIST);
+  }
+  // Addressed to ourselves like a group broadcast: no single peer
+  PacketHeader header = {0, PacketType(InternalPacket::Route).encoded, selfID,
+                         static_cast<uint8_t>(len)};
+  queueFrame(selfID, BroadCastMac, header, nullptr, 0, beacon);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::enableRpc(PacketType type) {
+  const uint8_t index = type.encoded;
+  if (index >= PacketCount)
+    return false;
+  if (rpcTypes[index])
+    return true;
+  if (packetCallbacks[index]) {
+    ESPNOW_LOGW("Packet type %d has a callback, not enabled for RPC\n",
+                index);
+    return false;
+  }
+  packetCallbacks[index] = [this, index](const uint8_t *dataPtr, size_t len,
+                                         UniqueID sender) {
+    handleRpc(index, dataPtr, len, sender);
+  };
+  rpcTypes[index] = true;
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::callbackAllowed(uint8_t type) const {
+  if (type >= PacketCount || !rpcTypes[type])
+    return true;
+  ESPNOW_LOGW("Packet type %d carries RPC frames, callback refused\n", type);
+  return false;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::registerRpcHandler(PacketType requestType,
+                                        RpcHandler handler) {
+  if (!enableRpc(requestType))
+    return false;
+  rpcHandlers[requestType.encoded] = handler;
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::startRpc(UniqueID targetID, PacketType packetType,
+                              const uint8_t *request, size_t len,
+                              uint32_t timeoutMs, const RpcCallback &callback,
+                              uint8_t &slotOut) {
+  const uint8_t type = packetType.encoded;
+  if (type >= PacketCount || len > MaxRpcPayloadSize)
+    return false;
+  if (!rpcTypes[type]) {
+    ESPNOW_LOGW("Packet type %d not enabled for RPC\n", type);
+    return false;
+  }
+
+  uint8_t frame[RpcHeaderSize + MaxRpcPayloadSize];
+  {
+    std::lock_guard<std::mutex> lock(rpcLock);
+    if (!rpcSlots)
+      rpcSlots.reset(new RpcSlot[RpcSlots]());
+    size_t free = RpcSlots;
+    for (size_t i = 0; i < RpcSlots && free == RpcSlots; ++i)
+      free = rpcSlots[i].inUse ? free : i;
+    if (free == RpcSlots) {
+      ESPNOW_LOGW("All %u RPC slots pending, call dropped\n",
+                  static_cast<unsigned>(RpcSlots));
+      return false;
+    }
+    RpcSlot &slot = rpcSlots[free];
+    slot.inUse = true;
+    slot.done = false;
+    slot.status = EspNowRpcStatus::Pending;
+    slot.target = targetID;
+    slot.type = type;
+    slot.id = rpcNextId++;
+    slot.startMs = static_cast<uint32_t>(millis());
+    slot.timeoutMs = timeoutMs;
+    slot.callback = callback;
+    slot.len = 0;
+    slotOut = static_cast<uint8_t>(free);
+    frame[0] = static_cast<uint8_t>(RpcKind::Request);
+    frame[1] = slot.id;
+  }
+  if (len > 0)
+    memcpy(frame + RpcHeaderSize, request, len);
+  // Set up first: the reply may arrive before sendPacket returns
+  if (sendPacket(targetID, packetType, frame, RpcHeaderSize + len))
+    return true;
+  std::lock_guard<std::mutex> lock(rpcLock);
+  rpcSlots[slotOut].inUse = false;
+  rpcSlots[slotOut].callback = nullptr;
+  return false;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::RpcCall
+HANDLER_PARAMS::callRpc(UniqueID targetID, PacketType requestType,
+                        const uint8_t *request, size_t len,
+                        uint32_t timeoutMs) {
+  RpcCall call = {static_cast<uint8_t>(RpcSlots), 0};
+  uint8_t slot;
+  if (!startRpc(targetID, requestType, request, len, timeoutMs, nullptr,
+                slot))
+    return call;
+  std::lock_guard<std::mutex> lock(rpcLock);
+  call.slot = slot;
+  call.id = rpcSlots[slot].id;
+  return call;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::callRpc(UniqueID targetID, PacketType requestType,
+                             const uint8_t *request, size_t len,
+                             uint32_t timeoutMs, RpcCallback callback) {
+  uint8_t slot;
+  return callback &&
+         startRpc(targetID, requestType, request, len, timeoutMs, callback,
+                  slot);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleRpc(uint8_t type, const uint8_t *dataPtr,
+                               size_t len, UniqueID sender) {
+  if (len < RpcHeaderSize ||
+      dataPtr[0] > static_cast<uint8_t>(RpcKind::Error)) {
+    ESPNOW_LOGW("Malformed RPC frame of type %d\n", type);
+    counters.countDrop(EspNowDrop::BadRpc);
     return;
   }
+  const RpcKind kind = static_cast<RpcKind>(dataPtr[0]);
+  const uint8_t id = dataPtr[1];
+  const uint8_t *body = dataPtr + RpcHeaderSize;
+  const size_t bodyLen = len - RpcHeaderSize;
 
-  // Check if callback is registered
-  if (!instance->packetCallbacks[header.type]) {
-    printf("[ESPNowHandler] No callback registered for header type: %d\n",
-           header.type);
+  if (kind == RpcKind::Request) {
+    uint8_t reply[RpcHeaderSize + MaxRpcPayloadSize];
+    size_t replyLen = 0;
+    bool ok = false;
+    if (rpcHandlers[type]) {
+      ok = rpcHandlers[type](body, bodyLen, sender, reply + RpcHeaderSize,
+                             replyLen);
+      if (replyLen > MaxRpcPayloadSize) {
+        ESPNOW_LOGE("RPC reply of %u bytes too large\n",
+                    static_cast<unsigned>(replyLen));
+        ok = false;
+      }
+    }
+    if (!ok)
+      replyLen = 0;
+    reply[0] = static_cast<uint8_t>(ok ? RpcKind::Reply : RpcKind::Error);
+    reply[1] = id;
+    rpcServed++;
+    sendPacket(sender, PacketType(static_cast<UserPacket>(type)), reply,
+               RpcHeaderSize + replyLen);
     return;
   }
 
-  // Pass data after the header to the callback
-  const uint8_t *payloadPtr = dataPtr + sizeof(PacketHeader);
-  instance->packetCallbacks[header.type](payloadPtr, header.len, header.sender);
+  const EspNowRpcStatus status =
+      kind == RpcKind::Reply ? EspNowRpcStatus::Ok : EspNowRpcStatus::Error;
+  RpcCallback callback;
+  {
+    std::lock_guard<std::mutex> lock(rpcLock);
+    RpcSlot *slot = nullptr;
+    for (size_t i = 0; rpcSlots && i < RpcSlots && slot == nullptr; ++i) {
+      RpcSlot &candidate = rpcSlots[i];
+      if (candidate.inUse && !candidate.done && candidate.id == id &&
+          candidate.type == type && candidate.target == sender)
+        slot = &candidate;
+    }
+    if (slot == nullptr) {
+      rpcLate++; // Timed out or cancelled already
+      return;
+    }
+    if (status == EspNowRpcStatus::Ok)
+      rpcCompleted++;
+    else
+      rpcErrors++;
+    if (slot->callback) {
+      callback = slot->callback;
+      slot->callback = nullptr;
+      slot->inUse = false;
+    } else {
+      slot->done = true;
+      slot->status = status;
+      slot->len = static_cast<uint8_t>(bodyLen);
+      memcpy(slot->reply, body, bodyLen);
+    }
+  }
+  if (callback)
+    callback(status, body, bodyLen, sender);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceRpc() {
+  RpcCallback expired[RpcSlots];
+  UniqueID targets[RpcSlots];
+  size_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(rpcLock);
+    const uint32_t now = static_cast<uint32_t>(millis());
+    for (size_t i = 0; rpcSlots && i < RpcSlots; ++i) {
+      RpcSlot &slot = rpcSlots[i];
+      if (!slot.inUse || slot.done || now - slot.startMs < slot.timeoutMs)
+        continue;
+      rpcTimeouts++;
+      if (slot.callback) {
+        expired[count] = slot.callback;
+        targets[count++] = slot.target;
+        slot.callback = nullptr;
+        slot.inUse = false;
+      } else {
+        slot.done = true;
+        slot.status = EspNowRpcStatus::Timeout;
+        slot.len = 0;
+      }
+    }
+  }
+  for (size_t i = 0; i < count; ++i)
+    expired[i](EspNowRpcStatus::Timeout, nullptr, 0, targets[i]);
+}
+
+HANDLER_TEMPLATE
+EspNowRpcStatus HANDLER_PARAMS::rpcStatus(RpcCall call) {
+  std::lock_guard<std::mutex> lock(rpcLock);
+  if (!rpcSlots || call.slot >= RpcSlots)
+    return EspNowRpcStatus::Invalid;
+  const RpcSlot &slot = rpcSlots[call.slot];
+  if (!slot.inUse || slot.id != call.id || slot.callback)
+    return EspNowRpcStatus::Invalid;
+  return slot.done ? slot.status : EspNowRpcStatus::Pending;
 }
 
 HANDLER_TEMPLATE
-void HANDLER_PARAMS::onDataSent(const uint8_t *macAddrPtr,
-                                esp_now_send_status_t status) {
-  return; // Possibly implement something here later
+EspNowRpcStatus HANDLER_PARAMS::takeRpcReply(RpcCall call, uint8_t *reply,
+                                             size_t &len) {
+  len = 0;
+  std::lock_guard<std::mutex> lock(rpcLock);
+  if (!rpcSlots || call.slot >= RpcSlots)
+    return EspNowRpcStatus::Invalid;
+  RpcSlot &slot = rpcSlots[call.slot];
+  if (!slot.inUse || slot.id != call.id || slot.callback)
+    return EspNowRpcStatus::Invalid;
+  if (!slot.done)
+    return EspNowRpcStatus::Pending;
+  if (reply != nullptr) {
+    memcpy(reply, slot.reply, slot.len);
+    len = slot.len;
+  }
+  slot.inUse = false;
+  return slot.status;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::cancelRpc(RpcCall call) {
+  std::lock_guard<std::mutex> lock(rpcLock);
+  if (!rpcSlots || call.slot >= RpcSlots)
+    return;
+  RpcSlot &slot = rpcSlots[call.slot];
+  if (slot.inUse && slot.id == call.id && !slot.callback)
+    slot.inUse = false;
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::RpcStats HANDLER_PARAMS::getRpcStats() {
+  RpcStats stats = {};
+  std::lock_guard<std::mutex> lock(rpcLock);
+  for (size_t i = 0; rpcSlots && i < RpcSlots; ++i)
+    stats.pending += rpcSlots[i].inUse ? 1 : 0;
+  stats.completed = rpcCompleted;
+  stats.errors = rpcErrors;
+  stats.timeouts = rpcTimeouts;
+  stats.late = rpcLate;
+  stats.served = rpcServed;
+  return stats;
+}
+
+HANDLER_TEMPLATE
+size_t HANDLER_PARAMS::freeTxSlots() const {
+  size_t free = 0;
+  for (size_t i = 0; i < TxQueueDepth; ++i)
+    free += txFrames[i].state == TxState::Free ? 1 : 0;
+  return free;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::openStream(UniqueID targetID, uint8_t streamId,
+                                uint32_t total, StreamSource source,
+                                uint32_t offset) {
+  if (!source || targetID == selfID ||
+      static_cast<size_t>(targetID) >= DeviceCount || offset > total)
+    return false;
+  std::lock_guard<std::mutex> lock(streamLock);
+  if (!streamsTx)
+    streamsTx.reset(new StreamTx[StreamSlots]());
+  StreamTx *stream = nullptr;
+  for (size_t i = 0; i < StreamSlots; ++i) {
+    StreamTx &candidate = streamsTx[i];
+    if (candidate.inUse && candidate.target == targetID &&
+        candidate.id == streamId)
+      return false; // Already open
+    if (!candidate.inUse && stream == nullptr)
+      stream = &candidate;
+  }
+  if (stream == nullptr) {
+    ESPNOW_LOGW("All %u stream slots busy\n",
+                static_cast<unsigned>(StreamSlots));
+    return false;
+  }
+  stream->inUse = true;
+  stream->open = false;
+  stream->target = targetID;
+  stream->id = streamId;
+  stream->stalls = 0;
+  stream->total = total;
+  stream->base = offset;
+  stream->next = offset;
+  stream->sent = offset;
+  stream->resentAt = UINT32_MAX;
+  stream->progressMs = static_cast<uint32_t>(millis());
+  stream->source = source;
+  {
+    std::lock_guard<std::mutex> txGuard(txLock);
+    streamLosses[stream - streamsTx.get()] = {targetID, streamId, UINT32_MAX};
+  }
+  if (!sendStreamOpen(*stream)) {
+    stream->inUse = false;
+    stream->source = nullptr;
+    return false;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::sendStreamOpen(StreamTx &stream) {
+  uint8_t open[StreamOpenSize];
+  open[0] = static_cast<uint8_t>(StreamKind::Open);
+  open[1] = stream.id;
+  TimeProbe::putUs(open + 2, stream.total);
+  TimeProbe::putUs(open + 6, stream.base);
+  open[10] = stream.base > 0 ? StreamResume : 0;
+  PacketHeader header = {0, PacketType(InternalPacket::Stream).encoded, selfID,
+                         sizeof(open)};
+  return queueFrame(stream.target, registry->getDeviceMac(stream.target),
+                    header, nullptr, 0, open);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::closeStream(UniqueID targetID, uint8_t streamId) {
+  std::lock_guard<std::mutex> lock(streamLock);
+  for (size_t i = 0; streamsTx && i < StreamSlots; ++i) {
+    StreamTx &stream = streamsTx[i];
+    if (stream.inUse && stream.target == targetID && stream.id == streamId) {
+      stream.inUse = false;
+      stream.source = nullptr;
+    }
+  }
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::fillStream(StreamTx &stream) {
+  const uint8_t *targetMac = registry->getDeviceMac(stream.target);
+  const size_t room =
+      payloadRoom(targetMac == nullptr ? PacketHeader::RouteFlag : 0);
+  if (!stream.open || room <= StreamHeaderSize)
+    return true;
+  const size_t chunk = room - StreamHeaderSize;
+  uint32_t lost;
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    StreamLoss &loss = streamLosses[&stream - streamsTx.get()];
+    lost = loss.lostAt;
+    loss.lostAt = UINT32_MAX;
+  }
+  if (lost >= stream.base && lost < stream.next) {
+    rewindStream(stream, lost);
+    streamFastResends++;
+  }
+  size_t slots;
+  {
+    std::lock_guard<std::mutex> lock(txLock);
+    const size_t free = freeTxSlots();
+    // Leave a slot for other traffic, so queueFrame never waits
+    slots = free > TxReservedSlots + 1 ? free - TxReservedSlots - 1 : 0;
+  }
+  uint8_t payload[ESP_NOW_MAX_DATA_LEN];
+  while (slots > 0 && stream.next < stream.total &&
+         stream.next - stream.base < StreamWindow * chunk) {
+    const uint32_t left = stream.total - stream.next;
+    const size_t len = left < chunk ? left : chunk;
+    if (!stream.source(stream.next, payload + StreamHeaderSize, len))
+      return false;
+    payload[0] = static_cast<uint8_t>(StreamKind::Data);
+    payload[1] = stream.id;
+    TimeProbe::putUs(payload + 2, stream.next);
+    PacketHeader header = {0, PacketType(InternalPacket::Stream).encoded,
+                           selfID,
+                           static_cast<uint8_t>(StreamHeaderSize + len)};
+    if (!queueFrame(stream.target, targetMac, header, nullptr, 0, payload))
+      break; // Retried from poll()
+    streamChunksSent++;
+    if (stream.next < stream.sent)
+      streamChunksResent++;
+    stream.next += static_cast<uint32_t>(len);
+    if (stream.next > stream.sent)
+      stream.sent = stream.next;
+    slots--;
+  }
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::noteStreamLoss(const TxFrame &frame,
+                                    const PacketHeader &header) {
+  const uint8_t *payload = frame.data + PacketHeader::Size +
+                           PacketHeader::extensionSize(header.flags);
+  if (payload[0] != static_cast<uint8_t>(StreamKind::Data))
+    return;
+  const uint32_t offset = TimeProbe::getUs(payload + 2);
+  for (size_t i = 0; i < StreamSlots; ++i) {
+    StreamLoss &loss = streamLosses[i];
+    if (loss.target == frame.target && loss.id == payload[1] &&
+        offset < loss.lostAt)
+      loss.lostAt = offset; // A stale match only costs an early resend
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::rewindStream(StreamTx &stream, uint32_t offset) {
+  stream.next = offset;
+  stream.resentAt = offset;
+  std::lock_guard<std::mutex> lock(txLock);
+  streamLosses[&stream - streamsTx.get()].lostAt = UINT32_MAX;
+  for (size_t i = 0; i < TxQueueDepth; ++i) {
+    TxFrame &frame = txFrames[i];
+    if (frame.state != TxState::Queued || frame.target != stream.target ||
+        frame.type != PacketType(InternalPacket::Stream).encoded)
+      continue;
+    PacketHeader header;
+    if (!PacketHeader::decode(frame.data, frame.len, header))
+      continue;
+    const uint8_t *payload = frame.data + PacketHeader::Size +
+                             PacketHeader::extensionSize(header.flags);
+    if (payload[0] == static_cast<uint8_t>(StreamKind::Data) &&
+        payload[1] == stream.id && TimeProbe::getUs(payload + 2) >= offset)
+      frame.state = TxState::Free; // Internal, so nothing to report
+  }
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::sendStreamAck(const StreamRx &stream, StreamKind kind) {
+  uint8_t ack[StreamHeaderSize];
+  ack[0] = static_cast<uint8_t>(kind);
+  ack[1] = stream.id;
+  TimeProbe::putUs(ack + 2, stream.next);
+  PacketHeader header = {0, PacketType(InternalPacket::Stream).encoded, selfID,
+                         sizeof(ack)};
+  queueFrame(stream.sender, registry->getDeviceMac(stream.sender), header,
+             nullptr, 0, ack);
+}
+
+HANDLER_TEMPLATE
+bool HANDLER_PARAMS::registerStreamSink(StreamSink sink) {
+  std::lock_guard<std::mutex> lock(streamLock);
+  if (!streamsRx)
+    streamsRx.reset(new StreamRx[StreamRxSlots]());
+  streamSink = sink;
+  return true;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::registerStreamCallback(StreamCallback callback) {
+  std::lock_guard<std::mutex> lock(streamLock);
+  streamCallback = callback;
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::handleStream(UniqueID sender, const uint8_t *dataPtr,
+                                  size_t len) {
+  if (len < StreamHeaderSize ||
+      dataPtr[0] > static_cast<uint8_t>(StreamKind::Gap) ||
+      (dataPtr[0] == static_cast<uint8_t>(StreamKind::Open) &&
+       len != StreamOpenSize) ||
+      (dataPtr[0] == static_cast<uint8_t>(StreamKind::Data) &&
+       len == StreamHeaderSize)) {
+    ESPNOW_LOGW("Malformed stream frame\n");
+    counters.countDrop(EspNowDrop::BadStream);
+    return;
+  }
+  const StreamKind kind = static_cast<StreamKind>(dataPtr[0]);
+  const uint8_t id = dataPtr[1];
+  const uint32_t offset = TimeProbe::getUs(dataPtr + 2);
+  const uint32_t now = static_cast<uint32_t>(millis());
+  std::unique_lock<std::mutex> lock(streamLock);
+
+  if (kind == StreamKind::Ack || kind == StreamKind::Gap) {
+    StreamTx *stream = nullptr;
+    for (size_t i = 0; streamsTx && i < StreamSlots; ++i) {
+      if (streamsTx[i].inUse && streamsTx[i].target == sender &&
+          streamsTx[i].id == id)
+        stream = &streamsTx[i];
+    }
+    if (stream == nullptr || offset > stream->total)
+      return; // Closed already, or not ours
+    if (!stream->open || offset > stream->base) {
+      if (!stream->open || offset > stream->next)
+        stream->next = offset; // The receiver's position wins
+      if (stream->sent < stream->next)
+        stream->sent = stream->next;
+      stream->open = true;
+      stream->base = offset;
+      stream->stalls = 0;
+      stream->progressMs = now;
+    }
+    if (kind == StreamKind::Gap && stream->next > offset &&
+        stream->resentAt != offset) {
+      rewindStream(*stream, offset); // Unless we went back there already
+      stream->progressMs = now;
+      streamFastResends++;
+    }
+    if (stream->base != stream->total)
+      return; // poll() sends the next chunks
+    stream->inUse = false;
+    stream->source = nullptr;
+    streamCompleted++;
+    const StreamCallback callback = streamCallback;
+    lock.unlock();
+    if (callback)
+      callback(sender, id, true, offset);
+    return;
+  }
+
+  if (!streamsRx || !streamSink) {
+    counters.countDrop(EspNowDrop::BadStream);
+    return; // Not receiving streams
+  }
+  // Finished streams free their slot but keep its fields, so a
+  // repeated last chunk or a resume can still be answered
+  StreamRx *stream = nullptr;
+  for (size_t i = 0; i < StreamRxSlots; ++i) {
+    StreamRx &candidate = streamsRx[i];
+    if (candidate.sender == sender && candidate.id == id &&
+        (candidate.inUse || candidate.next == candidate.total) &&
+        (stream == nullptr || candidate.inUse))
+      stream = &candidate;
+  }
+
+  if (kind == StreamKind::Open) {
+    const uint32_t total = TimeProbe::getUs(dataPtr + 2);
+    const uint32_t start = TimeProbe::getUs(dataPtr + 6);
+    const bool resume = (dataPtr[10] & StreamResume) != 0;
+    if (stream == nullptr || stream->total != total || !resume) {
+      if (stream == nullptr) { // A free slot, or the one idle longest
+        stream = &streamsRx[0];
+        for (size_t i = 1; i < StreamRxSlots && stream->inUse; ++i) {
+          if (!streamsRx[i].inUse ||
+              now - streamsRx[i].lastMs > now - stream->lastMs)
+            stream = &streamsRx[i];
+        }
+      }
+      stream->sender = sender;
+      stream->id = id;
+      stream->total = total;
+      stream->next = start <= total ? start : total;
+    }
+    stream->inUse = stream->next < stream->total;
+    stream->gapAcked = false;
+    stream->unacked = 0;
+    stream->lastMs = now;
+    sendStreamAck(*stream, StreamKind::Ack); // Resume from our position
+    return;
+  }
+
+  if (stream == nullptr) {
+    counters.countDrop(EspNowDrop::BadStream);
+    return; // Opened before we were tracking it
+  }
+  if (!stream->inUse) { // Our last ACK was lost
+    sendStreamAck(*stream, StreamKind::Ack);
+    return;
+  }
+  stream->lastMs = now;
+  const size_t chunkLen = len - StreamHeaderSize;
+  if (offset != stream->next || stream->next + chunkLen > stream->total) {
+    // A duplicate after a resend, or a gap: tell the sender where we are,
+    // once per gap so its window only goes back once
+    if (offset < stream->next)
+      sendStreamAck(*stream, StreamKind::Ack);
+    else if (!stream->gapAcked)
+      sendStreamAck(*stream, StreamKind::Gap);
+    stream->gapAcked = stream->gapAcked || offset > stream->next;
+    return;
+  }
+  const StreamSink sink = streamSink;
+  const StreamRx delivered = *stream;
+  stream->next += static_cast<uint32_t>(chunkLen);
+  stream->gapAcked = false;
+  streamBytesReceived += static_cast<uint32_t>(chunkLen);
+  const bool ack =
+      ++stream->unacked >= StreamAckEvery || stream->next == stream->total;
+  if (ack) {
+    stream->unacked = 0;
+    sendStreamAck(*stream, StreamKind::Ack);
+  }
+  stream->inUse = stream->next < stream->total;
+  lock.unlock();
+  sink(sender, id, delivered.next, dataPtr + StreamHeaderSize, chunkLen,
+       delivered.total);
+}
+
+HANDLER_TEMPLATE
+void HANDLER_PARAMS::serviceStreams() {
+  struct Ended {
+    UniqueID target;
+    uint8_t id;
+    uint32_t offset;
+  } ended[StreamSlots];
+  size_t endedCount = 0;
+  StreamCallback callback;
+  {
+    std::lock_guard<std::mutex> lock(streamLock);
+    const uint32_t now = static_cast<uint32_t>(millis());
+    for (size_t i = 0; streamsTx && i < StreamSlots; ++i) {
+      StreamTx &stream = streamsTx[i];
+      if (!stream.inUse)
+        continue;
+      const bool timedOut = now - stream.progressMs >= StreamRtoMs;
+      if (timedOut) {
+        stream.progressMs = now;
+        stream.stalls++;
+        if (stream.open) {
+          rewindStream(stream, stream.base);
+          streamTimeouts++;
+        }
+      }
+      bool sourceOk = true;
+      if (stream.stalls <= StreamMaxStalls) {
+        if (!stream.open && timedOut)
+          sendStreamOpen(stream); // Unanswered so far
+        sourceOk = fillStream(stream);
+      }
+      if (sourceOk && stream.stalls <= StreamMaxStalls)
+        continue;
+      ESPNOW_LOGW("Stream %u to device %u failed at offset %u\n", stream.id,
+                  static_cast<uint8_t>(stream.target),
+                  static_cast<unsigned>(stream.base));
+      ended[endedCount++] = {stream.target, stream.id, stream.base};
+      stream.inUse = false;
+      stream.source = nullptr;
+      streamFailed++;
+    }
+    callback = streamCallback;
+  }
+  for (size_t i = 0; callback && i < endedCount; ++i)
+    callback(ended[i].target, ended[i].id, false, ended[i].offset);
+}
+
+HANDLER_TEMPLATE
+typename HANDLER_PARAMS::StreamStats HANDLER_PARAMS::getStreamStats() {
+  StreamStats stats = {};
+  std::lock_guard<std::mutex> lock(streamLock);
+  for (size_t i = 0; streamsTx && i < StreamSlots; ++i)
+    stats.active += streamsTx[i].inUse ? 1 : 0;
+  stats.chunksSent = streamChunksSent;
+  stats.chunksResent = streamChunksResent;
+  stats.timeouts = streamTimeouts;
+  stats.fastResends = streamFastResends;
+  stats.bytesReceived = streamBytesReceived;
+  stats.completed = streamCompleted;
+  stats.failed = streamFailed;
+  return stats;
 }
 
 HANDLER_TEMPLATE
 bool HANDLER_PARAMS::handleDiscoveryPacket(const uint8_t *macAddrPtr,
-                                           const uint8_t *dataPtr) {
+                                           const uint8_t *dataPtr,
+                                           size_t len) {
+  if (len != sizeof(DiscoveryPacket)) {
+    ESPNOW_LOGW("Invalid discovery packet size: %u\n",
+                static_cast<unsigned>(len));
+    return false;
+  }
   DiscoveryPacket packet;
-  memcpy(&packet, dataPtr + sizeof(PacketHeader), sizeof(DiscoveryPacket));
+  memcpy(&packet, dataPtr, sizeof(DiscoveryPacket));
 
   uint8_t fields[3] = {static_cast<uint8_t>(packet.senderID),
                        static_cast<uint8_t>(packet.targetID),
@@ -356,34 +5208,49 @@ bool HANDLER_PARAMS::handleDiscoveryPacket(const uint8_t *macAddrPtr,
   const uint8_t checksum = calcChecksum(fields, sizeof(fields));
 
   if (checksum != packet.checksum) {
-    printf("[ESPNowHandler] Invalid checksum in discovery packet\n");
+    ESPNOW_LOGW("Invalid checksum in discovery packet\n");
     return false; // Invalid checksum
   }
 
   if (packet.targetID != selfID) {
-    printf("[ESPNowHandler] Discovery packet not for us (target ID %u)\n",
-           static_cast<uint8_t>(packet.targetID));
+    ESPNOW_LOGD("Discovery packet not for us (target ID %u)\n",
+                static_cast<uint8_t>(packet.targetID));
     return false; // Not for us
   }
 
-  printf("[ESPNowHandler] Adding device ID %u with MAC "
-         "%02X:%02X:%02X:%02X:%02X:%02X\n",
-         static_cast<uint8_t>(packet.senderID), macAddrPtr[0], macAddrPtr[1],
-         macAddrPtr[2], macAddrPtr[3], macAddrPtr[4], macAddrPtr[5]);
+  if (static_cast<size_t>(packet.senderID) >= DeviceCount) {
+    ESPNOW_LOGW("Discovery sender ID out of bounds: %u\n",
+                static_cast<uint8_t>(packet.senderID));
+    return false;
+  }
+
+  ESPNOW_LOGI("Adding device ID %u with MAC %02X:%02X:%02X:%02X:%02X:%02X\n",
+              static_cast<uint8_t>(packet.senderID), macAddrPtr[0],
+              macAddrPtr[1], macAddrPtr[2], macAddrPtr[3], macAddrPtr[4],
+              macAddrPtr[5]);
+  const uint8_t *knownMac = registry->getDeviceMac(packet.senderID);
+  const bool changed =
+      knownMac == nullptr || memcmp(knownMac, macAddrPtr, 6) != 0;
   bool addSuccess = registry->addDevice(packet.senderID, macAddrPtr);
-  if (addSuccess)
-    registry->saveToFlash();
-  printf("[ESPNowHandler] External device registration: %s\n",
-         addSuccess ? "success" : "failure");
-  pairingState = PairingState::Paired;
-  if (packet.state == PairingState::Waiting)
-    sendDiscoveryPacket(packet.senderID); // Acknowledge by sending back
+  if (addSuccess && changed) { // Saved later from poll(), not here
+    registryChangedMs = millis();
+    registryDirty = true;
+  }
+  ESPNOW_LOGI("External device registration: %s\n",
+              addSuccess ? "success" : "failure");
+  if (pairingSlots) { // Completes our own pairing with the sender
+    PairingState expected = PairingState::Waiting;
+    pairingSlots[static_cast<size_t>(packet.senderID)]
+        .state.compare_exchange_strong(expected, PairingState::Paired);
+  }
+  if (packet.state == PairingState::Waiting) // Acknowledge by sending back
+    sendDiscoveryPacket(packet.senderID, PairingState::Paired);
   return addSuccess;
 }
 
 HANDLER_TEMPLATE
-void HANDLER_PARAMS::sendDiscoveryPacket(UniqueID targetUniqueID) {
-  PairingState pairingStateLocal = pairingState.load();
+void HANDLER_PARAMS::sendDiscoveryPacket(UniqueID targetUniqueID,
+                                         PairingState pairingStateLocal) {
   uint8_t fields[3] = {static_cast<uint8_t>(selfID),
                        static_cast<uint8_t>(targetUniqueID),
                        static_cast<uint8_t>(pairingStateLocal)};
@@ -0,0 +1,241 @@
+#ifndef ESPNOWLOG_H
+#define ESPNOWLOG_H
+
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#define ESPNOW_LOG_LEVEL_NONE 0
+#define ESPNOW_LOG_LEVEL_ERROR 1
+#define ESPNOW_LOG_LEVEL_WARN 2
+#define ESPNOW_LOG_LEVEL_INFO 3
+#define ESPNOW_LOG_LEVEL_DEBUG 4
+
+#ifndef ESPNOW_LOG_LEVEL
+#define ESPNOW_LOG_LEVEL ESPNOW_LOG_LEVEL_INFO
+#endif
+// Messages above this level are compiled out, arguments included.
+// Set it with a build flag, e.g. -DESPNOW_LOG_LEVEL=ESPNOW_LOG_LEVEL_WARN.
+
+#ifndef ESPNOW_LOG_RECORD_SIZE
+#define ESPNOW_LOG_RECORD_SIZE 96
+#endif
+// Longest message kept in deferred mode, terminator included; longer
+// messages are truncated
+
+#define ESPNOW_LOG_AT(level, format, ...)                                      \
+  EspNowLog::instance().write(level, "[ESPNowHandler] " format, ##__VA_ARGS__)
+
+#if ESPNOW_LOG_LEVEL >= ESPNOW_LOG_LEVEL_ERROR
+#define ESPNOW_LOGE(format, ...)                                               \
+  ESPNOW_LOG_AT(ESPNOW_LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define ESPNOW_LOGE(format, ...) ((void)0)
+#endif
+
+#if ESPNOW_LOG_LEVEL >= ESPNOW_LOG_LEVEL_WARN
+#define ESPNOW_LOGW(format, ...)                                               \
+  ESPNOW_LOG_AT(ESPNOW_LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define ESPNOW_LOGW(format, ...) ((void)0)
+#endif
+
+#if ESPNOW_LOG_LEVEL >= ESPNOW_LOG_LEVEL_INFO
+#define ESPNOW_LOGI(format, ...)                                               \
+  ESPNOW_LOG_AT(ESPNOW_LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define ESPNOW_LOGI(format, ...) ((void)0)
+#endif
+
+#if ESPNOW_LOG_LEVEL >= ESPNOW_LOG_LEVEL_DEBUG
+#define ESPNOW_LOGD(format, ...)                                               \
+  ESPNOW_LOG_AT(ESPNOW_LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define ESPNOW_LOGD(format, ...) ((void)0)
+#endif
+
+// Output for the handler's diagnostics. By default every message is
+// printed where it happens. In deferred mode, messages are formatted into a
+// preallocated lock-free ring instead, and printed later by drain() or the
+// drain task, so a radio callback never waits on the serial port. Messages
+// logged while the ring is full are dropped and counted.
+class EspNowLog {
+public:
+  using Sink = void (*)(uint8_t level, const char *message);
+  // Receives each complete message, newline included
+
+  static EspNowLog &instance() {
+    static EspNowLog log;
+    return log;
+  }
+  // The log the handler writes to
+
+  EspNowLog() = default;
+  EspNowLog(const EspNowLog &) = delete;
+  EspNowLog &operator=(const EspNowLog &) = delete;
+
+  void write(uint8_t level, const char *format, ...)
+      __attribute__((format(printf, 3, 4)));
+
+  void setSink(Sink sink);
+  // Replaces the default sink, which prints to stdout. nullptr
+  // restores it.
+
+  bool enableDeferred(size_t records = 32);
+  // Opt-in, once: allocates records slots of
+  // ESPNOW_LOG_RECORD_SIZE bytes. Returns false if already enabled.
+
+  size_t drain(size_t maxRecords = SIZE_MAX);
+  // Passes up to maxRecords deferred messages to the sink and
+  // returns how many. Call from one task only.
+
+  uint32_t droppedRecords() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+#ifdef ESP_PLATFORM
+  bool startDrainTask(UBaseType_t priority = tskIDLE_PRIORITY + 1,
+                      uint32_t stackSize = 3072, uint32_t periodMs = 20);
+  // Starts a task that drains the ring every periodMs. Keep its
+  // priority below the tasks that send and receive.
+#endif
+
+private:
+  struct Record {
+    std::atomic<size_t> sequence;
+    uint8_t level;
+    char text[ESPNOW_LOG_RECORD_SIZE];
+  };
+
+  static void printSink(uint8_t, const char *message) {
+    fputs(message, stdout);
+  }
+
+  bool push(uint8_t level, const char *format, va_list args);
+  // Multiple producers: claims the next slot by advancing head,
+  // fills it and publishes it through its sequence number
+
+  Sink sink = printSink;
+  std::unique_ptr<Record[]> records;
+  std::atomic<bool> deferred{false};
+  size_t mask = 0;
+  std::atomic<size_t> head{0};
+  size_t tail = 0;
+  std::atomic<uint32_t> dropped{0};
+  uint32_t reportedDrops = 0;
+#ifdef ESP_PLATFORM
+  TaskHandle_t drainTask = nullptr;
+  uint32_t drainPeriodMs = 20;
+  static void drainTaskLoop(void *arg);
+#endif
+};
+
+inline void EspNowLog::write(uint8_t level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (deferred.load(std::memory_order_acquire)) {
+    if (!push(level, format, args))
+      dropped.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    char text[ESPNOW_LOG_RECORD_SIZE * 2];
+    vsnprintf(text, sizeof(text), format, args);
+    sink(level, text);
+  }
+  va_end(args);
+}
+
+inline void EspNowLog::setSink(Sink newSink) {
+  sink = (newSink != nullptr) ? newSink : printSink;
+}
+
+inline bool EspNowLog::enableDeferred(size_t minRecords) {
+  if (records || minRecords == 0)
+    return false;
+  size_t capacity = 1;
+  while (capacity < minRecords)
+    capacity <<= 1;
+  records.reset(new Record[capacity]);
+  for (size_t i = 0; i < capacity; ++i)
+    records[i].sequence.store(i, std::memory_order_relaxed);
+  mask = capacity - 1;
+  deferred.store(true, std::memory_order_release);
+  return true;
+}
+
+inline bool EspNowLog::push(uint8_t level, const char *format, va_list args) {
+  size_t position = head.load(std::memory_order_relaxed);
+  Record *record;
+  for (;;) {
+    record = &records[position & mask];
+    const size_t sequence = record->sequence.load(std::memory_order_acquire);
+    const intptr_t lag =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+    if (lag == 0) {
+      if (head.compare_exchange_weak(position, position + 1,
+                                     std::memory_order_relaxed))
+        break;
+    } else if (lag < 0) {
+      return false; // Full: the slot still holds an undrained record
+    } else {
+      position = head.load(std::memory_order_relaxed);
+    }
+  }
+  record->level = level;
+  const int len = vsnprintf(record->text, sizeof(record->text), format, args);
+  if (len >= static_cast<int>(sizeof(record->text)))
+    record->text[sizeof(record->text) - 2] = '\n'; // Keep the line ending
+  record->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+inline size_t EspNowLog::drain(size_t maxRecords) {
+  if (!records)
+    return 0;
+  size_t drained = 0;
+  while (drained < maxRecords) {
+    Record &record = records[tail & mask];
+    if (record.sequence.load(std::memory_order_acquire) != tail + 1)
+      break; // Empty, or the producer is still writing it
+    sink(record.level, record.text);
+    record.sequence.store(tail + mask + 1, std::memory_order_release);
+    tail++;
+    drained++;
+  }
+  const uint32_t lost = dropped.load(std::memory_order_relaxed);
+  if (lost != reportedDrops) {
+    char text[64];
+    snprintf(text, sizeof(text), "[ESPNowHandler] %u log messages dropped\n",
+             static_cast<unsigned>(lost - reportedDrops));
+    sink(ESPNOW_LOG_LEVEL_WARN, text);
+    reportedDrops = lost;
+  }
+  return drained;
+}
+
+#ifdef ESP_PLATFORM
+inline bool EspNowLog::startDrainTask(UBaseType_t priority,
+                                      uint32_t stackSize, uint32_t periodMs) {
+  if (!records || drainTask != nullptr)
+    return false;
+  drainPeriodMs = periodMs;
+  return xTaskCreate(drainTaskLoop, "EspNowLog", stackSize, this, priority,
+                     &drainTask) == pdPASS;
+}
+
+inline void EspNowLog::drainTaskLoop(void *arg) {
+  EspNowLog *log = static_cast<EspNowLog *>(arg);
+  for (;;) {
+    log->drain();
+    vTaskDelay(pdMS_TO_TICKS(log->drainPeriodMs));
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef ESPNOWPAYLOAD_H
+#define ESPNOWPAYLOAD_H
+
+#include <type_traits>
+
+// Compile-time table from packet type to the struct it carries. Bind each
+// typed packet once, at namespace scope, in a header both ends include:
+//
+//   ESPNOW_PAYLOAD(SensorPacket::Reading, Reading);
+//
+// The typed registerCallback<Type>, sendPacket<Type> and buildPacket<Type>
+// then take the struct from this table, so sender and receiver can't
+// disagree on it, and unbound types fail to compile.
+template <typename UserPacket, UserPacket Type> struct EspNowPayload {
+  static constexpr bool bound = false;
+};
+
+#define ESPNOW_PAYLOAD(packetType, Struct)                                     \
+  template <> struct EspNowPayload<decltype(packetType), packetType> {         \
+    static_assert(std::is_trivially_copyable<Struct>::value,                   \
+                  "Payload struct must be trivially copyable");                \
+    static constexpr bool bound = true;                                        \
+    using type = Struct;                                                       \
+  }
+
+#endif
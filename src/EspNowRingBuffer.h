@@ -0,0 +1,76 @@
+#ifndef ESPNOWRINGBUFFER_H
+#define ESPNOWRINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free single-producer/single-consumer ring of fixed-size slots.
+// Slots are allocated once on construction and filled in place: the producer
+// reserves a slot, writes it and commits; the consumer reads the front slot
+// and pops it. Capacity is rounded up to a power of two.
+template <typename T> class EspNowRingBuffer {
+public:
+  explicit EspNowRingBuffer(size_t minCapacity) {
+    size_t capacity = 1;
+    while (capacity < minCapacity)
+      capacity <<= 1;
+    slots = new T[capacity];
+    mask = capacity - 1;
+  }
+
+  ~EspNowRingBuffer() { delete[] slots; }
+
+  EspNowRingBuffer(const EspNowRingBuffer &) = delete;
+  EspNowRingBuffer &operator=(const EspNowRingBuffer &) = delete;
+
+  T *reserve();
+  // Producer: returns the next free slot, or nullptr when full
+
+  void commit();
+  // Producer: publishes the slot returned by reserve()
+
+  T *front();
+  // Consumer: returns the oldest published slot, or nullptr when empty
+
+  void pop();
+  // Consumer: releases the slot returned by front()
+
+  size_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+private:
+  T *slots;
+  size_t mask;
+  std::atomic<size_t> head{0}; // Written by the producer only
+  std::atomic<size_t> tail{0}; // Written by the consumer only
+};
+
+template <typename T> T *EspNowRingBuffer<T>::reserve() {
+  const size_t current = head.load(std::memory_order_relaxed);
+  if (current - tail.load(std::memory_order_acquire) > mask)
+    return nullptr;
+  return &slots[current & mask];
+}
+
+template <typename T> void EspNowRingBuffer<T>::commit() {
+  head.store(head.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+template <typename T> T *EspNowRingBuffer<T>::front() {
+  const size_t current = tail.load(std::memory_order_relaxed);
+  if (current == head.load(std::memory_order_acquire))
+    return nullptr;
+  return &slots[current & mask];
+}
+
+template <typename T> void EspNowRingBuffer<T>::pop() {
+  tail.store(tail.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+#endif
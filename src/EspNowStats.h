@@ -0,0 +1,217 @@
+#ifndef ESPNOWSTATS_H
+#define ESPNOWSTATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Why a frame or packet was dropped instead of delivered or sent
+enum class EspNowDrop : uint8_t {
+  TooShort,         // Frame shorter than the header
+  BadVersion,       // Unsupported header version
+  UnknownFlags,     // Extension the receiver can't parse
+  LengthMismatch,   // Header length doesn't match the frame
+  CrcMismatch,      // Frame CRC check failed
+  BadSender,        // Sender ID out of range
+  AuthFailed,       // Frame MAC doesn't belong to the sender ID
+  BadType,          // Packet type out of range
+  NoCallback,       // No callback registered for the type
+  ReliableDisabled, // Reliable frame, but no reliable type configured
+  MalformedBatch,   // Batch frame with a truncated record
+  BadFragment,      // Inconsistent fragment header or length
+  NoReassembly,     // Reassembly disabled, too small or out of slots
+  RxQueueFull,      // Deferred dispatch queue full
+  TxQueueFull,      // No transmit slot within the transmit timeout
+  ReliableWindow,   // Too many unacknowledged frames to the peer
+  TtlExpired,       // Routed frame out of hops
+  NoRoute,          // Routed frame for a device without a route
+  BadRpc,           // RPC frame too short or of an unknown kind
+  BadStream,        // Malformed stream frame, or for an unknown stream
+  NotAddressed,     // Group frame that doesn't include this device
+  NoPeerSlot,       // Peer cache full of pinned or busy peers
+  BadDelta,         // Delta without its keyframe, or malformed
+  Expired,          // Queued past its priority class deadline
+  BadOrigin,        // Routed frame whose origin didn't come that way
+  Count
+};
+
+// Runtime counters for one handler: per packet type, per peer and per drop
+// reason. Every update is a single relaxed atomic operation on a 32-bit
+// counter (lock-free on the ESP32), so the counters can stay enabled in
+// production and be updated from the Wi-Fi task. Counters wrap at 2^32.
+template <size_t Types, size_t Peers> class EspNowStats {
+public:
+  static constexpr size_t HistogramBuckets = 8;
+  static constexpr size_t DropCount = static_cast<size_t>(EspNowDrop::Count);
+
+  static size_t bucketFor(uint32_t us) {
+    // Bucket i counts durations below 4^(i+1) us, the last one the rest
+    size_t bucket = 0;
+    while (bucket + 1 < HistogramBuckets && us >= (4u << (2 * bucket)))
+      bucket++;
+    return bucket;
+  }
+
+  struct TypeStats {
+    uint32_t txPackets; // Passed to sendPacket
+    uint32_t txBytes;
+    uint32_t txFailures; // Refused by sendPacket or reported failed
+    uint32_t rxPackets;  // Delivered to the callback
+    uint32_t rxBytes;
+    uint32_t callbackUs[HistogramBuckets]; // See bucketFor
+    uint32_t callbackMaxUs;
+  };
+
+  struct PeerStats {
+    uint32_t txFrames; // Frames the MAC layer delivered
+    uint32_t txBytes;
+    uint32_t txFailures; // Frames the driver or MAC layer failed
+    uint32_t rxFrames;   // Authenticated frames received
+    uint32_t rxBytes;
+  };
+
+  struct Snapshot {
+    uint32_t periodMs; // Since the counters were last reset
+    TypeStats types[Types];
+    PeerStats peers[Peers];
+    uint32_t drops[DropCount];
+    uint32_t receiveMaxUs; // Longest time spent in the receive callback
+  };
+
+  void countTx(size_t type, size_t bytes) {
+    add(types[type].txPackets, 1);
+    add(types[type].txBytes, bytes);
+  }
+
+  void countTxFailure(size_t type) { add(types[type].txFailures, 1); }
+
+  void countRx(size_t type, size_t bytes, uint32_t callbackUs) {
+    Type &counters = types[type];
+    add(counters.rxPackets, 1);
+    add(counters.rxBytes, bytes);
+    add(counters.callbackUs[bucketFor(callbackUs)], 1);
+    raise(counters.callbackMaxUs, callbackUs);
+  }
+
+  void countPeerTx(size_t peer, size_t bytes, bool delivered) {
+    if (delivered) {
+      add(peers[peer].txFrames, 1);
+      add(peers[peer].txBytes, bytes);
+    } else {
+      add(peers[peer].txFailures, 1);
+    }
+  }
+
+  void countPeerRx(size_t peer, size_t bytes) {
+    add(peers[peer].rxFrames, 1);
+    add(peers[peer].rxBytes, bytes);
+  }
+
+  void countDrop(EspNowDrop reason) {
+    add(drops[static_cast<size_t>(reason)], 1);
+  }
+
+  void countReceiveTime(uint32_t us) { raise(receiveMaxUs, us); }
+
+  uint32_t dropCount(EspNowDrop reason) const {
+    return drops[static_cast<size_t>(reason)].load(std::memory_order_relaxed);
+  }
+
+  void snapshot(Snapshot &out, bool reset);
+  // Copies every counter into out, zeroing each as it is read if
+  // reset is set. Counters are read one by one, so updates made
+  // meanwhile land in this snapshot or the next, never in neither.
+  // Leaves periodMs to the caller.
+
+  void reset();
+
+private:
+  using Counter = std::atomic<uint32_t>;
+
+  struct Type {
+    Counter txPackets, txBytes, txFailures, rxPackets, rxBytes;
+    Counter callbackUs[HistogramBuckets];
+    Counter callbackMaxUs;
+  };
+
+  struct Peer {
+    Counter txFrames, txBytes, txFailures, rxFrames, rxBytes;
+  };
+
+  static void add(Counter &counter, size_t value) {
+    counter.fetch_add(static_cast<uint32_t>(value), std::memory_order_relaxed);
+  }
+
+  static void raise(Counter &counter, uint32_t value) {
+    uint32_t current = counter.load(std::memory_order_relaxed);
+    while (value > current &&
+           !counter.compare_exchange_weak(current, value,
+                                          std::memory_order_relaxed))
+      ;
+  }
+
+  static uint32_t take(Counter &counter, bool reset) {
+    return reset ? counter.exchange(0, std::memory_order_relaxed)
+                 : counter.load(std::memory_order_relaxed);
+  }
+
+  Type types[Types] = {};
+  Peer peers[Peers] = {};
+  Counter drops[DropCount] = {};
+  Counter receiveMaxUs{0};
+};
+
+template <size_t Types, size_t Peers>
+void EspNowStats<Types, Peers>::snapshot(Snapshot &out, bool reset) {
+  for (size_t i = 0; i < Types; ++i) {
+    Type &in = types[i];
+    TypeStats &type = out.types[i];
+    type.txPackets = take(in.txPackets, reset);
+    type.txBytes = take(in.txBytes, reset);
+    type.txFailures = take(in.txFailures, reset);
+    type.rxPackets = take(in.rxPackets, reset);
+    type.rxBytes = take(in.rxBytes, reset);
+    for (size_t b = 0; b < HistogramBuckets; ++b)
+      type.callbackUs[b] = take(in.callbackUs[b], reset);
+    type.callbackMaxUs = take(in.callbackMaxUs, reset);
+  }
+  for (size_t i = 0; i < Peers; ++i) {
+    Peer &in = peers[i];
+    PeerStats &peer = out.peers[i];
+    peer.txFrames = take(in.txFrames, reset);
+    peer.txBytes = take(in.txBytes, reset);
+    peer.txFailures = take(in.txFailures, reset);
+    peer.rxFrames = take(in.rxFrames, reset);
+    peer.rxBytes = take(in.rxBytes, reset);
+  }
+  for (size_t i = 0; i < DropCount; ++i)
+    out.drops[i] = take(drops[i], reset);
+  out.receiveMaxUs = take(receiveMaxUs, reset);
+}
+
+template <size_t Types, size_t Peers> void EspNowStats<Types, Peers>::reset() {
+  for (size_t i = 0; i < Types; ++i) {
+    Type &type = types[i];
+    type.txPackets = 0;
+    type.txBytes = 0;
+    type.txFailures = 0;
+    type.rxPackets = 0;
+    type.rxBytes = 0;
+    for (size_t b = 0; b < HistogramBuckets; ++b)
+      type.callbackUs[b] = 0;
+    type.callbackMaxUs = 0;
+  }
+  for (size_t i = 0; i < Peers; ++i) {
+    Peer &peer = peers[i];
+    peer.txFrames = 0;
+    peer.txBytes = 0;
+    peer.txFailures = 0;
+    peer.rxFrames = 0;
+    peer.rxBytes = 0;
+  }
+  for (size_t i = 0; i < DropCount; ++i)
+    drops[i] = 0;
+  receiveMaxUs = 0;
+}
+
+#endif
@@ -28,6 +28,9 @@ class EspNowHandlerTest {
 public:
   friend class EspNowHandler<TestDeviceID, TestPacketType>;
 
+  // Serialized wire header, as built by sendPacket
+  using Header = EspNowHandler<TestDeviceID, TestPacketType>::PacketHeader;
+
   static void setUp() {
     // Setup code before each test
   }
@@ -52,18 +55,14 @@ public:
 
     handler.registerCallback(TestPacketType::TYPE_1, callback);
 
-    // Create a proper packet with header (len must be size_t to match handler)
-    struct PacketHeaderLike {
-      uint8_t type;
-      TestDeviceID sender;
-      size_t len;
-    } header = {static_cast<uint8_t>(TestPacketType::TYPE_1), senderID,
-                sizeof(uint8_t)};
+    // Create a proper packet with the serialized header
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1), senderID,
+                     sizeof(uint8_t)};
 
-    const size_t packetSize = sizeof(header) + sizeof(uint8_t);
+    const size_t packetSize = Header::Size + sizeof(uint8_t);
     uint8_t buffer[packetSize] = {};
-    memcpy(buffer, &header, sizeof(header));
-    memcpy(buffer + sizeof(header), &data, sizeof(uint8_t));
+    header.encode(buffer);
+    memcpy(buffer + Header::Size, &data, sizeof(uint8_t));
 
     handler.onDataRecv(senderMac, buffer, static_cast<int>(packetSize));
   }
@@ -77,6 +76,12 @@ public:
     const TestDeviceID senderID = TestDeviceID::DEVICE_2;
     const uint8_t senderMac[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
 
+    bool paired = false;
+    handler.registerPairingCallback(
+        [&paired](TestDeviceID, bool ok) { paired = ok; });
+    TEST_ASSERT_EQUAL(ESP_OK, esp_now_init()); // To add the paired peer
+    TEST_ASSERT_TRUE(handler.pairDevice(senderID, false));
+
     // Build Discovery packet payload with state=Paired to avoid ACK send
     typename Handler::PairingState state = Handler::PairingState::Paired;
     uint8_t fields[3] = {static_cast<uint8_t>(senderID),
@@ -89,16 +94,12 @@ public:
 
     // Build header with InternalPacket::Discovery encoded type
     typename Handler::PacketType dType(Handler::InternalPacket::Discovery);
-    struct PacketHeaderLike {
-      uint8_t type;
-      TestDeviceID sender;
-      size_t len;
-    } header = {dType.encoded, senderID, sizeof(discovery)};
+    Header header = {0, dType.encoded, senderID, sizeof(discovery)};
 
-    const size_t packetSize = sizeof(header) + sizeof(discovery);
+    const size_t packetSize = Header::Size + sizeof(discovery);
     uint8_t buffer[packetSize] = {};
-    memcpy(buffer, &header, sizeof(header));
-    memcpy(buffer + sizeof(header), &discovery, sizeof(discovery));
+    header.encode(buffer);
+    memcpy(buffer + Header::Size, &discovery, sizeof(discovery));
 
     // Simulate receive of discovery
     handler.onDataRecv(senderMac, buffer, static_cast<int>(packetSize));
@@ -113,9 +114,17 @@ public:
     TEST_ASSERT_EQUAL_UINT8(senderMac[4], mac[4]);
     TEST_ASSERT_EQUAL_UINT8(senderMac[5], mac[5]);
 
-    auto stateAfter = handler.pairingState.load();
+    auto stateAfter =
+        handler.pairingSlots[static_cast<size_t>(senderID)].state.load();
     TEST_ASSERT_EQUAL(static_cast<uint8_t>(Handler::PairingState::Paired),
                       static_cast<uint8_t>(stateAfter));
+
+    // Completion is reported from poll()
+    TEST_ASSERT_FALSE(paired);
+    handler.poll();
+    TEST_ASSERT_TRUE(paired);
+    TEST_ASSERT_EQUAL(0, handler.pendingPairings());
+    esp_now_deinit();
   }
 
   // New: struct-based callback integration – simulate a full packet receive
@@ -129,6 +138,7 @@ public:
 
     const TestDeviceID senderID = TestDeviceID::DEVICE_2;
     const uint8_t senderMac[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
 
     // Register struct-based callback for TYPE_1
     handler.registerCallback<TestPacketStruct>(
@@ -140,19 +150,15 @@ public:
         });
 
     // Build a raw packet buffer: PacketHeader + TestPacketStruct payload
-    struct PacketHeaderLike {
-      uint8_t type;
-      TestDeviceID sender;
-      size_t len;
-    } header = {static_cast<uint8_t>(TestPacketType::TYPE_1), senderID,
-                sizeof(TestPacketStruct)};
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1), senderID,
+                     sizeof(TestPacketStruct)};
 
     TestPacketStruct payload{0x42, 0x1234, 0xAB};
 
-    const size_t packetSize = sizeof(header) + sizeof(payload);
+    const size_t packetSize = Header::Size + sizeof(payload);
     uint8_t buffer[packetSize] = {};
-    memcpy(buffer, &header, sizeof(header));
-    memcpy(buffer + sizeof(header), &payload, sizeof(payload));
+    header.encode(buffer);
+    memcpy(buffer + Header::Size, &payload, sizeof(payload));
 
     // Simulate ESP-NOW receive
     handler.onDataRecv(senderMac, buffer, static_cast<int>(packetSize));
@@ -178,41 +184,319 @@ public:
           fullyInvoked = true;
         });
 
-    // Header declares incorrect size to simulate mismatch
-    struct PacketHeaderLike {
-      uint8_t type;
-      TestDeviceID sender;
-      size_t len;
-    } badHeader = {static_cast<uint8_t>(TestPacketType::TYPE_1),
-                   TestDeviceID::DEVICE_2, sizeof(TestPacketStruct) - 1};
+    // Well-formed frame whose payload is one byte short of the struct
+    Header shortHeader = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                          TestDeviceID::DEVICE_2, sizeof(TestPacketStruct) - 1};
 
     TestPacketStruct payload{0x55, 0x6789, 0xCD};
 
-    const size_t packetSize = sizeof(badHeader) + sizeof(payload);
+    const size_t packetSize = Header::Size + sizeof(payload) - 1;
     uint8_t buffer[packetSize] = {};
-    memcpy(buffer, &badHeader, sizeof(badHeader));
-    memcpy(buffer + sizeof(badHeader), &payload, sizeof(payload));
+    shortHeader.encode(buffer);
+    memcpy(buffer + Header::Size, &payload, sizeof(payload) - 1);
 
     // Simulate ESP-NOW receive with size mismatch
     const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
     handler.onDataRecv(senderMac, buffer, static_cast<int>(packetSize));
 
     // Callback should have early-returned due to size mismatch
     TEST_ASSERT_FALSE(fullyInvoked);
   }
+
+  static void test_HeaderRejectsLengthMismatch() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+
+    bool invoked = false;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&invoked](const uint8_t *dataPtr, size_t len, TestDeviceID sender) {
+          invoked = true;
+        });
+
+    // Header declares one byte less than the frame carries
+    Header badHeader = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                        TestDeviceID::DEVICE_2, 3};
+    uint8_t buffer[Header::Size + 4] = {};
+    badHeader.encode(buffer);
+
+    const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+    handler.onDataRecv(senderMac, buffer, static_cast<int>(sizeof(buffer)));
+
+    TEST_ASSERT_FALSE(invoked);
+    std::unique_ptr<EspNowHandler<TestDeviceID, TestPacketType>::Stats> stats(
+        new EspNowHandler<TestDeviceID, TestPacketType>::Stats);
+    handler.getStats(*stats);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::LengthMismatch)]);
+  }
+
+  static void test_DeferredDispatchQueuesBurstUntilPolled() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+    TEST_ASSERT_TRUE(handler.enableDeferredDispatch(8));
+
+    uint8_t receivedOrder[16] = {};
+    size_t receivedCount = 0;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID sender) {
+          receivedOrder[receivedCount++] = *dataPtr;
+        });
+
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                     TestDeviceID::DEVICE_2, sizeof(uint8_t)};
+
+    // Burst of 12 frames into an 8 slot queue
+    const uint8_t senderMac[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+    uint8_t buffer[Header::Size + 1] = {};
+    header.encode(buffer);
+    for (uint8_t i = 0; i < 12; ++i) {
+      buffer[Header::Size] = i;
+      handler.onDataRecv(senderMac, buffer, static_cast<int>(sizeof(buffer)));
+    }
+
+    // Nothing runs in the receive callback itself
+    TEST_ASSERT_EQUAL(0, receivedCount);
+    auto stats = handler.getRxQueueStats();
+    TEST_ASSERT_EQUAL(8, stats.depth);
+    TEST_ASSERT_EQUAL(8, stats.highWater);
+    TEST_ASSERT_EQUAL(4, stats.overflowDrops);
+
+    TEST_ASSERT_EQUAL(3, handler.poll(3));
+    TEST_ASSERT_EQUAL(3, receivedCount);
+    TEST_ASSERT_EQUAL(5, handler.poll());
+    TEST_ASSERT_EQUAL(0, handler.poll());
+
+    TEST_ASSERT_EQUAL(8, receivedCount);
+    for (uint8_t i = 0; i < 8; ++i)
+      TEST_ASSERT_EQUAL_UINT8(i, receivedOrder[i]);
+    stats = handler.getRxQueueStats();
+    TEST_ASSERT_EQUAL(0, stats.depth);
+    TEST_ASSERT_EQUAL(8, stats.dispatched);
+  }
+
+  static void test_RejectsFrameWhoseLengthDoesNotMatchHeader() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+
+    size_t calls = 0;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&calls](const uint8_t *, size_t, TestDeviceID) { calls++; });
+
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                     TestDeviceID::DEVICE_2, 4};
+    uint8_t buffer[Header::Size + 8] = {};
+    header.encode(buffer);
+    const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+
+    // Truncated, padded and exact frames
+    handler.onDataRecv(senderMac, buffer, static_cast<int>(Header::Size + 3));
+    handler.onDataRecv(senderMac, buffer, static_cast<int>(Header::Size + 8));
+    TEST_ASSERT_EQUAL(0, calls);
+    handler.onDataRecv(senderMac, buffer, static_cast<int>(Header::Size + 4));
+    TEST_ASSERT_EQUAL(1, calls);
+
+    // Unknown extension flags can't be parsed
+    header.flags = 0x20;
+    header.encode(buffer);
+    handler.onDataRecv(senderMac, buffer, static_cast<int>(Header::Size + 4));
+    TEST_ASSERT_EQUAL(1, calls);
+  }
+
+  static void test_BatchFrameDispatchesEachRecordInOrder() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+
+    uint8_t order[8] = {};
+    size_t calls = 0;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t, TestDeviceID) {
+          order[calls++] = dataPtr[0];
+        });
+
+    // TYPE_1, TYPE_1, TYPE_2, TYPE_1 records, then a truncated one
+    const uint8_t records[] = {0, 1, 0x11, 0, 2, 0x22, 0x00, 1, 1, 0x05,
+                               0, 1, 0x33, 0, 9, 0x44};
+    const uint8_t batchType = 128 + 1; // InternalPacket::Batch
+    Header header = {0, batchType, TestDeviceID::DEVICE_2, sizeof(records)};
+    uint8_t buffer[Header::Size + sizeof(records)] = {};
+    header.encode(buffer);
+    memcpy(buffer + Header::Size, records, sizeof(records));
+    const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(3, calls); // TYPE_2 has no callback
+    TEST_ASSERT_EQUAL_UINT8(0x11, order[0]);
+    TEST_ASSERT_EQUAL_UINT8(0x22, order[1]);
+    TEST_ASSERT_EQUAL_UINT8(0x33, order[2]);
+  }
+
+  static void test_ReliableFrameIsDeliveredOnceAndAcknowledged() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+    handler.setReliable(TestPacketType::TYPE_1);
+
+    size_t calls = 0;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&calls](const uint8_t *, size_t, TestDeviceID) { calls++; });
+
+    // Header, then epoch 7, sequence number 301 and a backlog of one
+    // (300 is unacknowledged too), then the payload
+    Header header = {Header::ReliableFlag,
+                     static_cast<uint8_t>(TestPacketType::TYPE_1),
+                     TestDeviceID::DEVICE_2, 2};
+    uint8_t buffer[Header::Size + 4 + 2] = {};
+    header.encode(buffer);
+    buffer[Header::Size] = 7;
+    buffer[Header::Size + 1] = 301 & 0xFF;
+    buffer[Header::Size + 2] = 301 >> 8;
+    buffer[Header::Size + 3] = 1;
+    const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer)); // Retransmission
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_EQUAL(1, handler.getReliableStats().duplicates);
+
+    buffer[Header::Size + 1] = 300 & 0xFF; // Overtaken on first contact
+    buffer[Header::Size + 3] = 0;
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(2, calls);
+
+    buffer[Header::Size] = 8; // Sender rebooted: new epoch starts over
+    buffer[Header::Size + 1] = 0;
+    buffer[Header::Size + 2] = 0;
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(3, calls);
+
+    buffer[Header::Size + 1] = 5; // Outside what the sender had queued
+    buffer[Header::Size + 3] = static_cast<uint8_t>(
+        EspNowHandler<TestDeviceID, TestPacketType>::ReliableWindow);
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(3, calls);
+    TEST_ASSERT_EQUAL(1, handler.getReliableStats().duplicates);
+
+    for (uint8_t seq = 1; seq < 40; ++seq) { // Rebooted again, same epoch
+      buffer[Header::Size + 1] = seq;
+      buffer[Header::Size + 3] = 0;
+      handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    }
+    TEST_ASSERT_EQUAL(42, calls);
+    buffer[Header::Size + 1] = 0;
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(43, calls);
+  }
+
+  static void test_DropsFrameWhoseMacDoesNotMatchSender() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+
+    size_t calls = 0;
+    handler.registerCallback(
+        TestPacketType::TYPE_1,
+        [&calls](const uint8_t *, size_t, TestDeviceID) { calls++; });
+
+    const uint8_t device2Mac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    const uint8_t spoofMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x00};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, device2Mac);
+
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                     TestDeviceID::DEVICE_2, 1};
+    uint8_t buffer[Header::Size + 1] = {};
+    header.encode(buffer);
+
+    // Claims to be DEVICE_2 from another MAC, and from a MAC that
+    // belongs to no device at all
+    handler.onDataRecv(spoofMac, buffer, sizeof(buffer));
+    handler.onDataRecv(selfMac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(0, calls);
+    TEST_ASSERT_EQUAL(2, handler.getAuthDrops());
+
+    handler.onDataRecv(device2Mac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(1, calls);
+
+    // Unknown ID with a known MAC
+    header.sender = TestDeviceID::DEVICE_1;
+    header.encode(buffer);
+    handler.onDataRecv(device2Mac, buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_EQUAL(3, handler.getAuthDrops());
+  }
+
+  static void test_StatsCountDeliveriesAndDropReasons() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+    using Stats = EspNowHandler<TestDeviceID, TestPacketType>::Stats;
+    handler.registerCallback(TestPacketType::TYPE_1,
+                             [](const uint8_t *, size_t, TestDeviceID) {});
+
+    const uint8_t senderMac[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    handler.registry->addDevice(TestDeviceID::DEVICE_2, senderMac);
+    Header header = {0, static_cast<uint8_t>(TestPacketType::TYPE_1),
+                     TestDeviceID::DEVICE_2, 3};
+    uint8_t buffer[Header::Size + 3] = {};
+    header.encode(buffer);
+
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer));
+    handler.onDataRecv(senderMac, buffer, 2);                  // Too short
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer) - 1); // Truncated
+    buffer[1] = static_cast<uint8_t>(TestPacketType::TYPE_2);
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer)); // No callback
+    buffer[1] = 100;
+    handler.onDataRecv(senderMac, buffer, sizeof(buffer)); // Unknown type
+
+    std::unique_ptr<Stats> stats(new Stats);
+    handler.getStats(*stats, true);
+    const size_t type1 = static_cast<size_t>(TestPacketType::TYPE_1);
+    const size_t device2 = static_cast<size_t>(TestDeviceID::DEVICE_2);
+    TEST_ASSERT_EQUAL(2, stats->types[type1].rxPackets);
+    TEST_ASSERT_EQUAL(6, stats->types[type1].rxBytes);
+    TEST_ASSERT_EQUAL(2, stats->types[type1].callbackUs[0]);
+    TEST_ASSERT_EQUAL(4, stats->peers[device2].rxFrames); // Authenticated
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::TooShort)]);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::LengthMismatch)]);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::NoCallback)]);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::BadType)]);
+
+    handler.getStats(*stats);
+    TEST_ASSERT_EQUAL(0, stats->types[type1].rxPackets);
+    TEST_ASSERT_EQUAL(0, stats->peers[device2].rxFrames);
+  }
 };
 
-void setup() {
-  delay(2000);
+int runUnityTests() {
   EspNowHandlerTest handlerTest;
   UNITY_BEGIN();
   RUN_TEST(handlerTest.test_CallbackGetsCalledWhenSimulatingDataReceive);
   RUN_TEST(handlerTest.test_PairingWithInjectedResponse);
   RUN_TEST(handlerTest.test_StructCallbackGetsCalledWhenSimulatingDataReceive);
   RUN_TEST(handlerTest.test_StructCallbackRejectsIncorrectSize);
+  RUN_TEST(handlerTest.test_HeaderRejectsLengthMismatch);
+  RUN_TEST(handlerTest.test_DeferredDispatchQueuesBurstUntilPolled);
+  RUN_TEST(handlerTest.test_RejectsFrameWhoseLengthDoesNotMatchHeader);
+  RUN_TEST(handlerTest.test_BatchFrameDispatchesEachRecordInOrder);
+  RUN_TEST(handlerTest.test_ReliableFrameIsDeliveredOnceAndAcknowledged);
+  RUN_TEST(handlerTest.test_DropsFrameWhoseMacDoesNotMatchSender);
+  RUN_TEST(handlerTest.test_StatsCountDeliveriesAndDropReasons);
+  return UNITY_END();
+}
 
-  UNITY_END();
+#ifdef ARDUINO
+void setup() {
+  delay(2000);
+  runUnityTests();
 }
 void loop() {}
+#else
+int main(int argc, char **argv) { return runUnityTests(); }
+#endif
 
 #endif
\ No newline at end of file
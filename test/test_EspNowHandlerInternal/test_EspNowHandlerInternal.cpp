@@ -19,11 +19,28 @@ struct TestPacketStruct {
   uint8_t flags;
 };
 
+// Typed payload bound to TYPE_2
+struct TestTypedPayload {
+  uint32_t counter;
+  uint16_t level;
+};
+ESPNOW_PAYLOAD(TestPacketType::TYPE_2, TestTypedPayload);
+
 // Global variables for callback testing
 bool structCallbackCalled = false;
 TestPacketStruct receivedStruct = {};
 TestDeviceID receivedSender = TestDeviceID::SELF;
 
+// Log sink capture
+char logLines[8][ESPNOW_LOG_RECORD_SIZE] = {};
+size_t logLineCount = 0;
+
+void captureLog(uint8_t, const char *message) {
+  if (logLineCount < 8)
+    strncpy(logLines[logLineCount], message, ESPNOW_LOG_RECORD_SIZE - 1);
+  logLineCount++;
+}
+
 class EspNowHandlerTest {
 public:
   friend class EspNowHandler<TestDeviceID, TestPacketType>;
@@ -183,10 +200,324 @@ public:
     // Callback should not have been fully invoked due to size mismatch
     TEST_ASSERT_FALSE(callbackInvoked);
   }
+
+  static void test_ringBuffer_keepsOrderAcrossWrapAround() {
+    EspNowRingBuffer<uint32_t> ring(3); // Rounded up to 4 slots
+    TEST_ASSERT_EQUAL(4, ring.capacity());
+
+    for (uint32_t round = 0; round < 3; ++round) {
+      for (uint32_t i = 0; i < 4; ++i) {
+        uint32_t *slot = ring.reserve();
+        TEST_ASSERT_NOT_NULL(slot);
+        *slot = round * 10 + i;
+        ring.commit();
+      }
+      TEST_ASSERT_NULL(ring.reserve()); // Full
+      TEST_ASSERT_EQUAL(4, ring.size());
+
+      for (uint32_t i = 0; i < 4; ++i) {
+        uint32_t *slot = ring.front();
+        TEST_ASSERT_NOT_NULL(slot);
+        TEST_ASSERT_EQUAL(round * 10 + i, *slot);
+        ring.pop();
+      }
+      TEST_ASSERT_NULL(ring.front()); // Empty
+    }
+  }
+
+  static void test_enableDeferredDispatch_onlyOnce() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+
+    TEST_ASSERT_EQUAL(0, handler.poll()); // Immediate mode, nothing queued
+    TEST_ASSERT_TRUE(handler.enableDeferredDispatch(5));
+    TEST_ASSERT_FALSE(handler.enableDeferredDispatch(5));
+    TEST_ASSERT_EQUAL(8, handler.getRxQueueStats().capacity);
+  }
+
+  static void test_packetHeader_serializesToFourBytes() {
+    using Handler = EspNowHandler<TestDeviceID, TestPacketType>;
+    Handler::PacketHeader header = {0, 0x81, TestDeviceID::DEVICE_2, 200};
+
+    uint8_t wire[Handler::PacketHeader::Size] = {};
+    header.encode(wire);
+    TEST_ASSERT_EQUAL(4, Handler::PacketHeader::Size);
+    TEST_ASSERT_EQUAL_UINT8(Handler::PacketHeader::Version << 6, wire[0]);
+    TEST_ASSERT_EQUAL_UINT8(0x81, wire[1]);
+    TEST_ASSERT_EQUAL_UINT8(static_cast<uint8_t>(TestDeviceID::DEVICE_2),
+                            wire[2]);
+    TEST_ASSERT_EQUAL_UINT8(200, wire[3]);
+
+    Handler::PacketHeader decoded = {};
+    TEST_ASSERT_TRUE(
+        Handler::PacketHeader::decode(wire, sizeof(wire), decoded));
+    TEST_ASSERT_EQUAL_UINT8(0x81, decoded.type);
+    TEST_ASSERT_EQUAL(TestDeviceID::DEVICE_2, decoded.sender);
+    TEST_ASSERT_EQUAL_UINT8(200, decoded.len);
+
+    TEST_ASSERT_FALSE(Handler::PacketHeader::decode(wire, 3, decoded));
+    wire[0] = 0x00; // Version 0
+    TEST_ASSERT_FALSE(
+        Handler::PacketHeader::decode(wire, sizeof(wire), decoded));
+  }
+
+  static void test_fragmentHeader_roundTripsAndSplitsEvenly() {
+    using Handler = EspNowHandler<TestDeviceID, TestPacketType>;
+    Handler::FragmentHeader fragment = {7, 2, 5, 1000};
+
+    uint8_t wire[Handler::FragmentHeader::Size] = {};
+    fragment.encode(wire);
+    TEST_ASSERT_EQUAL(5, Handler::FragmentHeader::Size);
+    TEST_ASSERT_EQUAL_UINT8(0xE8, wire[3]); // 1000 little endian
+    TEST_ASSERT_EQUAL_UINT8(0x03, wire[4]);
+
+    Handler::FragmentHeader decoded = Handler::FragmentHeader::decode(wire);
+    TEST_ASSERT_EQUAL_UINT8(7, decoded.messageId);
+    TEST_ASSERT_EQUAL_UINT8(2, decoded.index);
+    TEST_ASSERT_EQUAL_UINT8(5, decoded.count);
+    TEST_ASSERT_EQUAL_UINT16(1000, decoded.total);
+    TEST_ASSERT_EQUAL(200, decoded.chunkSize());
+    TEST_ASSERT_TRUE(Handler::MaxMessageSize >= 16384);
+  }
+
+  static void test_delegate_storesCallableInlineAndCopies() {
+    using Delegate = EspNowDelegate<int(int)>;
+    Delegate empty;
+    TEST_ASSERT_FALSE(static_cast<bool>(empty));
+    TEST_ASSERT_TRUE(empty == nullptr);
+
+    int offset = 5;
+    Delegate add = [&offset](int value) { return value + offset; };
+    Delegate copy = add;
+    offset = 7;
+    TEST_ASSERT_EQUAL(10, add(3));
+    TEST_ASSERT_EQUAL(10, copy(3));
+
+    Delegate square = [](int value) { return value * value; };
+    copy = square;
+    TEST_ASSERT_EQUAL(16, copy(4));
+    copy = nullptr;
+    TEST_ASSERT_TRUE(copy == nullptr);
+
+    std::function<int(int)> wrapped = [](int value) { return -value; };
+    Delegate fromFunction = wrapped; // std::function fits inline too
+    TEST_ASSERT_EQUAL(-2, fromFunction(2));
+  }
+
+  static void test_registerCallback_structVersion_acceptsPlainLambda() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+    TestPacketStruct received = {};
+    handler.registerCallback<TestPacketStruct>(
+        TestPacketType::TYPE_2,
+        [&received](const TestPacketStruct &data, TestDeviceID) {
+          received = data;
+        });
+
+    TestPacketStruct sent = {};
+    sent.value = 4242;
+    handler.packetCallbacks[1](reinterpret_cast<const uint8_t *>(&sent),
+                               sizeof(sent), TestDeviceID::DEVICE_1);
+    TEST_ASSERT_EQUAL(4242, received.value);
+  }
+
+  static void test_crc16_matchesCcittCheckValueAndChains() {
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, espNowCrc16(check, sizeof(check)));
+    TEST_ASSERT_EQUAL_HEX16(0xFFFF, espNowCrc16(check, 0));
+    const uint16_t head = espNowCrc16(check, 4);
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, espNowCrc16(check + 4, 5, head));
+
+    // Every single bit error is detected
+    uint8_t frame[32];
+    for (size_t i = 0; i < sizeof(frame); ++i)
+      frame[i] = static_cast<uint8_t>(i * 37);
+    const uint16_t good = espNowCrc16(frame, sizeof(frame));
+    for (size_t bit = 0; bit < sizeof(frame) * 8; ++bit) {
+      frame[bit / 8] ^= static_cast<uint8_t>(1 << (bit % 8));
+      TEST_ASSERT_TRUE(espNowCrc16(frame, sizeof(frame)) != good);
+      frame[bit / 8] ^= static_cast<uint8_t>(1 << (bit % 8));
+    }
+  }
+
+  static void test_stats_bucketsSnapshotsAndResets() {
+    using Stats = EspNowStats<2, 3>;
+    TEST_ASSERT_EQUAL(0, Stats::bucketFor(0));
+    TEST_ASSERT_EQUAL(0, Stats::bucketFor(3));
+    TEST_ASSERT_EQUAL(1, Stats::bucketFor(4));
+    TEST_ASSERT_EQUAL(1, Stats::bucketFor(15));
+    TEST_ASSERT_EQUAL(2, Stats::bucketFor(16));
+    TEST_ASSERT_EQUAL(Stats::HistogramBuckets - 1,
+                      Stats::bucketFor(0xFFFFFFFF));
+
+    Stats stats;
+    stats.countRx(1, 10, 20);
+    stats.countRx(1, 30, 5);
+    stats.countPeerTx(2, 50, true);
+    stats.countPeerTx(2, 50, false);
+    stats.countDrop(EspNowDrop::NoCallback);
+    stats.countReceiveTime(7);
+    stats.countReceiveTime(3);
+
+    Stats::Snapshot snapshot;
+    stats.snapshot(snapshot, true);
+    TEST_ASSERT_EQUAL(2, snapshot.types[1].rxPackets);
+    TEST_ASSERT_EQUAL(40, snapshot.types[1].rxBytes);
+    TEST_ASSERT_EQUAL(1, snapshot.types[1].callbackUs[1]);
+    TEST_ASSERT_EQUAL(1, snapshot.types[1].callbackUs[2]);
+    TEST_ASSERT_EQUAL(20, snapshot.types[1].callbackMaxUs);
+    TEST_ASSERT_EQUAL(0, snapshot.types[0].rxPackets);
+    TEST_ASSERT_EQUAL(1, snapshot.peers[2].txFrames);
+    TEST_ASSERT_EQUAL(50, snapshot.peers[2].txBytes);
+    TEST_ASSERT_EQUAL(1, snapshot.peers[2].txFailures);
+    TEST_ASSERT_EQUAL(
+        1, snapshot.drops[static_cast<size_t>(EspNowDrop::NoCallback)]);
+    TEST_ASSERT_EQUAL(7, snapshot.receiveMaxUs);
+
+    // Reading with reset started the next period from zero
+    stats.countTx(0, 8);
+    stats.snapshot(snapshot, false);
+    TEST_ASSERT_EQUAL(1, snapshot.types[0].txPackets);
+    TEST_ASSERT_EQUAL(0, snapshot.types[1].rxPackets);
+    TEST_ASSERT_EQUAL(0, snapshot.types[1].callbackMaxUs);
+    TEST_ASSERT_EQUAL(0, stats.dropCount(EspNowDrop::NoCallback));
+    stats.reset();
+    stats.snapshot(snapshot, false);
+    TEST_ASSERT_EQUAL(0, snapshot.types[0].txPackets);
+  }
+
+  static void test_log_defersToRingAndCompilesOutDisabledLevels() {
+    logLineCount = 0;
+    EspNowLog log;
+    log.setSink(captureLog);
+    log.write(ESPNOW_LOG_LEVEL_WARN, "direct %d\n", 1);
+    TEST_ASSERT_EQUAL(1, logLineCount);
+    TEST_ASSERT_EQUAL_STRING("direct 1\n", logLines[0]);
+
+    TEST_ASSERT_TRUE(log.enableDeferred(4));
+    TEST_ASSERT_FALSE(log.enableDeferred(4));
+    for (int i = 0; i < 6; ++i)
+      log.write(ESPNOW_LOG_LEVEL_WARN, "deferred %d\n", i);
+    TEST_ASSERT_EQUAL(1, logLineCount); // Nothing printed on the hot path
+    TEST_ASSERT_EQUAL(2, log.droppedRecords());
+
+    TEST_ASSERT_EQUAL(2, log.drain(2));
+    TEST_ASSERT_EQUAL(4, logLineCount); // Two records and a drop notice
+    TEST_ASSERT_EQUAL_STRING("deferred 0\n", logLines[1]);
+    TEST_ASSERT_EQUAL_STRING("[ESPNowHandler] 2 log messages dropped\n",
+                             logLines[3]);
+    TEST_ASSERT_EQUAL(2, log.drain());
+    TEST_ASSERT_EQUAL(0, log.drain());
+    TEST_ASSERT_EQUAL(6, logLineCount);
+    TEST_ASSERT_EQUAL_STRING("deferred 3\n", logLines[5]);
+
+    // Long messages are cut but keep their line ending
+    char longText[ESPNOW_LOG_RECORD_SIZE * 2];
+    memset(longText, 'x', sizeof(longText) - 1);
+    longText[sizeof(longText) - 1] = '\0';
+    log.write(ESPNOW_LOG_LEVEL_WARN, "%s\n", longText);
+    TEST_ASSERT_EQUAL(1, log.drain());
+    TEST_ASSERT_EQUAL(ESPNOW_LOG_RECORD_SIZE - 1, strlen(logLines[6]));
+    TEST_ASSERT_EQUAL('\n', logLines[6][ESPNOW_LOG_RECORD_SIZE - 2]);
+
+    // Levels above ESPNOW_LOG_LEVEL don't even evaluate their arguments
+    int evaluated = 0;
+    ESPNOW_LOGD("debug %d\n", ++evaluated);
+    TEST_ASSERT_EQUAL(0, evaluated);
+  }
+
+  static void test_registerCallback_typedPayload_readsInPlaceWhenAligned() {
+    EspNowHandler<TestDeviceID, TestPacketType> handler(selfID, selfMac);
+    const TestTypedPayload *seen = nullptr;
+    uint32_t counter = 0;
+    handler.registerCallback<TestPacketType::TYPE_2>(
+        [&seen, &counter](const TestTypedPayload &payload, TestDeviceID) {
+          seen = &payload;
+          counter = payload.counter;
+        });
+
+    alignas(4) uint8_t buffer[sizeof(TestTypedPayload) + 4] = {};
+    TestTypedPayload sent = {};
+    sent.counter = 0x01020304;
+    memcpy(buffer, &sent, sizeof(sent));
+    handler.packetCallbacks[1](buffer, sizeof(sent), TestDeviceID::DEVICE_1);
+    TEST_ASSERT_TRUE(seen == reinterpret_cast<void *>(buffer)); // No copy
+    TEST_ASSERT_EQUAL(0x01020304, counter);
+
+    // Misaligned payload, e.g. behind a CRC: handed over as a copy
+    memcpy(buffer + 2, &sent, sizeof(sent));
+    handler.packetCallbacks[1](buffer + 2, sizeof(sent),
+                               TestDeviceID::DEVICE_1);
+    TEST_ASSERT_TRUE(seen != reinterpret_cast<void *>(buffer + 2));
+    TEST_ASSERT_EQUAL(0x01020304, counter);
+
+    seen = nullptr;
+    handler.packetCallbacks[1](buffer, sizeof(sent) - 1,
+                               TestDeviceID::DEVICE_1);
+    TEST_ASSERT_TRUE(seen == nullptr);
+  }
+
+  static void test_delta_encodesChangedRunsAndRejectsBadInput() {
+    uint8_t base[40] = {};
+    uint8_t data[40] = {};
+    data[3] = 1;
+    data[5] = 2; // Two bytes apart: same run
+    data[30] = 3;
+    uint8_t delta[40];
+    size_t len = 0;
+    TEST_ASSERT_TRUE(espNowDeltaEncode(base, data, 40, delta, 39, len));
+    const uint8_t expected[] = {3, 3, 1, 0, 2, 24, 1, 3};
+    TEST_ASSERT_EQUAL(sizeof(expected), len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, delta, len);
+
+    uint8_t rebuilt[40] = {};
+    TEST_ASSERT_TRUE(espNowDeltaApply(rebuilt, 40, delta, len));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, rebuilt, 40);
+
+    TEST_ASSERT_TRUE(espNowDeltaEncode(base, base, 40, delta, 39, len));
+    TEST_ASSERT_EQUAL(0, len); // Unchanged
+
+    memset(data, 0xFF, sizeof(data));
+    TEST_ASSERT_FALSE(espNowDeltaEncode(base, data, 40, delta, 39, len));
+
+    const uint8_t pastEnd[] = {38, 3, 1, 2, 3};
+    TEST_ASSERT_FALSE(espNowDeltaApply(rebuilt, 40, pastEnd, 5));
+    const uint8_t truncated[] = {0, 4, 1};
+    TEST_ASSERT_FALSE(espNowDeltaApply(rebuilt, 40, truncated, 3));
+  }
+
+  static void test_batchPriority_followsRecordsButNeverControl() {
+    using Handler = EspNowHandler<TestDeviceID, TestPacketType>;
+    Handler handler(selfID, selfMac);
+    handler.setPriority(TestPacketType::TYPE_1, EspNowPriority::High);
+    handler.setPriority(TestPacketType::TYPE_2, EspNowPriority::Bulk);
+    const uint8_t batchType =
+        Handler::PacketType(Handler::InternalPacket::Batch).encoded;
+    const uint8_t ackType =
+        Handler::PacketType(Handler::InternalPacket::Ack).encoded;
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(EspNowPriority::Normal),
+                      handler.priorityOf(batchType));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(EspNowPriority::Control),
+                      handler.priorityOf(ackType));
+
+    // Type, length, payload per record
+    uint8_t records[6] = {1, 1, 0xAA, 0, 1, 0xBB};
+    typename Handler::TxFrame frame = {};
+    Handler::PacketHeader header = {0, batchType, selfID, 3};
+    frame.len = static_cast<uint8_t>(
+        handler.encodeFrame(frame.data, header, nullptr, 0, records));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(EspNowPriority::Bulk),
+                      handler.batchPriority(frame));
+    header.len = sizeof(records);
+    frame.len = static_cast<uint8_t>(
+        handler.encodeFrame(frame.data, header, nullptr, 0, records));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(EspNowPriority::High),
+                      handler.batchPriority(frame));
+    handler.setPriority(TestPacketType::TYPE_1, EspNowPriority::Control);
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(EspNowPriority::High),
+                      handler.batchPriority(frame));
+  }
 };
 
-void setup() {
-  delay(2000);
+int runUnityTests() {
   EspNowHandlerTest handlerTest;
   UNITY_BEGIN();
   RUN_TEST(handlerTest.test_calcChecksum_returnsCorrectChecksum);
@@ -204,8 +535,30 @@ void setup() {
   RUN_TEST(
       handlerTest.test_registerCallback_structVersion_rejectsIncorrectSize);
   RUN_TEST(handlerTest.test_toIndex_convertsPacketTypeToSize);
-  UNITY_END();
+  RUN_TEST(handlerTest.test_ringBuffer_keepsOrderAcrossWrapAround);
+  RUN_TEST(handlerTest.test_enableDeferredDispatch_onlyOnce);
+  RUN_TEST(handlerTest.test_packetHeader_serializesToFourBytes);
+  RUN_TEST(handlerTest.test_fragmentHeader_roundTripsAndSplitsEvenly);
+  RUN_TEST(handlerTest.test_delegate_storesCallableInlineAndCopies);
+  RUN_TEST(handlerTest.test_registerCallback_structVersion_acceptsPlainLambda);
+  RUN_TEST(handlerTest.test_crc16_matchesCcittCheckValueAndChains);
+  RUN_TEST(handlerTest.test_stats_bucketsSnapshotsAndResets);
+  RUN_TEST(handlerTest.test_log_defersToRingAndCompilesOutDisabledLevels);
+  RUN_TEST(
+      handlerTest.test_registerCallback_typedPayload_readsInPlaceWhenAligned);
+  RUN_TEST(handlerTest.test_delta_encodesChangedRunsAndRejectsBadInput);
+  RUN_TEST(handlerTest.test_batchPriority_followsRecordsButNeverControl);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup() {
+  delay(2000);
+  runUnityTests();
 }
 void loop() {}
+#else
+int main(int argc, char **argv) { return runUnityTests(); }
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1734 @@
+#ifndef TEST_ESPNOWSIM_H
+#define TEST_ESPNOWSIM_H
+
+#include <EspNowSimNetwork.h>
+#include <cstring>
+#include <string>
+#include <unity.h>
+
+enum class TestPacketType : uint8_t { TYPE_1, TYPE_2, Count };
+
+enum class TestDeviceID : uint8_t { DEVICE_1, DEVICE_2, SELF, Count };
+
+using Network = EspNowSimNetwork<TestDeviceID, TestPacketType>;
+using Handler = EspNowHandler<TestDeviceID, TestPacketType>;
+
+// Larger ID space for site-wide scenarios
+enum class SiteDeviceID : uint8_t { Coordinator, Count = 64 };
+using SiteNetwork = EspNowSimNetwork<SiteDeviceID, TestPacketType>;
+
+// Typed payloads for the zero-copy API
+struct Setpoint {
+  uint32_t sequence;
+  int16_t value;
+};
+ESPNOW_PAYLOAD(TestPacketType::TYPE_1, Setpoint);
+ESPNOW_PAYLOAD(TestPacketType::TYPE_2, Setpoint);
+
+class EspNowHandlerTest {
+public:
+  friend class EspNowHandler<TestDeviceID, TestPacketType>;
+
+  static void test_sendPacket_deliversAcrossSimulatedMedium() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    size_t receivedLen = 0;
+    uint8_t received[4] = {};
+    TestDeviceID receivedSender = TestDeviceID::DEVICE_2;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_2,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID sender) {
+          receivedLen = len;
+          memcpy(received, dataPtr, len < 4 ? len : 4);
+          receivedSender = sender;
+        });
+
+    const uint8_t payload[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_2, payload, 4));
+    TEST_ASSERT_EQUAL(0, receivedLen); // Nothing arrives before airtime
+
+    net.runFor(10000);
+
+    TEST_ASSERT_EQUAL(4, receivedLen);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, received, 4);
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(TestDeviceID::SELF),
+                      static_cast<uint8_t>(receivedSender));
+  }
+
+  static void test_sendPacket_failsForUnpairedDevice() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+
+    const uint8_t payload = 0x01;
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, &payload, 1));
+  }
+
+  static void test_pairDevice_pairsOverSimulatedMedium() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    TEST_ASSERT_TRUE(net.listenForPairing(1));
+
+    size_t completions = 0;
+    bool paired = false;
+    net.node(0).registerPairingCallback([&](TestDeviceID target, bool ok) {
+      TEST_ASSERT_EQUAL(TestDeviceID::DEVICE_1, target);
+      completions++;
+      paired = ok;
+    });
+
+    const uint64_t start = net.sim().now();
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_1, true));
+    TEST_ASSERT_EQUAL(start, net.sim().now()); // Returns without waiting
+    TEST_ASSERT_EQUAL(1, net.node(0).pendingPairings());
+
+    net.pollEvery(1000);
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(1, completions);
+    TEST_ASSERT_TRUE(paired);
+    TEST_ASSERT_EQUAL(0, net.node(0).pendingPairings());
+
+    uint8_t mac[6];
+    Network::macFor(TestDeviceID::DEVICE_1, mac);
+    const uint8_t *learned = net.node(0).registry->getDeviceMac(
+        TestDeviceID::DEVICE_1);
+    TEST_ASSERT_NOT_NULL(learned);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(mac, learned, 6);
+
+    Network::macFor(TestDeviceID::SELF, mac);
+    learned = net.node(1).registry->getDeviceMac(TestDeviceID::SELF);
+    TEST_ASSERT_NOT_NULL(learned);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(mac, learned, 6);
+  }
+
+  static void test_pairing_runsInParallelAndTimesOut() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.addNode(TestDeviceID::DEVICE_2);
+    net.listenForPairing(1); // DEVICE_2 never answers
+
+    bool result[2] = {false, true};
+    uint64_t doneAt[2] = {};
+    net.node(0).registerPairingCallback([&](TestDeviceID target, bool ok) {
+      result[static_cast<size_t>(target)] = ok;
+      doneAt[static_cast<size_t>(target)] = net.sim().now();
+    });
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_1, true));
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_2, true));
+    TEST_ASSERT_EQUAL(2, net.node(0).pendingPairings());
+
+    net.pollEvery(1000);
+    net.runFor(120000000);
+    TEST_ASSERT_TRUE(result[0]);
+    TEST_ASSERT_FALSE(result[1]);
+    TEST_ASSERT_LESS_THAN(20000, doneAt[0]); // Not held up by DEVICE_2
+    TEST_ASSERT_GREATER_THAN(10000000, doneAt[1]); // Gave up after backoff
+    TEST_ASSERT_EQUAL(0, net.node(0).pendingPairings());
+  }
+
+  static void test_pairing_reportsFailureWhenPeerCannotBeAdded() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.listenForPairing(1);
+
+    size_t completions = 0;
+    bool paired = true;
+    net.node(0).registerPairingCallback([&](TestDeviceID, bool ok) {
+      completions++;
+      paired = ok;
+    });
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_1, true));
+    esp_now_peer_info_t peerInfo = {}; // Fill the peer table behind it
+    peerInfo.peer_addr[0] = 0x02;
+    for (uint8_t i = 1; i < ESP_NOW_MAX_TOTAL_PEER_NUM; ++i) {
+      peerInfo.peer_addr[5] = i;
+      TEST_ASSERT_EQUAL(ESP_OK, esp_now_add_peer(&peerInfo));
+    }
+
+    net.pollEvery(1000);
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(1, completions);
+    TEST_ASSERT_FALSE(paired);
+  }
+
+  static void test_lossyMedium_dropsFrames() {
+    EspNowSimConfig config;
+    config.lossRate = 1.0f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    bool received = false;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { received = true; });
+
+    const uint8_t payload = 0x01;
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, &payload, 1));
+    net.runFor(10000);
+
+    TEST_ASSERT_FALSE(received);
+    TEST_ASSERT_EQUAL(1, net.sim().getStats().framesLost);
+  }
+
+  static void test_medium_accountsLatencyAndAirtime() {
+    EspNowSimConfig config;
+    config.latencyUs = 1000;
+    config.jitterUs = 0;
+    config.airtimeUsPerByte = 10.0f;
+    config.frameOverheadUs = 0;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    uint64_t receivedAt = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1, [&](const uint8_t *, size_t, TestDeviceID) {
+          receivedAt = EspNowSim::instance().now();
+        });
+
+    const uint8_t payload[10] = {};
+    const uint64_t sentAt = net.sim().now();
+    net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                           payload, sizeof(payload));
+    net.runFor(10000);
+
+    const uint64_t frameLen = Handler::PacketHeader::Size + sizeof(payload);
+    TEST_ASSERT_EQUAL(sentAt + frameLen * 10 + 1000, receivedAt);
+    TEST_ASSERT_EQUAL(frameLen * 10 + 1000,
+                      net.sim().getStats().latencyUs.percentile(50));
+  }
+
+  static void test_deferredDispatch_runsCallbacksFromPoll() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(1).enableDeferredDispatch(4);
+
+    uint64_t receivedAt = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1, [&](const uint8_t *, size_t, TestDeviceID) {
+          receivedAt = EspNowSim::instance().now();
+        });
+    net.pollEvery(5000);
+
+    const uint8_t payload = 0x01;
+    net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                           &payload, 1);
+    net.runFor(20000);
+
+    // Frame arrives after ~1 ms but is only dispatched by the 5 ms poll
+    TEST_ASSERT_EQUAL(5000, receivedAt);
+    TEST_ASSERT_EQUAL(1, net.node(1).getRxQueueStats().dispatched);
+  }
+
+  static void test_txQueue_limitsFramesInFlightPerPeer() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    uint8_t received[10] = {};
+    size_t receivedCount = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t, TestDeviceID) {
+          received[receivedCount++] = *dataPtr;
+        });
+    size_t delivered = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID target, TestPacketType type, bool success) {
+          delivered += success ? 1 : 0;
+        });
+
+    Handler &sender = net.node(0);
+    sender.setTxWindow(2);
+    for (uint8_t i = 0; i < 10; ++i)
+      TEST_ASSERT_TRUE(sender.sendPacket(TestDeviceID::DEVICE_1,
+                                         TestPacketType::TYPE_1, &i, 1));
+
+    auto stats = sender.getTxQueueStats();
+    TEST_ASSERT_EQUAL(2, stats.inFlight);
+    TEST_ASSERT_EQUAL(8, stats.queued);
+
+    net.runFor(50000);
+
+    stats = net.node(0).getTxQueueStats();
+    TEST_ASSERT_EQUAL(0, stats.inFlight + stats.queued);
+    TEST_ASSERT_EQUAL(10, stats.delivered);
+    TEST_ASSERT_EQUAL(10, delivered);
+    TEST_ASSERT_EQUAL(10, receivedCount);
+    for (uint8_t i = 0; i < 10; ++i)
+      TEST_ASSERT_EQUAL_UINT8(i, received[i]); // In order
+  }
+
+  static void test_txQueue_appliesBackpressureInsteadOfFailing() {
+    EspNowSimConfig config;
+    config.driverQueueDepth = 4;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    size_t receivedCount = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { receivedCount++; });
+
+    // More frames than the queue holds, wider window than the driver takes
+    Handler &sender = net.node(0);
+    sender.setTxWindow(8);
+    const uint8_t payload[200] = {};
+    for (size_t i = 0; i < 40; ++i)
+      TEST_ASSERT_TRUE(sender.sendPacket(TestDeviceID::DEVICE_1,
+                                         TestPacketType::TYPE_1, payload,
+                                         sizeof(payload)));
+    net.runFor(200000);
+
+    auto stats = net.node(0).getTxQueueStats();
+    TEST_ASSERT_EQUAL(40, receivedCount);
+    TEST_ASSERT_EQUAL(40, stats.delivered);
+    TEST_ASSERT_EQUAL(0, stats.timeouts);
+    TEST_ASSERT_GREATER_THAN(0, stats.driverFull);
+  }
+
+  static void test_txQueue_reportsFailedDelivery() {
+    EspNowSimConfig config;
+    config.lossRate = 1.0f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    int result = -1;
+    TestPacketType reportedType = TestPacketType::TYPE_1;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID target, TestPacketType type, bool success) {
+          result = success ? 1 : 0;
+          reportedType = type;
+        });
+
+    const uint8_t payload = 0x01;
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_2, &payload, 1));
+    net.runFor(10000);
+
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(TestPacketType::TYPE_2),
+                      static_cast<uint8_t>(reportedType));
+    TEST_ASSERT_EQUAL(1, net.node(0).getTxQueueStats().failed);
+  }
+
+  static void test_sendPacket_fitsFullPayloadBehindCompactHeader() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    size_t receivedLen = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t len, TestDeviceID) { receivedLen = len; });
+
+    uint8_t payload[ESP_NOW_MAX_DATA_LEN] = {};
+    TEST_ASSERT_EQUAL(ESP_NOW_MAX_DATA_LEN - 4, Handler::MaxPayloadSize);
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                            TestPacketType::TYPE_1, payload,
+                                            Handler::MaxPayloadSize));
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                             TestPacketType::TYPE_1, payload,
+                                             Handler::MaxMessageSize + 1));
+    net.runFor(10000);
+
+    TEST_ASSERT_EQUAL(Handler::MaxPayloadSize, receivedLen);
+  }
+
+  static void test_sendPacket_fragmentsAndReassemblesLargeMessage() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    TEST_ASSERT_TRUE(net.node(1).enableReassembly(1, 4096));
+
+    static uint8_t payload[4000];
+    for (size_t i = 0; i < sizeof(payload); ++i)
+      payload[i] = static_cast<uint8_t>(i * 7);
+    static uint8_t received[4096];
+    size_t receivedLen = 0;
+    size_t calls = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID) {
+          calls++;
+          receivedLen = len;
+          memcpy(received, dataPtr, len);
+        });
+    size_t reports = 0;
+    bool delivered = false;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) {
+          reports++;
+          delivered = ok;
+        });
+
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                            TestPacketType::TYPE_1, payload,
+                                            sizeof(payload)));
+    net.runFor(100000);
+
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_EQUAL(sizeof(payload), receivedLen);
+    TEST_ASSERT_EQUAL_MEMORY(payload, received, sizeof(payload));
+    TEST_ASSERT_EQUAL(1, reports); // One report for the whole message
+    TEST_ASSERT_TRUE(delivered);
+    TEST_ASSERT_EQUAL(1, net.node(1).getReassemblyStats().completed);
+
+    // A queue too short for every fragment fails the message at once,
+    // and the fragments already queued report nothing more
+    net.node(0).setTxTimeout(0);
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                             TestPacketType::TYPE_1, payload,
+                                             sizeof(payload)));
+    TEST_ASSERT_EQUAL(2, reports);
+    TEST_ASSERT_FALSE(delivered);
+    net.runFor(100000);
+    TEST_ASSERT_EQUAL(2, reports);
+    TEST_ASSERT_EQUAL(1, calls);
+    net.runFor(1000000); // The receiver drops the partial message
+
+    // Message IDs wrap without inheriting the abandoned message's failure
+    size_t failures = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) { failures += ok ? 0 : 1; });
+    for (size_t i = 0; i < 256; ++i) {
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(
+          TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, payload, 300));
+      net.runFor(5000);
+    }
+    TEST_ASSERT_EQUAL(0, failures);
+    TEST_ASSERT_EQUAL(257, calls);
+  }
+
+  static void test_reassembly_dropsWithoutPoolAndExpiresPartial() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    size_t calls = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { calls++; });
+
+    static uint8_t payload[1000] = {};
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                            TestPacketType::TYPE_1, payload,
+                                            sizeof(payload)));
+    net.runFor(50000);
+    TEST_ASSERT_EQUAL(0, calls);
+    TEST_ASSERT_EQUAL(5, net.node(1).getReassemblyStats().dropped);
+
+    // Only the first of five fragments arrives: the slot times out
+    TEST_ASSERT_TRUE(net.node(1).enableReassembly(1, 1024, 20));
+    Handler::FragmentHeader fragment = {9, 0, 5, 1000};
+    uint8_t frame[Handler::PacketHeader::Size + Handler::FragmentHeader::Size +
+                  200] = {};
+    Handler::PacketHeader header = {Handler::PacketHeader::FragmentFlag, 0,
+                                    TestDeviceID::SELF, 200};
+    header.encode(frame);
+    fragment.encode(frame + Handler::PacketHeader::Size);
+    uint8_t selfMac[6];
+    Network::macFor(TestDeviceID::SELF, selfMac);
+    net.node(1).processFrame(selfMac, frame, sizeof(frame), 0);
+    TEST_ASSERT_EQUAL(1, net.node(1).getReassemblyStats().active);
+    net.runFor(30000);
+    net.node(1).poll();
+    TEST_ASSERT_EQUAL(0, net.node(1).getReassemblyStats().active);
+    TEST_ASSERT_EQUAL(1, net.node(1).getReassemblyStats().timeouts);
+    TEST_ASSERT_EQUAL(0, calls);
+  }
+
+  static void test_batching_packsSmallPacketsIntoOneFrame() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+
+    uint8_t received[32] = {};
+    size_t calls = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID sender) {
+          TEST_ASSERT_EQUAL(8, len);
+          TEST_ASSERT_EQUAL(TestDeviceID::SELF, sender);
+          received[calls++] = dataPtr[0];
+        });
+
+    TEST_ASSERT_TRUE(net.node(0).enableBatching(TestDeviceID::DEVICE_1, 5000));
+    net.sim().resetStats();
+    for (uint8_t i = 0; i < 10; ++i) {
+      uint8_t payload[8] = {i};
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(
+          TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, payload, 8));
+    }
+    net.runFor(4000);
+    TEST_ASSERT_EQUAL(0, calls); // Held until the deadline
+
+    net.pollEvery(1000);
+    net.runFor(3000);
+    TEST_ASSERT_EQUAL(10, calls);
+    TEST_ASSERT_EQUAL(1, net.sim().getStats().framesSent);
+    for (uint8_t i = 0; i < 10; ++i)
+      TEST_ASSERT_EQUAL_UINT8(i, received[i]);
+
+    // A full batch goes out without waiting; flushBatch sends the rest
+    calls = 0;
+    for (uint8_t i = 0; i < 30; ++i) {
+      uint8_t payload[8] = {i};
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                             payload, 8);
+    }
+    TEST_ASSERT_TRUE(net.node(0).flushBatch(TestDeviceID::DEVICE_1));
+    net.runFor(500);
+    TEST_ASSERT_EQUAL(0, calls);
+    net.runFor(10000);
+    TEST_ASSERT_EQUAL(30, calls);
+    TEST_ASSERT_EQUAL(3, net.sim().getStats().framesSent);
+  }
+
+  static void test_reliable_deliversExactlyOnceOverLossyLink() {
+    EspNowSimConfig config;
+    config.lossRate = 0.3f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(0).setReliable(TestPacketType::TYPE_1);
+    net.node(1).setReliable(TestPacketType::TYPE_1);
+
+    uint8_t seen[40] = {};
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t, TestDeviceID) {
+          seen[dataPtr[0]]++;
+        });
+    size_t delivered = 0;
+    size_t failed = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) {
+          ok ? delivered++ : failed++;
+        });
+
+    net.pollEvery(1000);
+    for (uint8_t i = 0; i < 40; ++i)
+      net.at(2000 * i, 0, [&net, i]() {
+        net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                               &i, 1);
+      });
+    net.runFor(2000000);
+
+    for (size_t i = 0; i < 40; ++i)
+      TEST_ASSERT_EQUAL(1, seen[i]);
+    TEST_ASSERT_EQUAL(40, delivered);
+    TEST_ASSERT_EQUAL(0, failed);
+    TEST_ASSERT_TRUE(net.node(0).getReliableStats().retransmits > 0);
+    TEST_ASSERT_EQUAL(0, net.node(0).getReliableStats().unacked);
+  }
+
+  static void test_reliable_reportsFailureWithoutAcks() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(0).setReliable(TestPacketType::TYPE_1);
+    // DEVICE_1 never marked the type reliable, so it doesn't acknowledge
+    size_t calls = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { calls++; });
+    size_t reports = 0;
+    bool delivered = true;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) {
+          reports++;
+          delivered = ok;
+        });
+
+    net.pollEvery(1000);
+    const uint8_t payload[2] = {1, 2};
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, payload, 2));
+    net.runFor(10000000);
+
+    TEST_ASSERT_EQUAL(0, calls);
+    TEST_ASSERT_EQUAL(1, reports);
+    TEST_ASSERT_FALSE(delivered);
+    TEST_ASSERT_EQUAL(8, net.node(0).getReliableStats().retransmits);
+  }
+
+  static void test_registry_coalescesSavesDuringDiscoveryBurst() {
+    SiteNetwork net;
+    net.addNode(SiteDeviceID::Coordinator);
+    for (size_t i = 1; i <= 50; ++i) {
+      net.addNode(static_cast<SiteDeviceID>(i));
+      net.listenForPairing(i);
+    }
+    net.node(0).setRegistryFlushDelay(500);
+    for (size_t i = 1; i <= 50; ++i)
+      net.node(0).registerComms(static_cast<SiteDeviceID>(i), true);
+
+    // Without poll() the receive path learns all 50 devices, writes nothing
+    net.runFor(150000);
+    const DeviceRegistry<SiteDeviceID> &registry = *net.node(0).registry;
+    for (size_t i = 1; i <= 50; ++i)
+      TEST_ASSERT_NOT_NULL(
+          registry.getDeviceMac(static_cast<SiteDeviceID>(i)));
+    TEST_ASSERT_EQUAL(0, registry.flashWriteCount());
+
+    net.pollEvery(1000);
+    net.runFor(100000);
+    TEST_ASSERT_EQUAL(0, registry.flashWriteCount()); // Still debouncing
+    net.runFor(500000);
+    TEST_ASSERT_EQUAL(1, registry.flashWriteCount());
+
+    // flush() saves a newly learned device at once, and only if unsaved
+    net.node(0).registry->removeDevice(static_cast<SiteDeviceID>(7));
+    net.node(0).registerComms(static_cast<SiteDeviceID>(7), true);
+    net.runFor(5000);
+    TEST_ASSERT_TRUE(net.node(0).flush());
+    TEST_ASSERT_EQUAL(2, registry.flashWriteCount());
+    TEST_ASSERT_TRUE(net.node(0).flush());
+    TEST_ASSERT_EQUAL(2, registry.flashWriteCount());
+  }
+
+  static void test_crc_catchesCorruptedFramesOnReliableLink() {
+    EspNowSimConfig config;
+    config.corruptRate = 0.2f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    for (size_t i = 0; i < 2; ++i) {
+      net.node(i).setReliable(TestPacketType::TYPE_1);
+      net.node(i).setCrc();
+    }
+
+    uint8_t seen[40] = {};
+    size_t damaged = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID) {
+          for (size_t j = 0; j < len; ++j)
+            damaged += dataPtr[j] != static_cast<uint8_t>(dataPtr[0] + j);
+          seen[dataPtr[0] % 40]++;
+        });
+
+    net.pollEvery(1000);
+    for (uint8_t i = 0; i < 40; ++i)
+      net.at(2000 * i, 0, [&net, i]() {
+        uint8_t payload[32];
+        for (uint8_t j = 0; j < sizeof(payload); ++j)
+          payload[j] = static_cast<uint8_t>(i + j);
+        net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                               payload, sizeof(payload));
+      });
+    net.runFor(2000000);
+
+    TEST_ASSERT_TRUE(net.sim().getStats().framesCorrupted > 0);
+    TEST_ASSERT_TRUE(net.node(1).getCrcDrops() > 0);
+    TEST_ASSERT_EQUAL(0, damaged);
+    for (size_t i = 0; i < 40; ++i)
+      TEST_ASSERT_EQUAL(1, seen[i]);
+    TEST_ASSERT_EQUAL(0, net.node(0).getReliableStats().unacked);
+  }
+
+  static void test_crc_fragmentsPayloadsThatNoLongerFitOneFrame() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    TEST_ASSERT_TRUE(net.node(1).enableReassembly(1, 512));
+    for (size_t i = 0; i < 2; ++i) {
+      net.node(i).setReliable(TestPacketType::TYPE_1);
+      net.node(i).setCrc();
+    }
+
+    size_t receivedLen = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t len, TestDeviceID) { receivedLen = len; });
+    net.pollEvery(1000);
+
+    // Header, sequence number and CRC leave 241 bytes in one frame
+    uint8_t payload[Handler::MaxPayloadSize] = {};
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                            TestPacketType::TYPE_1, payload,
+                                            Handler::MaxPayloadSize));
+    net.runFor(100000);
+
+    TEST_ASSERT_EQUAL(Handler::MaxPayloadSize, receivedLen);
+    TEST_ASSERT_EQUAL(0, net.node(1).getCrcDrops());
+    TEST_ASSERT_EQUAL(1, net.node(1).getReassemblyStats().completed);
+  }
+
+  static void test_stats_countTrafficPerTypeAndPeer() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(1).registerCallback(TestPacketType::TYPE_2,
+                                 [](const uint8_t *, size_t, TestDeviceID) {});
+
+    const uint8_t payload[10] = {};
+    for (size_t i = 0; i < 5; ++i)
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_2,
+                             payload, sizeof(payload));
+    // DEVICE_2 is registered but not on the medium: the MAC layer fails
+    uint8_t mac[6];
+    Network::macFor(TestDeviceID::DEVICE_2, mac);
+    net.node(0).registry->addDevice(TestDeviceID::DEVICE_2, mac);
+    net.node(0).registerComms(TestDeviceID::DEVICE_2);
+    net.node(0).sendPacket(TestDeviceID::DEVICE_2, TestPacketType::TYPE_2,
+                           payload, sizeof(payload));
+    net.runFor(50000);
+
+    const size_t type2 = static_cast<size_t>(TestPacketType::TYPE_2);
+    const size_t frameLen = Handler::PacketHeader::Size + sizeof(payload);
+    std::unique_ptr<Handler::Stats> stats(new Handler::Stats);
+    net.node(0).getStats(*stats);
+    TEST_ASSERT_EQUAL(6, stats->types[type2].txPackets);
+    TEST_ASSERT_EQUAL(60, stats->types[type2].txBytes);
+    TEST_ASSERT_EQUAL(1, stats->types[type2].txFailures);
+    const size_t device1 = static_cast<size_t>(TestDeviceID::DEVICE_1);
+    const size_t device2 = static_cast<size_t>(TestDeviceID::DEVICE_2);
+    TEST_ASSERT_EQUAL(5, stats->peers[device1].txFrames);
+    TEST_ASSERT_EQUAL(5 * frameLen, stats->peers[device1].txBytes);
+    TEST_ASSERT_EQUAL(1, stats->peers[device2].txFailures);
+    TEST_ASSERT_TRUE(stats->periodMs >= 50);
+
+    net.node(1).getStats(*stats);
+    const size_t self = static_cast<size_t>(TestDeviceID::SELF);
+    TEST_ASSERT_EQUAL(5, stats->types[type2].rxPackets);
+    TEST_ASSERT_EQUAL(5, stats->peers[self].rxFrames);
+    TEST_ASSERT_EQUAL(5 * frameLen, stats->peers[self].rxBytes);
+  }
+
+  static void test_group_broadcastsOnceAndFiltersNonMembers() {
+    SiteNetwork net;
+    for (uint8_t i = 0; i < 7; ++i)
+      net.addNode(static_cast<SiteDeviceID>(i));
+    for (size_t i = 1; i < 6; ++i)
+      net.link(0, i);
+    // Node 6 is an encrypted peer of the coordinator
+    uint8_t mac[6];
+    const SiteDeviceID secure = static_cast<SiteDeviceID>(6);
+    SiteNetwork::macFor(secure, mac);
+    net.node(0).registry->addDevice(secure, mac);
+    TEST_ASSERT_TRUE(net.node(0).registerComms(secure, false, true));
+    SiteNetwork::macFor(SiteDeviceID::Coordinator, mac);
+    net.node(6).registry->addDevice(SiteDeviceID::Coordinator, mac);
+    net.node(6).registerComms(SiteDeviceID::Coordinator);
+
+    size_t received[7] = {};
+    for (size_t i = 1; i < 7; ++i)
+      net.node(i).registerCallback(
+          TestPacketType::TYPE_1,
+          [&received, i](const uint8_t *dataPtr, size_t len, SiteDeviceID) {
+            if (len == 3 && dataPtr[2] == 0x33)
+              received[i]++;
+          });
+    size_t reports[7] = {};
+    net.node(0).registerSendCallback(
+        [&reports](SiteDeviceID target, TestPacketType, bool delivered) {
+          if (delivered)
+            reports[static_cast<size_t>(target)]++;
+        });
+
+    // Nodes 4 and 5 are linked but not members
+    TEST_ASSERT_TRUE(net.node(0).defineGroup(
+        0, {static_cast<SiteDeviceID>(1), static_cast<SiteDeviceID>(2),
+            static_cast<SiteDeviceID>(3), secure}));
+    TEST_ASSERT_FALSE(net.node(0).defineGroup(1, {SiteDeviceID::Coordinator}));
+    net.sim().resetStats();
+    const uint8_t payload[3] = {0x11, 0x22, 0x33};
+    TEST_ASSERT_TRUE(
+        net.node(0).sendToGroup(0, TestPacketType::TYPE_1, payload, 3));
+    net.runFor(20000);
+
+    // One broadcast for the plain members, one unicast for the other
+    TEST_ASSERT_EQUAL(2, net.sim().getStats().framesSent);
+    const size_t expected[7] = {0, 1, 1, 1, 0, 0, 1};
+    for (size_t i = 1; i < 7; ++i) {
+      TEST_ASSERT_EQUAL(expected[i], received[i]);
+      TEST_ASSERT_EQUAL(expected[i], reports[i]);
+    }
+    std::unique_ptr<SiteNetwork::Handler::Stats> stats(
+        new SiteNetwork::Handler::Stats);
+    net.node(4).getStats(*stats);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::NotAddressed)]);
+    net.node(0).getStats(*stats);
+    TEST_ASSERT_EQUAL(4, stats->types[0].txPackets);
+  }
+
+  static void test_group_unicastReportsEachMemberWithCrc() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    // DEVICE_2 is registered but not on the medium: the MAC layer fails
+    uint8_t mac[6];
+    Network::macFor(TestDeviceID::DEVICE_2, mac);
+    net.node(0).registry->addDevice(TestDeviceID::DEVICE_2, mac);
+    net.node(0).registerComms(TestDeviceID::DEVICE_2);
+    net.node(0).setCrc();
+
+    size_t received = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_2,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID) {
+          received += (len == 2 && dataPtr[1] == 0xCD) ? 1 : 0;
+        });
+    bool delivered[3] = {};
+    size_t reports = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID target, TestPacketType, bool ok) {
+          delivered[static_cast<size_t>(target)] = ok;
+          reports++;
+        });
+
+    TEST_ASSERT_TRUE(net.node(0).defineGroup(3, {TestDeviceID::DEVICE_1}));
+    TEST_ASSERT_TRUE(net.node(0).addToGroup(3, TestDeviceID::DEVICE_2));
+    const uint8_t payload[2] = {0xAB, 0xCD};
+    TEST_ASSERT_TRUE(
+        net.node(0).sendToGroup(3, TestPacketType::TYPE_2, payload, 2, true));
+    net.runFor(20000);
+
+    TEST_ASSERT_EQUAL(1, received);
+    TEST_ASSERT_EQUAL(0, net.node(1).getCrcDrops());
+    TEST_ASSERT_EQUAL(2, reports);
+    TEST_ASSERT_TRUE(delivered[static_cast<size_t>(TestDeviceID::DEVICE_1)]);
+    TEST_ASSERT_FALSE(delivered[static_cast<size_t>(TestDeviceID::DEVICE_2)]);
+
+    // Empty again: nothing is sent
+    TEST_ASSERT_TRUE(net.node(0).removeFromGroup(3, TestDeviceID::DEVICE_1));
+    TEST_ASSERT_TRUE(net.node(0).removeFromGroup(3, TestDeviceID::DEVICE_2));
+    net.sim().resetStats();
+    TEST_ASSERT_TRUE(
+        net.node(0).sendToGroup(3, TestPacketType::TYPE_2, payload, 2));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(0, net.sim().getStats().framesSent);
+  }
+
+  static void test_peerCache_reachesMoreNodesThanPeerLimit() {
+    SiteNetwork net;
+    for (uint8_t i = 0; i <= 30; ++i)
+      net.addNode(static_cast<SiteDeviceID>(i));
+    TEST_ASSERT_TRUE(net.node(0).enablePeerCache());
+    for (size_t i = 1; i <= 30; ++i)
+      net.link(0, i); // Beyond the driver's 20 peers
+    size_t received = 0;
+    for (size_t i = 1; i <= 30; ++i)
+      net.node(i).registerCallback(
+          TestPacketType::TYPE_1,
+          [&received](const uint8_t *, size_t, SiteDeviceID) { received++; });
+
+    const uint8_t payload[8] = {};
+    for (uint8_t i = 1; i <= 30; ++i) {
+      for (size_t j = 0; j < 2; ++j)
+        TEST_ASSERT_TRUE(net.node(0).sendPacket(static_cast<SiteDeviceID>(i),
+                                                TestPacketType::TYPE_1,
+                                                payload, sizeof(payload)));
+    }
+    net.runFor(100000);
+
+    TEST_ASSERT_EQUAL(60, received);
+    esp_now_peer_num_t peers = {};
+    net.node(0);
+    esp_now_get_peer_num(&peers);
+    TEST_ASSERT_EQUAL(19, peers.total_num);
+    const SiteNetwork::Handler::PeerCacheStats stats =
+        net.node(0).getPeerCacheStats();
+    TEST_ASSERT_EQUAL(19, stats.cached);
+    TEST_ASSERT_EQUAL(30, stats.misses);
+    TEST_ASSERT_EQUAL(30, stats.hits);
+    TEST_ASSERT_EQUAL(11, stats.evictions);
+  }
+
+  static void test_peerCache_keepsPinnedPeers() {
+    SiteNetwork net;
+    for (uint8_t i = 0; i <= 6; ++i)
+      net.addNode(static_cast<SiteDeviceID>(i));
+    TEST_ASSERT_TRUE(net.node(0).enablePeerCache(3));
+    for (size_t i = 1; i <= 6; ++i)
+      net.link(0, i);
+    uint8_t mac[6];
+    SiteNetwork::macFor(static_cast<SiteDeviceID>(1), mac);
+
+    TEST_ASSERT_TRUE(net.node(0).pinPeer(static_cast<SiteDeviceID>(1)));
+    const uint8_t payload = 0;
+    for (uint8_t i = 2; i <= 6; ++i) {
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(
+          static_cast<SiteDeviceID>(i), TestPacketType::TYPE_1, &payload, 1));
+      net.runFor(5000);
+    }
+    net.node(0);
+    TEST_ASSERT_TRUE(esp_now_is_peer_exist(mac));
+    TEST_ASSERT_EQUAL(3, net.node(0).getPeerCacheStats().evictions);
+
+    // With every slot pinned, other peers can't be added
+    TEST_ASSERT_TRUE(net.node(0).pinPeer(static_cast<SiteDeviceID>(2)));
+    TEST_ASSERT_TRUE(net.node(0).pinPeer(static_cast<SiteDeviceID>(3)));
+    TEST_ASSERT_FALSE(net.node(0).pinPeer(static_cast<SiteDeviceID>(4)));
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(static_cast<SiteDeviceID>(5),
+                                             TestPacketType::TYPE_1,
+                                             &payload, 1));
+    std::unique_ptr<SiteNetwork::Handler::Stats> stats(
+        new SiteNetwork::Handler::Stats);
+    net.node(0).getStats(*stats);
+    TEST_ASSERT_EQUAL(
+        1, stats->drops[static_cast<size_t>(EspNowDrop::NoPeerSlot)]);
+    TEST_ASSERT_TRUE(net.node(0).pinPeer(static_cast<SiteDeviceID>(3), false));
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(static_cast<SiteDeviceID>(5),
+                                            TestPacketType::TYPE_1,
+                                            &payload, 1));
+  }
+
+  static void test_typedPayload_buildsInFrameAndReachesTypedCallback() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(0).setReliable(TestPacketType::TYPE_1);
+    net.node(1).setReliable(TestPacketType::TYPE_1);
+
+    Setpoint received[4] = {};
+    size_t count = 0;
+    auto record = [&](const Setpoint &setpoint, TestDeviceID) {
+      if (count < 4)
+        received[count] = setpoint;
+      count++;
+    };
+    net.node(1).registerCallback<TestPacketType::TYPE_1>(record);
+    net.node(1).registerCallback<TestPacketType::TYPE_2>(record);
+
+    // Built in place in the transmit queue
+    TEST_ASSERT_TRUE(net.node(0).buildPacket<TestPacketType::TYPE_2>(
+        TestDeviceID::DEVICE_1, [](Setpoint &setpoint) {
+          setpoint.sequence = 1;
+          setpoint.value = -5;
+        }));
+    TEST_ASSERT_EQUAL(1, net.node(0).txFrames[0].data[4]); // Behind the header
+    net.runFor(10000);
+
+    // Payload behind the CRC, then a reliable type built on the stack
+    net.node(0).setCrc();
+    net.node(0).buildPacket<TestPacketType::TYPE_2>(
+        TestDeviceID::DEVICE_1, [](Setpoint &setpoint) { setpoint.value = 7; });
+    net.node(0).buildPacket<TestPacketType::TYPE_1>(
+        TestDeviceID::DEVICE_1, [](Setpoint &setpoint) { setpoint.value = 9; });
+    Setpoint sent = {4, 11};
+    net.node(0).sendPacket<TestPacketType::TYPE_2>(TestDeviceID::DEVICE_1,
+                                                   sent);
+    net.pollEvery(1000);
+    net.runFor(100000);
+
+    TEST_ASSERT_EQUAL(4, count);
+    TEST_ASSERT_EQUAL(1, received[0].sequence);
+    TEST_ASSERT_EQUAL(-5, received[0].value);
+    TEST_ASSERT_EQUAL(7, received[1].value);
+    TEST_ASSERT_EQUAL(9, received[2].value);
+    TEST_ASSERT_EQUAL(4, received[3].sequence);
+    TEST_ASSERT_EQUAL(11, received[3].value);
+    TEST_ASSERT_EQUAL(0, net.node(1).getCrcDrops());
+  }
+
+  static void test_delta_rebuildsStructsFromKeyframesAndDeltas() {
+    EspNowSimConfig config;
+    config.lossRate = 0.2f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    struct Telemetry {
+      uint32_t sequence;
+      uint32_t uptime;
+      int16_t readings[16];
+      uint8_t status[8];
+    };
+    for (size_t i = 0; i < 2; ++i)
+      TEST_ASSERT_TRUE(
+          net.node(i).enableDelta<Telemetry>(TestPacketType::TYPE_1, 10));
+
+    size_t received = 0;
+    size_t damaged = 0;
+    net.node(1).registerCallback<Telemetry>(
+        TestPacketType::TYPE_1, [&](const Telemetry &t, TestDeviceID) {
+          received++;
+          damaged += t.uptime != t.sequence * 50 ||
+                     t.readings[3] != static_cast<int16_t>(t.sequence) ||
+                     t.status[0] != 7;
+        });
+
+    net.pollEvery(1000);
+    for (uint32_t i = 0; i < 100; ++i)
+      net.at(5000 * i, 0, [&net, i]() {
+        Telemetry t = {};
+        t.sequence = i;
+        t.uptime = i * 50;
+        t.readings[3] = static_cast<int16_t>(i);
+        t.status[0] = 7;
+        net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                               t);
+      });
+    net.runFor(1000000);
+
+    const Handler::DeltaStats stats = net.node(0).getDeltaStats();
+    TEST_ASSERT_EQUAL(100, stats.keyframes + stats.deltas);
+    TEST_ASSERT_TRUE(stats.resyncs > 0); // Lost frames force keyframes
+    TEST_ASSERT_TRUE(stats.keyframes >= 10);
+    TEST_ASSERT_TRUE(stats.deltas > stats.keyframes);
+    TEST_ASSERT_EQUAL(0, damaged);
+    // A lost keyframe is followed by a new one, so no delta misses it
+    TEST_ASSERT_EQUAL(net.sim().getStats().framesDelivered, received);
+    TEST_ASSERT_EQUAL(0, net.node(1).getDeltaStats().missed);
+
+    // Deltas carry 10 of the 44 bytes: two runs
+    Handler::Stats traffic;
+    net.node(0).getStats(traffic);
+    TEST_ASSERT_TRUE(traffic.peers[0].txBytes <
+                     100 * (4 + sizeof(Telemetry)) / 2);
+  }
+
+  static void test_priority_controlOvertakesBulkAndStaleFramesExpire() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(0).setTxWindow(1);
+    net.node(0).setPriority(TestPacketType::TYPE_1, EspNowPriority::Control);
+    net.node(0).setPriority(TestPacketType::TYPE_2, EspNowPriority::Bulk);
+    net.node(0).setPriorityPolicy(EspNowPriority::Bulk, 1, 5);
+
+    std::vector<int> order; // Bulk index, or -1 for the control packet
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { order.push_back(-1); });
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_2,
+        [&](const uint8_t *dataPtr, size_t, TestDeviceID) {
+          order.push_back(dataPtr[0]);
+        });
+    size_t failed = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) { failed += ok ? 0 : 1; });
+
+    uint8_t bulk[100] = {};
+    for (uint8_t i = 0; i < 13; ++i) { // Leaves the reserved slots free
+      bulk[0] = i;
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(
+          TestDeviceID::DEVICE_1, TestPacketType::TYPE_2, bulk, sizeof(bulk)));
+    }
+    TEST_ASSERT_EQUAL(13, net.node(0).getTxQueueStats().queued +
+                              net.node(0).getTxQueueStats().inFlight);
+    const uint8_t stop = 1;
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                       TestPacketType::TYPE_1, &stop, 1));
+    net.runFor(100000);
+
+    // Behind the one bulk frame already in flight
+    TEST_ASSERT_TRUE(order.size() >= 2);
+    TEST_ASSERT_EQUAL(0, order[0]);
+    TEST_ASSERT_EQUAL(-1, order[1]);
+    // The bulk frames still queued after 5 ms were dropped
+    const uint32_t expired = net.node(0).getTxQueueStats().expired;
+    TEST_ASSERT_TRUE(expired > 0);
+    TEST_ASSERT_EQUAL(14, order.size() + expired);
+    TEST_ASSERT_EQUAL(expired, failed);
+    for (size_t i = 2; i < order.size(); ++i)
+      TEST_ASSERT_TRUE(order[i] > order[i - 1]);
+  }
+
+  static void test_priority_sharesLinkByWeight() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.node(0).setTxWindow(1);
+    net.node(0).setPriority(TestPacketType::TYPE_1, EspNowPriority::High);
+    net.node(0).setPriority(TestPacketType::TYPE_2, EspNowPriority::Bulk);
+    net.node(0).setPriorityPolicy(EspNowPriority::High, 3);
+
+    std::string order;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { order += 'H'; });
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_2,
+        [&](const uint8_t *, size_t, TestDeviceID) { order += 'b'; });
+
+    const uint8_t payload[8] = {};
+    for (size_t i = 0; i < 6; ++i)
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_2,
+                        payload, sizeof(payload));
+    for (size_t i = 0; i < 7; ++i)
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                        payload, sizeof(payload));
+    net.runFor(100000);
+
+    // The first bulk frame went out at once. Then three high frames per
+    // bulk frame while both wait, high first in each round.
+    TEST_ASSERT_EQUAL_STRING("bHHHHHHbHbbbb", order.c_str());
+  }
+
+  static void test_capture_completesSendsWithoutTheMedium() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    size_t receivedCount = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { receivedCount++; });
+    size_t delivered = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool success) {
+          delivered += success ? 1 : 0;
+        });
+
+    net.sim().setCapture(true);
+    net.node(0).setTxWindow(2);
+    for (uint8_t i = 0; i < 5; ++i)
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_1,
+                                              TestPacketType::TYPE_1, &i, 1));
+    TEST_ASSERT_EQUAL(0, net.sim().pendingEvents());
+    TEST_ASSERT_EQUAL(2, net.sim().getStats().framesSent);
+
+    TEST_ASSERT_EQUAL(5, net.sim().flushCaptured()); // Refills the window
+    TEST_ASSERT_EQUAL(5, delivered);
+    TEST_ASSERT_EQUAL(5, net.node(0).getTxQueueStats().delivered);
+    net.runFor(50000);
+    TEST_ASSERT_EQUAL(0, receivedCount);
+  }
+
+  static void test_timeSync_tracksReferenceOffsetAndDrift() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.sim().setClock(1, 5000000, 80.0); // 5 s ahead, 80 ppm fast
+    TEST_ASSERT_FALSE(net.node(1).getTimeSyncStats().synced);
+
+    net.node(1).enableTimeSync(TestDeviceID::SELF, 500);
+    net.pollEvery(1000);
+    net.runFor(30000000);
+
+    const uint32_t reference = net.node(0).networkTime();
+    const int32_t errorUs =
+        static_cast<int32_t>(net.node(1).networkTime() - reference);
+    TEST_ASSERT_TRUE(errorUs > -100 && errorUs < 100);
+    const Handler::TimeSyncStats stats = net.node(1).getTimeSyncStats();
+    TEST_ASSERT_TRUE(stats.synced);
+    TEST_ASSERT_TRUE(stats.offsetUs < -5000000 && stats.offsetUs > -5010000);
+    TEST_ASSERT_TRUE(stats.driftPpm < -70 && stats.driftPpm > -90);
+    TEST_ASSERT_TRUE(stats.samples >= 55);
+
+    // Probing runs at no cost to the reference, which needs nothing enabled
+    TEST_ASSERT_FALSE(net.node(0).getTimeSyncStats().synced);
+    Handler::PeerLatency latency;
+    TEST_ASSERT_FALSE(net.node(0).getPeerLatency(TestDeviceID::DEVICE_1,
+                                                 latency));
+    TEST_ASSERT_TRUE(
+        net.node(1).getPeerLatency(TestDeviceID::SELF, latency));
+    // Two 18 byte frames: 544 us of airtime and 150-250 us latency each
+    TEST_ASSERT_TRUE(latency.minRttUs >= 1388 && latency.minRttUs < 1450);
+    TEST_ASSERT_TRUE(latency.srttUs >= latency.minRttUs &&
+                     latency.srttUs <= 1588);
+    TEST_ASSERT_EQUAL(0, latency.lost);
+  }
+
+  static void test_timeSync_excludesDeferredDispatchDelay() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.sim().setClock(0, 3000000, 0); // Reference ahead this time
+    for (size_t i = 0; i < 2; ++i)
+      TEST_ASSERT_TRUE(net.node(i).enableDeferredDispatch());
+
+    // Probes wait up to 15 ms in each node's queue before they are handled
+    net.node(1).enableTimeSync(TestDeviceID::SELF, 200);
+    net.pollEvery(15000);
+    net.runFor(5000000);
+
+    const uint32_t reference = net.node(0).networkTime();
+    const int32_t errorUs =
+        static_cast<int32_t>(net.node(1).networkTime() - reference);
+    TEST_ASSERT_TRUE(errorUs > -100 && errorUs < 100);
+    Handler::PeerLatency latency;
+    TEST_ASSERT_TRUE(
+        net.node(1).getPeerLatency(TestDeviceID::SELF, latency));
+    TEST_ASSERT_TRUE(latency.srttUs < 1600);
+
+    // A probe superseded before its answer arrives counts as lost
+    TEST_ASSERT_TRUE(net.node(0).probePeer(TestDeviceID::DEVICE_1));
+    TEST_ASSERT_TRUE(net.node(0).probePeer(TestDeviceID::DEVICE_1));
+    net.runFor(50000);
+    TEST_ASSERT_TRUE(
+        net.node(0).getPeerLatency(TestDeviceID::DEVICE_1, latency));
+    TEST_ASSERT_EQUAL(1, latency.samples);
+    TEST_ASSERT_EQUAL(1, latency.lost);
+    TEST_ASSERT_FALSE(net.node(0).probePeer(TestDeviceID::SELF));
+  }
+
+  static void test_routing_relaysAcrossHopsWithoutCallingRelays() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.addNode(TestDeviceID::DEVICE_2);
+    net.link(0, 1); // A line: the ends only hear the relay in the middle
+    net.link(1, 2);
+    net.sim().setInRange(0, 2, false);
+    for (size_t i = 0; i < 3; ++i)
+      TEST_ASSERT_TRUE(net.node(i).enableRouting(100));
+
+    size_t relayCalls = 0;
+    TestDeviceID from = TestDeviceID::Count;
+    uint8_t received[4] = {};
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { relayCalls++; });
+    net.node(2).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *dataPtr, size_t len, TestDeviceID sender) {
+          from = sender;
+          memcpy(received, dataPtr, len < 4 ? len : 4);
+        });
+
+    // Unreachable until the beacons spread the routes
+    const uint8_t data[4] = {1, 2, 3, 4};
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                             TestPacketType::TYPE_1, data, 4));
+    net.pollEvery(1000);
+    net.runFor(500000);
+    TestDeviceID hop;
+    uint8_t hops = 0;
+    TEST_ASSERT_TRUE(net.node(0).getRoute(TestDeviceID::DEVICE_2, hop, hops));
+    TEST_ASSERT_TRUE(hop == TestDeviceID::DEVICE_1);
+    TEST_ASSERT_EQUAL(2, hops);
+
+    net.node(0).setCrc(); // Relays refresh the CRC after rewriting the TTL
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                            TestPacketType::TYPE_1, data, 4));
+    net.runFor(20000);
+    TEST_ASSERT_TRUE(from == TestDeviceID::SELF); // The origin, not the relay
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, received, 4);
+    TEST_ASSERT_EQUAL(0, relayCalls);
+    TEST_ASSERT_EQUAL(1, net.node(0).getRouteStats().originated);
+    TEST_ASSERT_EQUAL(1, net.node(1).getRouteStats().forwarded);
+    Handler::RouteStats stats = net.node(2).getRouteStats();
+    TEST_ASSERT_EQUAL(1, stats.delivered);
+    TEST_ASSERT_EQUAL(1, stats.deliveredByHops[1]);
+    TEST_ASSERT_EQUAL(0, net.node(2).getCrcDrops());
+
+    // Reliable types are acknowledged end to end, over the reverse route
+    net.node(0).setReliable(TestPacketType::TYPE_2);
+    net.node(2).setReliable(TestPacketType::TYPE_2);
+    size_t reliableCalls = 0;
+    net.node(2).registerCallback(
+        TestPacketType::TYPE_2,
+        [&](const uint8_t *, size_t, TestDeviceID) { reliableCalls++; });
+    bool acked = false;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID target, TestPacketType type, bool delivered) {
+          if (type == TestPacketType::TYPE_2 &&
+              target == TestDeviceID::DEVICE_2)
+            acked = delivered;
+        });
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                            TestPacketType::TYPE_2, data, 4));
+    net.runFor(50000);
+    TEST_ASSERT_EQUAL(1, reliableCalls);
+    TEST_ASSERT_TRUE(acked);
+
+    // A TTL of one hop doesn't reach past the relay, which drops the frame
+    TEST_ASSERT_TRUE(net.node(0).enableRouting(100, 1));
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                            TestPacketType::TYPE_1, data, 4));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(1, net.node(1).getRouteStats().ttlExpired);
+    TEST_ASSERT_EQUAL(2, net.node(2).getRouteStats().delivered);
+
+    // An origin the destination has in its registry would not be routed;
+    // claiming it through a relay is refused
+    uint8_t selfMac[6];
+    Network::macFor(TestDeviceID::SELF, selfMac);
+    net.node(2).registry->addDevice(TestDeviceID::SELF, selfMac);
+    TEST_ASSERT_TRUE(net.node(0).enableRouting(100));
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                            TestPacketType::TYPE_1, data, 4));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(2, net.node(2).getRouteStats().delivered);
+    TEST_ASSERT_EQUAL(1, net.node(2).getRouteStats().badOrigin);
+    net.node(2).registry->removeDevice(TestDeviceID::SELF);
+
+    // Routes through a relay that went quiet expire after three beacons
+    net.sim().setInRange(1, 2, false);
+    net.runFor(1000000);
+    TEST_ASSERT_FALSE(net.node(0).getRoute(TestDeviceID::DEVICE_2, hop, hops));
+    TEST_ASSERT_FALSE(net.node(0).sendPacket(TestDeviceID::DEVICE_2,
+                                             TestPacketType::TYPE_1, data, 4));
+  }
+
+  static void test_rpc_matchesRepliesToConcurrentCalls() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.addNode(TestDeviceID::DEVICE_2);
+    net.linkAll();
+    net.pollEvery(1000);
+
+    // Answers with each request byte plus one, and fails a leading 0xFF
+    TEST_ASSERT_TRUE(net.node(0).registerRpcHandler(
+        TestPacketType::TYPE_1,
+        [](const uint8_t *request, size_t len, TestDeviceID, uint8_t *reply,
+           size_t &replyLen) {
+          if (len > 0 && request[0] == 0xFF)
+            return false;
+          for (size_t i = 0; i < len; ++i)
+            reply[i] = static_cast<uint8_t>(request[i] + 1);
+          replyLen = len;
+          return true;
+        }));
+
+    // Types are reserved for RPC explicitly, never next to a callback
+    const uint8_t request[3] = {7, 8, 9};
+    TEST_ASSERT_TRUE(net.node(1).callRpc(TestDeviceID::SELF,
+                                         TestPacketType::TYPE_1, request, 3,
+                                         100)
+                         .slot == Handler::RpcSlots);
+    TEST_ASSERT_FALSE(net.node(0).registerCallback(
+        TestPacketType::TYPE_1, [](const uint8_t *, size_t, TestDeviceID) {}));
+    TEST_ASSERT_TRUE(net.node(1).registerCallback(
+        TestPacketType::TYPE_2, [](const uint8_t *, size_t, TestDeviceID) {}));
+    TEST_ASSERT_FALSE(net.node(1).enableRpc(TestPacketType::TYPE_2));
+    TEST_ASSERT_TRUE(net.node(1).enableRpc(TestPacketType::TYPE_1));
+    TEST_ASSERT_TRUE(net.node(2).enableRpc(TestPacketType::TYPE_1));
+
+    // Several calls in flight from two peers at once
+    uint8_t replies[4] = {};
+    size_t answered = 0;
+    for (uint8_t i = 0; i < 4; ++i) {
+      const uint8_t request[2] = {i, static_cast<uint8_t>(10 * i)};
+      TEST_ASSERT_TRUE(net.node(1).callRpc(
+          TestDeviceID::SELF, TestPacketType::TYPE_1, request, 2, 100,
+          [&replies, &answered, i](EspNowRpcStatus status,
+                                   const uint8_t *reply, size_t len,
+                                   TestDeviceID peer) {
+            TEST_ASSERT_TRUE(status == EspNowRpcStatus::Ok);
+            TEST_ASSERT_TRUE(peer == TestDeviceID::SELF);
+            TEST_ASSERT_EQUAL(2, len);
+            TEST_ASSERT_EQUAL(10 * i + 1, reply[1]);
+            replies[i] = reply[0];
+            answered++;
+          }));
+    }
+    Handler::RpcCall call = net.node(2).callRpc(
+        TestDeviceID::SELF, TestPacketType::TYPE_1, request, 3, 100);
+    const uint8_t failing[1] = {0xFF};
+    Handler::RpcCall failed = net.node(2).callRpc(
+        TestDeviceID::SELF, TestPacketType::TYPE_1, failing, 1, 100);
+    TEST_ASSERT_TRUE(net.node(2).rpcStatus(call) == EspNowRpcStatus::Pending);
+    TEST_ASSERT_EQUAL(2, net.node(2).getRpcStats().pending);
+
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(4, answered);
+    for (uint8_t i = 0; i < 4; ++i)
+      TEST_ASSERT_EQUAL(i + 1, replies[i]);
+    TEST_ASSERT_EQUAL(0, net.node(1).getRpcStats().pending);
+    uint8_t reply[Handler::MaxRpcPayloadSize];
+    size_t len = 0;
+    TEST_ASSERT_TRUE(net.node(2).takeRpcReply(call, reply, len) ==
+                     EspNowRpcStatus::Ok);
+    const uint8_t expected[3] = {8, 9, 10};
+    TEST_ASSERT_EQUAL(3, len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, reply, 3);
+    TEST_ASSERT_TRUE(net.node(2).takeRpcReply(failed, reply, len) ==
+                     EspNowRpcStatus::Error);
+    TEST_ASSERT_TRUE(net.node(2).rpcStatus(call) == EspNowRpcStatus::Invalid);
+    TEST_ASSERT_EQUAL(6, net.node(0).getRpcStats().served);
+    TEST_ASSERT_EQUAL(1, net.node(2).getRpcStats().errors);
+
+    // Unanswered calls time out from poll(); a late reply is ignored
+    net.sim().setInRange(0, 1, false);
+    EspNowRpcStatus result = EspNowRpcStatus::Pending;
+    TEST_ASSERT_TRUE(net.node(1).callRpc(
+        TestDeviceID::SELF, TestPacketType::TYPE_1, request, 3, 50,
+        [&result](EspNowRpcStatus status, const uint8_t *, size_t,
+                  TestDeviceID) { result = status; }));
+    net.runFor(40000);
+    TEST_ASSERT_TRUE(result == EspNowRpcStatus::Pending);
+    net.runFor(20000);
+    TEST_ASSERT_TRUE(result == EspNowRpcStatus::Timeout);
+    TEST_ASSERT_EQUAL(1, net.node(1).getRpcStats().timeouts);
+    TEST_ASSERT_EQUAL(0, net.node(1).getRpcStats().pending);
+  }
+
+  static void test_rpc_tableLimitsPendingCalls() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.pollEvery(1000);
+
+    TEST_ASSERT_TRUE(net.node(0).enableRpc(TestPacketType::TYPE_2));
+    Handler::RpcCall calls[Handler::RpcSlots];
+    const uint8_t request[1] = {1};
+    for (size_t i = 0; i < Handler::RpcSlots; ++i) {
+      calls[i] = net.node(0).callRpc(TestDeviceID::DEVICE_1,
+                                     TestPacketType::TYPE_2, request, 1, 30);
+      TEST_ASSERT_TRUE(net.node(0).rpcStatus(calls[i]) ==
+                       EspNowRpcStatus::Pending);
+    }
+    Handler::RpcCall extra = net.node(0).callRpc(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_2, request, 1, 30);
+    TEST_ASSERT_TRUE(net.node(0).rpcStatus(extra) == EspNowRpcStatus::Invalid);
+
+    // No handler on the peer: it doesn't know the type as RPC and drops it
+    net.runFor(50000);
+    size_t len = 0;
+    for (size_t i = 0; i < Handler::RpcSlots; ++i)
+      TEST_ASSERT_TRUE(net.node(0).takeRpcReply(calls[i], nullptr, len) ==
+                       EspNowRpcStatus::Timeout);
+    net.node(0).cancelRpc(calls[0]); // Collected already, a no-op
+    calls[0] = net.node(0).callRpc(TestDeviceID::DEVICE_1,
+                                   TestPacketType::TYPE_2, request, 1, 30);
+    TEST_ASSERT_TRUE(net.node(0).rpcStatus(calls[0]) ==
+                     EspNowRpcStatus::Pending);
+    net.node(0).cancelRpc(calls[0]);
+    TEST_ASSERT_EQUAL(0, net.node(0).getRpcStats().pending);
+  }
+
+  static void test_stream_deliversInOrderOverLossyLinkAndResumes() {
+    EspNowSimConfig config;
+    config.lossRate = 0.1f;
+    Network net(config);
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.pollEvery(1000);
+
+    // Byte i of the stream is i * 7, so the sink can check every chunk
+    const uint32_t total = 20000;
+    uint32_t received = 0;
+    bool inOrder = true;
+    TEST_ASSERT_TRUE(net.node(1).registerStreamSink(
+        [&](TestDeviceID sender, uint8_t streamId, uint32_t offset,
+            const uint8_t *dataPtr, size_t len, uint32_t streamTotal) {
+          inOrder = inOrder && sender == TestDeviceID::SELF && streamId == 3 &&
+                    offset == received && streamTotal == total;
+          for (size_t i = 0; i < len; ++i)
+            inOrder = inOrder && dataPtr[i] == static_cast<uint8_t>(
+                                                   (offset + i) * 7);
+          received += static_cast<uint32_t>(len);
+        }));
+    Handler::StreamSource source = [](uint32_t offset, uint8_t *out,
+                                      size_t len) {
+      for (size_t i = 0; i < len; ++i)
+        out[i] = static_cast<uint8_t>((offset + i) * 7);
+      return true;
+    };
+    bool complete = false;
+    bool failed = false;
+    uint32_t endOffset = 0;
+    net.node(0).registerStreamCallback(
+        [&](TestDeviceID target, uint8_t streamId, bool done, uint32_t offset) {
+          TEST_ASSERT_TRUE(target == TestDeviceID::DEVICE_1);
+          TEST_ASSERT_EQUAL(3, streamId);
+          complete = done;
+          failed = !done;
+          endOffset = offset;
+        });
+
+    // The link drops halfway; the stream is given up with its position
+    TEST_ASSERT_TRUE(net.node(0).openStream(TestDeviceID::DEVICE_1, 3, total,
+                                            source));
+    TEST_ASSERT_FALSE(net.node(0).openStream(TestDeviceID::DEVICE_1, 3, total,
+                                             source)); // Open already
+    while (received < total / 2)
+      net.runFor(1000);
+    net.sim().setInRange(0, 1, false);
+    net.runFor(2000000);
+    TEST_ASSERT_TRUE(failed);
+    TEST_ASSERT_TRUE(endOffset <= received);
+    TEST_ASSERT_TRUE(endOffset > 0);
+    TEST_ASSERT_EQUAL(0, net.node(0).getStreamStats().active);
+
+    // Resumed from an older offset, the receiver's position wins
+    net.sim().setInRange(0, 1, true);
+    TEST_ASSERT_TRUE(net.node(0).openStream(TestDeviceID::DEVICE_1, 3, total,
+                                            source, endOffset / 2));
+    net.runFor(2000000);
+    TEST_ASSERT_TRUE(complete);
+    TEST_ASSERT_EQUAL(total, endOffset);
+    TEST_ASSERT_EQUAL(total, received);
+    TEST_ASSERT_TRUE(inOrder);
+    Handler::StreamStats stats = net.node(0).getStreamStats();
+    TEST_ASSERT_EQUAL(1, stats.completed);
+    TEST_ASSERT_EQUAL(1, stats.failed);
+    TEST_ASSERT_TRUE(stats.chunksResent > 0); // Loss was recovered
+    TEST_ASSERT_EQUAL(total, net.node(1).getStreamStats().bytesReceived);
+  }
+
+  static void test_rateControl_backsOffOnFailuresAndCapsTypes() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.pollEvery(1000);
+    TEST_ASSERT_FALSE(net.node(0).enableRateControl(5, 10));
+    TEST_ASSERT_EQUAL(0, net.node(0).getPeerRate(TestDeviceID::DEVICE_1));
+    TEST_ASSERT_TRUE(net.node(0).enableRateControl(200, 10));
+    TEST_ASSERT_EQUAL(200, net.node(0).getPeerRate(TestDeviceID::DEVICE_1));
+
+    // Failed sends halve the rate down to the minimum
+    const uint8_t data[4] = {1, 2, 3, 4};
+    net.sim().setInRange(0, 1, false);
+    for (size_t i = 0; i < 12; ++i)
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                             data, 4);
+    net.runFor(500000);
+    TEST_ASSERT_EQUAL(10, net.node(0).getPeerRate(TestDeviceID::DEVICE_1));
+    TEST_ASSERT_TRUE(net.node(0).getRateStats().backoffs >= 4);
+
+    // Deliveries raise it again, and frames leave no faster than it allows
+    net.sim().setInRange(0, 1, true);
+    size_t received = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { received++; });
+    bool sending = true;
+    std::function<void()> tick = [&]() {
+      if (!sending)
+        return;
+      net.node(0).sendPacket(TestDeviceID::DEVICE_1, TestPacketType::TYPE_1,
+                             data, 4);
+      net.at(5000, 0, tick);
+    };
+    net.at(0, 0, tick);
+    net.runFor(200000);
+    TEST_ASSERT_TRUE(received <= 4 + 4); // A full bucket, then 10 a second
+    net.runFor(2000000);
+    TEST_ASSERT_TRUE(net.node(0).getPeerRate(TestDeviceID::DEVICE_1) > 20);
+    TEST_ASSERT_TRUE(net.node(0).getRateStats().increases > 0);
+    sending = false;
+
+    // A type cap applies without rate control, to every peer together
+    net.node(1).setRateLimit(TestPacketType::TYPE_2, 50);
+    size_t capped = 0;
+    uint64_t lastAt = 0;
+    net.node(0).registerCallback(
+        TestPacketType::TYPE_2, [&](const uint8_t *, size_t, TestDeviceID) {
+          capped++;
+          lastAt = net.sim().now();
+        });
+    const uint64_t start = net.sim().now();
+    for (size_t i = 0; i < 40; ++i)
+      TEST_ASSERT_TRUE(net.node(1).sendPacket(TestDeviceID::SELF,
+                                              TestPacketType::TYPE_2, data,
+                                              4)); // Waits for queue room
+    net.runFor(400000); // Still queued: one every 20 ms
+    TEST_ASSERT_EQUAL(40, capped);
+    TEST_ASSERT_TRUE(lastAt - start >= 600000); // 36 after the burst
+    TEST_ASSERT_EQUAL(0, net.node(1).getPeerRate(TestDeviceID::SELF));
+  }
+
+  static void test_stream_freesFinishedSlotsAndRestartsFromZero() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.pollEvery(1000);
+
+    const uint32_t total = 2000;
+    uint32_t received = 0;
+    uint32_t firstOffset = UINT32_MAX;
+    TEST_ASSERT_TRUE(net.node(1).registerStreamSink(
+        [&](TestDeviceID, uint8_t, uint32_t offset, const uint8_t *,
+            size_t len, uint32_t) {
+          if (received == 0)
+            firstOffset = offset;
+          received += static_cast<uint32_t>(len);
+        }));
+    size_t completed = 0;
+    net.node(0).registerStreamCallback(
+        [&](TestDeviceID, uint8_t, bool done, uint32_t) {
+          completed += done ? 1 : 0;
+        });
+    Handler::StreamSource source = [](uint32_t, uint8_t *out, size_t len) {
+      memset(out, 0x5a, len);
+      return true;
+    };
+
+    // More finished streams than incoming slots, each one frees its own
+    for (uint8_t id = 0; id < 3 * Handler::StreamRxSlots; ++id) {
+      TEST_ASSERT_TRUE(net.node(0).openStream(TestDeviceID::DEVICE_1, id,
+                                              total, source));
+      net.runFor(500000);
+      TEST_ASSERT_EQUAL(id + 1, completed);
+      for (size_t i = 0; i < Handler::StreamRxSlots; ++i)
+        TEST_ASSERT_FALSE(net.node(1).streamsRx[i].inUse);
+    }
+
+    // Sending a finished stream again from 0 starts it over
+    received = 0;
+    TEST_ASSERT_TRUE(net.node(0).openStream(TestDeviceID::DEVICE_1, 0, total,
+                                            source));
+    net.runFor(500000);
+    TEST_ASSERT_EQUAL(0, firstOffset);
+    TEST_ASSERT_EQUAL(total, received);
+    TEST_ASSERT_EQUAL(3 * Handler::StreamRxSlots + 1, completed);
+  }
+
+  static void test_reliable_timesFramesFromTheirSendNotTheirQueueing() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.link(0, 1);
+    net.pollEvery(1000);
+    net.node(0).setReliable(TestPacketType::TYPE_1);
+    net.node(1).setReliable(TestPacketType::TYPE_1);
+    TEST_ASSERT_TRUE(net.node(0).enableRateControl(20, 20));
+
+    size_t received = 0;
+    net.node(1).registerCallback(
+        TestPacketType::TYPE_1,
+        [&](const uint8_t *, size_t, TestDeviceID) { received++; });
+    size_t delivered = 0;
+    net.node(0).registerSendCallback(
+        [&](TestDeviceID, TestPacketType, bool ok) { delivered += ok; });
+
+    // Most frames wait for a token far longer than the timeout, but
+    // the clock only starts once they go to the driver
+    for (uint8_t i = 0; i < 10; ++i)
+      TEST_ASSERT_TRUE(net.node(0).sendPacket(
+          TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, &i, 1));
+    net.runFor(1000000);
+    TEST_ASSERT_EQUAL(10, received);
+    TEST_ASSERT_EQUAL(10, delivered);
+    TEST_ASSERT_EQUAL(0, net.node(0).getReliableStats().retransmits);
+    TEST_ASSERT_EQUAL(0, net.node(1).getReliableStats().duplicates);
+    const size_t peer = static_cast<size_t>(TestDeviceID::DEVICE_1);
+    TEST_ASSERT_TRUE(net.node(0).reliablePeers[peer].rtoUs <
+                     Handler::InitialRtoUs);
+  }
+
+  static void test_peerCache_leavesBroadcastPeerToPairingAndGroups() {
+    Network net;
+    net.addNode(TestDeviceID::SELF);
+    net.addNode(TestDeviceID::DEVICE_1);
+    net.addNode(TestDeviceID::DEVICE_2);
+    TEST_ASSERT_TRUE(net.node(0).enablePeerCache(1));
+    net.listenForPairing(1);
+    net.listenForPairing(2);
+    net.pollEvery(1000);
+    size_t paired = 0;
+    net.node(0).registerPairingCallback(
+        [&](TestDeviceID, bool ok) { paired += ok ? 1 : 0; });
+    size_t received[3] = {};
+    for (size_t i = 1; i <= 2; ++i)
+      net.node(i).registerCallback(
+          TestPacketType::TYPE_1,
+          [&received, i](const uint8_t *, size_t, TestDeviceID) {
+            received[i]++;
+          });
+
+    // Pairing broadcasts, then unicast to the paired device
+    const uint8_t payload = 0x01;
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_1, true));
+    net.runFor(20000);
+    TEST_ASSERT_TRUE(net.node(0).sendPacket(
+        TestDeviceID::DEVICE_1, TestPacketType::TYPE_1, &payload, 1));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(1, received[1]);
+    TEST_ASSERT_EQUAL(1, net.node(0).getPeerCacheStats().cached);
+    net.node(0);
+    TEST_ASSERT_TRUE(esp_now_is_peer_exist(BroadCastMac));
+
+    // The broadcast peer still carries the next pairing and a group
+    TEST_ASSERT_TRUE(net.node(0).registerComms(TestDeviceID::DEVICE_2, true));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(2, paired);
+    TEST_ASSERT_TRUE(net.node(0).defineGroup(
+        0, {TestDeviceID::DEVICE_1, TestDeviceID::DEVICE_2}));
+    TEST_ASSERT_TRUE(
+        net.node(0).sendToGroup(0, TestPacketType::TYPE_1, &payload, 1));
+    net.runFor(20000);
+    TEST_ASSERT_EQUAL(2, received[1]);
+    TEST_ASSERT_EQUAL(1, received[2]);
+    net.node(0);
+    TEST_ASSERT_TRUE(esp_now_is_peer_exist(BroadCastMac));
+  }
+};
+
+int runUnityTests() {
+  EspNowHandlerTest handlerTest;
+  UNITY_BEGIN();
+  RUN_TEST(handlerTest.test_sendPacket_deliversAcrossSimulatedMedium);
+  RUN_TEST(handlerTest.test_sendPacket_failsForUnpairedDevice);
+  RUN_TEST(handlerTest.test_pairDevice_pairsOverSimulatedMedium);
+  RUN_TEST(handlerTest.test_pairing_runsInParallelAndTimesOut);
+  RUN_TEST(handlerTest.test_pairing_reportsFailureWhenPeerCannotBeAdded);
+  RUN_TEST(handlerTest.test_lossyMedium_dropsFrames);
+  RUN_TEST(handlerTest.test_medium_accountsLatencyAndAirtime);
+  RUN_TEST(handlerTest.test_deferredDispatch_runsCallbacksFromPoll);
+  RUN_TEST(handlerTest.test_txQueue_limitsFramesInFlightPerPeer);
+  RUN_TEST(handlerTest.test_txQueue_appliesBackpressureInsteadOfFailing);
+  RUN_TEST(handlerTest.test_txQueue_reportsFailedDelivery);
+  RUN_TEST(handlerTest.test_sendPacket_fitsFullPayloadBehindCompactHeader);
+  RUN_TEST(handlerTest.test_sendPacket_fragmentsAndReassemblesLargeMessage);
+  RUN_TEST(handlerTest.test_reassembly_dropsWithoutPoolAndExpiresPartial);
+  RUN_TEST(handlerTest.test_batching_packsSmallPacketsIntoOneFrame);
+  RUN_TEST(handlerTest.test_reliable_deliversExactlyOnceOverLossyLink);
+  RUN_TEST(handlerTest.test_reliable_reportsFailureWithoutAcks);
+  RUN_TEST(handlerTest.test_registry_coalescesSavesDuringDiscoveryBurst);
+  RUN_TEST(handlerTest.test_crc_catchesCorruptedFramesOnReliableLink);
+  RUN_TEST(handlerTest.test_crc_fragmentsPayloadsThatNoLongerFitOneFrame);
+  RUN_TEST(handlerTest.test_stats_countTrafficPerTypeAndPeer);
+  RUN_TEST(handlerTest.test_group_broadcastsOnceAndFiltersNonMembers);
+  RUN_TEST(handlerTest.test_group_unicastReportsEachMemberWithCrc);
+  RUN_TEST(handlerTest.test_peerCache_reachesMoreNodesThanPeerLimit);
+  RUN_TEST(handlerTest.test_peerCache_keepsPinnedPeers);
+  RUN_TEST(handlerTest.test_typedPayload_buildsInFrameAndReachesTypedCallback);
+  RUN_TEST(handlerTest.test_delta_rebuildsStructsFromKeyframesAndDeltas);
+  RUN_TEST(handlerTest.test_priority_controlOvertakesBulkAndStaleFramesExpire);
+  RUN_TEST(handlerTest.test_priority_sharesLinkByWeight);
+  RUN_TEST(handlerTest.test_capture_completesSendsWithoutTheMedium);
+  RUN_TEST(handlerTest.test_timeSync_tracksReferenceOffsetAndDrift);
+  RUN_TEST(handlerTest.test_timeSync_excludesDeferredDispatchDelay);
+  RUN_TEST(handlerTest.test_routing_relaysAcrossHopsWithoutCallingRelays);
+  RUN_TEST(handlerTest.test_rpc_matchesRepliesToConcurrentCalls);
+  RUN_TEST(handlerTest.test_rpc_tableLimitsPendingCalls);
+  RUN_TEST(handlerTest.test_stream_deliversInOrderOverLossyLinkAndResumes);
+  RUN_TEST(handlerTest.test_rateControl_backsOffOnFailuresAndCapsTypes);
+  RUN_TEST(handlerTest.test_stream_freesFinishedSlotsAndRestartsFromZero);
+  RUN_TEST(handlerTest.test_reliable_timesFramesFromTheirSendNotTheirQueueing);
+  RUN_TEST(handlerTest.test_peerCache_leavesBroadcastPeerToPairingAndGroups);
+  return UNITY_END();
+}
+
+int main(int argc, char **argv) { return runUnityTests(); }
+
+#endif